@@ -0,0 +1,80 @@
+#!/bin/python
+"""Attribute-dense reads: files with many small attributes.
+
+Times read_attrs(), AttrFile.read_attrs() and read_attrs_many() on files
+with 8, 32 and 64 small attributes each (4-byte ints and short strings,
+the kind that used to cost a malloc() and free() apiece), and prints the
+time per attribute.  Run it against two builds to compare them; a build
+made with
+
+	CFLAGS=-DRAW_ARENA_MALLOC_EACH python setup.py build
+
+mallocs every name and value separately like reading did before the
+arena, and is the baseline to hold the usual build up against:
+
+	python bench/dense_attrs.py [files] [rounds]
+
+Runs on Haiku, and on Linux with the xattr backend; the files go into a
+temporary directory that's removed afterwards.  (Most Linux file systems
+keep all of a file's xattrs in one block, which is why it stops at 64.)"""
+
+import os
+import shutil
+import sys
+import tempfile
+import time
+
+from haikuglue.storage import AttrFile, read_attrs, read_attrs_many, write_attrs
+
+def make_files(directory, count, per_file):
+	attrs = {}
+	for i in range(per_file):
+		if i % 2:
+			attrs["META:int%d" % i] = ("LONG", i)
+		else:
+			attrs["META:str%d" % i] = ("CSTR", "s%d" % i)
+	paths = []
+	for i in range(count):
+		path = os.path.join(directory, "file%04d" % i)
+		open(path, "w").close()
+		write_attrs(path, attrs)
+		paths.append(path)
+	return paths
+
+def read_each(paths):
+	for path in paths:
+		read_attrs(path)
+
+def read_open(files):
+	for f in files:
+		f.read_attrs()
+
+def best(function, arg, rounds):
+	times = []
+	for i in range(rounds):
+		start = time.time()
+		function(arg)
+		times.append(time.time() - start)
+	return min(times)
+
+def main():
+	count = len(sys.argv) > 1 and int(sys.argv[1]) or 200
+	rounds = len(sys.argv) > 2 and int(sys.argv[2]) or 5
+	print "%5s %18s %18s %18s" % ("attrs", "read_attrs", "AttrFile", "read_attrs_many")
+	for per_file in (8, 32, 64):
+		directory = tempfile.mkdtemp()
+		try:
+			paths = make_files(directory, count, per_file)
+			files = [AttrFile(path) for path in paths]
+			total = float(count * per_file)
+			results = [best(read_each, paths, rounds), best(read_open, files, rounds),
+					   best(read_attrs_many, paths, rounds)]
+			for f in files:
+				f.close()
+			print "%5d %15.0f ns %15.0f ns %15.0f ns  per attribute" % tuple(
+				[per_file] + [seconds / total * 1e9 for seconds in results])
+		finally:
+			shutil.rmtree(directory)
+
+if __name__ == "__main__":
+	main()
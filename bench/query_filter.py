@@ -0,0 +1,94 @@
+#!/bin/python
+"""Compiled queries against the same test written as a Python lambda.
+
+Builds a list of read_attrs()-style dictionaries and times filtering it
+with Query.filter() and with a list comprehension over an equivalent
+lambda, and then crawls a directory of files with where= against crawl()
+followed by the lambda:
+
+	python bench/query_filter.py [items] [files] [rounds]
+
+The crawl part runs on Haiku, and on Linux with the xattr backend; its
+files go into a temporary directory that's removed afterwards."""
+
+import os
+import shutil
+import struct
+import sys
+import tempfile
+import time
+
+from haikuglue.storage import compile_query, crawl, write_attrs
+
+QUERY = "Audio:Genre==\"*Metal*\"||Media:Rating>=8"
+
+def python_match(attrs):
+	genre = attrs.get("Audio:Genre")
+	rating = attrs.get("Media:Rating")
+	return ((genre is not None and "Metal" in genre[1])
+			or (rating is not None and rating[1] >= 8))
+
+GENRES = ["Jazz", "Heavy Metal", "Pop", "Folk", "Speed Metal", "Blues"]
+
+def make_attrs(i):
+	return {"Audio:Genre": ("CSTR", GENRES[i % len(GENRES)]),
+			"Media:Rating": ("LONG", i % 10),
+			"Audio:Artist": ("CSTR", "artist%d" % (i % 97))}
+
+def dict_items(count):
+	cstr = struct.unpack(">I", "CSTR")[0]
+	long_type = struct.unpack(">I", "LONG")[0]
+	items = []
+	for i in range(count):
+		attrs = make_attrs(i)
+		items.append(("/music/track%d" % i,
+					  {"Audio:Genre": (cstr, attrs["Audio:Genre"][1]),
+					   "Media:Rating": (long_type, attrs["Media:Rating"][1]),
+					   "Audio:Artist": (cstr, attrs["Audio:Artist"][1])}))
+	return items
+
+def make_files(directory, count):
+	for i in range(count):
+		path = os.path.join(directory, "track%04d" % i)
+		open(path, "w").close()
+		write_attrs(path, make_attrs(i))
+
+def best(function, rounds):
+	times = []
+	for i in range(rounds):
+		start = time.time()
+		result = function()
+		times.append(time.time() - start)
+	return min(times), len(result)
+
+def report(label, count, native, python):
+	(native_time, native_hits), (python_time, python_hits) = native, python
+	assert native_hits == python_hits
+	print "%-8s %8.0f ns %8.0f ns %6.1fx  (%d of %d match)" % (
+		label, native_time / count * 1e9, python_time / count * 1e9,
+		python_time / native_time, native_hits, count)
+
+def main():
+	count = len(sys.argv) > 1 and int(sys.argv[1]) or 100000
+	files = len(sys.argv) > 2 and int(sys.argv[2]) or 2000
+	rounds = len(sys.argv) > 3 and int(sys.argv[3]) or 5
+	query = compile_query(QUERY)
+	print "%-8s %11s %11s %7s" % ("", "compiled", "lambda", "ratio")
+
+	items = dict_items(count)
+	report("filter", count,
+		   best(lambda: query.filter(items), rounds),
+		   best(lambda: [item for item in items if python_match(item[1])], rounds))
+
+	directory = tempfile.mkdtemp()
+	try:
+		make_files(directory, files)
+		report("crawl", files,
+			   best(lambda: list(crawl(directory, where=query)), rounds),
+			   best(lambda: [item for item in crawl(directory) if python_match(item[1])],
+					rounds))
+	finally:
+		shutil.rmtree(directory)
+
+if __name__ == "__main__":
+	main()
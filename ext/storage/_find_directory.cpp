@@ -38,9 +38,14 @@ static PyObject *bfs_find_directory( PyObject *self, PyObject *args )
 	}
 	
 	BPath path;
-	status_t retval = find_directory( static_cast<directory_which>( which ),
-									  &path,
-									  create_it ? true : false );
+	status_t retval;
+
+	Py_BEGIN_ALLOW_THREADS
+	retval = find_directory( static_cast<directory_which>( which ),
+							 &path,
+							 create_it ? true : false );
+	Py_END_ALLOW_THREADS
+
 	if( B_OK != retval ) {
 		try {
 			strstream s;
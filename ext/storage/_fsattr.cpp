@@ -6,24 +6,49 @@
 //
 
 #include "Python.h"
+#include "structmember.h"
 
+#ifdef __linux__
+#include "fsattr_xattr.h"	// the Haiku bits we need, on xattrs
+#include <unistd.h>
+#else
 #include <kernel/fs_attr.h>
 #include <kernel/fs_info.h>
 #include <support/TypeConstants.h>	// Type constants except:
 #include <storage/Mime.h>			// B_MIME_STRING_TYPE is here instead
-#include <malloc.h>
 #include <interface/Point.h>
 #include <interface/Rect.h>
 #include <interface/GraphicsDefs.h>
 #include <storage/Entry.h>
 #include <storage/Path.h>
 #include <storage/StorageDefs.h>
+#endif
+#include <malloc.h>
 #include <errno.h>	// for errno
 #include <string.h>	// for strerror()
 #include <limits.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#ifndef __linux__
 #include <support/ByteOrder.h>
+#endif
 
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <map>
+#include <new>
+#include <set>
+#include <string>
 #include <strstream>
+#include <vector>
+
+#include "fsattr_api.h"
+#include "fsquery_expr.h"
+#include "fsmonitor.h"
 
 // ----------------------------------------------------------------------
 // Some useful constants
@@ -32,987 +57,5482 @@
 #define ATTR_LITTLE_ENDIAN	0x00000004
 
 // ----------------------------------------------------------------------
-// Load the file attributes for a file/directory/symlink into a dictionary
-// of tuples; each tuple is ( type, data ), the key is the attribute name.
-//
-// args:
-// 	filename
-//  flags = 0 (optional)
+// Attribute type codecs.  Each type this module knows how to convert has a
+// decoder (raw data -> Python object) and an encoder (Python object -> raw
+// data) in one table, looked up by type code, so read_attrs(), write_attr()
+// and everything built on them (the batch calls, AttrFile, crawl(), query
+// prefetch) convert the same way.  Types nobody claims are raw bytes.
+// Applications can add their own with register_codec().
 
-static PyObject *bfs_read_attrs( PyObject *self, PyObject *args )
-{
-	// self isn't used for normal functions
-	self = self;
+// Attribute data ready to be written; small values are copied into the
+// inline buffer, bigger ones are malloc()ed, strings stay in the Python
+// string they came from (owner), and anything else with the new buffer
+// protocol is borrowed through a view.  Old-style buffers are copied, since
+// nothing stops their memory from moving while the GIL is released.  Only
+// copies made by encoders get byte-swapped.  Needs the GIL to go away.
+#define ATTR_DATA_INLINE	32
 
-	char *filename;
-	int mode = O_RDONLY;
-	int flags = 0;
+struct AttrData {
+	uint32 type;
+	char *buffer;
+	size_t size;
+	bool own_buffer;	// buffer was malloc()ed
+	bool swappable;		// buffer is a copy we can swap in place
+	bool has_view;
+	Py_buffer view;
+	PyObject *owner;
+	union {
+		char bytes[ATTR_DATA_INLINE];
+		double align;
+	} small;
 
-	if( PyArg_ParseTuple( args, "s|i", &filename, &flags ) ) {
-		// two arguments, last is optional
-		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
-		if( ( flags & ATTR_BIG_ENDIAN ) && ( flags & ATTR_LITTLE_ENDIAN ) ) {
-			PyErr_SetString( PyExc_ValueError, 
-							 "can't specify ATTR_BIG_ENDIAN and ATTR_LITTLE_ENDIAN, it's just not right" );
-			return NULL;
-		}
-	} else {
-		PyErr_SetString( PyExc_TypeError, "you must specify a path name" );
-		return NULL;
+	AttrData() : type( 0 ), buffer( NULL ), size( 0 ), own_buffer( false ),
+				 swappable( false ), has_view( false ), owner( NULL ) {}
+	~AttrData() {
+		if( own_buffer ) free( buffer );
+		if( has_view ) PyBuffer_Release( &view );
+		Py_XDECREF( owner );
 	}
-	
-	int fd = open( filename, mode );
-	if( fd < 0 ) {
-		try {
-			strstream s;
-			s << "can't open file: " << filename \
-			  << " (" << strerror( errno ) << ")" << ends;
-			PyErr_SetString( PyExc_IOError, s.str() );
-		} catch ( ... ) {
-			PyErr_SetString( PyExc_IOError, strerror( errno ) );
-		}
 
-		return NULL;
+	// Copy a value in; sets a MemoryError and returns false if that
+	// doesn't work out.
+	bool store( const void *value, size_t value_size ) {
+		if( value_size <= ATTR_DATA_INLINE ) {
+			buffer = small.bytes;
+		} else {
+			buffer = (char *)malloc( value_size );
+			if( NULL == buffer ) {
+				PyErr_NoMemory();
+				return false;
+			}
+			own_buffer = true;
+		}
+		memcpy( buffer, value, value_size );
+		size = value_size;
+		swappable = true;
+		return true;
 	}
-	
-	DIR *fa_dir = fs_fopen_attr_dir( fd );
-	if( fa_dir == NULL ) {
-		close( fd );
 
-		try {
-			strstream s;
-			s << "can't open file's attributes: " << filename \
-			  << " (" << strerror( errno ) << ")" << ends;
-			PyErr_SetString( PyExc_IOError, s.str() );
-		} catch ( ... ) {
-			PyErr_SetString( PyExc_IOError, "can't open file's attributes" );
-		}
+private:
+	// Not copyable; buffer can point into small, and both copies would
+	// free or release what they own.
+	AttrData( const AttrData & );
+	AttrData &operator=( const AttrData & );
+};
 
-		return NULL;
-	}
+// Decoders return a new reference; encoders fill in an AttrData.  Both set
+// an exception and fail if the data doesn't fit the type.
+typedef PyObject *(*AttrDecoder)( const char *name, const char *ptr, size_t size );
+typedef bool (*AttrEncoder)( PyObject *obj, AttrData &data );
 
-	PyObject *attributes = PyDict_New();
-	uint32 attributes_added = 0;
-	if( attributes == NULL ) {
-		(void)fs_close_attr_dir( fa_dir );
-		close( fd );
+struct AttrCodec {
+	uint32 type;
+	AttrDecoder decode;
+	AttrEncoder encode;
+	PyObject *py_decode;	// from register_codec(), used instead if set
+	PyObject *py_encode;
+};
 
-		return PyErr_NoMemory();
+// The one error every decoder reports.
+static PyObject *decode_error( const char *name, const char *what )
+{
+	try {
+		strstream s;
+		s << "error converting attribute \"" << name \
+		  << "\" to " << what << ends;
+		PyErr_SetString( PyExc_RuntimeError, s.str() );
+	} catch ( ... ) {
+		PyErr_Format( PyExc_RuntimeError, "error converting attribute to %s", what );
 	}
-	
-	struct dirent *fa_ent = fs_read_attr_dir( fa_dir );
-	while( fa_ent != NULL ) {
-		struct attr_info fa_info;
-		status_t retval = fs_stat_attr( fd, fa_ent->d_name, &fa_info );
-		
-		if( retval == B_OK ) {
-			char *ptr = (char *)malloc( fa_info.size );
-			if( ptr == NULL ) {
-				(void)fs_close_attr_dir( fa_dir );
-				close( fd );
-
-				return PyErr_NoMemory();
-			}
-			
-			ssize_t read_bytes = fs_read_attr( fd, 
-											   fa_ent->d_name, fa_info.type, 
-											   0, ptr, fa_info.size );
-			if( read_bytes != fa_info.size ) {
-				// that's bad... but we'll ignore it for now.
-				// dunno if we should raise an exception here or not...
-				try {
-					strstream s;
-					s << "error reading attribute \"" << fa_ent->d_name \
-					  << "\": read " << read_bytes << ", expected " \
-					  << fa_info.size << ends;
-					PyErr_SetString( PyExc_IOError, s.str() );
-				} catch ( ... ) {
-					PyErr_SetString( PyExc_IOError, "error reading attribute" );
-				}
-
-				// Need to clean up before we do this...
-				(void)fs_close_attr_dir( fa_dir );
-				close( fd );
+	return NULL;
+}
 
-				return NULL;
-			}
+// Get raw data out of a bytearray, memoryview, mmap, array or any other
+// buffer object.  New-style buffers are borrowed without copying, locked
+// against resizing while data holds the view.  Old-style ones (array and
+// mmap in this Python) are copied: another thread could resize or close
+// them while the attribute is written without the GIL.
+static bool borrow_attr_buffer( PyObject *obj, AttrData &data )
+{
+	static char empty[1] = "";
 
-			// Swap the data around for fun and profit.
-			if( flags & ATTR_BIG_ENDIAN ) {
-				(void)swap_data( fa_info.type, ptr, fa_info.size,
-								 B_SWAP_BENDIAN_TO_HOST );
-			} else if( flags & ATTR_LITTLE_ENDIAN ) {
-				(void)swap_data( fa_info.type, ptr, fa_info.size,
-								 B_SWAP_LENDIAN_TO_HOST );
-			}
-			
-			// Now build a Python object out of the attribute, stick it in
-			// a tuple, and add it to the dictionary.
-			PyObject *attr = NULL;
-
-			switch( fa_info.type ) {
-			case B_ASCII_TYPE:
-			case B_CHAR_TYPE:
-			case B_MIME_TYPE:
-			case B_RAW_TYPE:
-			case B_STRING_TYPE:
-			case B_MIME_STRING_TYPE:	// in storage/Mime.h... *grumble*
-				// convert to string
-				if( ptr[read_bytes - 1] == '\0' && read_bytes > 1 ) {
-					attr = PyString_FromString( ptr );
-				} else {
-					attr = PyString_FromStringAndSize( ptr, read_bytes );
-				}
+	if( PyObject_CheckBuffer( obj ) ) {
+		if( PyObject_GetBuffer( obj, &data.view, PyBUF_SIMPLE ) < 0 ) return false;
+		data.has_view = true;
+		data.buffer = ( NULL == data.view.buf ) ? empty : (char *)data.view.buf;
+		data.size = data.view.len;
+		return true;
+	}
 
-				if( attr == NULL ) {
-					try {
-						strstream s;
-						s << "error converting attribute \"" << fa_ent->d_name \
-						  << "\" to string" << ends;
-						PyErr_SetString( PyExc_RuntimeError, s.str() );
-					} catch ( ... ) {
-						PyErr_SetString( PyExc_RuntimeError, "error converting attribute to string" );
-					}
-				}
-				break;
-				
-			case B_BOOL_TYPE:
-			case B_INT8_TYPE:
-			case B_UINT8_TYPE:
-			case B_INT16_TYPE:
-			case B_UINT16_TYPE:
-			case B_INT32_TYPE:
-			case B_SIZE_T_TYPE:
-			case B_SSIZE_T_TYPE:
-			case B_UINT32_TYPE:
-			case B_INT64_TYPE:
-			case B_OFF_T_TYPE:
-			case B_TIME_TYPE:
-			case B_UINT64_TYPE:
-				// convert to integer
-				if( read_bytes == sizeof( char ) ) {				// 8-bit
-					attr = PyInt_FromLong( (long)( ptr[0] ) );
-				} else if( read_bytes == sizeof( short ) ) {		// 16-bit
-					short x;
-					memcpy( &x, ptr, sizeof( short ) );
-					attr = PyInt_FromLong( (long)x );
-				} else if( read_bytes == sizeof( long ) ) {			// 32-bit
-					long x;
-					memcpy( &x, ptr, sizeof( long ) );
-					attr = PyInt_FromLong( x );
-				} else if( read_bytes == sizeof( long long ) ) {	// 64-bit
-					long long x;
-					memcpy( &x, ptr, sizeof( long long ) );
-					attr = PyLong_FromLongLong( x );
-				} else {											// two-bit
-					attr = NULL;
-				}
-				
-				if( attr == NULL ) {
-					try {
-						strstream s;
-						s << "error converting attribute \"" << fa_ent->d_name \
-						  << "\" to integer" << ends;
-						PyErr_SetString( PyExc_RuntimeError, s.str() );
-					} catch ( ... ) {
-						PyErr_SetString( PyExc_RuntimeError, "error converting attribute to integer" );
-					}
-				}
-				break;
+	const void *ptr;
+	Py_ssize_t len;
+	if( PyObject_AsReadBuffer( obj, &ptr, &len ) < 0 ) return false;
+	if( !data.store( ( NULL == ptr ) ? empty : ptr, len ) ) return false;
 
-			case B_DOUBLE_TYPE:
-				// convert to float
-				if( read_bytes == sizeof( double ) ) {
-					double x;
-					memcpy( &x, ptr, sizeof( double ) );
-					attr = PyFloat_FromDouble( x );
-				} else {
-					attr = NULL;
-				}
+	// Bytes handed to us are written as they are, copied or not.
+	data.swappable = false;
+	return true;
+}
 
-				if( attr == NULL ) {
-					try {
-						strstream s;
-						s << "error converting attribute \"" << fa_ent->d_name \
-						  << "\" to float" << ends;
-						PyErr_SetString( PyExc_RuntimeError, s.str() );
-					} catch ( ... ) {
-						PyErr_SetString( PyExc_RuntimeError, "error converting attribute to float" );
-					}
-				}
-				break;
-				
-			case B_FLOAT_TYPE:
-				// convert to float
-				if( read_bytes == sizeof( float ) ) {
-					float x;
-					memcpy( &x, ptr, sizeof( float ) );
-					attr = PyFloat_FromDouble( (double)x );
-				} else {
-					attr = NULL;
-				}
+// Strings (and unicode, which has an old-style buffer of its own insides)
+// go through PyString_AsString(); anything else with a buffer is borrowed.
+static bool is_borrowable( PyObject *obj )
+{
+	return !PyString_Check( obj ) && !PyUnicode_Check( obj ) && 
+		   ( PyObject_CheckBuffer( obj ) || PyObject_CheckReadBuffer( obj ) );
+}
 
-				if( attr == NULL ) {
-					try {
-						strstream s;
-						s << "error converting attribute \"" << fa_ent->d_name \
-						  << "\" to float" << ends;
-						PyErr_SetString( PyExc_RuntimeError, s.str() );
-					} catch ( ... ) {
-						PyErr_SetString( PyExc_RuntimeError, "error converting attribute to float" );
-					}
-				}
-				break;
-				
-			case B_POINT_TYPE:
-				// BPoint -> (x,y)
-				attr = PyTuple_New( 2 );
-				if( attr ) {
-					BPoint *pt = static_cast<BPoint *>( (void *)ptr );
-					PyTuple_SET_ITEM( attr, 0, PyFloat_FromDouble( (double)pt->x ) );
-					PyTuple_SET_ITEM( attr, 1, PyFloat_FromDouble( (double)pt->y ) );
-				}
-				
-				if( attr == NULL ) {
-					try {
-						strstream s;
-						s << "error converting attribute \"" << fa_ent->d_name \
-						  << "\" to tuple" << ends;
-						PyErr_SetString( PyExc_RuntimeError, s.str() );
-					} catch ( ... ) {
-						PyErr_SetString( PyExc_RuntimeError, "error converting attribute to tuple" );
-					}
-				}
-				break;
-				
-			case B_RECT_TYPE:
-				// BRect -> (top,left,bottom,right)
-				attr = PyTuple_New( 4 );
-				if( attr ) {
-					BRect *rect = static_cast<BRect *>( (void *)ptr );
-					PyTuple_SET_ITEM( attr, 0, PyFloat_FromDouble( (double)rect->left ) );
-					PyTuple_SET_ITEM( attr, 1, PyFloat_FromDouble( (double)rect->top ) );
-					PyTuple_SET_ITEM( attr, 2, PyFloat_FromDouble( (double)rect->right ) );
-					PyTuple_SET_ITEM( attr, 3, PyFloat_FromDouble( (double)rect->bottom ) );
-				}
+// Point data at a Python string's contents; the caller keeps obj alive.
+static bool string_data( PyObject *obj, AttrData &data )
+{
+	char *str = PyString_AsString( obj );
+	if( NULL == str ) {
+		PyErr_SetString( PyExc_TypeError, "couldn't convert data to string" );
+		return false;
+	}
 
-				if( attr == NULL ) {
-					try {
-						strstream s;
-						s << "error converting attribute \"" << fa_ent->d_name \
-						  << "\" to tuple" << ends;
-						PyErr_SetString( PyExc_RuntimeError, s.str() );
-					} catch ( ... ) {
-						PyErr_SetString( PyExc_RuntimeError, "error converting attribute to tuple" );
-					}
-				}
-				break;
-				
-			case B_REF_TYPE:
-				// entry_ref -> pathname
-				{
-					BEntry ent( static_cast<entry_ref *>( (void *)ptr ) );
-					if( ent.InitCheck() != B_OK ) {
-						try {
-							strstream s;
-							s << "error getting filesystem entry for attribute \"" \
-							  << fa_ent->d_name \
-							  << "\": " << strerror( ent.InitCheck() ) << ends;
-							PyErr_SetString( PyExc_RuntimeError, s.str() );
-						} catch ( ... ) {
-							PyErr_SetString( PyExc_RuntimeError, "error getting filesystem entry for attribute" );
-						}
-
-						break;
-					}
-					
-					BPath path;
-					status_t path_retval = ent.GetPath( &path );
-					if( path_retval != B_OK ) {
-						try {
-							strstream s;
-							s << "error getting path of filesystem entry for attribute \"" \
-							  << fa_ent->d_name \
-							  << "\": " << strerror( path_retval ) << ends;
-							PyErr_SetString( PyExc_RuntimeError, s.str() );
-						} catch ( ... ) {
-							PyErr_SetString( PyExc_RuntimeError, "error getting path of filesystem entry for attribute" );
-						}
-
-						break;
-					}
-					
-					attr = PyString_FromString( path.Path() );
-				}
-				
-				if( attr == NULL ) {
-					try {
-						strstream s;
-						s << "error converting entry_ref attribute \"" \
-						  << fa_ent->d_name \
-						  << "\" to string" << ends;
-						PyErr_SetString( PyExc_RuntimeError, s.str() );
-					} catch ( ... ) {
-						PyErr_SetString( PyExc_RuntimeError, "error converting entry_ref attribute to string" );
-					}
-				}
-				break;
-				
-			case B_RGB_COLOR_TYPE:
-				// rgb_color -> (r,g,b,a)
-				attr = PyTuple_New( 4 );
-				if( attr ) {
-					rgb_color *rgb = static_cast<rgb_color *>( (void *)ptr );
-					PyTuple_SET_ITEM( attr, 0, PyInt_FromLong( (long)rgb->red ) );
-					PyTuple_SET_ITEM( attr, 1, PyInt_FromLong( (long)rgb->green ) );
-					PyTuple_SET_ITEM( attr, 2, PyInt_FromLong( (long)rgb->blue ) );
-					PyTuple_SET_ITEM( attr, 3, PyInt_FromLong( (long)rgb->alpha ) );
-				}
-				
-				if( attr == NULL ) {
-					try {
-						strstream s;
-						s << "error converting attribute \"" << fa_ent->d_name \
-						  << "\" to tuple" << ends;
-						PyErr_SetString( PyExc_RuntimeError, s.str() );
-					} catch ( ... ) {
-						PyErr_SetString( PyExc_RuntimeError, "error converting attribute to tuple" );
-					}
-				}
-				break;
+	data.buffer = str;
+	data.size = PyString_Size( obj );
+	return true;
+}
 
-			default:
-				// unknown data
-				attr = PyString_FromStringAndSize( ptr, read_bytes );
-				
-				if( attr == NULL ) {
-					try {
-						strstream s;
-						s << "error converting attribute \"" << fa_ent->d_name \
-						  << "\" to string" << ends;
-						PyErr_SetString( PyExc_RuntimeError, s.str() );
-					} catch ( ... ) {
-						PyErr_SetString( PyExc_RuntimeError, "error converting attribute to string" );
-					}
-				}
-				break;
-			}
+// Strings: a trailing NUL is dropped on the way in, and not added on the
+// way out.
+static PyObject *decode_string( const char *name, const char *ptr, size_t size )
+{
+	PyObject *attr;
+	if( size > 1 && ptr[size - 1] == '\0' ) {
+		attr = PyString_FromString( ptr );
+	} else {
+		attr = PyString_FromStringAndSize( ptr, size );
+	}
 
-			// We're done with this, so discard it.
-			free( ptr );
-
-			// If we've got a valid attribute, let's add it to the dictionary.
-			if( attr ) {
-				PyObject *the_tuple = PyTuple_New( 2 );
-				PyObject *the_name = PyString_FromString( fa_ent->d_name );
-				PyObject *the_type = PyInt_FromLong( fa_info.type );
-
-				if( the_tuple == NULL || the_name == NULL || the_type == NULL ) {
-					try {
-						strstream s;
-						s << "error creating attribute tuple for \"" \
-						  << fa_ent->d_name << "\"" << ends;
-						PyErr_SetString( PyExc_RuntimeError, s.str() );
-					} catch ( ... ) {
-						PyErr_SetString( PyExc_RuntimeError, "error creating attribute tuple" );
-					}
-					
-					// need to clean up
-					return NULL;
-				}
-				
-				PyTuple_SET_ITEM( the_tuple, 0, the_type );
-				PyTuple_SET_ITEM( the_tuple, 1, attr );
-				
-				if( PyDict_SetItem( attributes, the_name, the_tuple ) == -1 ) {
-					// error handling... 
-					// leak-o-rama
-					try {
-						strstream s;
-						s << "can't add attribute \"" << fa_ent->d_name \
-						  << "\" to list" << ends;
-						PyErr_SetString( PyExc_RuntimeError, s.str() );
-					} catch ( ... ) {
-						PyErr_SetString( PyExc_RuntimeError, "can't add attributes to list" );
-					}
-					return NULL;
-				}
-				
-				attributes_added++;
-			} else {
-				// Some sort of cleanup...
-				return NULL;
-			}
-		}
+	return ( NULL == attr ) ? decode_error( name, "string" ) : attr;
+}
 
-		// Get the next attribute's info.
-		fa_ent = fs_read_attr_dir( fa_dir );
-	}
+static bool encode_string( PyObject *obj, AttrData &data )
+{
+	return string_data( obj, data );
+}
 
-	(void)fs_close_attr_dir( fa_dir );
-	close( fd );
+static bool encode_c_string( PyObject *obj, AttrData &data )
+{
+	// In case some smart-ass tries to embed NULs...
+	if( !string_data( obj, data ) ) return false;
+	data.size = strlen( data.buffer );
+	return true;
+}
 
-	Py_INCREF( attributes );
-	return attributes;
+static bool encode_char( PyObject *obj, AttrData &data )
+{
+	// In case some smart-ass tries to make huge chars...
+	if( !string_data( obj, data ) ) return false;
+	data.size = 1;
+	return true;
 }
 
-// ----------------------------------------------------------------------
-// Write a file attribute to the file/directory/symlink; if the data is a
-// few things (like an rgb_color, BRect, etc.) it must be presented as a tuple.
-// 
-// args:
-//  filename
-//  attr_name
-//  attr_type (as a string or integer)
-//  attr_data (as an object; we'll figure out what it is)
-//  flags = 0 (optional)
+// Raw and unknown data: a string, or anything with the buffer protocol,
+// written as it is.
+static PyObject *decode_bytes( const char *name, const char *ptr, size_t size )
+{
+	PyObject *attr = PyString_FromStringAndSize( ptr, size );
+	return ( NULL == attr ) ? decode_error( name, "string" ) : attr;
+}
 
-static PyObject *bfs_write_attr( PyObject *self, PyObject *args )
+static bool encode_bytes( PyObject *obj, AttrData &data )
 {
-	// self isn't used for normal functions
-	self = self;
+	if( is_borrowable( obj ) ) return borrow_attr_buffer( obj, data );
+	return string_data( obj, data );
+}
 
-	char *filename;
-	char *attr_name;
-	PyObject *attr_type_obj;
-	PyObject *attr_data_obj;
-	int flags = 0;
+// Integers, one instance per fixed-width type.  Values that fit in a
+// Python int come back as one, the rest as longs.
+template<class T>
+static PyObject *decode_int( const char *name, const char *ptr, size_t size )
+{
+	if( size != sizeof( T ) ) return decode_error( name, "integer" );
 
-	// Could be B_READ_ONLY in BeOS > R4.5.
-	int mode = B_WRITE_ONLY;
+	T val;
+	memcpy( &val, ptr, sizeof( T ) );
 
-	if( PyArg_ParseTuple( args, "ssOO|i",
-						  &filename,
-						  &attr_name, &attr_type_obj, &attr_data_obj,
-						  &flags ) ) {
-		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
-		if( ( flags & ATTR_BIG_ENDIAN ) && ( flags & ATTR_LITTLE_ENDIAN ) ) {
-			PyErr_SetString( PyExc_ValueError, 
-							 "can't specify ATTR_BIG_ENDIAN and ATTR_LITTLE_ENDIAN, it's ust not right" );
-			return NULL;
+	PyObject *attr;
+	if( (T)-1 < 0 ) {
+		if( sizeof( T ) <= sizeof( long ) ) {
+			attr = PyInt_FromLong( (long)val );
+		} else {
+			attr = PyLong_FromLongLong( (PY_LONG_LONG)val );
 		}
 	} else {
-		PyErr_SetString( PyExc_TypeError, "invalid arguments" );
-		return NULL;
+		if( (unsigned PY_LONG_LONG)val <= (unsigned PY_LONG_LONG)LONG_MAX ) {
+			attr = PyInt_FromLong( (long)val );
+		} else {
+			attr = PyLong_FromUnsignedLongLong( (unsigned PY_LONG_LONG)val );
+		}
 	}
 
-	// Is the attribute name too long?  Hope you don't have embedded NULs...
-	if( strlen( attr_name ) > B_ATTR_NAME_LENGTH ) {
-		PyErr_SetString( PyExc_OverflowError, "attribute name too long" );
-		return NULL;
-	}
+	return ( NULL == attr ) ? decode_error( name, "integer" ) : attr;
+}
 
-	uint32 be_type_code = 0;
-	
-	if( PyInt_Check( attr_type_obj ) ) {			// integer version of B_*_TYPE
-		be_type_code = (uint32)PyInt_AsLong( attr_type_obj );
-	} else if( PyString_Check( attr_type_obj ) ) {	// string version
-		if( PyString_Size( attr_type_obj ) != 4 ) {
-			PyErr_SetString( PyExc_TypeError, "attribute type must be 4 characters" );
-			return NULL;
-		}
+// Types whose width depends on the platform (time_t, off_t...); data
+// written by either kind of system is read.
+template<class T>
+static PyObject *decode_native_int( const char *name, const char *ptr, size_t size )
+{
+	bool is_signed = ( (T)-1 < 0 );
 
-		char *type_str = PyString_AsString( attr_type_obj );
-		be_type_code += (uint32)type_str[0] << 24;	// endian-safe? hmm...
-		be_type_code += (uint32)type_str[1] << 16;	// brain isn't working...
-		be_type_code += (uint32)type_str[2] << 8;
-		be_type_code += (uint32)type_str[3];
-	} else {										// error version
-		PyErr_SetString( PyExc_TypeError, "attribute type must be specified as an integer or a string" );
-		return NULL;
+	if( size == sizeof( int32 ) ) {
+		return is_signed ? decode_int<int32>( name, ptr, size ) 
+						 : decode_int<uint32>( name, ptr, size );
+	} else if( size == sizeof( int64 ) ) {
+		return is_signed ? decode_int<int64>( name, ptr, size ) 
+						 : decode_int<uint64>( name, ptr, size );
 	}
 
-	char *buffer = NULL;
-	size_t buffer_size = 0;
-	bool own_buffer = false;
-
-	switch( be_type_code ) {
-	case B_ASCII_TYPE:
-	case B_CHAR_TYPE:
-	case B_MIME_TYPE:
-	case B_RAW_TYPE:
-	case B_STRING_TYPE:
-	case B_MIME_STRING_TYPE:
-		// convert from string
-		{
-			char *str = PyString_AsString( attr_data_obj );
-			if( NULL == str ) {
-				PyErr_SetString( PyExc_TypeError, 
-								 "couldn't convert data to string" );
-			} else {
-				buffer = str;
-				switch( be_type_code ) {
-				case B_CHAR_TYPE:
-					// In case some smart-ass tries to make huge chars...
-					buffer_size = 1;
-					break;
-
-				case B_STRING_TYPE:
-					// In case some smart-ass tries to embed NULs...
-					buffer_size = strlen( buffer );
-					break;
-
-				default:
-					buffer_size = PyString_Size( attr_data_obj );
-					break;
-				}
-			}
-		}
-		break;
-				
-	case B_BOOL_TYPE:
-		// convert from whatever
-		{
-			bool val = ( PyObject_IsTrue( attr_data_obj ) ? true : false );
-			buffer_size = sizeof( bool );
-			buffer = (char *)malloc( buffer_size );
-			if( buffer ) {
-				own_buffer = true;
-				memcpy( buffer, &val, buffer_size );
-			}
-		}
-		break;
+	return decode_int<T>( name, ptr, size );
+}
 
-	case B_INT8_TYPE:
-		// 8-bit value
-		{
-			long val = PyInt_AsLong( attr_data_obj );
-			if( val < SCHAR_MIN || val > SCHAR_MAX ) {
-				PyErr_SetString( PyExc_OverflowError, 
-								 "value bigger than 8 bits" );
-			} else {
-				buffer_size = sizeof( int8 );
-				buffer = (char *)malloc( buffer_size );
-				if( buffer ) {
-					own_buffer = true;
-					int8 val8 = (int8)val;
-					memcpy( buffer, &val8, buffer_size );
-				}
-			}
-		}
-		break;
+template<class T>
+static bool encode_int( PyObject *obj, AttrData &data )
+{
+	PyObject *as_long = PyNumber_Long( obj );
+	if( NULL == as_long ) return false;
 
-	case B_UINT8_TYPE:
-		// 8-bit value
-		{
-			unsigned long val = (unsigned long)PyInt_AsLong( attr_data_obj );
-			if( val > UCHAR_MAX ) {
-				PyErr_SetString( PyExc_OverflowError, 
-								 "value bigger than 8 bits" );
-			} else {
-				buffer_size = sizeof( uint8 );
-				buffer = (char *)malloc( buffer_size );
-				if( buffer ) {
-					own_buffer = true;
-					uint8 val8 = (uint8)val;
-					memcpy( buffer, &val8, buffer_size );
-				}
-			}
-		}
-		break;
+	T val;
+	bool fits;
+	if( (T)-1 < 0 ) {
+		PY_LONG_LONG x = PyLong_AsLongLong( as_long );
+		PY_LONG_LONG max = (PY_LONG_LONG)( ( (unsigned PY_LONG_LONG)1 << ( 8 * sizeof( T ) - 1 ) ) - 1 );
+		fits = ( x >= -max - 1 && x <= max );
+		val = (T)x;
+	} else {
+		unsigned PY_LONG_LONG x = PyLong_AsUnsignedLongLong( as_long );
+		fits = ( x <= (unsigned PY_LONG_LONG)(T)-1 );
+		val = (T)x;
+	}
+	Py_DECREF( as_long );
 
-	case B_INT16_TYPE:
-		// 16-bit value
-		{
-			long val = PyInt_AsLong( attr_data_obj );
-			if( val < SHRT_MIN || val > SHRT_MAX ) {
-				PyErr_SetString( PyExc_OverflowError, 
-								 "value bigger than 16 bits" );
-			} else {
-				buffer_size = sizeof( int16 );
-				buffer = (char *)malloc( buffer_size );
-				if( buffer ) {
-					own_buffer = true;
-					int16 val16 = (int16)val;
-					memcpy( buffer, &val16, buffer_size );
-				}
-			}
-		}
-		break;
+	if( PyErr_Occurred() ) return false;
+	if( !fits ) {
+		PyErr_Format( PyExc_OverflowError, "value bigger than %d bits", 
+					  (int)( 8 * sizeof( T ) ) );
+		return false;
+	}
 
-	case B_UINT16_TYPE:
-		// 16-bit value
-		{
-			unsigned long val = (unsigned long)PyInt_AsLong( attr_data_obj );
-			if( val > USHRT_MAX ) {
-				PyErr_SetString( PyExc_OverflowError, 
-								 "value bigger than 16 bits" );
-			} else {
-				buffer_size = sizeof( uint16 );
-				buffer = (char *)malloc( buffer_size );
-				if( buffer ) {
-					own_buffer = true;
-					uint16 val16 = (uint16)val;
-					memcpy( buffer, &val16, buffer_size );
-				}
-			}
-		}
-		break;
+	return data.store( &val, sizeof( T ) );
+}
 
-	case B_INT32_TYPE:
-	case B_SIZE_T_TYPE:
-	case B_SSIZE_T_TYPE:
-	case B_UINT32_TYPE:
-	case B_TIME_TYPE:	// see bug #19990610-11859; am I 32-bit or 64-bit?
-		// 32-bit values
-		{
-			long val = PyInt_AsLong( attr_data_obj );
-			buffer_size = sizeof( int32 );
-			buffer = (char *)malloc( buffer_size );
-			if( buffer ) {
-				own_buffer = true;
-				memcpy( buffer, &val, buffer_size );
-			}
-		}
-		break;
+static PyObject *decode_bool( const char *name, const char *ptr, size_t size )
+{
+	if( size < 1 ) return decode_error( name, "bool" );
+	return PyBool_FromLong( ptr[0] != 0 );
+}
 
-	case B_INT64_TYPE:
-	case B_OFF_T_TYPE:
-	case B_UINT64_TYPE:
-		// 64-bit values
-		{
-			long long val = PyLong_AsLongLong( attr_data_obj );
-			buffer_size = sizeof( int64 );
-			buffer = (char *)malloc( buffer_size );
-			if( buffer ) {
-				own_buffer = true;
-				memcpy( buffer, &val, buffer_size );
-			}
-		}
-		break;
+static bool encode_bool( PyObject *obj, AttrData &data )
+{
+	int truth = PyObject_IsTrue( obj );
+	if( truth < 0 ) return false;
 
-	case B_DOUBLE_TYPE:
-		// convert from double
-		{
-			double val = PyFloat_AsDouble( attr_data_obj );
-			buffer_size = sizeof( double );
-			buffer = (char *)malloc( buffer_size );
-			if( buffer ) {
-				own_buffer = true;
-				memcpy( buffer, &val, buffer_size );
-			}
-		}
-		break;
+	uint8 val = ( truth ? 1 : 0 );
+	return data.store( &val, sizeof( val ) );
+}
 
-	case B_FLOAT_TYPE:
-		// convert from float
-		{
-			double val = PyFloat_AsDouble( attr_data_obj );
-			if( val < (double)FLT_MIN || val > (double)FLT_MAX ) {
-				PyErr_SetString( PyExc_OverflowError, 
-								 "value bigger than 16 bits" );
-			} else {
-				float fval = (float)val;
-				buffer_size = sizeof( float );
-				buffer = (char *)malloc( buffer_size );
-				if( buffer ) {
-					own_buffer = true;
-					memcpy( buffer, &fval, buffer_size );
-				}
-			}
-		}
-		break;
-			
-	case B_POINT_TYPE:
-		// BPoint -> (x,y)
-		if( !PyTuple_Check( attr_data_obj ) ) {
-			PyErr_SetString( PyExc_TypeError, "BPoints are passed as tuples" );
-		} else {
-			PyObject *obj = PyTuple_GetItem( attr_data_obj, 0 );
-			if( NULL == obj ) {
-				PyErr_SetString( PyExc_IndexError, "can't get x from tuple" );
-				break;
-			}
-			float x = (float)PyFloat_AsDouble( obj );
+// Floating point, float and double.
+template<class T>
+static PyObject *decode_float( const char *name, const char *ptr, size_t size )
+{
+	if( size != sizeof( T ) ) return decode_error( name, "float" );
 
-			obj = PyTuple_GetItem( attr_data_obj, 1 );
-			if( NULL == obj ) {
-				PyErr_SetString( PyExc_IndexError, "can't get y from tuple" );
+	T val;
+	memcpy( &val, ptr, sizeof( T ) );
+	PyObject *attr = PyFloat_FromDouble( (double)val );
+	return ( NULL == attr ) ? decode_error( name, "float" ) : attr;
+}
+
+template<class T>
+static bool encode_float( PyObject *obj, AttrData &data )
+{
+	double x = PyFloat_AsDouble( obj );
+	if( PyErr_Occurred() ) return false;
+
+	// Infinities and NaNs go through (x - x isn't 0 for them); big finite
+	// numbers don't.
+	if( sizeof( T ) < sizeof( double ) && x - x == 0.0 && 
+		( x > (double)FLT_MAX || x < -(double)FLT_MAX ) ) {
+		PyErr_SetString( PyExc_OverflowError, "value too big for a float" );
+		return false;
+	}
+
+	T val = (T)x;
+	return data.store( &val, sizeof( T ) );
+}
+
+// Tuples of numbers: get count floats (or ints) out of a tuple, with the
+// element names for the error messages.
+static bool tuple_floats( PyObject *obj, const char *what, int count, 
+						  const char * const *names, float *values )
+{
+	if( !PyTuple_Check( obj ) ) {
+		PyErr_Format( PyExc_TypeError, "%s are passed as tuples", what );
+		return false;
+	}
+
+	for( int i = 0; i < count; i++ ) {
+		PyObject *item = PyTuple_GetItem( obj, i );
+		if( NULL == item ) {
+			PyErr_Format( PyExc_IndexError, "can't get %s from tuple", names[i] );
+			return false;
+		}
+		values[i] = (float)PyFloat_AsDouble( item );
+		if( PyErr_Occurred() ) return false;
+	}
+
+	return true;
+}
+
+static PyObject *decode_point( const char *name, const char *ptr, size_t size )
+{
+	if( size != sizeof( BPoint ) ) return decode_error( name, "tuple" );
+
+	// BPoint -> (x,y)
+	BPoint pt;
+	memcpy( &pt, ptr, sizeof( BPoint ) );
+	PyObject *attr = Py_BuildValue( "(dd)", (double)pt.x, (double)pt.y );
+	return ( NULL == attr ) ? decode_error( name, "tuple" ) : attr;
+}
+
+static bool encode_point( PyObject *obj, AttrData &data )
+{
+	static const char * const names[] = { "x", "y" };
+	float values[2];
+	if( !tuple_floats( obj, "BPoints", 2, names, values ) ) return false;
+
+	BPoint val( values[0], values[1] );
+	return data.store( &val, sizeof( BPoint ) );
+}
+
+static PyObject *decode_rect( const char *name, const char *ptr, size_t size )
+{
+	if( size != sizeof( BRect ) ) return decode_error( name, "tuple" );
+
+	// BRect -> (left,top,right,bottom)
+	BRect rect;
+	memcpy( &rect, ptr, sizeof( BRect ) );
+	PyObject *attr = Py_BuildValue( "(dddd)", (double)rect.left, (double)rect.top,
+									(double)rect.right, (double)rect.bottom );
+	return ( NULL == attr ) ? decode_error( name, "tuple" ) : attr;
+}
+
+static bool encode_rect( PyObject *obj, AttrData &data )
+{
+	static const char * const names[] = { "left", "top", "right", "bottom" };
+	float values[4];
+	if( !tuple_floats( obj, "BRects", 4, names, values ) ) return false;
+
+	BRect val( values[0], values[1], values[2], values[3] );
+	return data.store( &val, sizeof( BRect ) );
+}
+
+static PyObject *decode_rgb_color( const char *name, const char *ptr, size_t size )
+{
+	if( size != sizeof( rgb_color ) ) return decode_error( name, "tuple" );
+
+	// rgb_color -> (r,g,b,a)
+	rgb_color rgb;
+	memcpy( &rgb, ptr, sizeof( rgb_color ) );
+	PyObject *attr = Py_BuildValue( "(iiii)", (int)rgb.red, (int)rgb.green,
+									(int)rgb.blue, (int)rgb.alpha );
+	return ( NULL == attr ) ? decode_error( name, "tuple" ) : attr;
+}
+
+static bool encode_rgb_color( PyObject *obj, AttrData &data )
+{
+	static const char * const names[] = { "red", "green", "blue", "alpha" };
+	if( !PyTuple_Check( obj ) ) {
+		PyErr_SetString( PyExc_TypeError, "rgb_colors are passed as tuples" );
+		return false;
+	}
+
+	// Alpha is optional, and opaque if it isn't there.
+	uint8 values[4] = { 0, 0, 0, 255 };
+	for( int i = 0; i < 4; i++ ) {
+		PyObject *item = PyTuple_GetItem( obj, i );
+		if( NULL == item ) {
+			if( 3 == i ) {
+				PyErr_Clear();
 				break;
 			}
-			float y = (float)PyFloat_AsDouble( obj );
-			
-			BPoint val( x, y );
-			buffer_size = sizeof( BPoint );
-			buffer = (char *)malloc( buffer_size );
-			if( buffer ) {
-				own_buffer = true;
-				memcpy( buffer, &val, buffer_size );
+			PyErr_Format( PyExc_IndexError, "can't get %s from tuple", names[i] );
+			return false;
+		}
+
+		long val = PyInt_AsLong( item );
+		if( PyErr_Occurred() ) return false;
+		if( val < 0 || val > UCHAR_MAX ) {
+			PyErr_Format( PyExc_OverflowError, "%s value not between 0 and 255", names[i] );
+			return false;
+		}
+		values[i] = (uint8)val;
+	}
+
+	rgb_color color = { values[0], values[1], values[2], values[3] };
+	return data.store( &color, sizeof( rgb_color ) );
+}
+
+#ifndef __linux__
+// Set the RuntimeError for an entry_ref that doesn't lead anywhere.
+static void raise_ref_error( const char *name, bool no_entry, status_t error )
+{
+	const char *what = no_entry ? "error getting filesystem entry for attribute" :
+								  "error getting path of filesystem entry for attribute";
+	try {
+		strstream s;
+		s << what << " \"" << name << "\": " << strerror( error ) << ends;
+		PyErr_SetString( PyExc_RuntimeError, s.str() );
+	} catch ( ... ) {
+		PyErr_SetString( PyExc_RuntimeError, what );
+	}
+}
+
+// Find where an entry_ref leads; the raw readers call this with the GIL
+// released, and keep the answer in the RawAttr.  Returns B_OK, or the
+// error with no_entry saying which step it came from.
+static status_t ref_to_path( const char *ptr, size_t size, BPath &path, bool &no_entry )
+{
+	no_entry = true;
+	if( size < sizeof( entry_ref ) ) return B_BAD_VALUE;
+
+	BEntry ent( static_cast<const entry_ref *>( (const void *)ptr ) );
+	if( ent.InitCheck() != B_OK ) return ent.InitCheck();
+
+	no_entry = false;
+	return ent.GetPath( &path );
+}
+#endif
+
+static PyObject *decode_ref( const char *name, const char *ptr, size_t size )
+{
+	// entry_ref -> pathname
+#ifdef __linux__
+	// No device/inode lookup here; whoever wrote it gets the bytes back.
+	return decode_bytes( name, ptr, size );
+#else
+	// Raw attributes come with the path already looked up (see
+	// raw_attr_value()), so this is only for data that didn't.
+	BPath path;
+	bool no_entry;
+	status_t retval = ref_to_path( ptr, size, path, no_entry );
+	if( retval != B_OK ) {
+		raise_ref_error( name, no_entry, retval );
+		return NULL;
+	}
+
+	PyObject *attr = PyString_FromString( path.Path() );
+	return ( NULL == attr ) ? decode_error( name, "string" ) : attr;
+#endif
+}
+
+static bool encode_ref( PyObject *, AttrData & )
+{
+	PyErr_SetString( PyExc_NotImplementedError, "where the hell did you get an entry_ref from anyway?" );
+	return false;
+}
+
+static const AttrCodec builtin_codecs[] = {
+	{ B_ASCII_TYPE,			decode_string,				encode_string, NULL, NULL },
+	{ B_CHAR_TYPE,			decode_string,				encode_char, NULL, NULL },
+	{ B_MIME_TYPE,			decode_string,				encode_string, NULL, NULL },
+	{ B_MIME_STRING_TYPE,	decode_string,				encode_string, NULL, NULL },
+	{ B_STRING_TYPE,		decode_string,				encode_c_string, NULL, NULL },
+	{ B_RAW_TYPE,			decode_string,				encode_bytes, NULL, NULL },
+	{ B_BOOL_TYPE,			decode_bool,				encode_bool, NULL, NULL },
+	{ B_INT8_TYPE,			decode_int<int8>,			encode_int<int8>, NULL, NULL },
+	{ B_UINT8_TYPE,			decode_int<uint8>,			encode_int<uint8>, NULL, NULL },
+	{ B_INT16_TYPE,			decode_int<int16>,			encode_int<int16>, NULL, NULL },
+	{ B_UINT16_TYPE,		decode_int<uint16>,			encode_int<uint16>, NULL, NULL },
+	{ B_INT32_TYPE,			decode_int<int32>,			encode_int<int32>, NULL, NULL },
+	{ B_UINT32_TYPE,		decode_int<uint32>,			encode_int<uint32>, NULL, NULL },
+	{ B_INT64_TYPE,			decode_int<int64>,			encode_int<int64>, NULL, NULL },
+	{ B_UINT64_TYPE,		decode_int<uint64>,			encode_int<uint64>, NULL, NULL },
+	{ B_SIZE_T_TYPE,		decode_native_int<size_t>,	encode_int<size_t>, NULL, NULL },
+	{ B_SSIZE_T_TYPE,		decode_native_int<ssize_t>,	encode_int<ssize_t>, NULL, NULL },
+	{ B_OFF_T_TYPE,			decode_native_int<off_t>,	encode_int<off_t>, NULL, NULL },
+	{ B_TIME_TYPE,			decode_native_int<time_t>,	encode_int<time_t>, NULL, NULL },
+	{ B_FLOAT_TYPE,			decode_float<float>,		encode_float<float>, NULL, NULL },
+	{ B_DOUBLE_TYPE,		decode_float<double>,		encode_float<double>, NULL, NULL },
+	{ B_POINT_TYPE,			decode_point,				encode_point, NULL, NULL },
+	{ B_RECT_TYPE,			decode_rect,				encode_rect, NULL, NULL },
+	{ B_RGB_COLOR_TYPE,		decode_rgb_color,			encode_rgb_color, NULL, NULL },
+	{ B_REF_TYPE,			decode_ref,					encode_ref, NULL, NULL },
+};
+
+static const AttrCodec raw_codec = { 0, decode_bytes, encode_bytes, NULL, NULL };
+
+// Built at init from builtin_codecs, plus whatever register_codec() adds;
+// only touched with the GIL held.
+typedef map<uint32, AttrCodec> CodecTable;
+static CodecTable codec_table;
+
+static void init_codecs( void )
+{
+	for( size_t i = 0; i < sizeof( builtin_codecs ) / sizeof( builtin_codecs[0] ); i++ ) {
+		codec_table[builtin_codecs[i].type] = builtin_codecs[i];
+	}
+}
+
+static const AttrCodec &attr_codec( uint32 type )
+{
+	CodecTable::const_iterator found = codec_table.find( type );
+	return ( found == codec_table.end() ) ? raw_codec : found->second;
+}
+
+// Call a codec registered from Python.  The codec can register_codec()
+// its type over again, which drops the table's reference to it and the
+// table entry codec refers to, so hold on to the function while it runs.
+static PyObject *py_decode( const AttrCodec &codec, const char *name, 
+							const char *ptr, size_t size )
+{
+	PyObject *data = PyString_FromStringAndSize( ptr, size );
+	if( NULL == data ) return decode_error( name, "string" );
+
+	PyObject *decode = codec.py_decode;
+	Py_INCREF( decode );
+	PyObject *attr = PyObject_CallFunctionObjArgs( decode, data, NULL );
+	Py_DECREF( decode );
+	Py_DECREF( data );
+	return attr;
+}
+
+static bool py_encode( const AttrCodec &codec, PyObject *obj, AttrData &data )
+{
+	PyObject *encode = codec.py_encode;
+	Py_INCREF( encode );
+	PyObject *encoded = PyObject_CallFunctionObjArgs( encode, obj, NULL );
+	Py_DECREF( encode );
+	if( NULL == encoded ) return false;
+
+	// The encoder's string or buffer lives as long as data does.
+	bool ok;
+	if( PyString_Check( encoded ) ) {
+		data.owner = encoded;
+		data.buffer = PyString_AS_STRING( encoded );
+		data.size = PyString_GET_SIZE( encoded );
+		return true;
+	} else if( is_borrowable( encoded ) ) {
+		ok = borrow_attr_buffer( encoded, data );
+	} else {
+		PyErr_SetString( PyExc_TypeError, "encoders must return a string or a buffer" );
+		ok = false;
+	}
+
+	Py_DECREF( encoded );
+	return ok;
+}
+
+// ----------------------------------------------------------------------
+// Convert raw attribute data into a Python object, based on its type.
+// Sets an exception and returns NULL if that doesn't work out.
+
+static PyObject *convert_attr( const char *name, uint32 type, 
+							   const char *ptr, ssize_t read_bytes )
+{
+	const AttrCodec &codec = attr_codec( type );
+	if( NULL != codec.py_decode ) return py_decode( codec, name, ptr, read_bytes );
+	return codec.decode( name, ptr, read_bytes );
+}
+
+// ----------------------------------------------------------------------
+// Set an IOError like "what: name (error)".
+
+static void raise_io_error( const char *what, const char *name, int error )
+{
+	try {
+		strstream s;
+		s << what << ": " << name << " (" << strerror( error ) << ")" << ends;
+		PyErr_SetString( PyExc_IOError, s.str() );
+	} catch ( ... ) {
+		PyErr_SetString( PyExc_IOError, strerror( error ) );
+	}
+}
+
+// Set an IOError for an attribute bigger than the max_size it was read with.
+static void raise_too_big( const char *name, off_t size, off_t max_size )
+{
+	try {
+		strstream s;
+		s << "attribute \"" << name << "\" is " << size \
+		  << " bytes, more than max_size (" << max_size << ")" << ends;
+		PyErr_SetString( PyExc_IOError, s.str() );
+	} catch ( ... ) {
+		PyErr_SetString( PyExc_IOError, "attribute bigger than max_size" );
+	}
+}
+
+// ----------------------------------------------------------------------
+// Raw attribute reading.  This part doesn't touch any Python objects, so
+// it runs with the GIL released; the data is converted afterwards.  The
+// structures are in fsattr_api.h since other modules use them too.
+
+// Add an attribute to raw; without the GIL, so a bad_alloc becomes
+// NO_MEMORY, and false means reading should stop.
+static bool add_raw_attr( RawAttrs &raw, const RawAttr &attr )
+{
+	try {
+		raw.attrs.push_back( attr );
+	} catch ( ... ) {
+		raw.status = RawAttrs::NO_MEMORY;
+		return false;
+	}
+	return true;
+}
+
+// Sets TOO_BIG and returns true if an attribute of size bytes is more
+// than raw's max_size.
+static bool raw_attr_too_big( const char *name, off_t size, RawAttrs &raw )
+{
+	if( raw.max_size < 0 || size <= raw.max_size ) return false;
+
+	raw.status = RawAttrs::TOO_BIG;
+	raw.failed_name = name;
+	raw.expected = size;
+	return true;
+}
+
+// Read one attribute, if it's there; returns false if reading should stop.
+#ifdef __linux__
+// On xattrs the type is in the value, so a single fgetxattr() into a stack
+// buffer gets type, size and data for the usual small attribute; bigger
+// ones get their size first and are read straight into the arena.
+#define XATTR_STACK_READ	512
+
+static bool read_raw_attr( int fd, const char *name, int flags, RawAttrs &raw )
+{
+	char xname[XATTR_NAME_MAX + 1];
+	if( !xattr_name( name, xname ) ) return true;
+
+	char stack_buf[XATTR_STACK_READ];
+	char *value = stack_buf;
+	ssize_t size = fgetxattr( fd, xname, stack_buf, sizeof( stack_buf ) );
+	while( size < 0 && ERANGE == errno ) {
+		size = fgetxattr( fd, xname, NULL, 0 );
+		if( size < 0 ) break;
+		if( !raw.stat_only && raw_attr_too_big( name, size - XATTR_TYPE_SIZE, raw ) ) {
+			return false;
+		}
+
+		// Enough for the whole value; the type is dropped afterwards.
+		value = raw.arena.alloc( size );
+		if( NULL == value ) {
+			raw.status = RawAttrs::NO_MEMORY;
+			return false;
+		}
+		size = fgetxattr( fd, xname, value, size );
+	}
+	if( size < (ssize_t)XATTR_TYPE_SIZE ) return true;
+
+	RawAttr attr;
+	attr.name = raw.arena.copy_string( name );
+	memcpy( &attr.type, value, XATTR_TYPE_SIZE );
+	attr.size = size - XATTR_TYPE_SIZE;
+	if( NULL == attr.name ) {
+		raw.status = RawAttrs::NO_MEMORY;
+		return false;
+	}
+
+	if( raw.stat_only ) {
+		attr.data = NULL;
+		return add_raw_attr( raw, attr );
+	}
+
+	// (Big ones were caught before they were read.)
+	if( raw_attr_too_big( name, attr.size, raw ) ) return false;
+
+	char *ptr;
+	if( value == stack_buf ) {
+		ptr = raw.arena.alloc( attr.size );
+		if( ptr == NULL ) {
+			raw.status = RawAttrs::NO_MEMORY;
+			return false;
+		}
+		memcpy( ptr, value + XATTR_TYPE_SIZE, attr.size );
+	} else {
+		// Already in the arena; just skip the type.
+		ptr = value + XATTR_TYPE_SIZE;
+	}
+
+	if( flags & ATTR_BIG_ENDIAN ) {
+		(void)swap_data( attr.type, ptr, attr.size, B_SWAP_BENDIAN_TO_HOST );
+	} else if( flags & ATTR_LITTLE_ENDIAN ) {
+		(void)swap_data( attr.type, ptr, attr.size, B_SWAP_LENDIAN_TO_HOST );
+	}
+
+	attr.data = ptr;
+	return add_raw_attr( raw, attr );
+}
+#else
+static bool read_raw_attr( int fd, const char *name, int flags, RawAttrs &raw )
+{
+	struct attr_info fa_info;
+	status_t retval = fs_stat_attr( fd, name, &fa_info );
+	if( retval != B_OK ) return true;
+
+	RawAttr attr;
+	attr.name = raw.arena.copy_string( name );
+	attr.type = fa_info.type;
+	if( NULL == attr.name ) {
+		raw.status = RawAttrs::NO_MEMORY;
+		return false;
+	}
+
+	if( raw.stat_only ) {
+		attr.data = NULL;
+		attr.size = fa_info.size;
+		return add_raw_attr( raw, attr );
+	}
+
+	if( raw_attr_too_big( name, fa_info.size, raw ) ) return false;
+
+	char *ptr = raw.arena.alloc( fa_info.size );
+	if( ptr == NULL ) {
+		raw.status = RawAttrs::NO_MEMORY;
+		return false;
+	}
+	
+	ssize_t read_bytes = fs_read_attr( fd, name, fa_info.type, 
+									   0, ptr, fa_info.size );
+	if( read_bytes != fa_info.size ) {
+		raw.status = RawAttrs::SHORT_READ;
+		raw.failed_name = name;
+		raw.read_bytes = read_bytes;
+		raw.expected = fa_info.size;
+		return false;
+	}
+
+	// Swap the data around for fun and profit.
+	if( flags & ATTR_BIG_ENDIAN ) {
+		(void)swap_data( fa_info.type, ptr, fa_info.size,
+						 B_SWAP_BENDIAN_TO_HOST );
+	} else if( flags & ATTR_LITTLE_ENDIAN ) {
+		(void)swap_data( fa_info.type, ptr, fa_info.size,
+						 B_SWAP_LENDIAN_TO_HOST );
+	}
+
+	attr.data = ptr;
+	attr.size = read_bytes;
+
+	// Looking up where a ref leads goes to the disk, so do it here rather
+	// than when converting.
+	if( B_REF_TYPE == attr.type ) {
+		BPath path;
+		attr.ref_error = ref_to_path( ptr, read_bytes, path, attr.ref_no_entry );
+		if( B_OK == attr.ref_error ) {
+			attr.ref_path = raw.arena.copy_string( path.Path() );
+			if( NULL == attr.ref_path ) {
+				raw.status = RawAttrs::NO_MEMORY;
+				return false;
 			}
 		}
+	}
+
+	return add_raw_attr( raw, attr );
+}
+#endif
+
+static void read_raw_attrs_fd( int fd, int flags, const vector<string> *names,
+							   const char *prefix, RawAttrs &raw )
+{
+	// Exact names go straight to fs_stat_attr(), without the directory.
+	if( NULL != names ) {
+		for( size_t i = 0; i < names->size(); i++ ) {
+			if( !read_raw_attr( fd, ( *names )[i].c_str(), flags, raw ) ) break;
+		}
+		return;
+	}
+
+	DIR *fa_dir = fs_fopen_attr_dir( fd );
+	if( fa_dir == NULL ) {
+		raw.status = RawAttrs::ATTR_DIR_FAILED;
+		raw.error = errno;
+		return;
+	}
+
+	// Only the names are looked at for the ones that don't match.
+	size_t prefix_len = ( NULL == prefix ) ? 0 : strlen( prefix );
+	struct dirent *fa_ent = fs_read_attr_dir( fa_dir );
+	while( fa_ent != NULL ) {
+		if( ( NULL == prefix || strncmp( fa_ent->d_name, prefix, prefix_len ) == 0 ) &&
+			!read_raw_attr( fd, fa_ent->d_name, flags, raw ) ) break;
+
+		// Get the next attribute's info.
+		fa_ent = fs_read_attr_dir( fa_dir );
+	}
+
+	(void)fs_close_attr_dir( fa_dir );
+}
+
+static void read_raw_attrs( const char *filename, int mode, int flags, 
+							const vector<string> *names, const char *prefix,
+							RawAttrs &raw )
+{
+	int fd = open( filename, mode );
+	if( fd < 0 ) {
+		raw.status = RawAttrs::OPEN_FAILED;
+		raw.error = errno;
+		return;
+	}
+
+	read_raw_attrs_fd( fd, flags, names, prefix, raw );
+	close( fd );
+}
+
+// List the names of an open file's attributes; returns 0, or errno if the
+// attribute directory can't be read (ENOMEM if names can't hold them).
+static int list_attr_names_fd( int fd, vector<string> &names )
+{
+	DIR *fa_dir = fs_fopen_attr_dir( fd );
+	if( fa_dir == NULL ) return errno;
+
+	int error = 0;
+	struct dirent *fa_ent;
+	while( ( fa_ent = fs_read_attr_dir( fa_dir ) ) != NULL ) {
+		try {
+			names.push_back( fa_ent->d_name );
+		} catch ( ... ) {
+			error = ENOMEM;
+			break;
+		}
+	}
+
+	(void)fs_close_attr_dir( fa_dir );
+	return error;
+}
+
+// Set the Python exception for a failed read_raw_attrs().
+static void raise_raw_attrs_error( const char *filename, const RawAttrs &raw )
+{
+	switch( raw.status ) {
+	case RawAttrs::OPEN_FAILED:
+		try {
+			strstream s;
+			s << "can't open file: " << filename \
+			  << " (" << strerror( raw.error ) << ")" << ends;
+			PyErr_SetString( PyExc_IOError, s.str() );
+		} catch ( ... ) {
+			PyErr_SetString( PyExc_IOError, strerror( raw.error ) );
+		}
 		break;
-			
-	case B_RECT_TYPE:
-		// BRect -> (left,top,right,bottom)
-		if( !PyTuple_Check( attr_data_obj ) ) {
-			PyErr_SetString( PyExc_TypeError, "BRects are passed as tuples" );
-		} else {
-			PyObject *obj = PyTuple_GetItem( attr_data_obj, 0 );
-			if( NULL == obj ) {
-				PyErr_SetString( PyExc_IndexError, "can't get left from tuple" );
-				break;
-			}
-			float left = (float)PyFloat_AsDouble( obj );
 
-			obj = PyTuple_GetItem( attr_data_obj, 1 );
-			if( NULL == obj ) {
-				PyErr_SetString( PyExc_IndexError, "can't get top from tuple" );
-				break;
-			}
-			float top = (float)PyFloat_AsDouble( obj );
-			
-			obj = PyTuple_GetItem( attr_data_obj, 2 );
-			if( NULL == obj ) {
-				PyErr_SetString( PyExc_IndexError, "can't get right from tuple" );
-				break;
-			}
-			float right = (float)PyFloat_AsDouble( obj );
+	case RawAttrs::ATTR_DIR_FAILED:
+		try {
+			strstream s;
+			s << "can't open file's attributes: " << filename \
+			  << " (" << strerror( raw.error ) << ")" << ends;
+			PyErr_SetString( PyExc_IOError, s.str() );
+		} catch ( ... ) {
+			PyErr_SetString( PyExc_IOError, "can't open file's attributes" );
+		}
+		break;
 
-			obj = PyTuple_GetItem( attr_data_obj, 3 );
-			if( NULL == obj ) {
-				PyErr_SetString( PyExc_IndexError, "can't get bottom from tuple" );
-				break;
-			}
-			float bottom = (float)PyFloat_AsDouble( obj );
-			
-			BRect val( left, top, right, bottom );
-			buffer_size = sizeof( BRect );
-			buffer = (char *)malloc( buffer_size );
-			if( buffer ) {
-				own_buffer = true;
-				memcpy( buffer, &val, buffer_size );
-			}
+	case RawAttrs::NO_MEMORY:
+		PyErr_NoMemory();
+		break;
+
+	case RawAttrs::SHORT_READ:
+		try {
+			strstream s;
+			s << "error reading attribute \"" << raw.failed_name \
+			  << "\": read " << raw.read_bytes << ", expected " \
+			  << raw.expected << ends;
+			PyErr_SetString( PyExc_IOError, s.str() );
+		} catch ( ... ) {
+			PyErr_SetString( PyExc_IOError, "error reading attribute" );
 		}
 		break;
-				
-	case B_REF_TYPE:
-		// entry_ref -> pathname
-		PyErr_SetString( PyExc_NotImplementedError, "where the hell did you get an entry_ref from anyway?" );
+
+	case RawAttrs::TOO_BIG:
+		raise_too_big( raw.failed_name.c_str(), raw.expected, raw.max_size );
 		break;
-			
-	case B_RGB_COLOR_TYPE:
-		// rgb_color -> (r,g,b,a)
-		if( !PyTuple_Check( attr_data_obj ) ) {
-			PyErr_SetString( PyExc_TypeError, "rgb_colors are passed as tuples" );
-		} else {
-			PyObject *obj = PyTuple_GetItem( attr_data_obj, 0 );
-			if( NULL == obj ) {
-				PyErr_SetString( PyExc_IndexError, "can't get red from tuple" );
-				break;
-			}
-			long val = PyInt_AsLong( obj );
-			if( val > UCHAR_MAX ) {
-				PyErr_SetString( PyExc_OverflowError, 
-								 "red value value greater than 255" );
-				break;
+	}
+}
+
+// Convert a raw attribute.  A ref whose path was looked up while reading
+// uses that, unless a codec from Python has taken its type over.
+static PyObject *raw_attr_value( const RawAttr &raw_attr )
+{
+#ifndef __linux__
+	if( B_REF_TYPE == raw_attr.type && NULL != raw_attr.data ) {
+		const AttrCodec &codec = attr_codec( B_REF_TYPE );
+		if( NULL == codec.py_decode && decode_ref == codec.decode ) {
+			if( NULL == raw_attr.ref_path ) {
+				raise_ref_error( raw_attr.name, raw_attr.ref_no_entry, raw_attr.ref_error );
+				return NULL;
 			}
+			PyObject *attr = PyString_FromString( raw_attr.ref_path );
+			return ( NULL == attr ) ? decode_error( raw_attr.name, "string" ) : attr;
+		}
+	}
+#endif
+	return convert_attr( raw_attr.name, raw_attr.type, raw_attr.data, raw_attr.size );
+}
 
-			uint8 red = (uint8)val;
+// Build a Python object out of a raw attribute and stick it in a
+// ( type, data ) tuple.
+static PyObject *raw_attr_tuple( const RawAttr &raw_attr )
+{
+	const char *name = raw_attr.name;
 
-			obj = PyTuple_GetItem( attr_data_obj, 1 );
-			if( NULL == obj ) {
-				PyErr_SetString( PyExc_IndexError, "can't get green from tuple" );
-				break;
-			}
-			val = PyInt_AsLong( obj );
-			if( val > UCHAR_MAX ) {
-				PyErr_SetString( PyExc_OverflowError, 
-								 "green value value greater than 255" );
-				break;
-			}
+	PyObject *attr = raw_attr_value( raw_attr );
+	if( attr == NULL ) return NULL;
 
-			uint8 green = (uint8)val;
+	PyObject *the_tuple = PyTuple_New( 2 );
+	PyObject *the_type = PyInt_FromLong( raw_attr.type );
 
-			obj = PyTuple_GetItem( attr_data_obj, 1 );
-			if( NULL == obj ) {
-				PyErr_SetString( PyExc_IndexError, "can't get blue from tuple" );
-				break;
-			}
-			val = PyInt_AsLong( obj );
-			if( val > UCHAR_MAX ) {
-				PyErr_SetString( PyExc_OverflowError, 
-								 "blue value value greater than 255" );
-				break;
-			}
+	if( the_tuple == NULL || the_type == NULL ) {
+		try {
+			strstream s;
+			s << "error creating attribute tuple for \"" \
+			  << name << "\"" << ends;
+			PyErr_SetString( PyExc_RuntimeError, s.str() );
+		} catch ( ... ) {
+			PyErr_SetString( PyExc_RuntimeError, "error creating attribute tuple" );
+		}
+
+		Py_XDECREF( the_tuple );
+		Py_XDECREF( the_type );
+		Py_DECREF( attr );
+		return NULL;
+	}
+
+	PyTuple_SET_ITEM( the_tuple, 0, the_type );
+	PyTuple_SET_ITEM( the_tuple, 1, attr );
+	return the_tuple;
+}
+
+// Build the dictionary of ( type, data ) tuples from the raw attributes.
+static PyObject *raw_attrs_to_dict( const RawAttrs &raw )
+{
+	PyObject *attributes = PyDict_New();
+	if( attributes == NULL ) return PyErr_NoMemory();
+
+	for( size_t i = 0; i < raw.attrs.size(); i++ ) {
+		const char *name = raw.attrs[i].name;
+
+		PyObject *the_tuple = raw_attr_tuple( raw.attrs[i] );
+		if( the_tuple == NULL ) {
+			Py_DECREF( attributes );
+			return NULL;
+		}
+
+		int added = PyDict_SetItemString( attributes, name, the_tuple );
+		Py_DECREF( the_tuple );
+		if( added == -1 ) {
+			try {
+				strstream s;
+				s << "can't add attribute \"" << name \
+				  << "\" to list" << ends;
+				PyErr_SetString( PyExc_RuntimeError, s.str() );
+			} catch ( ... ) {
+				PyErr_SetString( PyExc_RuntimeError, "can't add attributes to list" );
+			}
+
+			Py_DECREF( attributes );
+			return NULL;
+		}
+	}
+
+	return attributes;
+}
+
+// Build a list of ( name, type, size ) tuples from stat_only raw attributes.
+static PyObject *raw_attrs_to_list( const RawAttrs &raw )
+{
+	PyObject *attributes = PyList_New( raw.attrs.size() );
+	if( attributes == NULL ) return PyErr_NoMemory();
+
+	for( size_t i = 0; i < raw.attrs.size(); i++ ) {
+		PyObject *item = Py_BuildValue( "(slL)", raw.attrs[i].name,
+										(long)raw.attrs[i].type,
+										(PY_LONG_LONG)raw.attrs[i].size );
+		if( item == NULL ) {
+			Py_DECREF( attributes );
+			return NULL;
+		}
+		PyList_SET_ITEM( attributes, i, item );
+	}
+
+	return attributes;
+}
+
+// Get the strings out of a sequence of strings; what says what they are,
+// for the TypeError if they aren't.
+static bool parse_string_list( PyObject *seq, const char *what, vector<string> &strings )
+{
+	PyObject *fast = PySequence_Fast( seq, "" );
+	bool ok = ( NULL != fast );
+
+	for( Py_ssize_t i = 0; ok && i < PySequence_Fast_GET_SIZE( fast ); i++ ) {
+		PyObject *item = PySequence_Fast_GET_ITEM( fast, i );
+		if( PyString_Check( item ) ) {
+			strings.push_back( PyString_AS_STRING( item ) );
+		} else {
+			ok = false;
+		}
+	}
+
+	Py_XDECREF( fast );
+	if( !ok ) {
+		PyErr_Format( PyExc_TypeError, "%s must be a sequence of strings", what );
+	}
+	return ok;
+}
+
+static bool parse_attr_names( PyObject *seq, vector<string> &names )
+{
+	return parse_string_list( seq, "attribute names", names );
+}
+
+// Read a whole attribute straight into a new bytearray, without going
+// through a buffer of our own; returns a ( type, bytearray ) tuple, or NULL
+// with an exception set.  If the attribute isn't there, missing is set
+// and no exception is.  Attributes bigger than max_size (unless it's < 0)
+// raise an IOError.
+static PyObject *read_attr_bytearray( int fd, const char *name, int flags, 
+									  off_t max_size, bool &missing )
+{
+	missing = false;
+
+	struct attr_info fa_info;
+	status_t retval;
+	int error;
+
+	Py_BEGIN_ALLOW_THREADS
+	retval = fs_stat_attr( fd, name, &fa_info );
+	error = errno;
+	Py_END_ALLOW_THREADS
+
+	if( retval != B_OK ) {
+		if( ENOENT == error ) {
+			missing = true;
+		} else {
+			raise_io_error( "can't stat attribute", name, error );
+		}
+		return NULL;
+	}
+	if( max_size >= 0 && fa_info.size > max_size ) {
+		raise_too_big( name, fa_info.size, max_size );
+		return NULL;
+	}
+
+	PyObject *data = PyByteArray_FromStringAndSize( NULL, fa_info.size );
+	if( NULL == data ) return NULL;
+
+	// Nobody else can see the bytearray yet, so it's safe to fill it
+	// without the GIL.
+	char *ptr = PyByteArray_AS_STRING( data );
+	ssize_t read_bytes;
+
+	Py_BEGIN_ALLOW_THREADS
+	read_bytes = fs_read_attr( fd, name, fa_info.type, 0, ptr, fa_info.size );
+	error = errno;
+	if( read_bytes == fa_info.size ) {
+		if( flags & ATTR_BIG_ENDIAN ) {
+			(void)swap_data( fa_info.type, ptr, fa_info.size,
+							 B_SWAP_BENDIAN_TO_HOST );
+		} else if( flags & ATTR_LITTLE_ENDIAN ) {
+			(void)swap_data( fa_info.type, ptr, fa_info.size,
+							 B_SWAP_LENDIAN_TO_HOST );
+		}
+	}
+	Py_END_ALLOW_THREADS
+
+	if( read_bytes != fa_info.size ) {
+		Py_DECREF( data );
+		if( read_bytes < 0 ) {
+			raise_io_error( "error reading attribute", name, error );
+		} else {
+			try {
+				strstream s;
+				s << "error reading attribute \"" << name \
+				  << "\": read " << read_bytes << ", expected " \
+				  << fa_info.size << ends;
+				PyErr_SetString( PyExc_IOError, s.str() );
+			} catch ( ... ) {
+				PyErr_SetString( PyExc_IOError, "error reading attribute" );
+			}
+		}
+		return NULL;
+	}
+
+	return Py_BuildValue( "(lN)", (long)fa_info.type, data );
+}
+
+// ----------------------------------------------------------------------
+// Attribute cache.  Once set_attr_cache_limit() turns it on, read_attrs()
+// keeps the decoded attributes of each node it reads, by ( device, node ),
+// and answers the next read of the node with a stat() and a dictionary
+// copy.  Every cached node is watched with a NodeMonitor, whose attribute
+// and stat events are applied before each lookup and throw the node out.
+// The writes in this module forget the node right away, so reading back
+// what was just written never sees the old values; changes made anywhere
+// else show up as soon as their event is in.  Everything here runs with
+// the GIL held, which is all the locking it needs.
+
+// Rough bookkeeping cost of an entry, and of each attribute in it on top
+// of its name and data.
+#define ATTR_CACHE_ENTRY_OVERHEAD	128
+#define ATTR_CACHE_ATTR_OVERHEAD	96
+
+typedef pair<dev_t, ino_t> AttrCacheNode;
+typedef pair<AttrCacheNode, int> AttrCacheKey;	// node, byte order flags
+
+struct AttrCacheEntry {
+	AttrCacheKey key;
+	PyObject *attrs;	// everything read_attrs() would return
+	size_t bytes;		// what it costs, roughly
+};
+
+typedef map<AttrCacheKey, list<AttrCacheEntry>::iterator> AttrCacheIndex;
+
+static list<AttrCacheEntry> attr_cache_lru;		// most recently used first
+static AttrCacheIndex attr_cache_index;
+static NodeMonitor *attr_cache_monitor = NULL;	// made by the first load
+static unsigned long attr_cache_generation = 0;	// new monitor, new generation
+static unsigned long attr_cache_writes = 0;		// bumped by every forget
+static size_t attr_cache_limit = 0;				// 0 when it's off
+static size_t attr_cache_bytes = 0;
+static unsigned long attr_cache_hits = 0;
+static unsigned long attr_cache_misses = 0;
+static unsigned long attr_cache_evictions = 0;
+static unsigned long attr_cache_invalidations = 0;
+static unsigned long attr_cache_overflows = 0;
+
+static bool attr_cache_has_node( const AttrCacheNode &node )
+{
+	AttrCacheIndex::iterator item = attr_cache_index.lower_bound( AttrCacheKey( node, INT_MIN ) );
+	return item != attr_cache_index.end() && item->first.first == node;
+}
+
+// Stop watching a node nothing in the cache needs any more.
+static void attr_cache_unwatch_idle( const AttrCacheNode &node )
+{
+	if( NULL != attr_cache_monitor && !attr_cache_has_node( node ) ) {
+		(void)attr_cache_monitor->unwatch( node.first, node.second );
+	}
+}
+
+static void attr_cache_remove( list<AttrCacheEntry>::iterator item )
+{
+	AttrCacheNode node = item->key.first;
+	PyObject *attrs = item->attrs;
+
+	attr_cache_bytes -= item->bytes;
+	attr_cache_index.erase( item->key );
+	attr_cache_lru.erase( item );
+	attr_cache_unwatch_idle( node );
+
+	// Last, since it can run any code at all.
+	Py_DECREF( attrs );
+}
+
+// Throw out everything cached for a node.
+static void attr_cache_forget( const AttrCacheNode &node )
+{
+	AttrCacheIndex::iterator item = attr_cache_index.lower_bound( AttrCacheKey( node, INT_MIN ) );
+	while( item != attr_cache_index.end() && item->first.first == node ) {
+		list<AttrCacheEntry>::iterator entry = item->second;
+		++item;
+		attr_cache_remove( entry );
+		attr_cache_invalidations++;
+	}
+}
+
+// Forget the node at path, or behind fd, after writing to it; the node
+// monitor gets there as well, but not necessarily before the next read.
+static void attr_cache_forget_path( const char *path, int flags )
+{
+	attr_cache_writes++;
+	if( attr_cache_lru.empty() ) return;
+
+	struct stat st;
+	int retval = ( flags & ATTR_SYMLINK ) ? lstat( path, &st ) : stat( path, &st );
+	if( 0 == retval ) attr_cache_forget( AttrCacheNode( st.st_dev, st.st_ino ) );
+}
+
+static void attr_cache_forget_fd( int fd )
+{
+	attr_cache_writes++;
+	if( attr_cache_lru.empty() ) return;
+
+	struct stat st;
+	if( 0 == fstat( fd, &st ) ) attr_cache_forget( AttrCacheNode( st.st_dev, st.st_ino ) );
+}
+
+// Drop the least recently used entries until the cache fits its limit.
+static void attr_cache_trim( void )
+{
+	while( !attr_cache_lru.empty() && attr_cache_bytes > attr_cache_limit ) {
+		list<AttrCacheEntry>::iterator last = attr_cache_lru.end();
+		--last;
+		attr_cache_remove( last );
+		attr_cache_evictions++;
+	}
+}
+
+// Empty the cache and let its node monitor go.
+static void attr_cache_clear( void )
+{
+	vector<PyObject *> dropped;
+	for( list<AttrCacheEntry>::iterator entry = attr_cache_lru.begin(); 
+		 entry != attr_cache_lru.end(); ++entry ) {
+		dropped.push_back( entry->attrs );
+	}
+	attr_cache_lru.clear();
+	attr_cache_index.clear();
+	attr_cache_bytes = 0;
+
+	NodeMonitor *monitor = attr_cache_monitor;
+	attr_cache_monitor = NULL;
+	attr_cache_generation++;
+	if( NULL != monitor ) {
+		Py_BEGIN_ALLOW_THREADS
+		delete monitor;
+		Py_END_ALLOW_THREADS
+	}
+
+	for( size_t i = 0; i < dropped.size(); i++ ) Py_DECREF( dropped[i] );
+}
+
+// Apply the events that came in since the last look.  If some were lost,
+// any node may have changed, so everything goes.
+static void attr_cache_update( void )
+{
+	if( NULL == attr_cache_monitor ) return;
+
+	vector<MonitorEvent> events;
+	attr_cache_monitor->take( events );
+	for( size_t i = 0; i < events.size(); i++ ) {
+		if( MONITOR_EVENTS_LOST == events[i].opcode ) {
+			attr_cache_overflows++;
+			attr_cache_clear();
+			return;
+		}
+		attr_cache_forget( AttrCacheNode( events[i].device, events[i].node ) );
+	}
+}
+
+// The cached attributes for key, or NULL (without an exception) if they
+// aren't there; a new reference.
+static PyObject *attr_cache_lookup( const AttrCacheKey &key )
+{
+	attr_cache_update();
+
+	AttrCacheIndex::iterator item = attr_cache_index.find( key );
+	if( item == attr_cache_index.end() ) {
+		attr_cache_misses++;
+		return NULL;
+	}
+
+	attr_cache_hits++;
+	attr_cache_lru.splice( attr_cache_lru.begin(), attr_cache_lru, item->second );
+	Py_INCREF( item->second->attrs );
+	return item->second->attrs;
+}
+
+// Start watching the node at path, which should be node; false if it
+// can't be watched, or isn't node any more.
+static bool attr_cache_watch( const char *path, const AttrCacheNode &node )
+{
+	if( NULL == attr_cache_monitor ) {
+		NodeMonitor *monitor = new NodeMonitor;
+		if( monitor->open() != 0 ) {
+			delete monitor;
+			return false;
+		}
+		attr_cache_monitor = monitor;
+	}
+
+	dev_t device;
+	ino_t ino;
+	if( attr_cache_monitor->watch( path, B_WATCH_ATTR | B_WATCH_STAT, device, ino ) != 0 ) {
+		return false;
+	}
+	if( AttrCacheNode( device, ino ) != node ) {
+		attr_cache_unwatch_idle( AttrCacheNode( device, ino ) );
+		return false;
+	}
+
+	return true;
+}
+
+static size_t attr_cache_cost( const RawAttrs &raw )
+{
+	size_t bytes = ATTR_CACHE_ENTRY_OVERHEAD;
+	for( size_t i = 0; i < raw.attrs.size(); i++ ) {
+		bytes += ATTR_CACHE_ATTR_OVERHEAD + strlen( raw.attrs[i].name ) + raw.attrs[i].size;
+	}
+	return bytes;
+}
+
+// Whether any of the attributes is decoded by a codec from Python.  The
+// ( type, data ) tuples of a cached node are handed out again and again,
+// which is only safe for the built-in decoders' immutable values; what a
+// Python decoder returns might be changed by whoever gets it.
+static bool attr_cache_py_decoded( const RawAttrs &raw )
+{
+	for( size_t i = 0; i < raw.attrs.size(); i++ ) {
+		if( NULL != attr_codec( raw.attrs[i].type ).py_decode ) return true;
+	}
+	return false;
+}
+
+// Read all of a node's attributes and keep them.  The node is watched
+// before it's read, so a change made while it's being read can't slip by;
+// if the watch doesn't work out, or the cache was cleared or written
+// through in the meantime, or a Python codec decoded any of them, the
+// attributes are returned without being kept.
+static PyObject *attr_cache_load( const char *filename, int flags, const AttrCacheKey &key )
+{
+	unsigned long writes = attr_cache_writes;
+	bool keep = attr_cache_watch( filename, key.first );
+	unsigned long generation = attr_cache_generation;
+
+	double scratch[RAW_ARENA_STACK / sizeof( double )];
+	RawAttrs raw;
+	raw.arena.use( (char *)scratch, sizeof( scratch ) );
+
+	Py_BEGIN_ALLOW_THREADS
+	int fd = open( filename, O_RDONLY );
+	if( fd < 0 ) {
+		raw.status = RawAttrs::OPEN_FAILED;
+		raw.error = errno;
+	} else {
+		struct stat st;
+		if( fstat( fd, &st ) != 0 || 
+			AttrCacheNode( st.st_dev, st.st_ino ) != key.first ) keep = false;
+		read_raw_attrs_fd( fd, flags, NULL, NULL, raw );
+		close( fd );
+	}
+	Py_END_ALLOW_THREADS
+
+	PyObject *attrs = NULL;
+	if( raw.status != RawAttrs::OK ) {
+		raise_raw_attrs_error( filename, raw );
+	} else {
+		attrs = raw_attrs_to_dict( raw );
+	}
+
+	size_t bytes = attr_cache_cost( raw );
+	if( NULL == attrs || !keep || bytes > attr_cache_limit ||
+		generation != attr_cache_generation || writes != attr_cache_writes ||
+		attr_cache_py_decoded( raw ) ) {
+		if( generation == attr_cache_generation ) attr_cache_unwatch_idle( key.first );
+		return attrs;
+	}
+
+	// Another thread may have beaten us to it.
+	AttrCacheIndex::iterator old = attr_cache_index.find( key );
+	if( old != attr_cache_index.end() ) attr_cache_remove( old->second );
+
+	AttrCacheEntry entry;
+	entry.key = key;
+	entry.attrs = attrs;
+	entry.bytes = bytes;
+	Py_INCREF( attrs );
+	attr_cache_lru.push_front( entry );
+	attr_cache_index[key] = attr_cache_lru.begin();
+	attr_cache_bytes += bytes;
+	attr_cache_trim();
+
+	return attrs;
+}
+
+// The part of a cached dictionary the caller asked for, as a new one; the
+// ( type, data ) tuples are shared.
+static PyObject *attr_cache_select( PyObject *attrs, const vector<string> *names,
+									const char *prefix )
+{
+	if( NULL == names && NULL == prefix ) return PyDict_Copy( attrs );
+
+	PyObject *result = PyDict_New();
+	if( NULL == result ) return NULL;
+
+	if( NULL != names ) {
+		for( size_t i = 0; i < names->size(); i++ ) {
+			PyObject *value = PyDict_GetItemString( attrs, ( *names )[i].c_str() );
+			if( NULL != value && 
+				PyDict_SetItemString( result, ( *names )[i].c_str(), value ) < 0 ) {
+				Py_DECREF( result );
+				return NULL;
+			}
+		}
+		return result;
+	}
+
+	size_t prefix_len = strlen( prefix );
+	Py_ssize_t pos = 0;
+	PyObject *key;
+	PyObject *value;
+	while( PyDict_Next( attrs, &pos, &key, &value ) ) {
+		if( strncmp( PyString_AS_STRING( key ), prefix, prefix_len ) == 0 &&
+			PyDict_SetItem( result, key, value ) < 0 ) {
+			Py_DECREF( result );
+			return NULL;
+		}
+	}
+	return result;
+}
+
+// read_attrs() through the cache.  Symlinks themselves (ATTR_SYMLINK)
+// aren't cached, since the node monitor follows them.
+static PyObject *read_attrs_cached( const char *filename, int flags, 
+									const vector<string> *names, const char *prefix )
+{
+	struct stat st;
+	int retval;
+	RawAttrs raw;
+
+	Py_BEGIN_ALLOW_THREADS
+	retval = stat( filename, &st );
+	raw.error = errno;
+	Py_END_ALLOW_THREADS
+
+	if( retval != 0 ) {
+		raw.status = RawAttrs::OPEN_FAILED;
+		raise_raw_attrs_error( filename, raw );
+		return NULL;
+	}
+
+	AttrCacheKey key( AttrCacheNode( st.st_dev, st.st_ino ), 
+					  flags & ( ATTR_BIG_ENDIAN | ATTR_LITTLE_ENDIAN ) );
+	PyObject *attrs = attr_cache_lookup( key );
+	if( NULL == attrs ) {
+		attrs = attr_cache_load( filename, flags, key );
+		if( NULL == attrs ) return NULL;
+	}
+
+	PyObject *result = attr_cache_select( attrs, names, prefix );
+	Py_DECREF( attrs );
+	return result;
+}
+
+// ----------------------------------------------------------------------
+// Load the file attributes for a file/directory/symlink into a dictionary
+// of tuples; each tuple is ( type, data ), the key is the attribute name.
+//
+// args:
+// 	filename
+//  flags = 0 (optional)
+//  names = None (optional)
+//  prefix = None (optional)
+//  max_size = RAW_ATTR_MAX_SIZE (optional; -1 for no limit)
+
+static PyObject *bfs_read_attrs( PyObject *self, PyObject *args, PyObject *kwds )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	static char *kwlist[] = { (char *)"filename", (char *)"flags", 
+							  (char *)"names", (char *)"prefix", 
+							  (char *)"max_size", NULL };
+	char *filename;
+	int mode = O_RDONLY;
+	int flags = 0;
+	PyObject *names_obj = Py_None;
+	char *prefix = NULL;
+	PY_LONG_LONG max_size = RAW_ATTR_MAX_SIZE;
+
+	if( PyArg_ParseTupleAndKeywords( args, kwds, "s|iOzL", kwlist, &filename, 
+									 &flags, &names_obj, &prefix, &max_size ) ) {
+		// five arguments, four are optional
+		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
+		if( ( flags & ATTR_BIG_ENDIAN ) && ( flags & ATTR_LITTLE_ENDIAN ) ) {
+			PyErr_SetString( PyExc_ValueError, 
+							 "can't specify ATTR_BIG_ENDIAN and ATTR_LITTLE_ENDIAN, it's just not right" );
+			return NULL;
+		}
+		if( Py_None != names_obj && NULL != prefix ) {
+			PyErr_SetString( PyExc_ValueError, "use names or prefix, not both" );
+			return NULL;
+		}
+	} else {
+		PyErr_SetString( PyExc_TypeError, "you must specify a path name" );
+		return NULL;
+	}
+
+	vector<string> names;
+	if( Py_None != names_obj && !parse_attr_names( names_obj, names ) ) return NULL;
+
+	// The cache holds what was read with the usual max_size.
+	if( attr_cache_limit > 0 && !( flags & ATTR_SYMLINK ) && 
+		RAW_ATTR_MAX_SIZE == max_size ) {
+		return read_attrs_cached( filename, flags, 
+								  Py_None != names_obj ? &names : NULL, prefix );
+	}
+
+	// Small attributes go on the stack.
+	double scratch[RAW_ARENA_STACK / sizeof( double )];
+	RawAttrs raw;
+	raw.arena.use( (char *)scratch, sizeof( scratch ) );
+	raw.max_size = (off_t)max_size;
+
+	Py_BEGIN_ALLOW_THREADS
+	read_raw_attrs( filename, mode, flags, 
+					Py_None != names_obj ? &names : NULL, prefix, raw );
+	Py_END_ALLOW_THREADS
+
+	if( raw.status != RawAttrs::OK ) {
+		raise_raw_attrs_error( filename, raw );
+		return NULL;
+	}
+
+	return raw_attrs_to_dict( raw );
+}
+
+// ----------------------------------------------------------------------
+// Set how much memory the attribute cache may use; 0 turns it off and
+// empties it.
+//
+// args:
+//	bytes
+
+static PyObject *bfs_set_attr_cache_limit( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	PY_LONG_LONG bytes;
+
+	if( !PyArg_ParseTuple( args, "L", &bytes ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a number of bytes" );
+		return NULL;
+	}
+	if( bytes < 0 ) {
+		PyErr_SetString( PyExc_ValueError, "the limit can't be negative" );
+		return NULL;
+	}
+
+	attr_cache_limit = (size_t)bytes;
+	if( 0 == attr_cache_limit ) {
+		attr_cache_clear();
+	} else {
+		attr_cache_trim();
+	}
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+// ----------------------------------------------------------------------
+// Forget everything in the attribute cache; it stays on.
+
+static PyObject *bfs_clear_attr_cache( PyObject *self, PyObject *args )
+{
+	// self and args aren't used
+	self = self;
+	args = args;
+
+	attr_cache_clear();
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+// ----------------------------------------------------------------------
+// How the attribute cache is doing.
+
+static PyObject *bfs_attr_cache_stats( PyObject *self, PyObject *args )
+{
+	// self and args aren't used
+	self = self;
+	args = args;
+
+	// Events that came in since the last read count already.
+	attr_cache_update();
+
+	return Py_BuildValue( "{s:k,s:k,s:k,s:k,s:k,s:k,s:K,s:K}", 
+						  "hits", attr_cache_hits, "misses", attr_cache_misses,
+						  "evictions", attr_cache_evictions, 
+						  "invalidations", attr_cache_invalidations,
+						  "overflows", attr_cache_overflows,
+						  "entries", (unsigned long)attr_cache_lru.size(),
+						  "bytes", (unsigned PY_LONG_LONG)attr_cache_bytes,
+						  "limit", (unsigned PY_LONG_LONG)attr_cache_limit );
+}
+
+// ----------------------------------------------------------------------
+// Read part of an attribute as raw bytes, so a big one can be gone through
+// in pieces instead of all at once.
+//
+// args:
+// 	filename
+//  attr_name
+//  offset = 0 (optional)
+//  length = -1 (optional; -1 means up to the end)
+//  flags = 0 (optional, only ATTR_SYMLINK matters)
+//  max_size = RAW_ATTR_MAX_SIZE (optional; -1 for no limit)
+
+static PyObject *bfs_read_attr( PyObject *self, PyObject *args, PyObject *kwds )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	static char *kwlist[] = { (char *)"filename", (char *)"attr_name", 
+							  (char *)"offset", (char *)"length", 
+							  (char *)"flags", (char *)"max_size", NULL };
+	char *filename;
+	char *attr_name;
+	PY_LONG_LONG offset = 0;
+	Py_ssize_t length = -1;
+	int mode = O_RDONLY;
+	int flags = 0;
+	PY_LONG_LONG max_size = RAW_ATTR_MAX_SIZE;
+
+	if( PyArg_ParseTupleAndKeywords( args, kwds, "ss|LniL", kwlist, &filename, 
+									 &attr_name, &offset, &length, &flags, 
+									 &max_size ) ) {
+		// six arguments, four are optional
+		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
+		if( offset < 0 ) {
+			PyErr_SetString( PyExc_ValueError, "offset can't be negative" );
+			return NULL;
+		}
+	} else {
+		PyErr_SetString( PyExc_TypeError, "you must specify a path name and an attribute name" );
+		return NULL;
+	}
+
+	int fd;
+	int error;
+	struct attr_info fa_info;
+	status_t retval = B_ERROR;
+
+	Py_BEGIN_ALLOW_THREADS
+	fd = open( filename, mode );
+	error = errno;
+	if( fd >= 0 ) {
+		retval = fs_stat_attr( fd, attr_name, &fa_info );
+		error = errno;
+	}
+	Py_END_ALLOW_THREADS
+
+	if( fd < 0 ) {
+		raise_io_error( "can't open file", filename, error );
+		return NULL;
+	}
+	if( retval != B_OK ) {
+		close( fd );
+		raise_io_error( "can't read attribute", attr_name, error );
+		return NULL;
+	}
+
+	// Only as much as there is past offset.
+	off_t left = ( fa_info.size > offset ) ? fa_info.size - offset : 0;
+	if( length < 0 || length > left ) length = (Py_ssize_t)left;
+	if( max_size >= 0 && length > max_size ) {
+		close( fd );
+		raise_too_big( attr_name, length, (off_t)max_size );
+		return NULL;
+	}
+
+	PyObject *data = PyString_FromStringAndSize( NULL, length );
+	if( NULL == data ) {
+		close( fd );
+		return NULL;
+	}
+
+	// Nobody else can see the string yet, so it's safe to fill it
+	// without the GIL.
+	char *ptr = PyString_AS_STRING( data );
+	ssize_t read_bytes = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	if( length > 0 ) {
+		read_bytes = fs_read_attr( fd, attr_name, fa_info.type, 
+								   (off_t)offset, ptr, length );
+		error = errno;
+	}
+	close( fd );
+	Py_END_ALLOW_THREADS
+
+	if( read_bytes < 0 ) {
+		Py_DECREF( data );
+		raise_io_error( "error reading attribute", attr_name, error );
+		return NULL;
+	}
+
+	if( read_bytes != length && _PyString_Resize( &data, read_bytes ) < 0 ) return NULL;
+	return data;
+}
+
+// ----------------------------------------------------------------------
+// Read one attribute into a bytearray, whatever its type; for big raw
+// attributes this skips the copy read_attrs() makes into a string.
+//
+// args:
+// 	filename
+//  attr_name
+//  flags = 0 (optional)
+//  max_size = RAW_ATTR_MAX_SIZE (optional; -1 for no limit)
+
+static PyObject *bfs_read_attr_buffer( PyObject *self, PyObject *args, PyObject *kwds )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	static char *kwlist[] = { (char *)"filename", (char *)"attr_name", 
+							  (char *)"flags", (char *)"max_size", NULL };
+	char *filename;
+	char *attr_name;
+	int mode = O_RDONLY;
+	int flags = 0;
+	PY_LONG_LONG max_size = RAW_ATTR_MAX_SIZE;
+
+	if( PyArg_ParseTupleAndKeywords( args, kwds, "ss|iL", kwlist, &filename, 
+									 &attr_name, &flags, &max_size ) ) {
+		// four arguments, two are optional
+		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
+		if( ( flags & ATTR_BIG_ENDIAN ) && ( flags & ATTR_LITTLE_ENDIAN ) ) {
+			PyErr_SetString( PyExc_ValueError, 
+							 "can't specify ATTR_BIG_ENDIAN and ATTR_LITTLE_ENDIAN, it's just not right" );
+			return NULL;
+		}
+	} else {
+		PyErr_SetString( PyExc_TypeError, "you must specify a path name and an attribute name" );
+		return NULL;
+	}
+
+	int fd;
+	int error;
+
+	Py_BEGIN_ALLOW_THREADS
+	fd = open( filename, mode );
+	error = errno;
+	Py_END_ALLOW_THREADS
+
+	if( fd < 0 ) {
+		raise_io_error( "can't open file", filename, error );
+		return NULL;
+	}
+
+	bool missing;
+	PyObject *result = read_attr_bytearray( fd, attr_name, flags, (off_t)max_size, missing );
+	close( fd );
+
+	if( missing ) raise_io_error( "can't read attribute", attr_name, ENOENT );
+	return result;
+}
+
+// ----------------------------------------------------------------------
+// Compiled queries.  A BFS query string is parsed and compiled once into
+// a program (see fsquery_expr.h); read_attrs_many() and crawl() run it in
+// their threads against the raw attributes, so files that don't match are
+// never turned into Python objects, and Query.match() and filter() run it
+// on dictionaries that have already been read.  compile_query() keeps the
+// last few it compiled, by query string.
+
+#define QUERY_CACHE_SIZE	64
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *query_string;
+	QueryProgram *program;
+	PyObject *slot_names;	// the program's slots as strings, for dict lookups
+} QueryObject;
+
+static PyObject *query_cache = NULL;	// query string -> Query
+
+// A file's raw attributes, by program slot.  name, size and last_modified
+// come from stat(), like they do in a BFS query; st is used if it's given,
+// otherwise fd is fstat()ed when one of them is needed.
+class RawAttrsSlots : public QuerySlots {
+public:
+	RawAttrsSlots( const QueryProgram &program, const RawAttrs &raw,
+				   const char *name, int fd, const struct stat *st )
+		: QuerySlots( program ), raw( raw ), name( name ), fd( fd ), st( st ) {}
+
+protected:
+	bool lookup( int slot, QueryValue &value ) {
+		const string &attr = program.slots[slot];
+		if( query_is_stat_attr( attr ) ) {
+			if( NULL == st ) {
+				if( fstat( fd, &own_st ) != 0 ) return false;
+				st = &own_st;
+			}
+			return query_stat_value( attr, name, *st, value );
+		}
+
+		for( size_t i = 0; i < raw.attrs.size(); i++ ) {
+			const RawAttr &raw_attr = raw.attrs[i];
+			if( attr == raw_attr.name ) {
+				return query_value_from_attr( raw_attr.type, raw_attr.data,
+											  raw_attr.size, value );
+			}
+		}
+		return false;
+	}
+
+private:
+	const RawAttrs &raw;
+	const char *name;
+	int fd;
+	const struct stat *st;
+	struct stat own_st;
+};
+
+// A Python value the way a query compares it; type is the attribute type
+// from a ( type, data ) tuple, or 0 for a bare value.  Returns false for
+// values a query can't compare (raw data, points, ...), which count as
+// missing.
+static bool query_value_from_object( uint32 type, PyObject *obj, QueryValue &value )
+{
+	if( PyString_Check( obj ) ) {
+		const char *data = PyString_AS_STRING( obj );
+		const char *end = (const char *)memchr( data, '\0', PyString_GET_SIZE( obj ) );
+		value.kind = QUERY_STRING;
+		value.str.assign( data, NULL == end ? PyString_GET_SIZE( obj ) : end - data );
+		return true;
+	}
+
+	if( PyUnicode_Check( obj ) ) {
+		PyObject *utf8 = PyUnicode_AsUTF8String( obj );
+		if( NULL == utf8 ) {
+			PyErr_Clear();
+			return false;
+		}
+		bool converted = query_value_from_object( type, utf8, value );
+		Py_DECREF( utf8 );
+		return converted;
+	}
+
+	if( PyFloat_Check( obj ) ) {
+		value.kind = QUERY_FLOAT;
+		value.f = PyFloat_AS_DOUBLE( obj );
+		return true;
+	}
+
+	if( !PyInt_Check( obj ) && !PyLong_Check( obj ) ) return false;
+
+	PyObject *number = PyNumber_Long( obj );
+	if( NULL == number ) {
+		PyErr_Clear();
+		return false;
+	}
+
+	value.kind = ( 0 != type && QUERY_UINT == query_type_kind( type ) ) ? QUERY_UINT : QUERY_INT;
+	if( QUERY_INT == value.kind ) {
+		value.i = PyLong_AsLongLong( number );
+		if( NULL != PyErr_Occurred() ) {
+			// Too big for an int64, but it might still fit a uint64.
+			PyErr_Clear();
+			value.kind = QUERY_UINT;
+		}
+	}
+	bool converted = true;
+	if( QUERY_UINT == value.kind ) {
+		value.u = PyLong_AsUnsignedLongLong( number );
+		if( NULL != PyErr_Occurred() ) {
+			PyErr_Clear();
+			converted = false;
+		}
+	}
+
+	Py_DECREF( number );
+	return converted;
+}
+
+// A dictionary like read_attrs() returns, by program slot; bare values
+// work too, for dictionaries built by hand.  names has the slots' names as
+// strings, which keep their hashes from one dictionary to the next.
+class DictSlots : public QuerySlots {
+public:
+	DictSlots( const QueryProgram &program, PyObject *names )
+		: QuerySlots( program ), names( names ), dict( NULL ) {}
+
+	void set_dict( PyObject *new_dict ) {
+		reset();
+		dict = new_dict;
+	}
+
+protected:
+	bool lookup( int slot, QueryValue &value ) {
+		PyObject *item = PyDict_GetItem( dict, PyTuple_GET_ITEM( names, slot ) );
+		if( NULL == item ) return false;
+
+		uint32 type = 0;
+		if( PyTuple_Check( item ) && PyTuple_GET_SIZE( item ) == 2 ) {
+			long type_code = PyInt_AsLong( PyTuple_GET_ITEM( item, 0 ) );
+			if( -1 == type_code && NULL != PyErr_Occurred() ) {
+				PyErr_Clear();
+				return false;
+			}
+			type = (uint32)type_code;
+			item = PyTuple_GET_ITEM( item, 1 );
+		}
+
+		return query_value_from_object( type, item, value );
+	}
+
+private:
+	PyObject *names;
+	PyObject *dict;
+};
+
+// Read the attributes the caller asked for, and match where against them.
+// The query may look at attributes that weren't asked for; those are read
+// too and dropped again once it has been matched.  Returns true if the
+// file matches (always, without a query) and could be read.
+static bool read_raw_attrs_where( int fd, int flags, const vector<string> *names,
+								  const char *prefix, const QueryProgram *where,
+								  const char *name, const struct stat *st,
+								  RawAttrs &raw )
+{
+	read_raw_attrs_fd( fd, flags, names, prefix, raw );
+	if( raw.status != RawAttrs::OK ) return false;
+	if( NULL == where ) return true;
+
+	size_t asked = raw.attrs.size();
+	if( NULL != names || NULL != prefix ) {
+		size_t prefix_len = ( NULL == prefix ) ? 0 : strlen( prefix );
+		vector<string> extra;
+		for( size_t i = 0; i < where->slots.size(); i++ ) {
+			const string &attr = where->slots[i];
+			if( query_is_stat_attr( attr ) ) continue;
+
+			bool read = ( NULL != names ) ? 
+				find( names->begin(), names->end(), attr ) != names->end() :
+				attr.compare( 0, prefix_len, prefix ) == 0;
+			if( !read ) extra.push_back( attr );
+		}
+
+		if( !extra.empty() ) {
+			read_raw_attrs_fd( fd, flags, &extra, NULL, raw );
+			if( raw.status != RawAttrs::OK ) return false;
+		}
+	}
+
+	RawAttrsSlots record( *where, raw, name, fd, st );
+	bool matched = query_run( *where, record );
+	raw.attrs.resize( asked );
+	return matched;
+}
+
+// Compile query_string; sets a ValueError and returns NULL if it doesn't
+// parse.
+static QueryObject *query_compile_string( PyTypeObject *type, PyObject *query_string )
+{
+	const char *query = PyString_AS_STRING( query_string );
+
+	QueryExpr expr;
+	if( !query_parse( query, expr ) ) {
+		try {
+			strstream s;
+			s << "bad query \"" << query << "\": " << expr.error << ends;
+			PyErr_SetString( PyExc_ValueError, s.str() );
+		} catch ( ... ) {
+			PyErr_SetString( PyExc_ValueError, "bad query" );
+		}
+		return NULL;
+	}
+
+	QueryObject *self = (QueryObject *)type->tp_alloc( type, 0 );
+	if( NULL == self ) return NULL;
+
+	self->program = new QueryProgram;
+	query_compile( expr, *self->program );
+	Py_INCREF( query_string );
+	self->query_string = query_string;
+
+	const vector<string> &slots = self->program->slots;
+	self->slot_names = PyTuple_New( slots.size() );
+	if( NULL == self->slot_names ) {
+		Py_DECREF( self );
+		return NULL;
+	}
+	for( size_t i = 0; i < slots.size(); i++ ) {
+		PyObject *name = PyString_FromString( slots[i].c_str() );
+		if( NULL == name ) {
+			Py_DECREF( self );
+			return NULL;
+		}
+		PyString_InternInPlace( &name );
+		PyTuple_SET_ITEM( self->slot_names, i, name );
+	}
+
+	return self;
+}
+
+static void query_dealloc( QueryObject *self )
+{
+	Py_XDECREF( self->query_string );
+	Py_XDECREF( self->slot_names );
+	delete self->program;
+	self->ob_type->tp_free( (PyObject *)self );
+}
+
+// ----------------------------------------------------------------------
+// Compile a query
+//
+// args:
+// 	query_string
+
+static PyObject *query_new( PyTypeObject *type, PyObject *args, PyObject *kwds )
+{
+	static char *kwlist[] = { (char *)"query_string", NULL };
+	PyObject *query_string;
+
+	if( !PyArg_ParseTupleAndKeywords( args, kwds, "S", kwlist, &query_string ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a query string" );
+		return NULL;
+	}
+
+	return (PyObject *)query_compile_string( type, query_string );
+}
+
+static PyObject *query_repr( QueryObject *self )
+{
+	return PyString_FromFormat( "<Query %s>", PyString_AS_STRING( self->query_string ) );
+}
+
+// ----------------------------------------------------------------------
+// Query methods
+
+static PyObject *query_match( QueryObject *self, PyObject *args )
+{
+	PyObject *attributes;
+
+	if( !PyArg_ParseTuple( args, "O!", &PyDict_Type, &attributes ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a dictionary of attributes" );
+		return NULL;
+	}
+
+	DictSlots record( *self->program, self->slot_names );
+	record.set_dict( attributes );
+	return PyBool_FromLong( query_run( *self->program, record ) );
+}
+
+static PyObject *query_filter( QueryObject *self, PyObject *args )
+{
+	PyObject *items;
+
+	if( !PyArg_ParseTuple( args, "O", &items ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify the items to filter" );
+		return NULL;
+	}
+
+	PyObject *iter = PyObject_GetIter( items );
+	if( NULL == iter ) return NULL;
+
+	PyObject *matches = PyList_New( 0 );
+	if( NULL == matches ) {
+		Py_DECREF( iter );
+		return NULL;
+	}
+
+	DictSlots record( *self->program, self->slot_names );
+	PyObject *item;
+	while( NULL != ( item = PyIter_Next( iter ) ) ) {
+		// ( path, attributes ), like crawl() hands out, or just the
+		// attributes.
+		PyObject *attributes = item;
+		if( PyTuple_Check( item ) && PyTuple_GET_SIZE( item ) > 0 ) {
+			attributes = PyTuple_GET_ITEM( item, PyTuple_GET_SIZE( item ) - 1 );
+		}
+		if( !PyDict_Check( attributes ) ) {
+			PyErr_SetString( PyExc_TypeError, 
+							 "items must be attribute dictionaries or ( path, attributes ) tuples" );
+			Py_DECREF( item );
+			break;
+		}
+
+		record.set_dict( attributes );
+		int added = 0;
+		if( query_run( *self->program, record ) ) added = PyList_Append( matches, item );
+		Py_DECREF( item );
+		if( added < 0 ) break;
+	}
+	Py_DECREF( iter );
+
+	if( NULL != PyErr_Occurred() ) {
+		Py_DECREF( matches );
+		return NULL;
+	}
+
+	return matches;
+}
+
+static PyObject *query_get_attrs( QueryObject *self, void *closure )
+{
+	// closure isn't used
+	closure = closure;
+
+	return PySequence_List( self->slot_names );
+}
+
+static PyMethodDef query_methods[] = {
+	{
+		"match",
+		(PyCFunction)query_match,
+		METH_VARARGS,
+		"match( attributes )\n" \
+		"\n" \
+		"True if a dictionary of attributes, like read_attrs() returns,\n" \
+		"matches the query.  Plain values work as well as ( type, data )\n" \
+		"tuples."
+	},
+	{
+		"filter",
+		(PyCFunction)query_filter,
+		METH_VARARGS,
+		"filter( items )\n" \
+		"\n" \
+		"Returns a list of the items that match the query.  Each item is a\n" \
+		"dictionary of attributes, or a tuple ending in one, like the\n" \
+		"( path, attributes ) tuples crawl() hands out."
+	},
+	{ NULL, NULL, 0, NULL }	// sentinel
+};
+
+static PyMemberDef query_members[] = {
+	{
+		(char *)"query_string",
+		T_OBJECT,
+		offsetof( QueryObject, query_string ),
+		READONLY,
+		(char *)"The query, as it was given."
+	},
+	{ NULL, 0, 0, 0, NULL }	// sentinel
+};
+
+static PyGetSetDef query_getset[] = {
+	{
+		(char *)"attrs",
+		(getter)query_get_attrs,
+		NULL,
+		(char *)"The attributes the query looks at, each once.",
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, NULL }	// sentinel
+};
+
+static PyTypeObject QueryType = {
+	PyObject_HEAD_INIT( NULL )
+	0,									// ob_size
+	"_fsattr.Query",					// tp_name
+	sizeof( QueryObject ),				// tp_basicsize
+	0,									// tp_itemsize
+	(destructor)query_dealloc,			// tp_dealloc
+	0,									// tp_print
+	0,									// tp_getattr
+	0,									// tp_setattr
+	0,									// tp_compare
+	(reprfunc)query_repr,				// tp_repr
+	0,									// tp_as_number
+	0,									// tp_as_sequence
+	0,									// tp_as_mapping
+	0,									// tp_hash
+	0,									// tp_call
+	0,									// tp_str
+	0,									// tp_getattro
+	0,									// tp_setattro
+	0,									// tp_as_buffer
+	Py_TPFLAGS_DEFAULT,					// tp_flags
+	"Query( query_string )\n" \
+	"\n" \
+	"A BFS query, compiled for matching attributes without going back to\n" \
+	"Python for each file; see compile_query().",	// tp_doc
+	0,									// tp_traverse
+	0,									// tp_clear
+	0,									// tp_richcompare
+	0,									// tp_weaklistoffset
+	0,									// tp_iter
+	0,									// tp_iternext
+	query_methods,						// tp_methods
+	query_members,						// tp_members
+	query_getset,						// tp_getset
+	0,									// tp_base
+	0,									// tp_dict
+	0,									// tp_descr_get
+	0,									// tp_descr_set
+	0,									// tp_dictoffset
+	0,									// tp_init
+	0,									// tp_alloc
+	query_new,							// tp_new
+};
+
+// The Query for query_string, from the cache if it's been compiled
+// lately; returns a new reference, or NULL with an exception set.
+static QueryObject *query_cached( PyObject *query_string )
+{
+	if( NULL == query_cache ) {
+		query_cache = PyDict_New();
+		if( NULL == query_cache ) return NULL;
+	}
+
+	PyObject *cached = PyDict_GetItem( query_cache, query_string );
+	if( NULL != cached ) {
+		Py_INCREF( cached );
+		return (QueryObject *)cached;
+	}
+
+	QueryObject *compiled = query_compile_string( &QueryType, query_string );
+	if( NULL == compiled ) return NULL;
+
+	// Starting over now and then is simpler than keeping track of use,
+	// and compiling is cheap; this just saves doing it in a loop.
+	if( PyDict_Size( query_cache ) >= QUERY_CACHE_SIZE ) PyDict_Clear( query_cache );
+	if( PyDict_SetItem( query_cache, query_string, (PyObject *)compiled ) < 0 ) {
+		PyErr_Clear();
+	}
+
+	return compiled;
+}
+
+// The where argument of read_attrs_many() and crawl(): a Query, or a
+// query string.  Returns a new reference, NULL with an exception set, or
+// NULL without one for None.
+static QueryObject *parse_where( PyObject *where_obj )
+{
+	if( Py_None == where_obj ) return NULL;
+
+	if( PyObject_TypeCheck( where_obj, &QueryType ) ) {
+		Py_INCREF( where_obj );
+		return (QueryObject *)where_obj;
+	}
+
+	if( PyString_Check( where_obj ) ) return query_cached( where_obj );
+
+	PyErr_SetString( PyExc_TypeError, "where must be a Query or a query string" );
+	return NULL;
+}
+
+// ----------------------------------------------------------------------
+// Compile a query, or get it from the cache
+//
+// args:
+// 	query_string
+
+static PyObject *bfs_compile_query( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	PyObject *query_string;
+
+	if( !PyArg_ParseTuple( args, "S", &query_string ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a query string" );
+		return NULL;
+	}
+
+	return (PyObject *)query_cached( query_string );
+}
+
+// ----------------------------------------------------------------------
+// Read the attributes of many files on a few native threads.  The files
+// are stat()ed first and handed out in ( device, inode ) order, which is
+// close to the order they sit in on the disk; the raw data is gathered
+// without the GIL and only turned into Python objects at the end.
+
+#define READ_MANY_DEFAULT_THREADS	4
+#define READ_MANY_MAX_THREADS		64
+
+struct ReadManyJob {
+	const vector<string> *paths;
+	const vector<size_t> *order;		// indexes into paths, disk order
+	const vector<string> *names;
+	const char *prefix;
+	int mode;
+	int flags;
+	const QueryProgram *where;			// or NULL
+	vector<RawAttrs> *results;			// one per path, in input order
+	vector<char> *matched;				// one per path, if there's a query
+
+	pthread_mutex_t lock;
+	size_t next;						// next slot of order to hand out
+};
+
+// Sort key; files that couldn't be stat()ed go last, in input order.
+struct ReadManyKey {
+	bool found;
+	dev_t device;
+	ino_t inode;
+	size_t index;
+
+	bool operator<( const ReadManyKey &other ) const {
+		if( found != other.found ) return found;
+		if( device != other.device ) return device < other.device;
+		if( inode != other.inode ) return inode < other.inode;
+		return index < other.index;
+	}
+};
+
+static void *read_many_thread( void *data )
+{
+	ReadManyJob *job = static_cast<ReadManyJob *>( data );
+
+	for( ;; ) {
+		pthread_mutex_lock( &job->lock );
+		size_t slot = job->next++;
+		pthread_mutex_unlock( &job->lock );
+		if( slot >= job->order->size() ) break;
+
+		size_t i = ( *job->order )[slot];
+		const char *path = ( *job->paths )[i].c_str();
+		if( NULL == job->where ) {
+			read_raw_attrs( path, job->mode, job->flags, job->names,
+							job->prefix, ( *job->results )[i] );
+			continue;
+		}
+
+		RawAttrs &raw = ( *job->results )[i];
+		int fd = open( path, job->mode );
+		if( fd < 0 ) {
+			raw.status = RawAttrs::OPEN_FAILED;
+			raw.error = errno;
+			continue;
+		}
+
+		const char *name = strrchr( path, '/' );
+		( *job->matched )[i] = read_raw_attrs_where( fd, job->flags, job->names,
+													 job->prefix, job->where,
+													 NULL == name ? path : name + 1,
+													 NULL, raw );
+		close( fd );
+	}
+
+	return NULL;
+}
+
+// Take the exception that's set and hand it back as an object.
+static PyObject *fetch_exception( void )
+{
+	PyObject *type;
+	PyObject *value;
+	PyObject *traceback;
+
+	PyErr_Fetch( &type, &value, &traceback );
+	PyErr_NormalizeException( &type, &value, &traceback );
+	Py_XDECREF( type );
+	Py_XDECREF( traceback );
+
+	if( NULL == value ) {
+		Py_INCREF( Py_None );
+		value = Py_None;
+	}
+	return value;
+}
+
+// Read many files into results (one per path, sized already) on up to
+// thread_count threads.  With a query, matched (sized already too) says
+// which files match it.  Call it without the GIL.
+static void read_many( const vector<string> &paths, const vector<string> *names,
+					   const char *prefix, int mode, int flags, int thread_count,
+					   const QueryProgram *where, vector<RawAttrs> &results,
+					   vector<char> *matched )
+{
+	vector<size_t> order;
+
+	ReadManyJob job;
+	job.paths = &paths;
+	job.order = &order;
+	job.names = names;
+	job.prefix = prefix;
+	job.mode = mode;
+	job.flags = flags;
+	job.where = where;
+	job.results = &results;
+	job.matched = matched;
+	job.next = 0;
+	pthread_mutex_init( &job.lock, NULL );
+
+	vector<ReadManyKey> keys( paths.size() );
+	for( size_t i = 0; i < paths.size(); i++ ) {
+		struct stat st;
+		int retval = ( flags & ATTR_SYMLINK ) ? lstat( paths[i].c_str(), &st ) 
+											  : stat( paths[i].c_str(), &st );
+		keys[i].found = ( retval == 0 );
+		keys[i].device = ( retval == 0 ) ? st.st_dev : 0;
+		keys[i].inode = ( retval == 0 ) ? st.st_ino : 0;
+		keys[i].index = i;
+	}
+	sort( keys.begin(), keys.end() );
+	for( size_t i = 0; i < keys.size(); i++ ) order.push_back( keys[i].index );
+
+	vector<pthread_t> threads;
+	if( (size_t)thread_count > paths.size() ) thread_count = paths.size();
+	for( int i = 0; i < thread_count; i++ ) {
+		pthread_t thread;
+		if( pthread_create( &thread, NULL, read_many_thread, &job ) == 0 ) {
+			threads.push_back( thread );
+		}
+	}
+
+	// If no thread could be started, do it here.
+	if( threads.empty() ) (void)read_many_thread( &job );
+	for( size_t i = 0; i < threads.size(); i++ ) pthread_join( threads[i], NULL );
+
+	pthread_mutex_destroy( &job.lock );
+}
+
+// One slot per path: what convert makes of its RawAttrs, the exception
+// that reading that file alone would have raised, or None if it was read
+// but doesn't match the query.
+static PyObject *many_results( const vector<string> &paths, 
+							   const vector<RawAttrs> &results,
+							   const vector<char> *matched,
+							   PyObject *(*convert)( const RawAttrs & ) )
+{
+	PyObject *result_list = PyList_New( paths.size() );
+	if( NULL == result_list ) return PyErr_NoMemory();
+
+	for( size_t i = 0; i < paths.size(); i++ ) {
+		PyObject *item = NULL;
+		if( results[i].status == RawAttrs::OK && NULL != matched && !( *matched )[i] ) {
+			Py_INCREF( Py_None );
+			item = Py_None;
+		} else if( results[i].status == RawAttrs::OK ) {
+			item = convert( results[i] );
+		} else {
+			raise_raw_attrs_error( paths[i].c_str(), results[i] );
+		}
+
+		if( NULL == item ) {
+			// Out of memory is the caller's problem, not the file's.
+			if( PyErr_ExceptionMatches( PyExc_MemoryError ) ) {
+				Py_DECREF( result_list );
+				return NULL;
+			}
+			item = fetch_exception();
+		}
+		PyList_SET_ITEM( result_list, i, item );
+	}
+
+	return result_list;
+}
+
+// ----------------------------------------------------------------------
+// Load the attributes of a list of files
+//
+// args:
+// 	paths
+//  names = None (optional)
+//  threads = READ_MANY_DEFAULT_THREADS (optional)
+//  flags = 0 (optional)
+//  prefix = None (optional)
+//  where = None (optional)
+
+static PyObject *bfs_read_attrs_many( PyObject *self, PyObject *args, PyObject *kwds )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	static char *kwlist[] = { (char *)"paths", (char *)"names", 
+							  (char *)"threads", (char *)"flags", 
+							  (char *)"prefix", (char *)"where", NULL };
+	PyObject *paths_obj;
+	PyObject *names_obj = Py_None;
+	int thread_count = READ_MANY_DEFAULT_THREADS;
+	int flags = 0;
+	char *prefix = NULL;
+	PyObject *where_obj = Py_None;
+	int mode = O_RDONLY;
+
+	if( PyArg_ParseTupleAndKeywords( args, kwds, "O|OiizO", kwlist, &paths_obj,
+									 &names_obj, &thread_count, &flags, &prefix,
+									 &where_obj ) ) {
+		// six arguments, five are optional
+		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
+		if( ( flags & ATTR_BIG_ENDIAN ) && ( flags & ATTR_LITTLE_ENDIAN ) ) {
+			PyErr_SetString( PyExc_ValueError, 
+							 "can't specify ATTR_BIG_ENDIAN and ATTR_LITTLE_ENDIAN, it's just not right" );
+			return NULL;
+		}
+		if( Py_None != names_obj && NULL != prefix ) {
+			PyErr_SetString( PyExc_ValueError, "use names or prefix, not both" );
+			return NULL;
+		}
+		if( thread_count < 1 ) thread_count = 1;
+		if( thread_count > READ_MANY_MAX_THREADS ) thread_count = READ_MANY_MAX_THREADS;
+	} else {
+		PyErr_SetString( PyExc_TypeError, "you must specify a list of paths" );
+		return NULL;
+	}
+
+	vector<string> paths;
+	vector<string> names;
+	if( !parse_string_list( paths_obj, "paths", paths ) ) return NULL;
+	if( Py_None != names_obj && !parse_attr_names( names_obj, names ) ) return NULL;
+
+	QueryObject *where = parse_where( where_obj );
+	if( NULL == where && NULL != PyErr_Occurred() ) return NULL;
+
+	// Sized up front and never resized, so the RawAttrs stay put.
+	vector<RawAttrs> results( paths.size() );
+	vector<char> matched( paths.size(), 0 );
+
+	Py_BEGIN_ALLOW_THREADS
+	read_many( paths, ( Py_None != names_obj ) ? &names : NULL, prefix,
+			   mode, flags, thread_count, NULL == where ? NULL : where->program,
+			   results, &matched );
+	Py_END_ALLOW_THREADS
+
+	PyObject *result_list = many_results( paths, results, 
+										  NULL == where ? NULL : &matched,
+										  raw_attrs_to_dict );
+	Py_XDECREF( where );
+	return result_list;
+}
+
+// ----------------------------------------------------------------------
+// List a file's attributes as ( name, type, size ) tuples; only the
+// attribute directory and fs_stat_attr() are used, no data is read.
+//
+// args:
+// 	filename
+//  flags = 0 (optional, only ATTR_SYMLINK matters)
+//  prefix = None (optional)
+
+static PyObject *bfs_list_attrs( PyObject *self, PyObject *args, PyObject *kwds )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	static char *kwlist[] = { (char *)"filename", (char *)"flags", 
+							  (char *)"prefix", NULL };
+	char *filename;
+	int mode = O_RDONLY;
+	int flags = 0;
+	char *prefix = NULL;
+
+	if( PyArg_ParseTupleAndKeywords( args, kwds, "s|iz", kwlist, &filename, 
+									 &flags, &prefix ) ) {
+		// three arguments, two are optional
+		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
+	} else {
+		PyErr_SetString( PyExc_TypeError, "you must specify a path name" );
+		return NULL;
+	}
+
+	double scratch[RAW_ARENA_STACK / sizeof( double )];
+	RawAttrs raw;
+	raw.arena.use( (char *)scratch, sizeof( scratch ) );
+	raw.stat_only = true;
+
+	Py_BEGIN_ALLOW_THREADS
+	read_raw_attrs( filename, mode, flags, NULL, prefix, raw );
+	Py_END_ALLOW_THREADS
+
+	if( raw.status != RawAttrs::OK ) {
+		raise_raw_attrs_error( filename, raw );
+		return NULL;
+	}
+
+	return raw_attrs_to_list( raw );
+}
+
+// ----------------------------------------------------------------------
+// list_attrs() for many files, on a few native threads like
+// read_attrs_many().
+//
+// args:
+// 	paths
+//  threads = READ_MANY_DEFAULT_THREADS (optional)
+//  flags = 0 (optional, only ATTR_SYMLINK matters)
+//  prefix = None (optional)
+
+static PyObject *bfs_list_attrs_many( PyObject *self, PyObject *args, PyObject *kwds )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	static char *kwlist[] = { (char *)"paths", (char *)"threads", 
+							  (char *)"flags", (char *)"prefix", NULL };
+	PyObject *paths_obj;
+	int thread_count = READ_MANY_DEFAULT_THREADS;
+	int flags = 0;
+	char *prefix = NULL;
+	int mode = O_RDONLY;
+
+	if( PyArg_ParseTupleAndKeywords( args, kwds, "O|iiz", kwlist, &paths_obj,
+									 &thread_count, &flags, &prefix ) ) {
+		// four arguments, three are optional
+		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
+		if( thread_count < 1 ) thread_count = 1;
+		if( thread_count > READ_MANY_MAX_THREADS ) thread_count = READ_MANY_MAX_THREADS;
+	} else {
+		PyErr_SetString( PyExc_TypeError, "you must specify a list of paths" );
+		return NULL;
+	}
+
+	vector<string> paths;
+	if( !parse_string_list( paths_obj, "paths", paths ) ) return NULL;
+
+	// Sized up front and never resized, so the RawAttrs stay put.
+	vector<RawAttrs> results( paths.size() );
+	for( size_t i = 0; i < results.size(); i++ ) results[i].stat_only = true;
+
+	Py_BEGIN_ALLOW_THREADS
+	read_many( paths, NULL, prefix, mode, flags, thread_count, NULL, results, NULL );
+	Py_END_ALLOW_THREADS
+
+	return many_results( paths, results, NULL, raw_attrs_to_list );
+}
+
+// ----------------------------------------------------------------------
+// Crawl a directory tree on a few native threads, reading the attributes
+// of everything in it.  Each thread works on its own stack of directories
+// and steals from the bottom of the others' when it runs out; entries are
+// stat()ed and opened relative to their directory's descriptor, so paths
+// aren't looked up over and over.  Results come back to the iterator in
+// batches, and the threads wait if it falls too far behind.
+
+#define CRAWL_DEFAULT_THREADS	4
+#define CRAWL_MAX_THREADS		64
+#define CRAWL_BATCH_SIZE		64
+#define CRAWL_QUEUED_BATCHES	16
+
+struct CrawlHit {
+	string path;
+	RawAttrs *raw;
+};
+
+typedef vector<CrawlHit> CrawlBatch;
+
+static void crawl_free_batch( CrawlBatch *batch )
+{
+	for( size_t i = 0; i < batch->size(); i++ ) delete ( *batch )[i].raw;
+	delete batch;
+}
+
+struct CrawlShared {
+	pthread_mutex_t lock;
+	pthread_cond_t work;			// directories queued, or the crawl is over
+	pthread_cond_t not_empty;		// a batch is ready, or the threads are done
+	pthread_cond_t not_full;		// room for another batch
+	vector< deque<string> > stacks;	// directories to read, one per thread
+	int pending;					// directories queued or being read
+	int running;					// threads still going
+	deque<CrawlBatch *> batches;
+	set< pair<dev_t, ino_t> > seen;	// directories, when following symlinks
+	unsigned long errors;			// entries that couldn't be read
+	bool cancelled;
+
+	// What to read; fixed before the threads start.
+	vector<string> names;
+	bool use_names;
+	string prefix;
+	bool use_prefix;
+	int flags;
+	bool follow_symlinks;
+	const QueryProgram *where;		// or NULL; the iterator keeps it alive
+};
+
+struct CrawlWorker {
+	CrawlShared *shared;
+	size_t id;
+};
+
+// Hand a batch to the iterator, waiting for room.  Takes the batch.
+static void crawl_flush( CrawlShared *shared, CrawlBatch *batch )
+{
+	pthread_mutex_lock( &shared->lock );
+	while( !shared->cancelled && shared->batches.size() >= CRAWL_QUEUED_BATCHES ) {
+		pthread_cond_wait( &shared->not_full, &shared->lock );
+	}
+	if( shared->cancelled ) {
+		crawl_free_batch( batch );
+	} else {
+		shared->batches.push_back( batch );
+		pthread_cond_signal( &shared->not_empty );
+	}
+	pthread_mutex_unlock( &shared->lock );
+}
+
+static void crawl_error( CrawlShared *shared )
+{
+	pthread_mutex_lock( &shared->lock );
+	shared->errors++;
+	pthread_mutex_unlock( &shared->lock );
+}
+
+// Read one directory: queue its subdirectories and read the attributes of
+// everything in it.
+static void crawl_directory( CrawlShared *shared, size_t id, const string &dir )
+{
+	DIR *dir_handle = opendir( dir.c_str() );
+	if( NULL == dir_handle ) {
+		crawl_error( shared );
+		return;
+	}
+	int dir_fd = dirfd( dir_handle );
+
+	CrawlBatch *batch = new CrawlBatch;
+	struct dirent *ent;
+	while( NULL != ( ent = readdir( dir_handle ) ) ) {
+		if( strcmp( ent->d_name, "." ) == 0 || strcmp( ent->d_name, ".." ) == 0 ) {
+			continue;
+		}
+
+		struct stat st;
+		if( fstatat( dir_fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW ) != 0 ) {
+			crawl_error( shared );
+			continue;
+		}
+
+		// FIFOs, devices and sockets could block the open() below forever.
+		if( !S_ISREG( st.st_mode ) && !S_ISDIR( st.st_mode ) && 
+			!S_ISLNK( st.st_mode ) ) continue;
+
+		bool is_link = S_ISLNK( st.st_mode );
+		bool is_dir = S_ISDIR( st.st_mode );
+		if( is_link && shared->follow_symlinks && 
+			fstatat( dir_fd, ent->d_name, &st, 0 ) == 0 ) {
+			is_dir = S_ISDIR( st.st_mode );
+		}
+
+		string path = dir;
+		if( path[path.size() - 1] != '/' ) path += '/';
+		path += ent->d_name;
+
+		if( is_dir ) {
+			pthread_mutex_lock( &shared->lock );
+			// Without symlinks there are no loops to watch out for.
+			if( !shared->follow_symlinks || 
+				shared->seen.insert( make_pair( st.st_dev, st.st_ino ) ).second ) {
+				shared->stacks[id].push_back( path );
+				shared->pending++;
+				pthread_cond_signal( &shared->work );
+			}
+			pthread_mutex_unlock( &shared->lock );
+		}
+
+		// ATTR_SYMLINK means the link's own attributes, like read_attrs().
+		// A link can still lead to a FIFO or a device, hence O_NONBLOCK.
+		int mode = O_RDONLY | O_NONBLOCK | O_NOCTTY;
+		if( is_link && ( shared->flags & ATTR_SYMLINK ) ) mode |= O_NOTRAVERSE;
+
+		int fd = openat( dir_fd, ent->d_name, mode );
+		if( fd < 0 ) {
+			crawl_error( shared );
+			continue;
+		}
+
+		RawAttrs *raw = new RawAttrs;
+		bool matched = read_raw_attrs_where( fd, shared->flags, 
+											 shared->use_names ? &shared->names : NULL,
+											 shared->use_prefix ? shared->prefix.c_str() : NULL,
+											 shared->where, ent->d_name, &st, *raw );
+		close( fd );
+
+		if( raw->status != RawAttrs::OK ) {
+			delete raw;
+			crawl_error( shared );
+			continue;
+		}
+		if( !matched ) {
+			delete raw;
+			continue;
+		}
+
+		CrawlHit hit;
+		hit.path = path;
+		hit.raw = raw;
+		batch->push_back( hit );
+		if( batch->size() >= CRAWL_BATCH_SIZE ) {
+			crawl_flush( shared, batch );
+			batch = new CrawlBatch;
+		}
+	}
+
+	closedir( dir_handle );
+
+	if( batch->empty() ) {
+		delete batch;
+	} else {
+		crawl_flush( shared, batch );
+	}
+}
+
+static void *crawl_thread( void *data )
+{
+	CrawlWorker *worker = static_cast<CrawlWorker *>( data );
+	CrawlShared *shared = worker->shared;
+	size_t id = worker->id;
+	delete worker;
+
+	for( ;; ) {
+		string dir;
+		bool found = false;
+
+		pthread_mutex_lock( &shared->lock );
+		while( !shared->cancelled ) {
+			// Newest of our own first, that keeps the stacks shallow; then
+			// the oldest of somebody else's, that's the biggest piece of work.
+			if( !shared->stacks[id].empty() ) {
+				dir = shared->stacks[id].back();
+				shared->stacks[id].pop_back();
+				found = true;
+			} else {
+				for( size_t i = 1; i < shared->stacks.size() && !found; i++ ) {
+					deque<string> &victim = shared->stacks[( id + i ) % shared->stacks.size()];
+					if( !victim.empty() ) {
+						dir = victim.front();
+						victim.pop_front();
+						found = true;
+					}
+				}
+			}
+			if( found || 0 == shared->pending ) break;
+
+			pthread_cond_wait( &shared->work, &shared->lock );
+		}
+		pthread_mutex_unlock( &shared->lock );
+
+		if( !found ) break;
+
+		crawl_directory( shared, id, dir );
+
+		pthread_mutex_lock( &shared->lock );
+		if( 0 == --shared->pending ) pthread_cond_broadcast( &shared->work );
+		pthread_mutex_unlock( &shared->lock );
+	}
+
+	pthread_mutex_lock( &shared->lock );
+	shared->running--;
+	pthread_cond_broadcast( &shared->not_empty );
+	pthread_mutex_unlock( &shared->lock );
+
+	return NULL;
+}
+
+// ----------------------------------------------------------------------
+// Crawl iterator; owns the threads and hands out ( path, attributes ).
+
+typedef struct {
+	PyObject_HEAD
+	CrawlShared *shared;
+	vector<pthread_t> *threads;
+	CrawlBatch *batch;		// batch being handed out, or NULL
+	size_t batch_pos;		// next hit in batch
+	PyObject *where;		// the Query the threads match, or NULL
+} CrawlIterObject;
+
+// Stop the threads, if they're still going, and wait for them.
+static void crawl_iter_stop( CrawlIterObject *self )
+{
+	if( self->threads->empty() ) return;
+
+	pthread_mutex_lock( &self->shared->lock );
+	self->shared->cancelled = true;
+	pthread_cond_broadcast( &self->shared->work );
+	pthread_cond_broadcast( &self->shared->not_full );
+	pthread_mutex_unlock( &self->shared->lock );
+
+	Py_BEGIN_ALLOW_THREADS
+	for( size_t i = 0; i < self->threads->size(); i++ ) {
+		pthread_join( ( *self->threads )[i], NULL );
+	}
+	Py_END_ALLOW_THREADS
+
+	self->threads->clear();
+}
+
+static void crawl_iter_dealloc( CrawlIterObject *self )
+{
+	crawl_iter_stop( self );
+
+	CrawlShared *shared = self->shared;
+	if( NULL != self->batch ) crawl_free_batch( self->batch );
+	for( size_t i = 0; i < shared->batches.size(); i++ ) {
+		crawl_free_batch( shared->batches[i] );
+	}
+	pthread_mutex_destroy( &shared->lock );
+	pthread_cond_destroy( &shared->work );
+	pthread_cond_destroy( &shared->not_empty );
+	pthread_cond_destroy( &shared->not_full );
+	delete shared;
+	delete self->threads;
+	Py_XDECREF( self->where );
+
+	PyObject_Del( self );
+}
+
+static PyObject *crawl_iter_next( CrawlIterObject *self )
+{
+	CrawlShared *shared = self->shared;
+
+	for( ;; ) {
+		if( NULL == self->batch || self->batch_pos >= self->batch->size() ) {
+			if( NULL != self->batch ) {
+				crawl_free_batch( self->batch );
+				self->batch = NULL;
+			}
+
+			Py_BEGIN_ALLOW_THREADS
+			pthread_mutex_lock( &shared->lock );
+			while( shared->batches.empty() && shared->running > 0 ) {
+				pthread_cond_wait( &shared->not_empty, &shared->lock );
+			}
+			if( !shared->batches.empty() ) {
+				self->batch = shared->batches.front();
+				shared->batches.pop_front();
+				pthread_cond_signal( &shared->not_full );
+			}
+			pthread_mutex_unlock( &shared->lock );
+			Py_END_ALLOW_THREADS
+
+			self->batch_pos = 0;
+			if( NULL == self->batch ) {
+				// All done; returning NULL with no exception set stops
+				// the iteration.
+				crawl_iter_stop( self );
+				return NULL;
+			}
+		}
+
+		CrawlHit &hit = ( *self->batch )[self->batch_pos++];
+		PyObject *attributes = raw_attrs_to_dict( *hit.raw );
+		if( NULL == attributes ) {
+			// Attributes that can't be converted are counted, not raised;
+			// one odd file shouldn't end the crawl.
+			if( PyErr_ExceptionMatches( PyExc_MemoryError ) ) return NULL;
+			PyErr_Clear();
+			pthread_mutex_lock( &shared->lock );
+			shared->errors++;
+			pthread_mutex_unlock( &shared->lock );
+			continue;
+		}
+
+		PyObject *item = Py_BuildValue( "(sN)", hit.path.c_str(), attributes );
+		return item;
+	}
+}
+
+static PyObject *crawl_iter_get_errors( CrawlIterObject *self, void *closure )
+{
+	// closure isn't used
+	closure = closure;
+
+	pthread_mutex_lock( &self->shared->lock );
+	unsigned long errors = self->shared->errors;
+	pthread_mutex_unlock( &self->shared->lock );
+
+	return PyLong_FromUnsignedLong( errors );
+}
+
+static PyGetSetDef crawl_iter_getset[] = {
+	{
+		(char *)"errors",
+		(getter)crawl_iter_get_errors,
+		NULL,
+		(char *)"How many entries have been skipped because they couldn't be read.",
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, NULL }	// sentinel
+};
+
+static PyTypeObject CrawlIterType = {
+	PyObject_HEAD_INIT( NULL )
+	0,									// ob_size
+	"_fsattr.CrawlIterator",			// tp_name
+	sizeof( CrawlIterObject ),			// tp_basicsize
+	0,									// tp_itemsize
+	(destructor)crawl_iter_dealloc,		// tp_dealloc
+	0,									// tp_print
+	0,									// tp_getattr
+	0,									// tp_setattr
+	0,									// tp_compare
+	0,									// tp_repr
+	0,									// tp_as_number
+	0,									// tp_as_sequence
+	0,									// tp_as_mapping
+	0,									// tp_hash
+	0,									// tp_call
+	0,									// tp_str
+	0,									// tp_getattro
+	0,									// tp_setattro
+	0,									// tp_as_buffer
+	Py_TPFLAGS_DEFAULT,					// tp_flags
+	"Iterator over ( path, attributes ) for a crawl, see crawl().",	// tp_doc
+	0,									// tp_traverse
+	0,									// tp_clear
+	0,									// tp_richcompare
+	0,									// tp_weaklistoffset
+	PyObject_SelfIter,					// tp_iter
+	(iternextfunc)crawl_iter_next,		// tp_iternext
+	0,									// tp_methods
+	0,									// tp_members
+	crawl_iter_getset,					// tp_getset
+};
+
+// ----------------------------------------------------------------------
+// Crawl a directory tree
+//
+// args:
+// 	root
+//  names = None (optional)
+//  follow_symlinks = False (optional)
+//  threads = CRAWL_DEFAULT_THREADS (optional)
+//  flags = 0 (optional)
+//  prefix = None (optional)
+//  where = None (optional)
+
+static PyObject *bfs_crawl( PyObject *self, PyObject *args, PyObject *kwds )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	static char *kwlist[] = { (char *)"root", (char *)"names", 
+							  (char *)"follow_symlinks", (char *)"threads", 
+							  (char *)"flags", (char *)"prefix", (char *)"where",
+							  NULL };
+	char *root;
+	PyObject *names_obj = Py_None;
+	int follow_symlinks = 0;
+	int thread_count = CRAWL_DEFAULT_THREADS;
+	int flags = 0;
+	char *prefix = NULL;
+	PyObject *where_obj = Py_None;
+
+	if( PyArg_ParseTupleAndKeywords( args, kwds, "s|OiiizO", kwlist, &root, 
+									 &names_obj, &follow_symlinks, &thread_count,
+									 &flags, &prefix, &where_obj ) ) {
+		// seven arguments, six are optional
+		if( ( flags & ATTR_BIG_ENDIAN ) && ( flags & ATTR_LITTLE_ENDIAN ) ) {
+			PyErr_SetString( PyExc_ValueError, 
+							 "can't specify ATTR_BIG_ENDIAN and ATTR_LITTLE_ENDIAN, it's just not right" );
+			return NULL;
+		}
+		if( Py_None != names_obj && NULL != prefix ) {
+			PyErr_SetString( PyExc_ValueError, "use names or prefix, not both" );
+			return NULL;
+		}
+		if( thread_count < 1 ) thread_count = 1;
+		if( thread_count > CRAWL_MAX_THREADS ) thread_count = CRAWL_MAX_THREADS;
+	} else {
+		PyErr_SetString( PyExc_TypeError, "you must specify a root directory" );
+		return NULL;
+	}
+
+	QueryObject *where = parse_where( where_obj );
+	if( NULL == where && NULL != PyErr_Occurred() ) return NULL;
+
+	CrawlShared *shared = new CrawlShared;
+	shared->use_names = ( Py_None != names_obj );
+	if( shared->use_names && !parse_attr_names( names_obj, shared->names ) ) {
+		delete shared;
+		Py_XDECREF( where );
+		return NULL;
+	}
+	shared->where = ( NULL == where ) ? NULL : where->program;
+	shared->use_prefix = ( NULL != prefix );
+	if( shared->use_prefix ) shared->prefix = prefix;
+	shared->flags = flags;
+	shared->follow_symlinks = ( follow_symlinks != 0 );
+	shared->errors = 0;
+	shared->cancelled = false;
+	shared->stacks.resize( thread_count );
+	shared->pending = 1;
+	shared->running = 0;
+	pthread_mutex_init( &shared->lock, NULL );
+	pthread_cond_init( &shared->work, NULL );
+	pthread_cond_init( &shared->not_empty, NULL );
+	pthread_cond_init( &shared->not_full, NULL );
+
+	string root_dir = root;
+	while( root_dir.size() > 1 && root_dir[root_dir.size() - 1] == '/' ) {
+		root_dir.erase( root_dir.size() - 1 );
+	}
+	shared->stacks[0].push_back( root_dir );
+	struct stat root_st;
+	if( shared->follow_symlinks && stat( root_dir.c_str(), &root_st ) == 0 ) {
+		shared->seen.insert( make_pair( root_st.st_dev, root_st.st_ino ) );
+	}
+
+	CrawlIterObject *iter = PyObject_New( CrawlIterObject, &CrawlIterType );
+	if( NULL == iter ) {
+		pthread_mutex_destroy( &shared->lock );
+		pthread_cond_destroy( &shared->work );
+		pthread_cond_destroy( &shared->not_empty );
+		pthread_cond_destroy( &shared->not_full );
+		delete shared;
+		Py_XDECREF( where );
+		return NULL;
+	}
+	iter->shared = shared;
+	iter->threads = new vector<pthread_t>;
+	iter->batch = NULL;
+	iter->batch_pos = 0;
+	iter->where = (PyObject *)where;
+
+	for( int i = 0; i < thread_count; i++ ) {
+		CrawlWorker *worker = new CrawlWorker;
+		worker->shared = shared;
+		worker->id = i;
+
+		pthread_mutex_lock( &shared->lock );
+		shared->running++;
+		pthread_mutex_unlock( &shared->lock );
+
+		pthread_t thread;
+		if( pthread_create( &thread, NULL, crawl_thread, worker ) != 0 ) {
+			pthread_mutex_lock( &shared->lock );
+			shared->running--;
+			pthread_mutex_unlock( &shared->lock );
+			delete worker;
+			continue;
+		}
+		iter->threads->push_back( thread );
+	}
+
+	if( iter->threads->empty() ) {
+		PyErr_SetString( PyExc_RuntimeError, "can't start the crawl threads" );
+		Py_DECREF( iter );
+		return NULL;
+	}
+
+	return (PyObject *)iter;
+}
+
+// ----------------------------------------------------------------------
+// Convert Python objects into raw attribute data, for writing.
+
+// Get an attribute type, given as an integer or a four-character string.
+static bool parse_attr_type( PyObject *attr_type_obj, uint32 &be_type_code )
+{
+	be_type_code = 0;
+
+	if( PyInt_Check( attr_type_obj ) ) {			// integer version of B_*_TYPE
+		be_type_code = (uint32)PyInt_AsLong( attr_type_obj );
+	} else if( PyString_Check( attr_type_obj ) ) {	// string version
+		if( PyString_Size( attr_type_obj ) != 4 ) {
+			PyErr_SetString( PyExc_TypeError, "attribute type must be 4 characters" );
+			return false;
+		}
+
+		char *type_str = PyString_AsString( attr_type_obj );
+		be_type_code += (uint32)type_str[0] << 24;	// endian-safe? hmm...
+		be_type_code += (uint32)type_str[1] << 16;	// brain isn't working...
+		be_type_code += (uint32)type_str[2] << 8;
+		be_type_code += (uint32)type_str[3];
+	} else {										// error version
+		PyErr_SetString( PyExc_TypeError, "attribute type must be specified as an integer or a string" );
+		return false;
+	}
+
+	return true;
+}
+
+// Turn the data into the attribute type's raw form with its codec,
+// byte-swapped the way flags says.  Sets an exception and returns false if
+// the data doesn't fit the type.
+static bool convert_attr_data( uint32 be_type_code, PyObject *attr_data_obj,
+							   int flags, AttrData &data )
+{
+	const AttrCodec &codec = attr_codec( be_type_code );
+	bool ok = ( NULL != codec.py_encode ) ? py_encode( codec, attr_data_obj, data )
+										  : codec.encode( attr_data_obj, data );
+	if( !ok ) return false;
+
+	// Swap the data around for fun and profit; only our own copies, the
+	// rest is strings and borrowed bytes that aren't ours to scribble on.
+	if( !data.swappable ) {
+		// leave them be
+	} else if( flags & ATTR_BIG_ENDIAN ) {
+		(void)swap_data( be_type_code, data.buffer, data.size,
+						 B_SWAP_HOST_TO_BENDIAN );
+	} else if( flags & ATTR_LITTLE_ENDIAN ) {
+		(void)swap_data( be_type_code, data.buffer, data.size,
+						 B_SWAP_HOST_TO_LENDIAN );
+	}
+
+	data.type = be_type_code;
+	return true;
+}
+
+// ----------------------------------------------------------------------
+// Register a codec for an attribute type.
+//
+// args:
+// 	attr_type (as a string or integer)
+// 	decode = None (optional)
+// 	encode = None (optional)
+
+static PyObject *bfs_register_codec( PyObject *self, PyObject *args, PyObject *kwds )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	static char *kwlist[] = { (char *)"attr_type", (char *)"decode", 
+							  (char *)"encode", NULL };
+	PyObject *attr_type_obj;
+	PyObject *decode = Py_None;
+	PyObject *encode = Py_None;
+
+	if( !PyArg_ParseTupleAndKeywords( args, kwds, "O|OO", kwlist, &attr_type_obj,
+									  &decode, &encode ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify an attribute type" );
+		return NULL;
+	}
+	if( ( Py_None != decode && !PyCallable_Check( decode ) ) ||
+		( Py_None != encode && !PyCallable_Check( encode ) ) ) {
+		PyErr_SetString( PyExc_TypeError, "decode and encode must be callable or None" );
+		return NULL;
+	}
+
+	uint32 be_type_code;
+	if( !parse_attr_type( attr_type_obj, be_type_code ) ) return NULL;
+
+	// Start over from the built-in codec (or raw bytes), so a side that
+	// isn't given keeps working the way it did.
+	AttrCodec codec = raw_codec;
+	for( size_t i = 0; i < sizeof( builtin_codecs ) / sizeof( builtin_codecs[0] ); i++ ) {
+		if( builtin_codecs[i].type == be_type_code ) codec = builtin_codecs[i];
+	}
+	codec.type = be_type_code;
+
+	// The old functions are let go of once the table is done with them;
+	// that can run any Python code.
+	PyObject *old_decode = NULL;
+	PyObject *old_encode = NULL;
+	CodecTable::iterator old = codec_table.find( be_type_code );
+	if( old != codec_table.end() ) {
+		old_decode = old->second.py_decode;
+		old_encode = old->second.py_encode;
+	}
+
+	if( Py_None != decode ) {
+		Py_INCREF( decode );
+		codec.py_decode = decode;
+	}
+	if( Py_None != encode ) {
+		Py_INCREF( encode );
+		codec.py_encode = encode;
+	}
+
+	// Nothing left to register for a type nobody knows.
+	if( codec.decode == raw_codec.decode && codec.encode == raw_codec.encode &&
+		NULL == codec.py_decode && NULL == codec.py_encode ) {
+		if( old != codec_table.end() ) codec_table.erase( old );
+	} else {
+		codec_table[be_type_code] = codec;
+	}
+	Py_XDECREF( old_decode );
+	Py_XDECREF( old_encode );
+
+	// What's cached was decoded the old way.
+	attr_cache_clear();
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+// ----------------------------------------------------------------------
+// Write a file attribute to the file/directory/symlink; if the data is a
+// few things (like an rgb_color, BRect, etc.) it must be presented as a tuple.
+// 
+// args:
+//  filename
+//  attr_name
+//  attr_type (as a string or integer)
+//  attr_data (as an object; we'll figure out what it is)
+//  flags = 0 (optional)
+
+static PyObject *bfs_write_attr( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *filename;
+	char *attr_name;
+	PyObject *attr_type_obj;
+	PyObject *attr_data_obj;
+	int flags = 0;
+
+	// Could be B_READ_ONLY in BeOS > R4.5.
+	int mode = B_WRITE_ONLY;
+
+	if( PyArg_ParseTuple( args, "ssOO|i",
+						  &filename,
+						  &attr_name, &attr_type_obj, &attr_data_obj,
+						  &flags ) ) {
+		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
+		if( ( flags & ATTR_BIG_ENDIAN ) && ( flags & ATTR_LITTLE_ENDIAN ) ) {
+			PyErr_SetString( PyExc_ValueError, 
+							 "can't specify ATTR_BIG_ENDIAN and ATTR_LITTLE_ENDIAN, it's ust not right" );
+			return NULL;
+		}
+	} else {
+		PyErr_SetString( PyExc_TypeError, "invalid arguments" );
+		return NULL;
+	}
+
+	// Is the attribute name too long?  Hope you don't have embedded NULs...
+	if( strlen( attr_name ) > B_ATTR_NAME_LENGTH ) {
+		PyErr_SetString( PyExc_OverflowError, "attribute name too long" );
+		return NULL;
+	}
+
+	uint32 be_type_code;
+	AttrData data;
+	if( !parse_attr_type( attr_type_obj, be_type_code ) ||
+		!convert_attr_data( be_type_code, attr_data_obj, flags, data ) ) {
+		return NULL;
+	}
+
+	// The buffer is either ours or belongs to attr_data_obj, which data
+	// and the caller's argument tuple keep alive, so the GIL can go.
+	int fd;
+	ssize_t wrote = -1;
+	int error = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	// fs_remove_attr() before trying to write it?
+	fd = open( filename, mode );
+	if( fd >= 0 ) {
+		wrote = fs_write_attr( fd, attr_name, data.type, 0,
+							   data.buffer, data.size );
+		error = errno;
+		close( fd );
+	} else {
+		error = errno;
+	}
+	Py_END_ALLOW_THREADS
+
+	if( fd >= 0 ) attr_cache_forget_path( filename, flags );
+
+	if( fd < 0 ) {
+		raise_io_error( "can't open file", filename, error );
+		return NULL;
+	}
+
+	if( wrote != (ssize_t)data.size ) {
+		raise_io_error( "error writing attribute", attr_name, error );
+		return NULL;
+	}
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+// ----------------------------------------------------------------------
+// Write several attributes to the file/directory/symlink through a single
+// open().  Everything is converted before anything is written, so bad data
+// leaves the file alone; after that, attributes that can't be written
+// don't stop the others.
+//
+// args:
+//  filename
+//  attrs (mapping of attr_name to ( attr_type, attr_data ))
+//  flags = 0 (optional)
+
+static PyObject *bfs_write_attrs( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *filename;
+	PyObject *attrs_obj;
+	int flags = 0;
+
+	// Could be B_READ_ONLY in BeOS > R4.5.
+	int mode = B_WRITE_ONLY;
+
+	if( PyArg_ParseTuple( args, "sO|i", &filename, &attrs_obj, &flags ) &&
+		PyMapping_Check( attrs_obj ) ) {
+		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
+		if( ( flags & ATTR_BIG_ENDIAN ) && ( flags & ATTR_LITTLE_ENDIAN ) ) {
+			PyErr_SetString( PyExc_ValueError, 
+							 "can't specify ATTR_BIG_ENDIAN and ATTR_LITTLE_ENDIAN, it's just not right" );
+			return NULL;
+		}
+	} else {
+		PyErr_SetString( PyExc_TypeError, "invalid arguments" );
+		return NULL;
+	}
+
+	PyObject *items = PyObject_CallMethod( attrs_obj, (char *)"items", NULL );
+	if( NULL == items ) return NULL;
+
+	// An array rather than a vector, since AttrData can't be copied.
+	Py_ssize_t count = PyList_Size( items );
+	vector<string> names( count );
+	AttrData *data = new (nothrow) AttrData[count];
+	if( NULL == data ) {
+		Py_DECREF( items );
+		return PyErr_NoMemory();
+	}
+
+	for( Py_ssize_t i = 0; i < count; i++ ) {
+		PyObject *item = PyList_GET_ITEM( items, i );
+		char *attr_name;
+		PyObject *attr_type_obj;
+		PyObject *attr_data_obj;
+
+		if( !PyArg_ParseTuple( item, "s(OO)", &attr_name, &attr_type_obj, &attr_data_obj ) ) {
+			PyErr_SetString( PyExc_TypeError, 
+							 "attrs must map attribute names to ( type, data ) tuples" );
+			delete [] data;
+			Py_DECREF( items );
+			return NULL;
+		}
+		if( strlen( attr_name ) > B_ATTR_NAME_LENGTH ) {
+			PyErr_SetString( PyExc_OverflowError, "attribute name too long" );
+			delete [] data;
+			Py_DECREF( items );
+			return NULL;
+		}
+
+		uint32 be_type_code;
+		if( !parse_attr_type( attr_type_obj, be_type_code ) ||
+			!convert_attr_data( be_type_code, attr_data_obj, flags, data[i] ) ) {
+			delete [] data;
+			Py_DECREF( items );
+			return NULL;
+		}
+		names[i] = attr_name;
+	}
+
+	// The buffers that aren't ours belong to strings in items, which stays
+	// alive until we're done, so the GIL can go.
+	int fd;
+	int error = 0;
+	vector<int> errors( count, 0 );
+
+	Py_BEGIN_ALLOW_THREADS
+	fd = open( filename, mode );
+	if( fd >= 0 ) {
+#ifdef __linux__
+		// One index lookup for all of them.
+		IndexTarget target;
+		index_target( fd, target );
+#endif
+		for( Py_ssize_t i = 0; i < count; i++ ) {
+			errno = 0;
+#ifdef __linux__
+			ssize_t wrote = xattr_write_at( fd, names[i].c_str(), data[i].type, 0,
+											data[i].buffer, data[i].size, true, &target );
+#else
+			ssize_t wrote = fs_write_attr( fd, names[i].c_str(), data[i].type, 0,
+										   data[i].buffer, data[i].size );
+#endif
+			if( wrote != (ssize_t)data[i].size ) errors[i] = ( errno != 0 ) ? errno : EIO;
+		}
+		close( fd );
+	} else {
+		error = errno;
+	}
+	Py_END_ALLOW_THREADS
+
+	delete [] data;
+	Py_DECREF( items );
+
+	if( fd >= 0 ) attr_cache_forget_path( filename, flags );
+
+	if( fd < 0 ) {
+		raise_io_error( "can't open file", filename, error );
+		return NULL;
+	}
+
+	// Report the ones that failed in an IOError with an errors attribute,
+	// { attr_name: ( errno, message ) }; the rest were written.
+	PyObject *failed = PyDict_New();
+	if( NULL == failed ) return PyErr_NoMemory();
+
+	string failed_names;
+	for( Py_ssize_t i = 0; i < count; i++ ) {
+		if( 0 == errors[i] ) continue;
+
+		PyObject *reason = Py_BuildValue( "(is)", errors[i], strerror( errors[i] ) );
+		if( NULL == reason || 
+			PyDict_SetItemString( failed, names[i].c_str(), reason ) < 0 ) {
+			Py_XDECREF( reason );
+			Py_DECREF( failed );
+			return NULL;
+		}
+		Py_DECREF( reason );
+
+		if( !failed_names.empty() ) failed_names += ", ";
+		failed_names += names[i];
+	}
+
+	if( PyDict_Size( failed ) == 0 ) {
+		Py_DECREF( failed );
+		Py_INCREF( Py_None );
+		return Py_None;
+	}
+
+	PyObject *exc = NULL;
+	try {
+		strstream s;
+		s << "error writing attributes of " << filename << ": " 
+		  << failed_names << ends;
+		exc = PyObject_CallFunction( PyExc_IOError, (char *)"s", s.str() );
+	} catch ( ... ) {
+		exc = PyObject_CallFunction( PyExc_IOError, (char *)"s", "error writing attributes" );
+	}
+
+	if( NULL != exc && PyObject_SetAttrString( exc, "errors", failed ) == 0 ) {
+		PyErr_SetObject( PyExc_IOError, exc );
+	}
+	Py_XDECREF( exc );
+	Py_DECREF( failed );
+	return NULL;
+}
+
+// ----------------------------------------------------------------------
+// Write raw bytes into an attribute at an offset, leaving the rest of it
+// alone (fs_write_attr() truncates the attribute when the offset is 0).
+// The attribute is created with attr_type if it isn't there yet.
+//
+// args:
+//  filename
+//  attr_name
+//  attr_type (as a string or integer)
+//  attr_data (a string or anything with the buffer protocol)
+//  offset
+//  flags = 0 (optional, only ATTR_SYMLINK matters)
+
+static PyObject *bfs_write_attr_at( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *filename;
+	char *attr_name;
+	PyObject *attr_type_obj;
+	Py_buffer view;
+	PY_LONG_LONG offset;
+	int flags = 0;
+	int mode = O_RDONLY;
+
+	if( PyArg_ParseTuple( args, "ssOs*L|i", &filename, &attr_name, 
+						  &attr_type_obj, &view, &offset, &flags ) ) {
+		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
+	} else {
+		PyErr_SetString( PyExc_TypeError, "invalid arguments" );
+		return NULL;
+	}
+
+	uint32 be_type_code = B_RAW_TYPE;
+	if( offset < 0 ) {
+		PyErr_SetString( PyExc_ValueError, "offset can't be negative" );
+	} else if( strlen( attr_name ) > B_ATTR_NAME_LENGTH ) {
+		PyErr_SetString( PyExc_OverflowError, "attribute name too long" );
+	} else {
+		(void)parse_attr_type( attr_type_obj, be_type_code );
+	}
+	if( PyErr_Occurred() ) {
+		PyBuffer_Release( &view );
+		return NULL;
+	}
+
+	// The view keeps the data where it is while the GIL is gone.
+	const char *ptr = (const char *)view.buf;
+#ifndef __linux__
+	Py_ssize_t total = 0;
+#endif
+	int fd;
+	int attr_fd = -1;
+	int error = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	fd = open( filename, mode );
+	if( fd < 0 ) {
+		error = errno;
+	} else {
+#ifdef __linux__
+		// No attribute descriptors on xattrs; the value is patched in place.
+		attr_fd = fd;
+		if( xattr_write_at( fd, attr_name, be_type_code, (off_t)offset, 
+							ptr, view.len, false ) < 0 ) error = errno;
+#else
+		attr_fd = fs_fopen_attr( fd, attr_name, be_type_code, O_WRONLY | O_CREAT );
+		if( attr_fd < 0 ) {
+			error = errno;
+		} else {
+			if( lseek( attr_fd, (off_t)offset, SEEK_SET ) < 0 ) error = errno;
+			while( 0 == error && total < view.len ) {
+				ssize_t wrote = write( attr_fd, ptr + total, view.len - total );
+				if( wrote <= 0 ) {
+					error = ( wrote < 0 ) ? errno : EIO;
+				} else {
+					total += wrote;
+				}
+			}
+			fs_close_attr( attr_fd );
+		}
+#endif
+		close( fd );
+	}
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release( &view );
+
+	if( fd >= 0 ) attr_cache_forget_path( filename, flags );
+
+	if( fd < 0 ) {
+		raise_io_error( "can't open file", filename, error );
+		return NULL;
+	}
+	if( 0 != error ) {
+		raise_io_error( attr_fd < 0 ? "can't open attribute" : "error writing attribute", 
+						attr_name, error );
+		return NULL;
+	}
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+// ----------------------------------------------------------------------
+// Remove an attribute from the file/directory/symlink.
+//
+// args:
+//	filename
+//	attr_name
+//	flags = 0 (optional)
+
+static PyObject *bfs_remove_attr( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *filename;
+	char *attr_name;
+	int flags = 0;
+
+	int mode = O_WRONLY;
+	
+	if( PyArg_ParseTuple( args, "ss|i",
+						  &filename, 
+						  &attr_name, 
+						  &flags ) ) {
+		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
+		if( ( flags & ATTR_BIG_ENDIAN ) && ( flags & ATTR_LITTLE_ENDIAN ) ) {
+			PyErr_SetString( PyExc_ValueError, 
+							 "can't specify ATTR_BIG_ENDIAN and ATTR_LITTLE_ENDIAN, it's ust not right" );
+			return NULL;
+		}
+	} else {
+		PyErr_SetString( PyExc_TypeError, "invalid arguments" );
+		return NULL;
+	}
+
+	int fd;
+	int retval = B_OK;
+	int error = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	fd = open( filename, mode );
+	if( fd >= 0 ) {
+		retval = fs_remove_attr( fd, attr_name );
+		error = errno;
+		close( fd );
+	} else {
+		error = errno;
+	}
+	Py_END_ALLOW_THREADS
+
+	if( fd >= 0 ) attr_cache_forget_path( filename, flags );
+
+	if( fd < 0 ) {
+		raise_io_error( "can't open file", filename, error );
+		return NULL;
+	}
+
+	if( retval != B_OK ) {
+		raise_io_error( "can't remove attribute", attr_name, error );
+		return NULL;
+	}
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+// ----------------------------------------------------------------------
+// AttrFile; keeps a file open so a series of attribute calls on it doesn't
+// pay for a path lookup and an open() each time.  Opened read-only, which
+// is enough for writing attributes too (BeOS > R4.5 and Haiku check the
+// node's permissions, not the descriptor's mode).
+
+typedef struct {
+	PyObject_HEAD
+	int fd;				// -1 once closed
+	int flags;			// ATTR_* flags for reading and writing
+	bool own_fd;		// close fd when we're done?
+	PyObject *file;		// file object fd belongs to, kept alive; or NULL
+	PyObject *name;		// path, or a description of the descriptor
+	int users;			// calls using fd without the GIL
+	int closed_fd;		// fd, if it was closed while still in use; or -1
+} AttrFileObject;
+
+// Let go of a descriptor nobody is using any more.
+static void attr_file_release( AttrFileObject *self, int fd )
+{
+	if( self->own_fd ) {
+		Py_BEGIN_ALLOW_THREADS
+		close( fd );
+		Py_END_ALLOW_THREADS
+	}
+	Py_CLEAR( self->file );
+}
+
+// Calls that use fd without the GIL pin it first.  A close() from another
+// thread in the meantime only marks the AttrFile closed, and the last call
+// out closes fd; otherwise the number could be handed to another file
+// under them, and they'd go on with that one's attributes.
+static int attr_file_pin( AttrFileObject *self )
+{
+	self->users++;
+	return self->fd;
+}
+
+static void attr_file_unpin( AttrFileObject *self )
+{
+	if( --self->users > 0 || self->closed_fd < 0 ) return;
+
+	int fd = self->closed_fd;
+	self->closed_fd = -1;
+	attr_file_release( self, fd );
+}
+
+static void attr_file_close( AttrFileObject *self )
+{
+	int fd = self->fd;
+	self->fd = -1;
+	if( fd < 0 ) return;
+
+	if( self->users > 0 ) {
+		self->closed_fd = fd;
+	} else {
+		attr_file_release( self, fd );
+	}
+}
+
+static void attr_file_dealloc( AttrFileObject *self )
+{
+	attr_file_close( self );
+	Py_XDECREF( self->name );
+	self->ob_type->tp_free( (PyObject *)self );
+}
+
+// Sets a ValueError and returns false if the AttrFile is closed.
+static bool attr_file_check( AttrFileObject *self )
+{
+	if( self->fd < 0 ) {
+		PyErr_SetString( PyExc_ValueError, "I/O operation on closed AttrFile" );
+		return false;
+	}
+
+	return true;
+}
+
+// ----------------------------------------------------------------------
+// Open an AttrFile
+//
+// args:
+// 	file (a path, a file descriptor or a file object)
+// 	flags = 0 (optional)
+
+static PyObject *attr_file_new( PyTypeObject *type, PyObject *args, PyObject *kwds )
+{
+	static char *kwlist[] = { (char *)"file", (char *)"flags", NULL };
+	PyObject *file_obj;
+	int flags = 0;
+
+	if( !PyArg_ParseTupleAndKeywords( args, kwds, "O|i", kwlist, &file_obj, &flags ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a path, descriptor or file" );
+		return NULL;
+	}
+	if( ( flags & ATTR_BIG_ENDIAN ) && ( flags & ATTR_LITTLE_ENDIAN ) ) {
+		PyErr_SetString( PyExc_ValueError, 
+						 "can't specify ATTR_BIG_ENDIAN and ATTR_LITTLE_ENDIAN, it's just not right" );
+		return NULL;
+	}
+
+	AttrFileObject *self = (AttrFileObject *)type->tp_alloc( type, 0 );
+	if( NULL == self ) return NULL;
+
+	// Everything dealloc looks at has to be sane before the first return.
+	self->fd = -1;
+	self->flags = flags;
+	self->own_fd = false;
+	self->file = NULL;
+	self->name = NULL;
+	self->users = 0;
+	self->closed_fd = -1;
+
+	if( PyString_Check( file_obj ) ) {
+		const char *filename = PyString_AS_STRING( file_obj );
+		int mode = O_RDONLY;
+		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
+
+		int fd;
+		int error;
+
+		Py_BEGIN_ALLOW_THREADS
+		fd = open( filename, mode );
+		error = errno;
+		Py_END_ALLOW_THREADS
+
+		if( fd < 0 ) {
+			raise_io_error( "can't open file", filename, error );
+			Py_DECREF( self );
+			return NULL;
+		}
+
+		self->fd = fd;
+		self->own_fd = true;
+		Py_INCREF( file_obj );
+		self->name = file_obj;
+	} else {
+		// A descriptor, or something with a fileno(); either way it stays
+		// open when we're done with it.
+		int fd = PyObject_AsFileDescriptor( file_obj );
+		if( fd < 0 ) {
+			Py_DECREF( self );
+			return NULL;
+		}
+
+		self->fd = fd;
+		if( !PyInt_Check( file_obj ) && !PyLong_Check( file_obj ) ) {
+			Py_INCREF( file_obj );
+			self->file = file_obj;
+		}
+		self->name = PyString_FromFormat( "<fd %d>", fd );
+		if( NULL == self->name ) {
+			Py_DECREF( self );
+			return NULL;
+		}
+	}
+
+	return (PyObject *)self;
+}
+
+static PyObject *attr_file_repr( AttrFileObject *self )
+{
+	return PyString_FromFormat( "<%s AttrFile %s>", 
+								self->fd < 0 ? "closed" : "open",
+								PyString_AsString( self->name ) );
+}
+
+// ----------------------------------------------------------------------
+// AttrFile methods
+
+static PyObject *attr_file_get( AttrFileObject *self, PyObject *args )
+{
+	char *attr_name;
+	PyObject *default_obj = Py_None;
+
+	if( !PyArg_ParseTuple( args, "s|O", &attr_name, &default_obj ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify an attribute name" );
+		return NULL;
+	}
+	if( !attr_file_check( self ) ) return NULL;
+
+	vector<string> names( 1, attr_name );
+	double scratch[RAW_ARENA_STACK / sizeof( double )];
+	RawAttrs raw;
+	raw.arena.use( (char *)scratch, sizeof( scratch ) );
+
+	int fd = attr_file_pin( self );
+	Py_BEGIN_ALLOW_THREADS
+	read_raw_attrs_fd( fd, self->flags, &names, NULL, raw );
+	Py_END_ALLOW_THREADS
+	attr_file_unpin( self );
+
+	if( raw.status != RawAttrs::OK ) {
+		raise_raw_attrs_error( PyString_AsString( self->name ), raw );
+		return NULL;
+	}
+
+	if( raw.attrs.empty() ) {
+		Py_INCREF( default_obj );
+		return default_obj;
+	}
+
+	return raw_attr_tuple( raw.attrs[0] );
+}
+
+static PyObject *attr_file_get_buffer( AttrFileObject *self, PyObject *args )
+{
+	char *attr_name;
+	PyObject *default_obj = Py_None;
+
+	if( !PyArg_ParseTuple( args, "s|O", &attr_name, &default_obj ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify an attribute name" );
+		return NULL;
+	}
+	if( !attr_file_check( self ) ) return NULL;
+
+	bool missing;
+	int fd = attr_file_pin( self );
+	PyObject *result = read_attr_bytearray( fd, attr_name, self->flags, 
+											RAW_ATTR_MAX_SIZE, missing );
+	attr_file_unpin( self );
+	if( missing ) {
+		Py_INCREF( default_obj );
+		return default_obj;
+	}
+
+	return result;
+}
+
+static PyObject *attr_file_set( AttrFileObject *self, PyObject *args )
+{
+	char *attr_name;
+	PyObject *attr_type_obj;
+	PyObject *attr_data_obj;
+
+	if( !PyArg_ParseTuple( args, "sOO", &attr_name, &attr_type_obj, &attr_data_obj ) ) {
+		PyErr_SetString( PyExc_TypeError, "invalid arguments" );
+		return NULL;
+	}
+	if( !attr_file_check( self ) ) return NULL;
+
+	if( strlen( attr_name ) > B_ATTR_NAME_LENGTH ) {
+		PyErr_SetString( PyExc_OverflowError, "attribute name too long" );
+		return NULL;
+	}
+
+	uint32 be_type_code;
+	AttrData data;
+	if( !parse_attr_type( attr_type_obj, be_type_code ) ||
+		!convert_attr_data( be_type_code, attr_data_obj, self->flags, data ) ) {
+		return NULL;
+	}
+
+	ssize_t wrote;
+	int error;
+
+	int fd = attr_file_pin( self );
+	Py_BEGIN_ALLOW_THREADS
+	wrote = fs_write_attr( fd, attr_name, data.type, 0, data.buffer, data.size );
+	error = errno;
+	Py_END_ALLOW_THREADS
+
+	attr_cache_forget_fd( fd );
+	attr_file_unpin( self );
+
+	if( wrote != (ssize_t)data.size ) {
+		raise_io_error( "error writing attribute", attr_name, error );
+		return NULL;
+	}
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+static PyObject *attr_file_remove( AttrFileObject *self, PyObject *args )
+{
+	char *attr_name;
+
+	if( !PyArg_ParseTuple( args, "s", &attr_name ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify an attribute name" );
+		return NULL;
+	}
+	if( !attr_file_check( self ) ) return NULL;
+
+	int retval;
+	int error;
+
+	int fd = attr_file_pin( self );
+	Py_BEGIN_ALLOW_THREADS
+	retval = fs_remove_attr( fd, attr_name );
+	error = errno;
+	Py_END_ALLOW_THREADS
+
+	attr_cache_forget_fd( fd );
+	attr_file_unpin( self );
+
+	if( retval != B_OK ) {
+		raise_io_error( "can't remove attribute", attr_name, error );
+		return NULL;
+	}
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+static PyObject *attr_file_list( AttrFileObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	if( !attr_file_check( self ) ) return NULL;
+
+	vector<string> names;
+	int error;
+
+	int fd = attr_file_pin( self );
+	Py_BEGIN_ALLOW_THREADS
+	error = list_attr_names_fd( fd, names );
+	Py_END_ALLOW_THREADS
+	attr_file_unpin( self );
+
+	if( error != 0 ) {
+		raise_io_error( "can't open file's attributes", 
+						PyString_AsString( self->name ), error );
+		return NULL;
+	}
+
+	PyObject *name_list = PyList_New( names.size() );
+	if( NULL == name_list ) return PyErr_NoMemory();
+
+	for( size_t i = 0; i < names.size(); i++ ) {
+		PyObject *name = PyString_FromString( names[i].c_str() );
+		if( NULL == name ) {
+			Py_DECREF( name_list );
+			return NULL;
+		}
+		PyList_SET_ITEM( name_list, i, name );
+	}
+
+	return name_list;
+}
+
+static PyObject *attr_file_iter( AttrFileObject *self )
+{
+	PyObject *name_list = attr_file_list( self, NULL );
+	if( NULL == name_list ) return NULL;
+
+	PyObject *iter = PyObject_GetIter( name_list );
+	Py_DECREF( name_list );
+	return iter;
+}
+
+static PyObject *attr_file_read_attrs( AttrFileObject *self, PyObject *args, PyObject *kwds )
+{
+	static char *kwlist[] = { (char *)"names", (char *)"prefix", NULL };
+	PyObject *names_obj = Py_None;
+	char *prefix = NULL;
+
+	if( !PyArg_ParseTupleAndKeywords( args, kwds, "|Oz", kwlist, &names_obj, &prefix ) ) {
+		return NULL;
+	}
+	if( Py_None != names_obj && NULL != prefix ) {
+		PyErr_SetString( PyExc_ValueError, "use names or prefix, not both" );
+		return NULL;
+	}
+	if( !attr_file_check( self ) ) return NULL;
+
+	vector<string> names;
+	if( Py_None != names_obj && !parse_attr_names( names_obj, names ) ) return NULL;
+
+	double scratch[RAW_ARENA_STACK / sizeof( double )];
+	RawAttrs raw;
+	raw.arena.use( (char *)scratch, sizeof( scratch ) );
+
+	int fd = attr_file_pin( self );
+	Py_BEGIN_ALLOW_THREADS
+	read_raw_attrs_fd( fd, self->flags, 
+					   Py_None != names_obj ? &names : NULL, prefix, raw );
+	Py_END_ALLOW_THREADS
+	attr_file_unpin( self );
+
+	if( raw.status != RawAttrs::OK ) {
+		raise_raw_attrs_error( PyString_AsString( self->name ), raw );
+		return NULL;
+	}
+
+	return raw_attrs_to_dict( raw );
+}
+
+static PyObject *attr_file_fileno( AttrFileObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	if( !attr_file_check( self ) ) return NULL;
+	return PyInt_FromLong( self->fd );
+}
+
+static PyObject *attr_file_close_method( AttrFileObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	attr_file_close( self );
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+static PyObject *attr_file_enter( AttrFileObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	if( !attr_file_check( self ) ) return NULL;
+
+	Py_INCREF( self );
+	return (PyObject *)self;
+}
+
+static PyObject *attr_file_exit( AttrFileObject *self, PyObject *args )
+{
+	// args (the exception, if any) isn't used; it isn't swallowed either
+	args = args;
+
+	attr_file_close( self );
+
+	Py_INCREF( Py_False );
+	return Py_False;
+}
+
+static PyObject *attr_file_get_closed( AttrFileObject *self, void *closure )
+{
+	// closure isn't used
+	closure = closure;
+
+	return PyBool_FromLong( self->fd < 0 );
+}
+
+static PyMethodDef attr_file_methods[] = {
+	{
+		"get",
+		(PyCFunction)attr_file_get,
+		METH_VARARGS,
+		"get( attr_name, default = None )\n" \
+		"\n" \
+		"Returns the attribute as a ( type, data ) tuple, or default if the\n" \
+		"file doesn't have it."
+	},
+	{
+		"get_buffer",
+		(PyCFunction)attr_file_get_buffer,
+		METH_VARARGS,
+		"get_buffer( attr_name, default = None )\n" \
+		"\n" \
+		"Returns the attribute as a ( type, bytearray ) tuple, like\n" \
+		"read_attr_buffer(), or default if the file doesn't have it."
+	},
+	{
+		"set",
+		(PyCFunction)attr_file_set,
+		METH_VARARGS,
+		"set( attr_name, attr_type, attr_data )\n" \
+		"\n" \
+		"Write an attribute, like write_attr()."
+	},
+	{
+		"remove",
+		(PyCFunction)attr_file_remove,
+		METH_VARARGS,
+		"remove( attr_name )\n" \
+		"\n" \
+		"Remove an attribute, like remove_attr()."
+	},
+	{
+		"list",
+		(PyCFunction)attr_file_list,
+		METH_NOARGS,
+		"list()\n" \
+		"\n" \
+		"Returns a list of the names of the file's attributes; iterating\n" \
+		"over the AttrFile goes over the same names."
+	},
+	{
+		"read_attrs",
+		(PyCFunction)attr_file_read_attrs,
+		METH_VARARGS | METH_KEYWORDS,
+		"read_attrs( names = None, prefix = None )\n" \
+		"\n" \
+		"Read several attributes into a dictionary, like read_attrs()."
+	},
+	{
+		"fileno",
+		(PyCFunction)attr_file_fileno,
+		METH_NOARGS,
+		"fileno()\n" \
+		"\n" \
+		"Returns the file descriptor."
+	},
+	{
+		"close",
+		(PyCFunction)attr_file_close_method,
+		METH_NOARGS,
+		"close()\n" \
+		"\n" \
+		"Close the file, unless the AttrFile was made from a descriptor or\n" \
+		"file object, which are left open.  Closing twice is harmless."
+	},
+	{
+		"__enter__",
+		(PyCFunction)attr_file_enter,
+		METH_NOARGS,
+		"Returns the AttrFile itself."
+	},
+	{
+		"__exit__",
+		(PyCFunction)attr_file_exit,
+		METH_VARARGS,
+		"Closes the AttrFile."
+	},
+	{ // sentinel
+		NULL,	// name
+		NULL,	// function
+		0,		// flags
+		""		// docstring
+	}
+};
+
+static PyMemberDef attr_file_members[] = {
+	{
+		(char *)"name",
+		T_OBJECT,
+		offsetof( AttrFileObject, name ),
+		READONLY,
+		(char *)"Path of the file, or which descriptor it is."
+	},
+	{
+		(char *)"flags",
+		T_INT,
+		offsetof( AttrFileObject, flags ),
+		READONLY,
+		(char *)"The attr flags used for reading and writing."
+	},
+	{ NULL, 0, 0, 0, NULL }	// sentinel
+};
+
+static PyGetSetDef attr_file_getset[] = {
+	{
+		(char *)"closed",
+		(getter)attr_file_get_closed,
+		NULL,
+		(char *)"True once the AttrFile has been closed.",
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, NULL }	// sentinel
+};
+
+static PyTypeObject AttrFileType = {
+	PyObject_HEAD_INIT( NULL )
+	0,									// ob_size
+	"_fsattr.AttrFile",					// tp_name
+	sizeof( AttrFileObject ),			// tp_basicsize
+	0,									// tp_itemsize
+	(destructor)attr_file_dealloc,		// tp_dealloc
+	0,									// tp_print
+	0,									// tp_getattr
+	0,									// tp_setattr
+	0,									// tp_compare
+	(reprfunc)attr_file_repr,			// tp_repr
+	0,									// tp_as_number
+	0,									// tp_as_sequence
+	0,									// tp_as_mapping
+	0,									// tp_hash
+	0,									// tp_call
+	0,									// tp_str
+	0,									// tp_getattro
+	0,									// tp_setattro
+	0,									// tp_as_buffer
+	Py_TPFLAGS_DEFAULT,					// tp_flags
+	"AttrFile( file, flags = 0 )\n" \
+	"\n" \
+	"An open file for reading and writing attributes.  file is a path,\n" \
+	"a file descriptor or a file object; flags are the attr flags that\n" \
+	"read_attrs() and write_attr() take.  Descriptors and file objects\n" \
+	"stay open after the AttrFile is closed.  Works as a context manager.",	// tp_doc
+	0,									// tp_traverse
+	0,									// tp_clear
+	0,									// tp_richcompare
+	0,									// tp_weaklistoffset
+	(getiterfunc)attr_file_iter,		// tp_iter
+	0,									// tp_iternext
+	attr_file_methods,					// tp_methods
+	attr_file_members,					// tp_members
+	attr_file_getset,					// tp_getset
+	0,									// tp_base
+	0,									// tp_dict
+	0,									// tp_descr_get
+	0,									// tp_descr_set
+	0,									// tp_dictoffset
+	0,									// tp_init
+	0,									// tp_alloc
+	attr_file_new,						// tp_new
+};
+
+// ----------------------------------------------------------------------
+// Watcher; tells you when nodes' attributes, stat data or directory
+// entries change, instead of reading them again to find out.  The events
+// are kept by a NodeMonitor (see fsmonitor.h), repeats folded together
+// until they're read, and fileno() is readable while there are some.
+
+#define WATCHER_DEFAULT_FLAGS	( B_WATCH_ATTR | B_WATCH_STAT )
+
+typedef struct {
+	PyObject_HEAD
+	NodeMonitor *monitor;
+	bool closed;
+} WatcherObject;
+
+static void watcher_close( WatcherObject *self )
+{
+	if( self->closed ) return;
+
+	Py_BEGIN_ALLOW_THREADS
+	self->monitor->close();
+	Py_END_ALLOW_THREADS
+	self->closed = true;
+}
+
+static void watcher_dealloc( WatcherObject *self )
+{
+	if( NULL != self->monitor ) {
+		watcher_close( self );
+		delete self->monitor;
+	}
+	self->ob_type->tp_free( (PyObject *)self );
+}
+
+// Sets a ValueError and returns false if the Watcher is closed.
+static bool watcher_check( WatcherObject *self )
+{
+	if( self->closed ) {
+		PyErr_SetString( PyExc_ValueError, "Watcher is closed" );
+		return false;
+	}
+
+	return true;
+}
+
+// ----------------------------------------------------------------------
+// Start a Watcher
+//
+// args:
+// 	none
+
+static PyObject *watcher_new( PyTypeObject *type, PyObject *args, PyObject *kwds )
+{
+	static char *kwlist[] = { NULL };
+
+	if( !PyArg_ParseTupleAndKeywords( args, kwds, "", kwlist ) ) return NULL;
+
+	WatcherObject *self = (WatcherObject *)type->tp_alloc( type, 0 );
+	if( NULL == self ) return NULL;
+
+	self->monitor = new NodeMonitor;
+	self->closed = false;
+
+	int error = self->monitor->open();
+	if( error != 0 ) {
+		try {
+			strstream s;
+			s << "can't start watching: " << strerror( error ) << ends;
+			PyErr_SetString( PyExc_RuntimeError, s.str() );
+		} catch ( ... ) {
+			PyErr_SetString( PyExc_RuntimeError, strerror( error ) );
+		}
+
+		Py_DECREF( self );
+		return NULL;
+	}
+
+	return (PyObject *)self;
+}
+
+// ----------------------------------------------------------------------
+// Watcher methods
+
+static PyObject *watcher_watch( WatcherObject *self, PyObject *args )
+{
+	char *path;
+	int flags = WATCHER_DEFAULT_FLAGS;
+
+	if( !PyArg_ParseTuple( args, "s|i", &path, &flags ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a path" );
+		return NULL;
+	}
+	if( !watcher_check( self ) ) return NULL;
+
+	dev_t device;
+	ino_t node;
+	int error;
+
+	Py_BEGIN_ALLOW_THREADS
+	error = self->monitor->watch( path, flags, device, node );
+	Py_END_ALLOW_THREADS
+
+	if( EINVAL == error ) {
+		if( flags & B_WATCH_NAME ) {
+			PyErr_SetString( PyExc_ValueError, "WATCH_NAME isn't supported here" );
+		} else {
+			PyErr_Format( PyExc_ValueError, "unknown watch flags: 0x%x", flags );
+		}
+		return NULL;
+	} else if( error != 0 ) {
+		raise_io_error( "can't watch", path, error );
+		return NULL;
+	}
+
+	return Py_BuildValue( "(LL)", (PY_LONG_LONG)device, (PY_LONG_LONG)node );
+}
+
+static PyObject *watcher_unwatch( WatcherObject *self, PyObject *args )
+{
+	PyObject *target;
+
+	if( !PyArg_ParseTuple( args, "O", &target ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a path or node_ref" );
+		return NULL;
+	}
+	if( !watcher_check( self ) ) return NULL;
+
+	PY_LONG_LONG device;
+	PY_LONG_LONG node;
+	if( PyString_Check( target ) ) {
+		struct stat st;
+		if( stat( PyString_AS_STRING( target ), &st ) != 0 ) {
+			raise_io_error( "can't unwatch", PyString_AS_STRING( target ), errno );
+			return NULL;
+		}
+		device = st.st_dev;
+		node = st.st_ino;
+	} else if( !PyArg_ParseTuple( target, "LL", &device, &node ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a path or node_ref" );
+		return NULL;
+	}
+
+	int error;
+	Py_BEGIN_ALLOW_THREADS
+	error = self->monitor->unwatch( device, node );
+	Py_END_ALLOW_THREADS
+
+	if( ENOENT == error ) {
+		PyErr_SetString( PyExc_KeyError, "that node isn't being watched" );
+		return NULL;
+	} else if( error != 0 ) {
+		PyErr_SetString( PyExc_IOError, strerror( error ) );
+		return NULL;
+	}
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+static PyObject *watcher_fileno( WatcherObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	if( !watcher_check( self ) ) return NULL;
+	return PyInt_FromLong( self->monitor->fileno() );
+}
+
+static PyObject *watcher_read_events( WatcherObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	vector<MonitorEvent> events;
+	self->monitor->take( events );
+
+	PyObject *event_list = PyList_New( events.size() );
+	if( NULL == event_list ) return NULL;
+
+	for( size_t i = 0; i < events.size(); i++ ) {
+		const MonitorEvent &event = events[i];
+		PyObject *the_event;
+		if( MONITOR_EVENTS_LOST == event.opcode ) {
+			the_event = Py_BuildValue( "(OOi)", Py_None, Py_None, event.opcode );
+		} else if( event.has_attr ) {
+			the_event = Py_BuildValue( "((LL)si)", (PY_LONG_LONG)event.device,
+									   (PY_LONG_LONG)event.node,
+									   event.attr.c_str(), event.opcode );
+		} else {
+			the_event = Py_BuildValue( "((LL)Oi)", (PY_LONG_LONG)event.device,
+									   (PY_LONG_LONG)event.node,
+									   Py_None, event.opcode );
+		}
+
+		if( NULL == the_event ) {
+			Py_DECREF( event_list );
+			return NULL;
+		}
+		PyList_SET_ITEM( event_list, i, the_event );
+	}
+
+	return event_list;
+}
+
+static PyObject *watcher_close_method( WatcherObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	watcher_close( self );
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+static PyObject *watcher_enter( WatcherObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	if( !watcher_check( self ) ) return NULL;
+
+	Py_INCREF( self );
+	return (PyObject *)self;
+}
+
+static PyObject *watcher_exit( WatcherObject *self, PyObject *args )
+{
+	// args (the exception, if any) isn't used; it isn't swallowed either
+	args = args;
+
+	watcher_close( self );
+
+	Py_INCREF( Py_False );
+	return Py_False;
+}
+
+static PyObject *watcher_get_closed( WatcherObject *self, void *closure )
+{
+	// closure isn't used
+	closure = closure;
+
+	return PyBool_FromLong( self->closed );
+}
+
+static PyMethodDef watcher_methods[] = {
+	{
+		"watch",
+		(PyCFunction)watcher_watch,
+		METH_VARARGS,
+		"watch( path, flags = monitor.WATCH_ATTR | monitor.WATCH_STAT )\n" \
+		"\n" \
+		"Start watching the node at path, or change what's watched about it,\n" \
+		"and return its node_ref, a ( device, node ) tuple.  flags are the\n" \
+		"monitor.WATCH_* flags; WATCH_DIRECTORY reports entries created,\n" \
+		"removed and moved in a directory.  0 stops watching it.  Flags\n" \
+		"that can't be watched here raise ValueError."
+	},
+	{
+		"unwatch",
+		(PyCFunction)watcher_unwatch,
+		METH_VARARGS,
+		"unwatch( path or node_ref )\n" \
+		"\n" \
+		"Stop watching a node.  Raises KeyError if it isn't being watched."
+	},
+	{
+		"fileno",
+		(PyCFunction)watcher_fileno,
+		METH_NOARGS,
+		"fileno()\n" \
+		"\n" \
+		"Returns a file descriptor that becomes readable when events are\n" \
+		"waiting, for use with select(), poll() or an asyncio loop.  Don't\n" \
+		"read it yourself, read_events() does that."
+	},
+	{
+		"read_events",
+		(PyCFunction)watcher_read_events,
+		METH_NOARGS,
+		"read_events()\n" \
+		"\n" \
+		"Returns the events that arrived since the last call, oldest first,\n" \
+		"without waiting; the list is empty if there aren't any.  Each event\n" \
+		"is a ( node_ref, attr_name, opcode ) tuple, where opcode is one of\n" \
+		"monitor.ATTR_CHANGED, STAT_CHANGED, ENTRY_CREATED, ENTRY_REMOVED\n" \
+		"and ENTRY_MOVED, and attr_name is None except for ATTR_CHANGED.\n" \
+		"Events that repeat before they're read are only reported once, and\n" \
+		"entry events are reported for the directory, not the entry.  If\n" \
+		"events were lost, there's a ( None, None, monitor.EVENTS_LOST )\n" \
+		"event, and anything watched may have changed."
+	},
+	{
+		"close",
+		(PyCFunction)watcher_close_method,
+		METH_NOARGS,
+		"close()\n" \
+		"\n" \
+		"Stop watching everything.  Events that already arrived can still be\n" \
+		"read with read_events()."
+	},
+	{
+		"__enter__",
+		(PyCFunction)watcher_enter,
+		METH_NOARGS,
+		"Returns the Watcher itself."
+	},
+	{
+		"__exit__",
+		(PyCFunction)watcher_exit,
+		METH_VARARGS,
+		"Closes the Watcher."
+	},
+	{ // sentinel
+		NULL,	// name
+		NULL,	// function
+		0,		// flags
+		""		// docstring
+	}
+};
+
+static PyGetSetDef watcher_getset[] = {
+	{
+		(char *)"closed",
+		(getter)watcher_get_closed,
+		NULL,
+		(char *)"True once the Watcher has been closed.",
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, NULL }	// sentinel
+};
+
+static PyTypeObject WatcherType = {
+	PyObject_HEAD_INIT( NULL )
+	0,									// ob_size
+	"_fsattr.Watcher",					// tp_name
+	sizeof( WatcherObject ),			// tp_basicsize
+	0,									// tp_itemsize
+	(destructor)watcher_dealloc,		// tp_dealloc
+	0,									// tp_print
+	0,									// tp_getattr
+	0,									// tp_setattr
+	0,									// tp_compare
+	0,									// tp_repr
+	0,									// tp_as_number
+	0,									// tp_as_sequence
+	0,									// tp_as_mapping
+	0,									// tp_hash
+	0,									// tp_call
+	0,									// tp_str
+	0,									// tp_getattro
+	0,									// tp_setattro
+	0,									// tp_as_buffer
+	Py_TPFLAGS_DEFAULT,					// tp_flags
+	"Watcher()\n" \
+	"\n" \
+	"Watches nodes for changes to their attributes, stat data or directory\n" \
+	"entries; see watch(), fileno() and read_events().  Works as a context\n" \
+	"manager.\n" \
+	"\n" \
+	"On Linux this is a stand-in built on inotify, which works out which\n" \
+	"attribute changed by comparing them with what they were.",	// tp_doc
+	0,									// tp_traverse
+	0,									// tp_clear
+	0,									// tp_richcompare
+	0,									// tp_weaklistoffset
+	0,									// tp_iter
+	0,									// tp_iternext
+	watcher_methods,					// tp_methods
+	0,									// tp_members
+	watcher_getset,						// tp_getset
+	0,									// tp_base
+	0,									// tp_dict
+	0,									// tp_descr_get
+	0,									// tp_descr_set
+	0,									// tp_dictoffset
+	0,									// tp_init
+	0,									// tp_alloc
+	watcher_new,						// tp_new
+};
+
+#ifndef __linux__
+// (Not on Linux; xattrs have no descriptors to stream through.)
+
+// ----------------------------------------------------------------------
+// AttrStream; one attribute opened like a file, with fs_open_attr(), for
+// attributes too big to want in memory all at once.  The data is just
+// bytes here; nothing is converted or swapped.
+
+typedef struct {
+	PyObject_HEAD
+	int fd;				// attribute descriptor, -1 once closed
+	uint32 type;		// attribute type
+	bool readable;
+	bool writable;
+	PyObject *name;		// attribute name
+	PyObject *filename;	// file it belongs to
+	int users;			// calls using fd without the GIL
+	int closed_fd;		// fd, if it was closed while still in use; or -1
+} AttrStreamObject;
+
+static void attr_stream_release( int fd )
+{
+	Py_BEGIN_ALLOW_THREADS
+	fs_close_attr( fd );
+	Py_END_ALLOW_THREADS
+}
+
+// Pinned the same way as AttrFile's descriptor, see attr_file_pin().
+static int attr_stream_pin( AttrStreamObject *self )
+{
+	self->users++;
+	return self->fd;
+}
+
+static void attr_stream_unpin( AttrStreamObject *self )
+{
+	if( --self->users > 0 || self->closed_fd < 0 ) return;
+
+	int fd = self->closed_fd;
+	self->closed_fd = -1;
+	attr_stream_release( fd );
+}
+
+static void attr_stream_close( AttrStreamObject *self )
+{
+	int fd = self->fd;
+	self->fd = -1;
+	if( fd < 0 ) return;
+
+	if( self->users > 0 ) {
+		self->closed_fd = fd;
+	} else {
+		attr_stream_release( fd );
+	}
+}
+
+static void attr_stream_dealloc( AttrStreamObject *self )
+{
+	attr_stream_close( self );
+	Py_XDECREF( self->name );
+	Py_XDECREF( self->filename );
+	self->ob_type->tp_free( (PyObject *)self );
+}
+
+// Sets a ValueError and returns false if the AttrStream is closed.
+static bool attr_stream_check( AttrStreamObject *self )
+{
+	if( self->fd < 0 ) {
+		PyErr_SetString( PyExc_ValueError, "I/O operation on closed AttrStream" );
+		return false;
+	}
+
+	return true;
+}
+
+// Like attr_stream_check(), plus an IOError if it's the wrong way around.
+static bool attr_stream_check_mode( AttrStreamObject *self, bool write )
+{
+	if( !attr_stream_check( self ) ) return false;
+
+	if( write ? !self->writable : !self->readable ) {
+		PyErr_SetString( PyExc_IOError, 
+						 write ? "AttrStream not open for writing" : 
+								 "AttrStream not open for reading" );
+		return false;
+	}
+
+	return true;
+}
+
+// ----------------------------------------------------------------------
+// Open an AttrStream
+//
+// args:
+// 	filename
+// 	attr_name
+// 	mode = "r" (optional; "r", "r+", "w", "w+", "a" or "a+", "b" is ignored)
+// 	attr_type = B_RAW_TYPE (optional, for new attributes)
+// 	flags = 0 (optional, only ATTR_SYMLINK matters)
+
+static PyObject *attr_stream_new( PyTypeObject *type, PyObject *args, PyObject *kwds )
+{
+	static char *kwlist[] = { (char *)"filename", (char *)"attr_name", 
+							  (char *)"mode", (char *)"attr_type", 
+							  (char *)"flags", NULL };
+	char *filename;
+	char *attr_name;
+	char *mode_str = (char *)"r";
+	PyObject *attr_type_obj = NULL;
+	int flags = 0;
+
+	if( !PyArg_ParseTupleAndKeywords( args, kwds, "ss|sOi", kwlist, &filename, 
+									  &attr_name, &mode_str, &attr_type_obj, 
+									  &flags ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a path name and an attribute name" );
+		return NULL;
+	}
+
+	if( strlen( attr_name ) > B_ATTR_NAME_LENGTH ) {
+		PyErr_SetString( PyExc_OverflowError, "attribute name too long" );
+		return NULL;
+	}
+
+	uint32 be_type_code = B_RAW_TYPE;
+	if( NULL != attr_type_obj && !parse_attr_type( attr_type_obj, be_type_code ) ) {
+		return NULL;
+	}
+
+	// Same letters as open(); "a" is done with a seek to the end, since
+	// not every file system does O_APPEND on attributes.
+	bool plus = ( strchr( mode_str, '+' ) != NULL );
+	bool append = false;
+	int open_mode;
+	switch( mode_str[0] ) {
+	case 'r':
+		open_mode = plus ? O_RDWR : O_RDONLY;
+		break;
+
+	case 'w':
+		open_mode = ( plus ? O_RDWR : O_WRONLY ) | O_CREAT | O_TRUNC;
+		break;
+
+	case 'a':
+		open_mode = ( plus ? O_RDWR : O_WRONLY ) | O_CREAT;
+		append = true;
+		break;
+
+	default:
+		PyErr_Format( PyExc_ValueError, "mode must be 'r', 'w' or 'a', not '%s'", mode_str );
+		return NULL;
+	}
+	if( flags & ATTR_SYMLINK ) open_mode |= O_NOTRAVERSE;
+
+	AttrStreamObject *self = (AttrStreamObject *)type->tp_alloc( type, 0 );
+	if( NULL == self ) return NULL;
+
+	// Everything dealloc looks at has to be sane before the first return.
+	self->fd = -1;
+	self->users = 0;
+	self->closed_fd = -1;
+	self->type = be_type_code;
+	self->readable = ( ( open_mode & O_ACCMODE ) != O_WRONLY );
+	self->writable = ( ( open_mode & O_ACCMODE ) != O_RDONLY );
+	self->name = PyString_FromString( attr_name );
+	self->filename = PyString_FromString( filename );
+	if( NULL == self->name || NULL == self->filename ) {
+		Py_DECREF( self );
+		return NULL;
+	}
+
+	// An existing attribute keeps its type, so go through the node to
+	// find out what that is.
+	int node_mode = O_RDONLY;
+	if( flags & ATTR_SYMLINK ) node_mode |= O_NOTRAVERSE;
+
+	int node_fd;
+	int fd = -1;
+	int error;
+
+	Py_BEGIN_ALLOW_THREADS
+	node_fd = open( filename, node_mode );
+	error = errno;
+	if( node_fd >= 0 ) {
+		struct attr_info fa_info;
+		if( fs_stat_attr( node_fd, attr_name, &fa_info ) == B_OK && 
+			!( open_mode & O_TRUNC ) ) {
+			be_type_code = fa_info.type;
+		}
+		fd = fs_fopen_attr( node_fd, attr_name, be_type_code, 
+							open_mode & ~O_NOTRAVERSE );
+		error = errno;
+		if( fd >= 0 && append ) lseek( fd, 0, SEEK_END );
+		close( node_fd );
+	}
+	Py_END_ALLOW_THREADS
+
+	if( node_fd < 0 ) {
+		raise_io_error( "can't open file", filename, error );
+		Py_DECREF( self );
+		return NULL;
+	}
+	if( fd < 0 ) {
+		raise_io_error( "can't open attribute", attr_name, error );
+		Py_DECREF( self );
+		return NULL;
+	}
+
+	self->fd = fd;
+	self->type = be_type_code;
+	return (PyObject *)self;
+}
+
+static PyObject *attr_stream_repr( AttrStreamObject *self )
+{
+	return PyString_FromFormat( "<%s AttrStream %s of %s>", 
+								self->fd < 0 ? "closed" : "open",
+								PyString_AsString( self->name ),
+								PyString_AsString( self->filename ) );
+}
+
+// ----------------------------------------------------------------------
+// AttrStream methods
 
-			uint8 blue = (uint8)val;
+static PyObject *attr_stream_read( AttrStreamObject *self, PyObject *args )
+{
+	Py_ssize_t size = -1;
 
-			obj = PyTuple_GetItem( attr_data_obj, 1 );
-			if( NULL != obj ) {
-				val = PyInt_AsLong( obj );
-			} else {
-				val = 255;
-			}
-			if( val > UCHAR_MAX ) {
-				PyErr_SetString( PyExc_OverflowError, 
-								 "alpha value value greater than 255" );
-				break;
-			}
+	if( !PyArg_ParseTuple( args, "|n", &size ) ) return NULL;
+	if( !attr_stream_check_mode( self, false ) ) return NULL;
 
-			uint8 alpha = (uint8)val;
+	if( size < 0 ) {
+		// The rest of it.
+		struct stat st;
+		off_t pos;
+		int error;
 
-			rgb_color color = { red, green, blue, alpha };
-			buffer_size = sizeof( rgb_color );
-			buffer = (char *)malloc( buffer_size );
-			if( buffer ) {
-				own_buffer = true;
-				memcpy( buffer, &color, buffer_size );
-			}
+		int fd = attr_stream_pin( self );
+		Py_BEGIN_ALLOW_THREADS
+		pos = lseek( fd, 0, SEEK_CUR );
+		if( pos < 0 || fstat( fd, &st ) != 0 ) pos = -1;
+		error = errno;
+		Py_END_ALLOW_THREADS
+		attr_stream_unpin( self );
+
+		if( pos < 0 ) {
+			raise_io_error( "can't stat attribute", PyString_AsString( self->name ), error );
+			return NULL;
 		}
-		break;
+		size = ( st.st_size > pos ) ? (Py_ssize_t)( st.st_size - pos ) : 0;
+	}
 
-	default:
-		// unknown data
-		{
-			char *str = PyString_AsString( attr_data_obj );
-			if( NULL == str ) {
-				PyErr_SetString( PyExc_TypeError, 
-								 "couldn't convert data" );
-			} else {
-				buffer = str;
-				buffer_size = PyString_Size( attr_data_obj );
-			}
+	PyObject *data = PyString_FromStringAndSize( NULL, size );
+	if( NULL == data ) return NULL;
+
+	// Nobody else can see the string yet, so it's safe to fill it
+	// without the GIL.
+	char *ptr = PyString_AS_STRING( data );
+	Py_ssize_t total = 0;
+	int error = 0;
+
+	int fd = attr_stream_pin( self );
+	Py_BEGIN_ALLOW_THREADS
+	while( total < size ) {
+		ssize_t got = read( fd, ptr + total, size - total );
+		if( got < 0 ) {
+			error = errno;
+			break;
 		}
-		break;
+		if( 0 == got ) break;
+		total += got;
 	}
+	Py_END_ALLOW_THREADS
+	attr_stream_unpin( self );
 
-	if( NULL == buffer ) {
+	if( 0 != error ) {
+		Py_DECREF( data );
+		raise_io_error( "error reading attribute", PyString_AsString( self->name ), error );
 		return NULL;
 	}
 
-	// Swap the data around for fun and profit.
-	if( flags & ATTR_BIG_ENDIAN ) {
-		(void)swap_data( be_type_code, buffer, buffer_size,
-						 B_SWAP_HOST_TO_BENDIAN );
-	} else if( flags & ATTR_LITTLE_ENDIAN ) {
-		(void)swap_data( be_type_code, buffer, buffer_size,
-						 B_SWAP_HOST_TO_LENDIAN );
+	if( total != size && _PyString_Resize( &data, total ) < 0 ) return NULL;
+	return data;
+}
+
+static PyObject *attr_stream_readinto( AttrStreamObject *self, PyObject *args )
+{
+	Py_buffer view;
+
+	if( !PyArg_ParseTuple( args, "w*", &view ) ) return NULL;
+	if( !attr_stream_check_mode( self, false ) ) {
+		PyBuffer_Release( &view );
+		return NULL;
 	}
-			
-	// fs_remove_attr() before trying to write it?
-	int fd = open( filename, mode );
-	if( fd < 0 ) {
-		try {
-			strstream s;
-			s << "can't open file: " << filename \
-			  << " (" << strerror( errno ) << ")" << ends;
-			PyErr_SetString( PyExc_IOError, s.str() );
-		} catch ( ... ) {
-			PyErr_SetString( PyExc_IOError, strerror( errno ) );
+
+	// The view keeps the buffer from moving while the GIL is gone.
+	char *ptr = (char *)view.buf;
+	Py_ssize_t total = 0;
+	int error = 0;
+
+	int fd = attr_stream_pin( self );
+	Py_BEGIN_ALLOW_THREADS
+	while( total < view.len ) {
+		ssize_t got = read( fd, ptr + total, view.len - total );
+		if( got < 0 ) {
+			error = errno;
+			break;
 		}
-			return NULL;
+		if( 0 == got ) break;
+		total += got;
 	}
+	Py_END_ALLOW_THREADS
+	attr_stream_unpin( self );
 
-	ssize_t wrote = fs_write_attr( fd, attr_name, be_type_code, 0,
-								   buffer, buffer_size );
-	close( fd );
+	PyBuffer_Release( &view );
 
-	if( wrote != (ssize_t)buffer_size ) {
-		try {
-			strstream s;
-			s << "error writing attribute: " << attr_name \
-			  << " (" << strerror( errno ) << ")" << ends;
-			PyErr_SetString( PyExc_IOError, s.str() );
-		} catch ( ... ) {
-			PyErr_SetString( PyExc_IOError, strerror( errno ) );
-		}
+	if( 0 != error ) {
+		raise_io_error( "error reading attribute", PyString_AsString( self->name ), error );
+		return NULL;
+	}
+
+	return PyInt_FromSsize_t( total );
+}
+
+static PyObject *attr_stream_write( AttrStreamObject *self, PyObject *args )
+{
+	Py_buffer view;
 
+	if( !PyArg_ParseTuple( args, "s*", &view ) ) return NULL;
+	if( !attr_stream_check_mode( self, true ) ) {
+		PyBuffer_Release( &view );
 		return NULL;
 	}
 
-	if( own_buffer && buffer ) free( buffer );
+	const char *ptr = (const char *)view.buf;
+	Py_ssize_t total = 0;
+	int error = 0;
+
+	int fd = attr_stream_pin( self );
+	Py_BEGIN_ALLOW_THREADS
+	while( total < view.len ) {
+		ssize_t wrote = write( fd, ptr + total, view.len - total );
+		if( wrote <= 0 ) {
+			error = ( wrote < 0 ) ? errno : EIO;
+			break;
+		}
+		total += wrote;
+	}
+	Py_END_ALLOW_THREADS
+	attr_stream_unpin( self );
+
+	PyBuffer_Release( &view );
+	attr_cache_forget_path( PyString_AS_STRING( self->filename ), 0 );
+
+	if( 0 != error ) {
+		raise_io_error( "error writing attribute", PyString_AsString( self->name ), error );
+		return NULL;
+	}
 
 	Py_INCREF( Py_None );
 	return Py_None;
 }
 
-// ----------------------------------------------------------------------
-// Remove an attribute from the file/directory/symlink.
-//
-// args:
-//	filename
-//	attr_name
-//	flags = 0 (optional)
-
-static PyObject *bfs_remove_attr( PyObject *self, PyObject *args )
+static PyObject *attr_stream_seek( AttrStreamObject *self, PyObject *args )
 {
-	// self isn't used for normal functions
-	self = self;
+	PY_LONG_LONG offset;
+	int whence = SEEK_SET;
 
-	char *filename;
-	char *attr_name;
-	int flags = 0;
+	if( !PyArg_ParseTuple( args, "L|i", &offset, &whence ) ) return NULL;
+	if( !attr_stream_check( self ) ) return NULL;
 
-	int mode = O_WRONLY;
-	
-	if( PyArg_ParseTuple( args, "ss|i",
-						  &filename, 
-						  &attr_name, 
-						  &flags ) ) {
-		if( flags & ATTR_SYMLINK ) mode |= O_NOTRAVERSE;
-		if( ( flags & ATTR_BIG_ENDIAN ) && ( flags & ATTR_LITTLE_ENDIAN ) ) {
-			PyErr_SetString( PyExc_ValueError, 
-							 "can't specify ATTR_BIG_ENDIAN and ATTR_LITTLE_ENDIAN, it's ust not right" );
-			return NULL;
-		}
-	} else {
-		PyErr_SetString( PyExc_TypeError, "invalid arguments" );
-		return NULL;
-	}
+	off_t pos;
+	int error;
 
-	int fd = open( filename, mode );
-	if( fd < 0 ) {
-		try {
-			strstream s;
-			s << "can't open file: " << filename \
-			  << " (" << strerror( errno ) << ")" << ends;
-			PyErr_SetString( PyExc_IOError, s.str() );
-		} catch ( ... ) {
-			PyErr_SetString( PyExc_IOError, strerror( errno ) );
-		}
+	int fd = attr_stream_pin( self );
+	Py_BEGIN_ALLOW_THREADS
+	pos = lseek( fd, (off_t)offset, whence );
+	error = errno;
+	Py_END_ALLOW_THREADS
+	attr_stream_unpin( self );
 
+	if( pos < 0 ) {
+		raise_io_error( "can't seek in attribute", PyString_AsString( self->name ), error );
 		return NULL;
 	}
 
-	int retval = fs_remove_attr( fd, attr_name );
-	if( retval != B_OK ) {
-		try {
-			strstream s;
-			s << "can't remove attribute: " << attr_name \
-			  << " (" << strerror( errno ) << ")" << ends;
-			PyErr_SetString( PyExc_IOError, s.str() );
-		} catch ( ... ) {
-			PyErr_SetString( PyExc_IOError, strerror( errno ) );
-		}
+	return PyLong_FromLongLong( pos );
+}
 
-		close( fd );
+static PyObject *attr_stream_tell( AttrStreamObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	if( !attr_stream_check( self ) ) return NULL;
+
+	off_t pos = lseek( self->fd, 0, SEEK_CUR );
+	if( pos < 0 ) {
+		raise_io_error( "can't seek in attribute", PyString_AsString( self->name ), errno );
 		return NULL;
 	}
-	
-	close( fd );
+
+	return PyLong_FromLongLong( pos );
+}
+
+static PyObject *attr_stream_fileno( AttrStreamObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	if( !attr_stream_check( self ) ) return NULL;
+	return PyInt_FromLong( self->fd );
+}
+
+static PyObject *attr_stream_close_method( AttrStreamObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	attr_stream_close( self );
 
 	Py_INCREF( Py_None );
 	return Py_None;
 }
 
+static PyObject *attr_stream_enter( AttrStreamObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	if( !attr_stream_check( self ) ) return NULL;
+
+	Py_INCREF( self );
+	return (PyObject *)self;
+}
+
+static PyObject *attr_stream_exit( AttrStreamObject *self, PyObject *args )
+{
+	// args (the exception, if any) isn't used; it isn't swallowed either
+	args = args;
+
+	attr_stream_close( self );
+
+	Py_INCREF( Py_False );
+	return Py_False;
+}
+
+static PyObject *attr_stream_get_closed( AttrStreamObject *self, void *closure )
+{
+	// closure isn't used
+	closure = closure;
+
+	return PyBool_FromLong( self->fd < 0 );
+}
+
+static PyMethodDef attr_stream_methods[] = {
+	{
+		"read",
+		(PyCFunction)attr_stream_read,
+		METH_VARARGS,
+		"read( size = -1 )\n" \
+		"\n" \
+		"Read up to size bytes, or the rest of the attribute if size is\n" \
+		"negative; returns a string, empty at the end."
+	},
+	{
+		"readinto",
+		(PyCFunction)attr_stream_readinto,
+		METH_VARARGS,
+		"readinto( buffer )\n" \
+		"\n" \
+		"Read into a writable buffer (a bytearray, say) without making a\n" \
+		"string; returns how many bytes were read, 0 at the end."
+	},
+	{
+		"write",
+		(PyCFunction)attr_stream_write,
+		METH_VARARGS,
+		"write( data )\n" \
+		"\n" \
+		"Write a string or anything else with the buffer protocol at the\n" \
+		"current position."
+	},
+	{
+		"seek",
+		(PyCFunction)attr_stream_seek,
+		METH_VARARGS,
+		"seek( offset, whence = 0 )\n" \
+		"\n" \
+		"Move to offset, like file.seek(); returns the new position."
+	},
+	{
+		"tell",
+		(PyCFunction)attr_stream_tell,
+		METH_NOARGS,
+		"tell()\n" \
+		"\n" \
+		"Returns the current position."
+	},
+	{
+		"fileno",
+		(PyCFunction)attr_stream_fileno,
+		METH_NOARGS,
+		"fileno()\n" \
+		"\n" \
+		"Returns the attribute's descriptor."
+	},
+	{
+		"close",
+		(PyCFunction)attr_stream_close_method,
+		METH_NOARGS,
+		"close()\n" \
+		"\n" \
+		"Close the attribute; closing it twice is fine."
+	},
+	{
+		"__enter__",
+		(PyCFunction)attr_stream_enter,
+		METH_NOARGS,
+		"Returns the AttrStream itself."
+	},
+	{
+		"__exit__",
+		(PyCFunction)attr_stream_exit,
+		METH_VARARGS,
+		"Closes the AttrStream."
+	},
+	{ // sentinel
+		NULL,	// name
+		NULL,	// function
+		0,		// flags
+		""		// docstring
+	}
+};
+
+static PyMemberDef attr_stream_members[] = {
+	{
+		(char *)"name",
+		T_OBJECT,
+		offsetof( AttrStreamObject, name ),
+		READONLY,
+		(char *)"The attribute's name."
+	},
+	{
+		(char *)"filename",
+		T_OBJECT,
+		offsetof( AttrStreamObject, filename ),
+		READONLY,
+		(char *)"Path of the file the attribute belongs to."
+	},
+	{
+		(char *)"type",
+		T_UINT,
+		offsetof( AttrStreamObject, type ),
+		READONLY,
+		(char *)"The attribute's type."
+	},
+	{ NULL, 0, 0, 0, NULL }	// sentinel
+};
+
+static PyGetSetDef attr_stream_getset[] = {
+	{
+		(char *)"closed",
+		(getter)attr_stream_get_closed,
+		NULL,
+		(char *)"True once the AttrStream has been closed.",
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, NULL }	// sentinel
+};
+
+static PyTypeObject AttrStreamType = {
+	PyObject_HEAD_INIT( NULL )
+	0,									// ob_size
+	"_fsattr.AttrStream",				// tp_name
+	sizeof( AttrStreamObject ),			// tp_basicsize
+	0,									// tp_itemsize
+	(destructor)attr_stream_dealloc,	// tp_dealloc
+	0,									// tp_print
+	0,									// tp_getattr
+	0,									// tp_setattr
+	0,									// tp_compare
+	(reprfunc)attr_stream_repr,			// tp_repr
+	0,									// tp_as_number
+	0,									// tp_as_sequence
+	0,									// tp_as_mapping
+	0,									// tp_hash
+	0,									// tp_call
+	0,									// tp_str
+	0,									// tp_getattro
+	0,									// tp_setattro
+	0,									// tp_as_buffer
+	Py_TPFLAGS_DEFAULT,					// tp_flags
+	"AttrStream( filename, attr_name, mode = 'r', attr_type = B_RAW_TYPE, flags = 0 )\n" \
+	"\n" \
+	"One attribute opened like a file, for reading and writing it in\n" \
+	"pieces; see open_attr().  Works as a context manager.",	// tp_doc
+	0,									// tp_traverse
+	0,									// tp_clear
+	0,									// tp_richcompare
+	0,									// tp_weaklistoffset
+	0,									// tp_iter
+	0,									// tp_iternext
+	attr_stream_methods,				// tp_methods
+	attr_stream_members,				// tp_members
+	attr_stream_getset,					// tp_getset
+	0,									// tp_base
+	0,									// tp_dict
+	0,									// tp_descr_get
+	0,									// tp_descr_set
+	0,									// tp_dictoffset
+	0,									// tp_init
+	0,									// tp_alloc
+	attr_stream_new,					// tp_new
+};
+
+// ----------------------------------------------------------------------
+// Open an attribute like a file; just makes an AttrStream.
+//
+// args:
+// 	filename
+// 	attr_name
+// 	mode = "r" (optional)
+// 	attr_type = B_RAW_TYPE (optional)
+// 	flags = 0 (optional)
+
+static PyObject *bfs_open_attr( PyObject *self, PyObject *args, PyObject *kwds )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	return PyObject_Call( (PyObject *)&AttrStreamType, args, kwds );
+}
+#endif
+
 // ----------------------------------------------------------------------
 // List of functions defined in the module
 static PyMethodDef fsattr_methods[] = {
 	{
 		"read_attrs",
-		bfs_read_attrs,
-		METH_VARARGS,
-		"read_attrs( filename, flags = 0 )\n" \
+		(PyCFunction)bfs_read_attrs,
+		METH_VARARGS | METH_KEYWORDS,
+		"read_attrs( filename, flags = 0, names = None, prefix = None,\n" \
+		"            max_size = attr.MAX_SIZE )\n" \
 		"\n" \
 		"Reads the attributes for filename; returns a dictionary of tuples,\n" \
 		"each tuple is ( type, data ) and the key is the attribute name.\n"\
 		"\n" \
+		"If names is a list of attribute names, only those are read (the\n" \
+		"ones the file doesn't have are left out), without going through\n" \
+		"the attribute directory.  If prefix is given, only attributes whose\n" \
+		"names start with it are read.\n" \
+		"\n" \
 		"If flags is attr.SYMLINK, symbolic links WILL NOT be traversed;\n" \
 		"you'll get the attribute data for the symlink, not the target.\n" \
 		"If flags has attr.BIG_ENDIAN set, the data will be read from big-endian\n" \
 		"format; if flags has attr.LITTLE_ENDIAN set, the data will be read from\n" \
 		"little-endian format.  If both attr.BIG_ENDIAN and attr.LITTLE_ENDIAN are\n" \
-		"set, a ValueError exception is raised." \
+		"set, a ValueError exception is raised.\n" \
+		"\n" \
+		"An attribute bigger than max_size bytes raises an IOError instead of\n" \
+		"being read; -1 reads any size.\n" \
+		"\n" \
+		"With the attribute cache on (see set_attr_cache_limit()), a file\n" \
+		"read before is answered from memory until its attributes or stat\n" \
+		"data change." \
+	},
+	{
+		"set_attr_cache_limit",
+		bfs_set_attr_cache_limit,
+		METH_VARARGS,
+		"set_attr_cache_limit( bytes )\n" \
+		"\n" \
+		"Turn the attribute cache on, with roughly bytes of memory for it;\n" \
+		"0 (the default) turns it off and empties it.  read_attrs() keeps\n" \
+		"the attributes of the files it reads there, by device and node,\n" \
+		"dropping the least recently used ones to stay under the limit.\n" \
+		"Each cached file is watched, and forgotten as soon as one of its\n" \
+		"attributes or its stat data changes; the writes in this module\n" \
+		"forget it right away.  A negative limit raises ValueError."
+	},
+	{
+		"clear_attr_cache",
+		bfs_clear_attr_cache,
+		METH_NOARGS,
+		"clear_attr_cache()\n" \
+		"\n" \
+		"Forget everything in the attribute cache, and stop watching the\n" \
+		"files in it.  The cache stays on."
+	},
+	{
+		"attr_cache_stats",
+		bfs_attr_cache_stats,
+		METH_NOARGS,
+		"attr_cache_stats()\n" \
+		"\n" \
+		"Returns a dictionary with the attribute cache's hits, misses,\n" \
+		"evictions (files dropped to stay under the limit), invalidations\n" \
+		"(files dropped because they changed), overflows (times it was\n" \
+		"emptied because node monitor events were lost), entries, bytes and\n" \
+		"limit."
+	},
+	{
+		"read_attr",
+		(PyCFunction)bfs_read_attr,
+		METH_VARARGS | METH_KEYWORDS,
+		"read_attr( filename, attr_name, offset = 0, length = -1, flags = 0,\n" \
+		"           max_size = attr.MAX_SIZE )\n" \
+		"\n" \
+		"Reads length bytes of an attribute starting at offset, or up to the\n" \
+		"end if length is negative, and returns them as a string; nothing is\n" \
+		"converted or byte-swapped.  Only as much as is there gets read, so\n" \
+		"a piece past the end comes back short or empty.  If flags is\n" \
+		"attr.SYMLINK, symbolic links WILL NOT be traversed.  A piece bigger\n" \
+		"than max_size bytes raises an IOError; -1 allows any size."
+	},
+	{
+		"read_attr_buffer",
+		(PyCFunction)bfs_read_attr_buffer,
+		METH_VARARGS | METH_KEYWORDS,
+		"read_attr_buffer( filename, attr_name, flags = 0, max_size = attr.MAX_SIZE )\n" \
+		"\n" \
+		"Reads one attribute, whatever its type, and returns a ( type, data )\n" \
+		"tuple where data is a bytearray holding the attribute's bytes.  The\n" \
+		"attribute is read straight into the bytearray, so big raw attributes\n" \
+		"aren't copied on the way.  flags and max_size work like they do for\n" \
+		"read_attrs().\n" \
+		"Raises IOError if the file doesn't have the attribute."
+	},
+	{
+		"read_attrs_many",
+		(PyCFunction)bfs_read_attrs_many,
+		METH_VARARGS | METH_KEYWORDS,
+		"read_attrs_many( paths, names = None, threads = 4, flags = 0,\n" \
+		"                 prefix = None, where = None )\n" \
+		"\n" \
+		"Reads the attributes of many files at once, on a few native threads,\n" \
+		"in the order the files sit on the disk.  Returns a list with one\n" \
+		"item per path, in the same order: the dictionary read_attrs() would\n" \
+		"have returned, or the exception it would have raised for that file.\n" \
+		"names, prefix and flags work like they do for read_attrs().\n" \
+		"\n" \
+		"where is a Query or query string; files that don't match it are\n" \
+		"None, and are never converted to Python objects."
+	},
+	{
+		"list_attrs",
+		(PyCFunction)bfs_list_attrs,
+		METH_VARARGS | METH_KEYWORDS,
+		"list_attrs( filename, flags = 0, prefix = None )\n" \
+		"\n" \
+		"Returns a list of ( name, type, size ) tuples, one per attribute of\n" \
+		"filename (only those whose names start with prefix, if it's given).\n" \
+		"None of the data is read, so this is much cheaper than read_attrs()\n" \
+		"for finding out what's there.  If flags is attr.SYMLINK, symbolic\n" \
+		"links WILL NOT be traversed."
+	},
+	{
+		"list_attrs_many",
+		(PyCFunction)bfs_list_attrs_many,
+		METH_VARARGS | METH_KEYWORDS,
+		"list_attrs_many( paths, threads = 4, flags = 0, prefix = None )\n" \
+		"\n" \
+		"list_attrs() for many files at once, on a few native threads like\n" \
+		"read_attrs_many().  Returns a list with one item per path, in the\n" \
+		"same order: the list list_attrs() would have returned, or the\n" \
+		"exception it would have raised for that file."
+	},
+	{
+		"crawl",
+		(PyCFunction)bfs_crawl,
+		METH_VARARGS | METH_KEYWORDS,
+		"crawl( root, names = None, follow_symlinks = False, threads = 4,\n" \
+		"       flags = 0, prefix = None, where = None )\n" \
+		"\n" \
+		"Walks the directory tree under root on a few native threads and\n" \
+		"returns an iterator of ( path, attributes ) tuples, one for every\n" \
+		"file, directory and symlink below root; attributes is the dictionary\n" \
+		"read_attrs() would return.  The tuples come out in no particular\n" \
+		"order, as the threads find them.  names, prefix and flags work like\n" \
+		"they do for read_attrs(); with attr.SYMLINK you get the attributes of\n" \
+		"symlinks themselves, not of their targets.\n" \
+		"\n" \
+		"Symlinks to directories are only followed if follow_symlinks is\n" \
+		"true; each directory is still crawled only once.  Entries that can't\n" \
+		"be read are skipped, and counted in the iterator's errors attribute.\n" \
+		"\n" \
+		"where is a Query or query string; only entries that match it are\n" \
+		"handed out, and the threads do the matching."
+	},
+	{
+		"compile_query",
+		bfs_compile_query,
+		METH_VARARGS,
+		"compile_query( query_string )\n" \
+		"\n" \
+		"Compiles a BFS query, like name==\"*.jpg\"&&size>1000, into a Query\n" \
+		"whose match() and filter() methods, and the where argument of\n" \
+		"read_attrs_many() and crawl(), test attributes without running any\n" \
+		"Python per file.  The last few queries compiled are kept, so\n" \
+		"calling it again with the same string is cheap.  Raises ValueError\n" \
+		"if the query doesn't parse."
 	},
 	{
 		"write_attr",
@@ -1031,7 +5551,69 @@ static PyMethodDef fsattr_methods[] = {
 		"\n" \
 		"attr_type can be a four-character string, or a number; you'll get\n" \
 		"a TypeError exception if the data doesn't match the type in a\n" \
-		"reasonable manner."
+		"reasonable manner.  For B_RAW_TYPE and types this module doesn't\n" \
+		"know, attr_data can also be a bytearray, memoryview, mmap, array or\n" \
+		"anything else with the buffer protocol.  bytearrays and memoryviews\n" \
+		"are written without being copied; old-style buffers such as mmap\n" \
+		"and array are copied first."
+	},
+	{
+		"write_attrs",
+		bfs_write_attrs,
+		METH_VARARGS,
+		"write_attrs( filename, attrs, flags = 0 )\n" \
+		"\n" \
+		"Write several attributes to filename, opening it once.  attrs maps\n" \
+		"attribute names to ( attr_type, attr_data ) tuples, like the ones\n" \
+		"read_attrs() returns; flags are the same as for write_attr().\n" \
+		"\n" \
+		"All the data is converted before anything is written, so a\n" \
+		"TypeError or OverflowError leaves the file untouched.  If some of\n" \
+		"the attributes can't be written, the others still are, and an\n" \
+		"IOError is raised whose errors attribute maps each one that failed\n" \
+		"to an ( errno, message ) tuple."
+	},
+	{
+		"write_attr_at",
+		bfs_write_attr_at,
+		METH_VARARGS,
+		"write_attr_at( filename, attr_name, attr_type, attr_data, offset, flags = 0 )\n" \
+		"\n" \
+		"Write attr_data, a string or anything with the buffer protocol, into\n" \
+		"the attribute at offset, as raw bytes.  The rest of the attribute is\n" \
+		"left alone, it grows if needed, and it's created with attr_type if\n" \
+		"it isn't there yet.  If flags is attr.SYMLINK, symbolic links WILL\n" \
+		"NOT be traversed."
+	},
+#ifndef __linux__
+	{
+		"open_attr",
+		(PyCFunction)bfs_open_attr,
+		METH_VARARGS | METH_KEYWORDS,
+		"open_attr( filename, attr_name, mode = 'r', attr_type = B_RAW_TYPE,\n" \
+		"           flags = 0 )\n" \
+		"\n" \
+		"Opens an attribute like a file and returns an AttrStream, with\n" \
+		"read(), readinto(), write(), seek(), tell() and close().  mode is\n" \
+		"'r', 'w' or 'a', optionally with '+', like open(); 'w' empties the\n" \
+		"attribute and attr_type is used for a new one.  If flags is\n" \
+		"attr.SYMLINK, symbolic links WILL NOT be traversed."
+	},
+#endif
+	{
+		"register_codec",
+		(PyCFunction)bfs_register_codec,
+		METH_VARARGS | METH_KEYWORDS,
+		"register_codec( attr_type, decode = None, encode = None )\n" \
+		"\n" \
+		"Use your own conversion for attributes of attr_type (a number or a\n" \
+		"four-character string), everywhere attributes are converted.\n" \
+		"decode( data ) gets the raw data as a string and returns whatever\n" \
+		"read_attrs() should; encode( value ) gets what was passed to\n" \
+		"write_attr() and returns a string or buffer with the raw data.\n" \
+		"A side left as None converts the way it would have anyway, so\n" \
+		"register_codec( attr_type ) puts the type back the way it was.\n" \
+		"Byte swapping is up to the codec."
 	},
 	{
 		"remove_attr",
@@ -1061,22 +5643,84 @@ extern "C" DL_EXPORT(PyObject *) init_fsattr( void )
 									"BeFS file attribute functions:\n" \
 									"\n" \
 									"read_attrs - read the attributes for a file/directory/symlink\n" \
-									"write_attr - write an attribute to a file/directory/symlink" \
-									"remove_attr - remove an attribute for a file/directory/symlink\n",
+									"set_attr_cache_limit - turn the attribute cache for read_attrs on\n" \
+									"clear_attr_cache - empty the attribute cache\n" \
+									"attr_cache_stats - how the attribute cache is doing\n" \
+									"read_attr - read part of an attribute\n" \
+									"read_attr_buffer - read one attribute into a bytearray\n" \
+									"read_attrs_many - read the attributes of many files at once\n" \
+									"list_attrs - list the names, types and sizes of a file's attributes\n" \
+									"list_attrs_many - list the attributes of many files at once\n" \
+									"crawl - read the attributes of everything in a directory tree\n" \
+									"compile_query - compile a query for matching attributes\n" \
+									"write_attr - write an attribute to a file/directory/symlink\n" \
+									"write_attrs - write several attributes at once\n" \
+									"write_attr_at - write part of an attribute\n" \
+									"open_attr - open an attribute like a file\n" \
+									"remove_attr - remove an attribute for a file/directory/symlink\n" \
+									"register_codec - convert an attribute type your own way\n" \
+									"AttrFile - an open file for several attribute calls\n" \
+									"Query - a compiled query, see compile_query\n" \
+									"Watcher - tells you when attributes change\n" \
+									"AttrStream - an open attribute, see open_attr\n",
 									static_cast<PyObject *>( NULL ),
 									PYTHON_API_VERSION );
 
+	init_codecs();
+
+	// The C interface for the other modules.
+	static FsAttrAPI api;
+	api.version = FSATTR_API_VERSION;
+	api.read_raw_attrs_fd = read_raw_attrs_fd;
+	api.raw_attrs_to_dict = raw_attrs_to_dict;
+	api.parse_attr_names = parse_attr_names;
+	PyModule_AddObject( mod, "_C_API", 
+						PyCapsule_New( &api, FSATTR_API_CAPSULE, NULL ) );
+
+	if( PyType_Ready( &AttrFileType ) < 0 ) return mod;
+	Py_INCREF( &AttrFileType );
+	PyModule_AddObject( mod, "AttrFile", (PyObject *)&AttrFileType );
+
+	if( PyType_Ready( &WatcherType ) < 0 ) return mod;
+	Py_INCREF( &WatcherType );
+	PyModule_AddObject( mod, "Watcher", (PyObject *)&WatcherType );
+
+	if( PyType_Ready( &QueryType ) < 0 ) return mod;
+	Py_INCREF( &QueryType );
+	PyModule_AddObject( mod, "Query", (PyObject *)&QueryType );
+
+#ifndef __linux__
+	if( PyType_Ready( &AttrStreamType ) < 0 ) return mod;
+	Py_INCREF( &AttrStreamType );
+	PyModule_AddObject( mod, "AttrStream", (PyObject *)&AttrStreamType );
+#endif
+
+	if( PyType_Ready( &CrawlIterType ) < 0 ) return mod;
+
 	// Add some symbolic constants to the module
 	PyObject *mdict = PyModule_GetDict( mod );
 	PyObject *dict = PyDict_New();
 	PyObject *attr_dict = PyDict_New();
+	PyObject *monitor_dict = PyDict_New();
 
 	PyDict_SetItemString(mdict, "types", dict);
 	PyDict_SetItemString(mdict, "attr", attr_dict);
+	PyDict_SetItemString(mdict, "monitor", monitor_dict);
 
 	PyDict_SetItemString( attr_dict, "SYMLINK", PyInt_FromLong( ATTR_SYMLINK ) );
 	PyDict_SetItemString( attr_dict, "BIG_ENDIAN", PyInt_FromLong( ATTR_BIG_ENDIAN ) );
 	PyDict_SetItemString( attr_dict, "LITTLE_ENDIAN", PyInt_FromLong( ATTR_LITTLE_ENDIAN ) );
+	PyDict_SetItemString( attr_dict, "MAX_SIZE", PyInt_FromLong( RAW_ATTR_MAX_SIZE ) );
+
+	PyDict_SetItemString( monitor_dict, "WATCH_STAT", PyInt_FromLong( B_WATCH_STAT ) );
+	PyDict_SetItemString( monitor_dict, "WATCH_ATTR", PyInt_FromLong( B_WATCH_ATTR ) );
+	PyDict_SetItemString( monitor_dict, "WATCH_DIRECTORY", PyInt_FromLong( B_WATCH_DIRECTORY ) );
+	PyDict_SetItemString( monitor_dict, "ENTRY_CREATED", PyInt_FromLong( B_ENTRY_CREATED ) );
+	PyDict_SetItemString( monitor_dict, "ENTRY_REMOVED", PyInt_FromLong( B_ENTRY_REMOVED ) );
+	PyDict_SetItemString( monitor_dict, "ENTRY_MOVED", PyInt_FromLong( B_ENTRY_MOVED ) );
+	PyDict_SetItemString( monitor_dict, "STAT_CHANGED", PyInt_FromLong( B_STAT_CHANGED ) );
+	PyDict_SetItemString( monitor_dict, "ATTR_CHANGED", PyInt_FromLong( B_ATTR_CHANGED ) );
+	PyDict_SetItemString( monitor_dict, "EVENTS_LOST", PyInt_FromLong( MONITOR_EVENTS_LOST ) );
 
 	// Why look, a whole bunch of untested object constructors...
 	PyDict_SetItemString( dict, "B_AFFINE_TRANSFORM_TYPE", PyInt_FromLong( B_AFFINE_TRANSFORM_TYPE ) );
@@ -7,104 +7,3691 @@
 //
 
 #include "Python.h"
+#include "structmember.h"
 
+#ifdef __linux__
+// No BFS here; queries run on the userland indexes in fsindex.h, and live
+// queries on an inotify stand-in (see LiveQuery).
+#include "fsattr_xattr.h"
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <poll.h>
+#else
 #include <kernel/OS.h>			// for port_id in fs_query.h... tsk tsk.
 #include <kernel/fs_query.h>
+#include <kernel/fs_index.h>
 #include <kernel/fs_info.h>
+#include <app/AppDefs.h>		// for B_QUERY_UPDATE
+#include <app/Looper.h>
+#include <app/Message.h>
+#include <app/Messenger.h>
+#include <storage/Entry.h>
+#include <storage/Node.h>
+#include <storage/NodeMonitor.h>	// for B_ENTRY_CREATED and friends
+#include <storage/Path.h>
 #include <storage/StorageDefs.h>
+#endif
+#include <ctype.h>
 #include <errno.h>	// for errno
 #include <string.h>	// for strerror()
 #include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
 
+#include <deque>
+#include <list>
+#include <map>
+#include <new>
+#include <set>
+#include <string>
 #include <strstream>
+#include <vector>
+
+using namespace std;
+
+#include "fsattr_api.h"
+
+#ifndef __linux__
+
+// ----------------------------------------------------------------------
+// Open a query, setting a Python exception if that fails.
+
+static DIR *open_query( dev_t vol_dev, const char *query, uint32 flags )
+{
+	DIR *qdir;
+	int error;
+
+	Py_BEGIN_ALLOW_THREADS
+	qdir = fs_open_query( vol_dev, query, flags );
+	error = errno;
+	Py_END_ALLOW_THREADS
+
+	if( NULL == qdir ) {
+		try {
+			strstream s;
+			s << "error with query \"" << query << "\": "
+			  << strerror( error ) << ends;
+			PyErr_SetString( PyExc_RuntimeError, s.str() );
+		} catch ( ... ) {
+			PyErr_SetString( PyExc_RuntimeError, strerror( error ) );
+		}
+	}
+
+	return qdir;
+}
+
+// ----------------------------------------------------------------------
+// Directory path cache.  Entry refs only know their parent directory's
+// inode, so building a path means asking the kernel for the directory's
+// path; this keeps the most recently used ones around, so thousands of
+// hits in one folder cost a single lookup.  A renamed directory keeps its
+// old path here until it drops out of the cache or clear_path_cache() is
+// called.
+
+#define PATH_CACHE_DEFAULT_SIZE 1024
+
+typedef pair<dev_t, ino_t> DirKey;
+typedef pair<DirKey, string> DirPath;
+
+static pthread_mutex_t path_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static list<DirPath> path_cache_lru;		// most recently used first
+static map<DirKey, list<DirPath>::iterator> path_cache_index;
+static size_t path_cache_size = PATH_CACHE_DEFAULT_SIZE;
+static unsigned long path_cache_hits = 0;
+static unsigned long path_cache_misses = 0;
+
+// Trim the cache down to size; call with path_cache_lock held.
+static void path_cache_trim( void )
+{
+	while( path_cache_lru.size() > path_cache_size ) {
+		path_cache_index.erase( path_cache_lru.back().first );
+		path_cache_lru.pop_back();
+	}
+}
+
+// Build the path of an entry, going through the cache for its directory.
+// Doesn't touch Python, so it can run without the GIL.
+static bool path_for_ref( dev_t device, ino_t directory, const char *name, 
+						  string &path )
+{
+	DirKey key( device, directory );
+	bool found = false;
+
+	pthread_mutex_lock( &path_cache_lock );
+	map<DirKey, list<DirPath>::iterator>::iterator item = path_cache_index.find( key );
+	if( item != path_cache_index.end() ) {
+		path_cache_lru.splice( path_cache_lru.begin(), path_cache_lru, item->second );
+		path = item->second->second;
+		found = true;
+		path_cache_hits++;
+	} else {
+		path_cache_misses++;
+	}
+	pthread_mutex_unlock( &path_cache_lock );
+
+	if( !found ) {
+		entry_ref dir_ref( device, directory, "." );
+		BPath dir_path( &dir_ref );
+		if( dir_path.InitCheck() != B_OK ) return false;
+		path = dir_path.Path();
+
+		pthread_mutex_lock( &path_cache_lock );
+		if( path_cache_size > 0 && 
+			path_cache_index.find( key ) == path_cache_index.end() ) {
+			path_cache_lru.push_front( DirPath( key, path ) );
+			path_cache_index[key] = path_cache_lru.begin();
+			path_cache_trim();
+		}
+		pthread_mutex_unlock( &path_cache_lock );
+	}
+
+	if( path.empty() || path[path.size() - 1] != '/' ) path += '/';
+	path += name;
+	return true;
+}
+
+// ----------------------------------------------------------------------
+// Volume table.  The mounted volumes are read once with fs_stat_dev() and
+// kept here by their mount points, so query( ..., device = "/boot" ) in a
+// loop costs a map lookup instead of a trip to the kernel.  Only the mount
+// points themselves are looked up that way: they're absolute paths without
+// symlinks, and only a mount or unmount can make one lead somewhere else.
+// Any other path can stop meaning the same thing at any time (a chdir(), a
+// symlink pointed elsewhere), so it goes to the kernel every time.  A
+// looper watching for mounts and unmounts throws the table out when the
+// set of volumes changes; if the watch can't be set up, the table is read
+// again each time it's needed.
+
+struct VolumeInfo {
+	dev_t device;
+	uint32 flags;
+	string name;
+	string mount_point;
+	string fs_name;
+};
+
+static pthread_mutex_t volume_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<VolumeInfo> volume_table;
+static map<string, dev_t> volume_mounts;	// mount point -> device
+static bool volume_table_stale = true;
+static bool volume_watching = false;
+
+class VolumeWatcher : public BLooper {
+public:
+	VolumeWatcher() : BLooper( "haikuglue volume watcher", B_LOW_PRIORITY ) {}
+
+	virtual void MessageReceived( BMessage *message )
+	{
+		int32 opcode;
+		if( message->what == B_NODE_MONITOR && 
+			message->FindInt32( "opcode", &opcode ) == B_OK &&
+			( opcode == B_DEVICE_MOUNTED || opcode == B_DEVICE_UNMOUNTED ) ) {
+			pthread_mutex_lock( &volume_lock );
+			volume_table_stale = true;
+			pthread_mutex_unlock( &volume_lock );
+		} else {
+			BLooper::MessageReceived( message );
+		}
+	}
+};
+
+static pthread_once_t volume_watch_once = PTHREAD_ONCE_INIT;
+static VolumeWatcher *volume_watcher = NULL;
+
+// Start watching for mounts and unmounts; run through volume_watch_once.
+static void volume_watch( void )
+{
+	volume_watcher = new VolumeWatcher;
+	volume_watcher->Run();
+	bool watching = ( watch_node( NULL, B_WATCH_MOUNT, BMessenger( volume_watcher ) ) == B_OK );
+
+	pthread_mutex_lock( &volume_lock );
+	volume_watching = watching;
+	pthread_mutex_unlock( &volume_lock );
+}
+
+// Read the mounted volumes again; call with volume_lock held.
+static void volume_table_refresh( void )
+{
+	volume_table.clear();
+	volume_mounts.clear();
+
+	int32 cookie = 0;
+	dev_t device;
+	while( ( device = next_dev( &cookie ) ) >= 0 ) {
+		fs_info info;
+		if( fs_stat_dev( device, &info ) != 0 ) continue;
+
+		VolumeInfo volume;
+		volume.device = device;
+		volume.flags = info.flags;
+		volume.name = info.volume_name;
+		volume.fs_name = info.fsh_name;
+
+		entry_ref root_ref( device, info.root, "." );
+		BPath root_path( &root_ref );
+		if( root_path.InitCheck() == B_OK ) {
+			volume.mount_point = root_path.Path();
+			volume_mounts[volume.mount_point] = device;
+		}
+
+		volume_table.push_back( volume );
+	}
+
+	volume_table_stale = false;
+}
+
+// Make sure the table is there and current; call with volume_lock held.
+static void volume_table_check( void )
+{
+	if( volume_table_stale || !volume_watching ) {
+		// The watcher takes the lock itself, so start it without.
+		pthread_mutex_unlock( &volume_lock );
+		pthread_once( &volume_watch_once, volume_watch );
+		pthread_mutex_lock( &volume_lock );
+
+		volume_table_refresh();
+	}
+}
+
+// dev_for_path() through the table.  Doesn't touch Python.
+static dev_t volume_dev_for_path( const char *path )
+{
+	pthread_mutex_lock( &volume_lock );
+	volume_table_check();
+	map<string, dev_t>::iterator item = volume_mounts.find( path );
+	if( item != volume_mounts.end() ) {
+		dev_t device = item->second;
+		pthread_mutex_unlock( &volume_lock );
+		return device;
+	}
+	pthread_mutex_unlock( &volume_lock );
+
+	return dev_for_path( path );
+}
+
+// Copy the table out.  Doesn't touch Python.
+static vector<VolumeInfo> volume_list( void )
+{
+	pthread_mutex_lock( &volume_lock );
+	volume_table_check();
+	vector<VolumeInfo> volumes( volume_table );
+	pthread_mutex_unlock( &volume_lock );
+
+	return volumes;
+}
+
+// ----------------------------------------------------------------------
+// Volume objects; what volumes() hands out, and what the device argument
+// of the query functions takes besides a path.
+
+typedef struct {
+	PyObject_HEAD
+	int device;
+	unsigned int flags;
+	PyObject *name;
+	PyObject *mount_point;
+	PyObject *fs_name;
+} VolumeObject;
+
+static void volume_dealloc( VolumeObject *self )
+{
+	Py_XDECREF( self->name );
+	Py_XDECREF( self->mount_point );
+	Py_XDECREF( self->fs_name );
+	PyObject_Del( self );
+}
+
+static PyObject *volume_repr( VolumeObject *self )
+{
+	return PyString_FromFormat( "<Volume %d \"%s\" at %s>", self->device,
+								PyString_AsString( self->name ),
+								PyString_AsString( self->mount_point ) );
+}
+
+static PyObject *volume_get_queries( VolumeObject *self, void *closure )
+{
+	// closure isn't used
+	closure = closure;
+
+	return PyBool_FromLong( self->flags & B_FS_HAS_QUERY );
+}
+
+static PyMemberDef volume_members[] = {
+	{
+		(char *)"device",
+		T_INT,
+		offsetof( VolumeObject, device ),
+		READONLY,
+		(char *)"Device number of the volume."
+	},
+	{
+		(char *)"flags",
+		T_UINT,
+		offsetof( VolumeObject, flags ),
+		READONLY,
+		(char *)"The volume's B_FS_* flags."
+	},
+	{
+		(char *)"name",
+		T_OBJECT,
+		offsetof( VolumeObject, name ),
+		READONLY,
+		(char *)"Name of the volume."
+	},
+	{
+		(char *)"mount_point",
+		T_OBJECT,
+		offsetof( VolumeObject, mount_point ),
+		READONLY,
+		(char *)"Path the volume is mounted at."
+	},
+	{
+		(char *)"fs_name",
+		T_OBJECT,
+		offsetof( VolumeObject, fs_name ),
+		READONLY,
+		(char *)"Name of the file system, like \"bfs\"."
+	},
+	{ NULL, 0, 0, 0, NULL }	// sentinel
+};
+
+static PyGetSetDef volume_getset[] = {
+	{
+		(char *)"queries",
+		(getter)volume_get_queries,
+		NULL,
+		(char *)"True if the volume can be queried.",
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, NULL }	// sentinel
+};
+
+static PyTypeObject VolumeType = {
+	PyObject_HEAD_INIT( NULL )
+	0,									// ob_size
+	"_fsquery.Volume",					// tp_name
+	sizeof( VolumeObject ),				// tp_basicsize
+	0,									// tp_itemsize
+	(destructor)volume_dealloc,			// tp_dealloc
+	0,									// tp_print
+	0,									// tp_getattr
+	0,									// tp_setattr
+	0,									// tp_compare
+	(reprfunc)volume_repr,				// tp_repr
+	0,									// tp_as_number
+	0,									// tp_as_sequence
+	0,									// tp_as_mapping
+	0,									// tp_hash
+	0,									// tp_call
+	0,									// tp_str
+	0,									// tp_getattro
+	0,									// tp_setattro
+	0,									// tp_as_buffer
+	Py_TPFLAGS_DEFAULT,					// tp_flags
+	"A mounted volume, see volumes().",	// tp_doc
+	0,									// tp_traverse
+	0,									// tp_clear
+	0,									// tp_richcompare
+	0,									// tp_weaklistoffset
+	0,									// tp_iter
+	0,									// tp_iternext
+	0,									// tp_methods
+	volume_members,						// tp_members
+	volume_getset,						// tp_getset
+};
+
+static PyObject *volume_new( const VolumeInfo &info )
+{
+	VolumeObject *volume = PyObject_New( VolumeObject, &VolumeType );
+	if( NULL == volume ) return NULL;
+
+	volume->device = info.device;
+	volume->flags = info.flags;
+	volume->name = PyString_FromString( info.name.c_str() );
+	volume->mount_point = PyString_FromString( info.mount_point.c_str() );
+	volume->fs_name = PyString_FromString( info.fs_name.c_str() );
+	if( NULL == volume->name || NULL == volume->mount_point || 
+		NULL == volume->fs_name ) {
+		Py_DECREF( volume );
+		return NULL;
+	}
+
+	return (PyObject *)volume;
+}
+
+// "O&" converter for device arguments: None for the boot volume, a path on
+// the volume, or a Volume.
+static int volume_converter( PyObject *obj, void *result )
+{
+	dev_t *vol_dev = static_cast<dev_t *>( result );
+
+	if( PyObject_TypeCheck( obj, &VolumeType ) ) {
+		*vol_dev = ( (VolumeObject *)obj )->device;
+	} else if( Py_None == obj || PyString_Check( obj ) ) {
+		const char *path = ( Py_None == obj ) ? "/boot" : PyString_AS_STRING( obj );
+		Py_BEGIN_ALLOW_THREADS
+		*vol_dev = volume_dev_for_path( path );
+		Py_END_ALLOW_THREADS
+	} else {
+		PyErr_SetString( PyExc_TypeError, "device must be a path or a Volume" );
+		return 0;
+	}
+
+	return 1;
+}
+
+// ----------------------------------------------------------------------
+// Entry refs; a lightweight ( device, directory, name ) for each query hit,
+// with the path only worked out if somebody asks for it.
+
+typedef struct {
+	PyObject_HEAD
+	int device;
+	PY_LONG_LONG directory;
+	PyObject *name;
+} EntryRefObject;
+
+static void entry_ref_dealloc( EntryRefObject *self )
+{
+	Py_XDECREF( self->name );
+	PyObject_Del( self );
+}
+
+static PyObject *entry_ref_repr( EntryRefObject *self )
+{
+	PyObject *name_repr = PyObject_Repr( self->name );
+	if( NULL == name_repr ) return NULL;
+
+	PyObject *repr = PyString_FromFormat( "EntryRef(%d, %lld, %s)", 
+										  self->device, self->directory,
+										  PyString_AsString( name_repr ) );
+	Py_DECREF( name_repr );
+	return repr;
+}
+
+static PyObject *entry_ref_get_path( EntryRefObject *self, void *closure )
+{
+	// closure isn't used
+	closure = closure;
+
+	string path;
+	bool found;
+	const char *name = PyString_AS_STRING( self->name );
+
+	Py_BEGIN_ALLOW_THREADS
+	found = path_for_ref( self->device, self->directory, name, path );
+	Py_END_ALLOW_THREADS
+
+	if( !found ) {
+		try {
+			strstream s;
+			s << "can't find the path of \"" << name << "\"" << ends;
+			PyErr_SetString( PyExc_IOError, s.str() );
+		} catch ( ... ) {
+			PyErr_SetString( PyExc_IOError, "can't find the path" );
+		}
+
+		return NULL;
+	}
+
+	return PyString_FromString( path.c_str() );
+}
+
+static PyMemberDef entry_ref_members[] = {
+	{
+		(char *)"device",
+		T_INT,
+		offsetof( EntryRefObject, device ),
+		READONLY,
+		(char *)"Device the entry is on."
+	},
+	{
+		(char *)"directory",
+		T_LONGLONG,
+		offsetof( EntryRefObject, directory ),
+		READONLY,
+		(char *)"Inode of the directory holding the entry."
+	},
+	{
+		(char *)"name",
+		T_OBJECT,
+		offsetof( EntryRefObject, name ),
+		READONLY,
+		(char *)"Name of the entry in its directory."
+	},
+	{ NULL, 0, 0, 0, NULL }	// sentinel
+};
+
+static PyGetSetDef entry_ref_getset[] = {
+	{
+		(char *)"path",
+		(getter)entry_ref_get_path,
+		NULL,
+		(char *)"Full path of the entry, built when asked for.",
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, NULL }	// sentinel
+};
+
+static PyTypeObject EntryRefType = {
+	PyObject_HEAD_INIT( NULL )
+	0,									// ob_size
+	"_fsquery.EntryRef",				// tp_name
+	sizeof( EntryRefObject ),			// tp_basicsize
+	0,									// tp_itemsize
+	(destructor)entry_ref_dealloc,		// tp_dealloc
+	0,									// tp_print
+	0,									// tp_getattr
+	0,									// tp_setattr
+	0,									// tp_compare
+	(reprfunc)entry_ref_repr,			// tp_repr
+	0,									// tp_as_number
+	0,									// tp_as_sequence
+	0,									// tp_as_mapping
+	0,									// tp_hash
+	0,									// tp_call
+	0,									// tp_str
+	0,									// tp_getattro
+	0,									// tp_setattro
+	0,									// tp_as_buffer
+	Py_TPFLAGS_DEFAULT,					// tp_flags
+	"A query hit as ( device, directory, name ); the path attribute\n" \
+	"is only worked out when you ask for it.",	// tp_doc
+	0,									// tp_traverse
+	0,									// tp_clear
+	0,									// tp_richcompare
+	0,									// tp_weaklistoffset
+	0,									// tp_iter
+	0,									// tp_iternext
+	0,									// tp_methods
+	entry_ref_members,					// tp_members
+	entry_ref_getset,					// tp_getset
+};
+
+#endif // !__linux__
+
+// ----------------------------------------------------------------------
+// Attribute prefetch.  query( ..., attrs = [...] ) reads the named
+// attributes of each hit in the same loop that reads the query, using
+// _fsattr's own reading and conversion code (see fsattr_api.h).
+
+static FsAttrAPI *fsattr_api = NULL;
+
+// Find _fsattr's C interface, importing the module the first time.
+static FsAttrAPI *get_fsattr_api( void )
+{
+	if( NULL == fsattr_api ) {
+		fsattr_api = (FsAttrAPI *)PyCapsule_Import( FSATTR_API_CAPSULE, 0 );
+		if( NULL != fsattr_api && fsattr_api->version != FSATTR_API_VERSION ) {
+			PyErr_SetString( PyExc_ImportError, "_fsattr is the wrong version" );
+			fsattr_api = NULL;
+		}
+	}
+
+	return fsattr_api;
+}
+
+#ifndef __linux__
+
+// ----------------------------------------------------------------------
+// What the caller wants back for each hit of a query.
+
+struct QueryWants {
+	bool refs;						// EntryRefs instead of paths
+	const vector<string> *attrs;	// attributes to read as well, or NULL
+
+	QueryWants() : refs( false ), attrs( NULL ) {}
+};
+
+// What a query turned up for one entry.  Depending on what the caller
+// wants, either the path or the ref parts are filled in, plus the
+// prefetched attributes if any were asked for.
+struct QueryHit {
+	dev_t device;
+	ino_t directory;
+	string name;
+	string path;
+	RawAttrs *attrs;
+};
+
+static void free_query_hits( vector<QueryHit> &hits )
+{
+	for( size_t i = 0; i < hits.size(); i++ ) delete hits[i].attrs;
+	hits.clear();
+}
+
+// Read the wanted attributes of a hit.  Query hits are entries, and it was
+// the entry's own attributes that matched, so symlinks aren't traversed.
+static RawAttrs *read_hit_attrs( const QueryHit &hit, const QueryWants &wants )
+{
+	int fd;
+	if( wants.refs ) {
+		entry_ref ref( hit.device, hit.directory, hit.name.c_str() );
+		BNode node( &ref );
+		fd = ( node.InitCheck() == B_OK ) ? node.Dup() : -1;
+	} else {
+		fd = open( hit.path.c_str(), O_RDONLY | O_NOTRAVERSE );
+	}
+	if( fd < 0 ) return NULL;
+
+	RawAttrs *raw = new RawAttrs;
+	fsattr_api->read_raw_attrs_fd( fd, 0, wants.attrs, NULL, *raw );
+	close( fd );
+
+	if( raw->status != RawAttrs::OK ) {
+		delete raw;
+		return NULL;
+	}
+
+	return raw;
+}
+
+// Read the next entry of a query in the form the caller wants.  Entries
+// without a path, and files that vanished since the query found them, are
+// passed over.  Doesn't touch Python.  Returns false if the query has run
+// dry.
+static bool next_query_hit( DIR *qdir, QueryHit &hit, const QueryWants &wants )
+{
+	for( ;; ) {
+		struct dirent *qent = fs_read_query( qdir );
+		if( NULL == qent ) return false;
+
+		hit.attrs = NULL;
+		if( wants.refs ) {
+			hit.device = qent->d_pdev;
+			hit.directory = qent->d_pino;
+			hit.name = qent->d_name;
+		} else {
+			char buff[B_PATH_NAME_LENGTH];
+			status_t retval = get_path_for_dirent( qent, buff, B_PATH_NAME_LENGTH );
+			if( retval != B_OK ) continue;	// throw an exception instead?
+
+			hit.path = buff;
+		}
+
+		if( NULL != wants.attrs ) {
+			hit.attrs = read_hit_attrs( hit, wants );
+			if( NULL == hit.attrs ) continue;
+		}
+
+		return true;
+	}
+}
+
+// Read up to max_count (or all, if it's negative) of the remaining hits of
+// a query.  Doesn't touch Python, so call it without the GIL.  Returns
+// false if the query has run dry.
+static bool read_query_hits( DIR *qdir, vector<QueryHit> &hits, int max_count,
+							 const QueryWants &wants )
+{
+	for( int count = 0; max_count < 0 || count < max_count; count++ ) {
+		QueryHit hit;
+		if( !next_query_hit( qdir, hit, wants ) ) return false;
+		hits.push_back( hit );
+	}
+
+	return true;
+}
+
+// Skip over count hits of a query, for paging through the results.  They
+// are counted the way read_query_hits() counts them, so that pages line up
+// even when entries go missing.  Doesn't touch Python.  Returns false if
+// the query has run dry.
+static bool skip_query_hits( DIR *qdir, int count, const QueryWants &wants )
+{
+	for( int i = 0; i < count; i++ ) {
+		QueryHit hit;
+		if( !next_query_hit( qdir, hit, wants ) ) return false;
+		delete hit.attrs;
+	}
+
+	return true;
+}
+
+// Turn one hit into a path or an EntryRef.
+static PyObject *hit_entry( const QueryHit &hit, bool refs )
+{
+	if( !refs ) return PyString_FromString( hit.path.c_str() );
+
+	EntryRefObject *ref = PyObject_New( EntryRefObject, &EntryRefType );
+	if( NULL == ref ) return NULL;
+
+	ref->device = hit.device;
+	ref->directory = hit.directory;
+	ref->name = PyString_FromString( hit.name.c_str() );
+	if( NULL == ref->name ) {
+		Py_DECREF( ref );
+		return NULL;
+	}
+
+	return (PyObject *)ref;
+}
+
+// Turn the hits into a Python list of paths or EntryRefs, or of
+// ( path or EntryRef, attributes ) tuples if attributes were prefetched.
+static PyObject *hit_list( const vector<QueryHit> &hits, const QueryWants &wants )
+{
+	PyObject *query_list = PyList_New( hits.size() );
+	if( NULL == query_list ) return PyErr_NoMemory();
+
+	for( size_t i = 0; i < hits.size(); i++ ) {
+		PyObject *entry = hit_entry( hits[i], wants.refs );
+		if( NULL != entry && NULL != wants.attrs ) {
+			PyObject *attributes = fsattr_api->raw_attrs_to_dict( *hits[i].attrs );
+			PyObject *pair = NULL;
+			if( NULL != attributes ) pair = PyTuple_Pack( 2, entry, attributes );
+			Py_XDECREF( attributes );
+			Py_DECREF( entry );
+			entry = pair;
+		}
+
+		if( NULL == entry ) {
+			Py_DECREF( query_list );
+			return NULL;
+		}
+		PyList_SET_ITEM( query_list, i, entry );
+	}
+
+	return query_list;
+}
+
+// ----------------------------------------------------------------------
+// Read all the remaining entries of a query into a list of paths, with
+// the GIL released while the disk is busy.
+
+static PyObject *read_query_paths( DIR *qdir )
+{
+	vector<QueryHit> hits;
+	QueryWants wants;
+
+	Py_BEGIN_ALLOW_THREADS
+	(void)read_query_hits( qdir, hits, -1, wants );
+	Py_END_ALLOW_THREADS
+
+	return hit_list( hits, wants );
+}
+
+// ----------------------------------------------------------------------
+// Query result cache.  query( ..., cached = True ) keeps the hits of each
+// ( volume, query ) it runs and answers the next identical query from
+// memory.  Each cached query is opened as a live query with its own port;
+// the entry-created and entry-removed notifications pile up there and are
+// applied before the hits are handed out again.  If a port ever fills up,
+// notifications may have been dropped, so that query is run from scratch.
+// Hits are kept as refs so both paths and EntryRefs can come out of it.
+
+#define QUERY_CACHE_DEFAULT_ENTRIES	32
+#define QUERY_CACHE_DEFAULT_BYTES	( 4 * 1024 * 1024 )
+#define QUERY_CACHE_DEFAULT_PORT_CAPACITY	256
+
+// Rough bookkeeping cost of one cached hit, on top of its name.
+#define QUERY_CACHE_HIT_OVERHEAD	( sizeof( RefKey ) + 32 )
+
+typedef pair<DirKey, string> RefKey;
+typedef pair<dev_t, string> QueryKey;
+
+struct CachedQuery {
+	QueryKey key;
+	port_id port;		// where the live query's notifications go
+	int32 capacity;		// how many the port holds
+	DIR *qdir;			// the live query itself
+	set<RefKey> hits;
+	size_t bytes;		// what the hits cost, roughly
+};
+
+static pthread_mutex_t query_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static list<CachedQuery *> query_cache_lru;		// most recently used first
+static map<QueryKey, list<CachedQuery *>::iterator> query_cache_index;
+static size_t query_cache_max_entries = QUERY_CACHE_DEFAULT_ENTRIES;
+static size_t query_cache_max_bytes = QUERY_CACHE_DEFAULT_BYTES;
+static int32 query_cache_port_capacity = QUERY_CACHE_DEFAULT_PORT_CAPACITY;
+static size_t query_cache_bytes = 0;
+static unsigned long query_cache_hits = 0;
+static unsigned long query_cache_misses = 0;
+static unsigned long query_cache_updates = 0;
+static unsigned long query_cache_overflows = 0;
+
+static size_t query_cache_hit_bytes( const RefKey &ref )
+{
+	return QUERY_CACHE_HIT_OVERHEAD + ref.second.size();
+}
+
+// Queries that only differ in whitespace outside of quotes are the same
+// query as far as the cache is concerned.
+static string normalize_query( const char *query )
+{
+	string result;
+	bool quoted = false;
+	bool space = false;
+
+	for( const char *p = query; *p; p++ ) {
+		if( !quoted && isspace( (unsigned char)*p ) ) {
+			space = true;
+			continue;
+		}
+		if( space && !result.empty() ) result += ' ';
+		space = false;
+
+		if( *p == '"' ) quoted = !quoted;
+		else if( *p == '\\' && quoted && p[1] ) result += *p++;
+		result += *p;
+	}
+
+	return result;
+}
+
+// Let go of a cached query's live query and port.  Doesn't need the lock,
+// the entry has to be out of the cache already.
+static void query_cache_free( CachedQuery *entry )
+{
+	if( NULL != entry->qdir ) (void)fs_close_query( entry->qdir );
+	if( entry->port >= 0 ) (void)delete_port( entry->port );
+	delete entry;
+}
+
+// Take an entry out of the cache; call with query_cache_lock held, and
+// free it with query_cache_free() after letting go of the lock.
+static void query_cache_remove( list<CachedQuery *>::iterator item )
+{
+	CachedQuery *entry = *item;
+	query_cache_bytes -= entry->bytes;
+	query_cache_index.erase( entry->key );
+	query_cache_lru.erase( item );
+}
+
+// Trim the cache down to its limits; call with query_cache_lock held.
+static void query_cache_trim( vector<CachedQuery *> &evicted )
+{
+	while( !query_cache_lru.empty() && 
+		   ( query_cache_lru.size() > query_cache_max_entries || 
+			 query_cache_bytes > query_cache_max_bytes ) ) {
+		list<CachedQuery *>::iterator last = query_cache_lru.end();
+		--last;
+		evicted.push_back( *last );
+		query_cache_remove( last );
+	}
+}
+
+// Apply the notifications that came in since the last look; call with
+// query_cache_lock held.  Returns false if the port was full, in which case
+// some of them may have been lost.
+static bool query_cache_drain( CachedQuery *entry )
+{
+	if( port_count( entry->port ) >= entry->capacity ) return false;
+
+	vector<char> buffer;
+	for( ;; ) {
+		ssize_t size = port_buffer_size_etc( entry->port, B_RELATIVE_TIMEOUT, 0 );
+		if( size < 0 ) break;	// B_WOULD_BLOCK once it's empty
+
+		buffer.resize( size > 0 ? size : 1 );
+		int32 code;
+		if( read_port_etc( entry->port, &code, &buffer[0], size, 
+						   B_RELATIVE_TIMEOUT, 0 ) < 0 ) break;
+
+		BMessage message;
+		int32 opcode;
+		int32 device;
+		int64 directory;
+		const char *name = NULL;
+
+		if( message.Unflatten( &buffer[0] ) != B_OK || 
+			message.what != B_QUERY_UPDATE ||
+			message.FindInt32( "opcode", &opcode ) != B_OK ||
+			message.FindInt32( "device", &device ) != B_OK ||
+			message.FindInt64( "directory", &directory ) != B_OK ||
+			message.FindString( "name", &name ) != B_OK ) continue;
+
+		RefKey ref( DirKey( device, directory ), name );
+		size_t before = entry->bytes;
+		if( opcode == B_ENTRY_CREATED ) {
+			if( entry->hits.insert( ref ).second ) {
+				entry->bytes += query_cache_hit_bytes( ref );
+			}
+		} else if( opcode == B_ENTRY_REMOVED ) {
+			if( entry->hits.erase( ref ) > 0 ) {
+				entry->bytes -= query_cache_hit_bytes( ref );
+			}
+		}
+		query_cache_bytes += entry->bytes;
+		query_cache_bytes -= before;
+		query_cache_updates++;
+	}
+
+	return true;
+}
+
+// Look for the query in the cache, bringing it up to date; call with
+// query_cache_lock held.  Stale entries go into evicted.
+static bool query_cache_lookup( const QueryKey &key, vector<QueryHit> &hits,
+								vector<CachedQuery *> &evicted )
+{
+	map<QueryKey, list<CachedQuery *>::iterator>::iterator item = 
+		query_cache_index.find( key );
+	if( item == query_cache_index.end() ) return false;
+
+	list<CachedQuery *>::iterator lru_item = item->second;
+	CachedQuery *entry = *lru_item;
+	if( !query_cache_drain( entry ) ) {
+		query_cache_overflows++;
+		evicted.push_back( entry );
+		query_cache_remove( lru_item );
+		return false;
+	}
+	query_cache_lru.splice( query_cache_lru.begin(), query_cache_lru, lru_item );
+
+	hits.reserve( entry->hits.size() );
+	for( set<RefKey>::const_iterator ref = entry->hits.begin(); 
+		 ref != entry->hits.end(); ++ref ) {
+		QueryHit hit;
+		hit.device = ref->first.first;
+		hit.directory = ref->first.second;
+		hit.name = ref->second;
+		hit.attrs = NULL;
+		hits.push_back( hit );
+	}
+
+	// The notifications may have grown it past the limit; the hits are
+	// copied already, so even this entry can go.
+	query_cache_trim( evicted );
+
+	return true;
+}
+
+// Run a query as a live query, returning the new cache entry with its hits
+// also copied to hits.  Doesn't touch Python; on failure it returns NULL
+// with the error number in error.
+static CachedQuery *query_cache_run( const QueryKey &key, const char *query,
+									 int32 capacity, vector<QueryHit> &hits, 
+									 int &error )
+{
+	CachedQuery *entry = new CachedQuery;
+	entry->key = key;
+	entry->qdir = NULL;
+	entry->bytes = 0;
+	entry->capacity = capacity;
+	entry->port = create_port( capacity, "haikuglue query cache" );
+	if( entry->port < 0 ) {
+		error = entry->port;
+		query_cache_free( entry );
+		return NULL;
+	}
+
+	entry->qdir = fs_open_live_query( key.first, query, B_LIVE_QUERY, entry->port, 0 );
+	if( NULL == entry->qdir ) {
+		error = errno;
+		query_cache_free( entry );
+		return NULL;
+	}
+
+	// Changes made while this runs end up in the port as well and are
+	// applied on top the next time around; the set takes care of doubles.
+	QueryWants wants;
+	wants.refs = true;
+	(void)read_query_hits( entry->qdir, hits, -1, wants );
+
+	for( size_t i = 0; i < hits.size(); i++ ) {
+		RefKey ref( DirKey( hits[i].device, hits[i].directory ), hits[i].name );
+		if( entry->hits.insert( ref ).second ) {
+			entry->bytes += query_cache_hit_bytes( ref );
+		}
+	}
+
+	return entry;
+}
+
+// Get the hits of a query through the cache, in the form the caller wants,
+// skipping offset of them and stopping after limit (if it isn't negative).
+// Doesn't touch Python; on failure it returns false with the error number
+// in error.
+static bool cached_query_hits( dev_t vol_dev, const char *query,
+							   vector<QueryHit> &hits, const QueryWants &wants,
+							   int offset, int limit, int &error )
+{
+	QueryKey key( vol_dev, normalize_query( query ) );
+	vector<CachedQuery *> evicted;
+	vector<QueryHit> refs;
+	CachedQuery *entry = NULL;
+
+	pthread_mutex_lock( &query_cache_lock );
+	bool found = query_cache_lookup( key, refs, evicted );
+	if( found ) query_cache_hits++;
+	else query_cache_misses++;
+	int32 capacity = query_cache_port_capacity;
+	pthread_mutex_unlock( &query_cache_lock );
+
+	if( !found ) {
+		entry = query_cache_run( key, query, capacity, refs, error );
+		if( NULL == entry ) {
+			for( size_t i = 0; i < evicted.size(); i++ ) query_cache_free( evicted[i] );
+			return false;
+		}
+
+		pthread_mutex_lock( &query_cache_lock );
+		if( entry->bytes <= query_cache_max_bytes && query_cache_max_entries > 0 &&
+			query_cache_index.find( key ) == query_cache_index.end() ) {
+			query_cache_lru.push_front( entry );
+			query_cache_index[key] = query_cache_lru.begin();
+			query_cache_bytes += entry->bytes;
+			query_cache_trim( evicted );
+			entry = NULL;
+		}
+		pthread_mutex_unlock( &query_cache_lock );
+	}
+
+	// Whatever didn't make it into the cache goes away now.
+	if( NULL != entry ) query_cache_free( entry );
+	for( size_t i = 0; i < evicted.size(); i++ ) query_cache_free( evicted[i] );
+
+	// The cached hits are kept sorted, so pages of them are stable as long
+	// as nothing changes.  offset counts the hits that make it, like limit.
+	int skip = offset;
+	for( size_t i = 0; i < refs.size(); i++ ) {
+		if( limit >= 0 && hits.size() >= (size_t)limit ) break;
+
+		QueryHit &hit = refs[i];
+		if( !wants.refs && 
+			!path_for_ref( hit.device, hit.directory, hit.name.c_str(), hit.path ) ) {
+			continue;
+		}
+		if( NULL != wants.attrs ) {
+			hit.attrs = read_hit_attrs( hit, wants );
+			if( NULL == hit.attrs ) continue;
+		}
+		if( skip > 0 ) {
+			skip--;
+			delete hit.attrs;
+			hit.attrs = NULL;
+			continue;
+		}
+		hits.push_back( hit );
+	}
+
+	return true;
+}
+
+// ----------------------------------------------------------------------
+// Perform a query
+//
+// args:
+// 	query
+//  volume = /boot (optional)
+//  flags = 0 (optional)
+//  refs = False (optional)
+//  attrs = None (optional)
+//  cached = False (optional)
+//  limit = -1 (optional)
+//  offset = 0 (optional)
+
+static PyObject *bfs_query( PyObject *self, PyObject *args, PyObject *kwds )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	static char *kwlist[] = { (char *)"query_string", (char *)"device", 
+							  (char *)"flags", (char *)"refs", 
+							  (char *)"attrs", (char *)"cached", 
+							  (char *)"limit", (char *)"offset", NULL };
+	char *query;
+	PyObject *volume = Py_None;
+	uint32 flags = 0;
+	int refs = 0;
+	PyObject *attrs_obj = Py_None;
+	int cached = 0;
+	int limit = -1;
+	int offset = 0;
+	dev_t vol_dev;
+
+	if( PyArg_ParseTupleAndKeywords( args, kwds, "s|OIiOiii", kwlist, &query, 
+									 &volume, &flags, &refs, &attrs_obj,
+									 &cached, &limit, &offset ) ) {
+		// eight arguments, seven are optional
+		if( !volume_converter( volume, &vol_dev ) ) return NULL;
+		if( 0 != flags ) {
+			PyErr_SetString( PyExc_ValueError, "don't use flags" );
+			return NULL;
+		}
+		if( offset < 0 ) {
+			PyErr_SetString( PyExc_ValueError, "offset can't be negative" );
+			return NULL;
+		}
+	} else {
+		PyErr_SetString( PyExc_TypeError, "you must specify a query string" );
+		return NULL;
+	}
+
+	QueryWants wants;
+	vector<string> attr_names;
+	wants.refs = ( refs != 0 );
+	if( Py_None != attrs_obj ) {
+		if( NULL == get_fsattr_api() ) return NULL;
+		if( !fsattr_api->parse_attr_names( attrs_obj, attr_names ) ) return NULL;
+		wants.attrs = &attr_names;
+	}
+
+	vector<QueryHit> hits;
+
+	if( cached ) {
+		bool ok;
+		int error = 0;
+
+		Py_BEGIN_ALLOW_THREADS
+		ok = cached_query_hits( vol_dev, query, hits, wants, offset, limit, error );
+		Py_END_ALLOW_THREADS
+
+		if( !ok ) {
+			try {
+				strstream s;
+				s << "error with query \"" << query << "\": "
+				  << strerror( error ) << ends;
+				PyErr_SetString( PyExc_RuntimeError, s.str() );
+			} catch ( ... ) {
+				PyErr_SetString( PyExc_RuntimeError, strerror( error ) );
+			}
+			return NULL;
+		}
+	} else {
+		DIR *qdir = open_query( vol_dev, query, flags );
+		if( NULL == qdir ) return NULL;
+
+		// Stop reading once there are enough hits; the rest of the query
+		// is never looked at.
+		Py_BEGIN_ALLOW_THREADS
+		if( skip_query_hits( qdir, offset, wants ) ) {
+			(void)read_query_hits( qdir, hits, limit, wants );
+		}
+		(void)fs_close_query( qdir );
+		Py_END_ALLOW_THREADS
+	}
+
+	PyObject *query_list = hit_list( hits, wants );
+	free_query_hits( hits );
+	return query_list;
+}
+
+// ----------------------------------------------------------------------
+// Query iterator; owns the query's DIR and reads it a chunk of entries at
+// a time, so the first path shows up right away and only one chunk of
+// paths is held in memory.
+
+#define QUERY_CHUNK_SIZE 64
+
+typedef struct {
+	PyObject_HEAD
+	DIR *qdir;				// NULL once the query is used up or closed
+	PyObject *chunk;		// list of paths read but not handed out yet
+	Py_ssize_t chunk_pos;	// index of the next path in chunk
+	int chunk_size;			// how many entries to read per refill
+	QueryWants wants;		// paths or EntryRefs, prefetched attributes
+	vector<string> *attr_names;	// what wants.attrs points at
+} QueryIterObject;
+
+static void query_iter_close( QueryIterObject *self )
+{
+	if( NULL != self->qdir ) {
+		(void)fs_close_query( self->qdir );
+		self->qdir = NULL;
+	}
+}
+
+static void query_iter_dealloc( QueryIterObject *self )
+{
+	query_iter_close( self );
+	Py_XDECREF( self->chunk );
+	delete self->attr_names;
+	PyObject_Del( self );
+}
+
+// Read up to chunk_size more paths into a fresh chunk.  The query is
+// closed when it runs dry or something goes wrong; returns -1 with an
+// exception set on errors.
+static int query_iter_fill( QueryIterObject *self )
+{
+	Py_CLEAR( self->chunk );
+	self->chunk_pos = 0;
+	if( NULL == self->qdir ) return 0;
+
+	vector<QueryHit> hits;
+	bool more;
+
+	Py_BEGIN_ALLOW_THREADS
+	more = read_query_hits( self->qdir, hits, self->chunk_size, self->wants );
+	Py_END_ALLOW_THREADS
+
+	if( !more ) query_iter_close( self );
+
+	self->chunk = hit_list( hits, self->wants );
+	free_query_hits( hits );
+	if( NULL == self->chunk ) {
+		query_iter_close( self );
+		return -1;
+	}
+
+	return 0;
+}
+
+static PyObject *query_iter_next( QueryIterObject *self )
+{
+	if( NULL == self->chunk || 
+		self->chunk_pos >= PyList_GET_SIZE( self->chunk ) ) {
+		if( query_iter_fill( self ) ) return NULL;
+	}
+
+	if( self->chunk_pos >= PyList_GET_SIZE( self->chunk ) ) {
+		// Nothing left; returning NULL with no exception set stops
+		// the iteration.
+		Py_CLEAR( self->chunk );
+		return NULL;
+	}
+
+	PyObject *path = PyList_GET_ITEM( self->chunk, self->chunk_pos++ );
+	Py_INCREF( path );
+	return path;
+}
+
+// Hand out the next count results as a list, reading just enough of the
+// query for them; a short list means the query is used up.
+static PyObject *query_iter_fetch( QueryIterObject *self, PyObject *args )
+{
+	int count;
+
+	if( !PyArg_ParseTuple( args, "i", &count ) || count < 0 ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a number of results" );
+		return NULL;
+	}
+
+	// Whatever is left of the current chunk goes first.
+	PyObject *page;
+	if( NULL != self->chunk ) {
+		Py_ssize_t end = self->chunk_pos + count;
+		if( end > PyList_GET_SIZE( self->chunk ) ) end = PyList_GET_SIZE( self->chunk );
+		page = PyList_GetSlice( self->chunk, self->chunk_pos, end );
+		self->chunk_pos = end;
+	} else {
+		page = PyList_New( 0 );
+	}
+	if( NULL == page ) return NULL;
+
+	Py_ssize_t have = PyList_GET_SIZE( page );
+	if( have < count && NULL != self->qdir ) {
+		vector<QueryHit> hits;
+		bool more;
+
+		Py_BEGIN_ALLOW_THREADS
+		more = read_query_hits( self->qdir, hits, count - have, self->wants );
+		Py_END_ALLOW_THREADS
+
+		if( !more ) query_iter_close( self );
+
+		PyObject *rest = hit_list( hits, self->wants );
+		free_query_hits( hits );
+		if( NULL == rest || PyList_SetSlice( page, have, have, rest ) ) {
+			Py_XDECREF( rest );
+			Py_DECREF( page );
+			query_iter_close( self );
+			return NULL;
+		}
+		Py_DECREF( rest );
+	}
+
+	return page;
+}
+
+static PyObject *query_iter_close_method( QueryIterObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	query_iter_close( self );
+	Py_CLEAR( self->chunk );
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+static PyMethodDef query_iter_methods[] = {
+	{
+		"fetch",
+		(PyCFunction)query_iter_fetch,
+		METH_VARARGS,
+		"fetch( count )\n" \
+		"\n" \
+		"Returns a list of the next count results, carrying on where the\n" \
+		"last fetch() or iteration stopped; only as much of the query is\n" \
+		"read as it takes.  A list shorter than count means the query is\n" \
+		"used up."
+	},
+	{
+		"close",
+		(PyCFunction)query_iter_close_method,
+		METH_NOARGS,
+		"close()\n" \
+		"\n" \
+		"Close the query now instead of waiting for the iterator to be\n" \
+		"used up or garbage collected."
+	},
+	{ // sentinel
+		NULL,	// name
+		NULL,	// function
+		0,		// flags
+		""		// docstring
+	}
+};
+
+static PyTypeObject QueryIterType = {
+	PyObject_HEAD_INIT( NULL )
+	0,									// ob_size
+	"_fsquery.QueryIterator",			// tp_name
+	sizeof( QueryIterObject ),			// tp_basicsize
+	0,									// tp_itemsize
+	(destructor)query_iter_dealloc,		// tp_dealloc
+	0,									// tp_print
+	0,									// tp_getattr
+	0,									// tp_setattr
+	0,									// tp_compare
+	0,									// tp_repr
+	0,									// tp_as_number
+	0,									// tp_as_sequence
+	0,									// tp_as_mapping
+	0,									// tp_hash
+	0,									// tp_call
+	0,									// tp_str
+	0,									// tp_getattro
+	0,									// tp_setattro
+	0,									// tp_as_buffer
+	Py_TPFLAGS_DEFAULT,					// tp_flags
+	"Iterator over the paths found by a query, see iquery().",	// tp_doc
+	0,									// tp_traverse
+	0,									// tp_clear
+	0,									// tp_richcompare
+	0,									// tp_weaklistoffset
+	PyObject_SelfIter,					// tp_iter
+	(iternextfunc)query_iter_next,		// tp_iternext
+	query_iter_methods,					// tp_methods
+};
+
+// ----------------------------------------------------------------------
+// Start a query and return an iterator over its results
+//
+// args:
+// 	query
+//  volume = /boot (optional)
+//  flags = 0 (optional)
+//  chunk_size = QUERY_CHUNK_SIZE (optional)
+//  refs = False (optional)
+//  attrs = None (optional)
+//  offset = 0 (optional)
+
+static PyObject *bfs_iquery( PyObject *self, PyObject *args, PyObject *kwds )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	static char *kwlist[] = { (char *)"query_string", (char *)"device", 
+							  (char *)"flags", (char *)"chunk_size", 
+							  (char *)"refs", (char *)"attrs", 
+							  (char *)"offset", NULL };
+	char *query;
+	PyObject *volume = Py_None;
+	uint32 flags = 0;
+	int chunk_size = QUERY_CHUNK_SIZE;
+	int refs = 0;
+	PyObject *attrs_obj = Py_None;
+	int offset = 0;
+	dev_t vol_dev;
+
+	if( PyArg_ParseTupleAndKeywords( args, kwds, "s|OIiiOi", kwlist, &query, 
+									 &volume, &flags, &chunk_size, &refs,
+									 &attrs_obj, &offset ) ) {
+		// seven arguments, six are optional
+		if( !volume_converter( volume, &vol_dev ) ) return NULL;
+		if( 0 != flags ) {
+			PyErr_SetString( PyExc_ValueError, "don't use flags" );
+			return NULL;
+		}
+		if( chunk_size < 1 ) {
+			PyErr_SetString( PyExc_ValueError, "chunk_size must be at least 1" );
+			return NULL;
+		}
+		if( offset < 0 ) {
+			PyErr_SetString( PyExc_ValueError, "offset can't be negative" );
+			return NULL;
+		}
+	} else {
+		PyErr_SetString( PyExc_TypeError, "you must specify a query string" );
+		return NULL;
+	}
+
+	QueryIterObject *iter = PyObject_New( QueryIterObject, &QueryIterType );
+	if( NULL == iter ) return NULL;
+
+	iter->qdir = NULL;
+	iter->chunk = NULL;
+	iter->chunk_pos = 0;
+	iter->chunk_size = chunk_size;
+	iter->wants = QueryWants();
+	iter->wants.refs = ( refs != 0 );
+	iter->attr_names = NULL;
+
+	if( Py_None != attrs_obj ) {
+		iter->attr_names = new vector<string>;
+		if( NULL == get_fsattr_api() || 
+			!fsattr_api->parse_attr_names( attrs_obj, *iter->attr_names ) ) {
+			Py_DECREF( iter );
+			return NULL;
+		}
+		iter->wants.attrs = iter->attr_names;
+	}
+
+	iter->qdir = open_query( vol_dev, query, flags );
+	if( NULL == iter->qdir ) {
+		Py_DECREF( iter );
+		return NULL;
+	}
+
+	if( offset > 0 ) {
+		bool more;
+
+		Py_BEGIN_ALLOW_THREADS
+		more = skip_query_hits( iter->qdir, offset, iter->wants );
+		Py_END_ALLOW_THREADS
+
+		if( !more ) query_iter_close( iter );
+	}
+
+	return (PyObject *)iter;
+}
+
+// ----------------------------------------------------------------------
+// Query every mounted volume that supports queries at the same time.  Each
+// volume gets its own thread, and their paths are merged through a bounded
+// queue; the whole thing takes about as long as the slowest volume instead
+// of the sum of all of them.
+
+#define QUERY_ALL_QUEUE_SIZE 1024
+
+struct QueryAllShared {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;	// signalled when paths arrive or a thread ends
+	pthread_cond_t not_full;	// signalled when paths are taken or on cancel
+	deque<string> paths;
+	int started;				// worker threads, one per volume
+	int running;				// worker threads still reading their volume
+	int failed;					// volumes whose query couldn't be opened
+	int first_error;			// errno of the first of those
+	bool cancelled;				// the iterator went away early
+	string query;
+};
+
+struct QueryAllWorker {
+	QueryAllShared *shared;
+	dev_t device;
+};
+
+static void *query_all_thread( void *data )
+{
+	QueryAllWorker *worker = static_cast<QueryAllWorker *>( data );
+	QueryAllShared *shared = worker->shared;
+
+	DIR *qdir = fs_open_query( worker->device, shared->query.c_str(), 0 );
+	if( NULL == qdir ) {
+		int error = errno;
+
+		pthread_mutex_lock( &shared->lock );
+		if( 0 == shared->failed++ ) shared->first_error = error;
+		shared->running--;
+		pthread_cond_signal( &shared->not_empty );
+		pthread_mutex_unlock( &shared->lock );
+
+		delete worker;
+		return NULL;
+	}
+
+	struct dirent *qent;
+	bool cancelled = false;
+	while( !cancelled && NULL != ( qent = fs_read_query( qdir ) ) ) {
+		char buff[B_PATH_NAME_LENGTH];
+		status_t retval = get_path_for_dirent( qent, buff, B_PATH_NAME_LENGTH );
+		if( retval != B_OK ) continue;	// same as query()
+
+		pthread_mutex_lock( &shared->lock );
+		while( shared->paths.size() >= QUERY_ALL_QUEUE_SIZE && !shared->cancelled ) {
+			pthread_cond_wait( &shared->not_full, &shared->lock );
+		}
+		cancelled = shared->cancelled;
+		if( !cancelled ) {
+			shared->paths.push_back( buff );
+			pthread_cond_signal( &shared->not_empty );
+		}
+		pthread_mutex_unlock( &shared->lock );
+	}
+
+	(void)fs_close_query( qdir );
+
+	pthread_mutex_lock( &shared->lock );
+	shared->running--;
+	pthread_cond_signal( &shared->not_empty );
+	pthread_mutex_unlock( &shared->lock );
+
+	delete worker;
+	return NULL;
+}
+
+typedef struct {
+	PyObject_HEAD
+	QueryAllShared *shared;
+	vector<pthread_t> *threads;
+	deque<string> *pending;		// paths taken off the queue, not returned yet
+} QueryAllIterObject;
+
+// Tell the threads to stop and wait for them.
+static void query_all_iter_stop( QueryAllIterObject *self )
+{
+	if( NULL == self->threads || self->threads->empty() ) return;
+
+	pthread_mutex_lock( &self->shared->lock );
+	self->shared->cancelled = true;
+	pthread_cond_broadcast( &self->shared->not_full );
+	pthread_mutex_unlock( &self->shared->lock );
+
+	Py_BEGIN_ALLOW_THREADS
+	for( size_t i = 0; i < self->threads->size(); i++ ) {
+		pthread_join( ( *self->threads )[i], NULL );
+	}
+	Py_END_ALLOW_THREADS
+
+	self->threads->clear();
+}
+
+static void query_all_iter_dealloc( QueryAllIterObject *self )
+{
+	query_all_iter_stop( self );
+	if( NULL != self->shared ) {
+		pthread_mutex_destroy( &self->shared->lock );
+		pthread_cond_destroy( &self->shared->not_empty );
+		pthread_cond_destroy( &self->shared->not_full );
+		delete self->shared;
+	}
+	delete self->threads;
+	delete self->pending;
+	PyObject_Del( self );
+}
+
+static PyObject *query_all_iter_next( QueryAllIterObject *self )
+{
+	if( self->pending->empty() ) {
+		QueryAllShared *shared = self->shared;
+		bool finished = false;
+		int failed = 0;
+		int first_error = 0;
+
+		// Take everything that's queued in one go, so we don't bounce
+		// the GIL around for every path.
+		Py_BEGIN_ALLOW_THREADS
+		pthread_mutex_lock( &shared->lock );
+		while( shared->paths.empty() && shared->running > 0 ) {
+			pthread_cond_wait( &shared->not_empty, &shared->lock );
+		}
+		self->pending->swap( shared->paths );
+		pthread_cond_broadcast( &shared->not_full );
+		finished = ( shared->running == 0 );
+		failed = shared->failed;
+		first_error = shared->first_error;
+		pthread_mutex_unlock( &shared->lock );
+		Py_END_ALLOW_THREADS
+
+		if( self->pending->empty() && finished ) {
+			query_all_iter_stop( self );
+
+			// Only complain if no volume could run the query at all, and
+			// only once; after that the iterator is just exhausted.  The
+			// threads are gone, so no lock is needed.
+			if( failed > 0 && failed == shared->started ) {
+				shared->failed = 0;
+				try {
+					strstream s;
+					s << "error with query \"" << shared->query << "\": "
+					  << strerror( first_error ) << ends;
+					PyErr_SetString( PyExc_RuntimeError, s.str() );
+				} catch ( ... ) {
+					PyErr_SetString( PyExc_RuntimeError, strerror( first_error ) );
+				}
+			}
+
+			return NULL;
+		}
+	}
+
+	PyObject *path = PyString_FromString( self->pending->front().c_str() );
+	self->pending->pop_front();
+	return path;
+}
+
+static PyTypeObject QueryAllIterType = {
+	PyObject_HEAD_INIT( NULL )
+	0,									// ob_size
+	"_fsquery.QueryAllIterator",		// tp_name
+	sizeof( QueryAllIterObject ),		// tp_basicsize
+	0,									// tp_itemsize
+	(destructor)query_all_iter_dealloc,	// tp_dealloc
+	0,									// tp_print
+	0,									// tp_getattr
+	0,									// tp_setattr
+	0,									// tp_compare
+	0,									// tp_repr
+	0,									// tp_as_number
+	0,									// tp_as_sequence
+	0,									// tp_as_mapping
+	0,									// tp_hash
+	0,									// tp_call
+	0,									// tp_str
+	0,									// tp_getattro
+	0,									// tp_setattro
+	0,									// tp_as_buffer
+	Py_TPFLAGS_DEFAULT,					// tp_flags
+	"Iterator over the paths found by query_all().",	// tp_doc
+	0,									// tp_traverse
+	0,									// tp_clear
+	0,									// tp_richcompare
+	0,									// tp_weaklistoffset
+	PyObject_SelfIter,					// tp_iter
+	(iternextfunc)query_all_iter_next,	// tp_iternext
+};
+
+// ----------------------------------------------------------------------
+// Query all the volumes
+//
+// args:
+// 	query
+
+static PyObject *bfs_query_all( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *query;
+
+	if( !PyArg_ParseTuple( args, "s", &query ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a query string" );
+		return NULL;
+	}
+
+	vector<dev_t> devices;
+	vector<VolumeInfo> volumes;
+
+	Py_BEGIN_ALLOW_THREADS
+	volumes = volume_list();
+	Py_END_ALLOW_THREADS
+
+	for( size_t i = 0; i < volumes.size(); i++ ) {
+		if( volumes[i].flags & B_FS_HAS_QUERY ) devices.push_back( volumes[i].device );
+	}
+
+	QueryAllIterObject *iter = PyObject_New( QueryAllIterObject, &QueryAllIterType );
+	if( NULL == iter ) return NULL;
+
+	iter->shared = new QueryAllShared;
+	iter->threads = new vector<pthread_t>;
+	iter->pending = new deque<string>;
+
+	QueryAllShared *shared = iter->shared;
+	pthread_mutex_init( &shared->lock, NULL );
+	pthread_cond_init( &shared->not_empty, NULL );
+	pthread_cond_init( &shared->not_full, NULL );
+	shared->started = 0;
+	shared->running = 0;
+	shared->failed = 0;
+	shared->first_error = 0;
+	shared->cancelled = false;
+	shared->query = query;
+
+	for( size_t i = 0; i < devices.size(); i++ ) {
+		QueryAllWorker *worker = new QueryAllWorker;
+		worker->shared = shared;
+		worker->device = devices[i];
+
+		pthread_mutex_lock( &shared->lock );
+		shared->started++;
+		shared->running++;
+		pthread_mutex_unlock( &shared->lock );
+
+		pthread_t thread;
+		if( pthread_create( &thread, NULL, query_all_thread, worker ) != 0 ) {
+			pthread_mutex_lock( &shared->lock );
+			shared->started--;
+			shared->running--;
+			pthread_mutex_unlock( &shared->lock );
+			delete worker;
+			continue;
+		}
+		iter->threads->push_back( thread );
+	}
+
+	return (PyObject *)iter;
+}
+
+#endif // !__linux__
+
+// ----------------------------------------------------------------------
+// Attribute indexes.  BFS can only run a query if at least one of the
+// attributes it compares is indexed, and it's only fast if the one it
+// picks narrows things down; these manage a volume's indexes.  On Linux
+// the same goes for the indexes fsindex.h keeps.
+
+// Set a RuntimeError for a failed index call.
+static void raise_index_error( const char *what, const char *name, int error )
+{
+	try {
+		strstream s;
+		s << "can't " << what << " index \"" << name << "\": "
+		  << strerror( error ) << ends;
+		PyErr_SetString( PyExc_RuntimeError, s.str() );
+	} catch ( ... ) {
+		PyErr_SetString( PyExc_RuntimeError, strerror( error ) );
+	}
+}
+
+// Get a type code, given either as an integer or a four-character string
+// like write_attr() takes.
+static bool parse_type_code( PyObject *type_obj, uint32 &type_code )
+{
+	if( PyInt_Check( type_obj ) ) {
+		type_code = (uint32)PyInt_AsLong( type_obj );
+	} else if( PyString_Check( type_obj ) && PyString_Size( type_obj ) == 4 ) {
+		const unsigned char *type_str = (const unsigned char *)PyString_AsString( type_obj );
+		type_code = ( (uint32)type_str[0] << 24 ) | ( (uint32)type_str[1] << 16 ) |
+					( (uint32)type_str[2] << 8 ) | (uint32)type_str[3];
+	} else {
+		PyErr_SetString( PyExc_TypeError, "index type must be an integer or 4 characters" );
+		return false;
+	}
+
+	return true;
+}
+
+#ifndef __linux__
+
+// Pick the attribute names out of a query string; those are the words
+// right in front of a comparison.  Each name is listed once, in the order
+// they first show up.
+static void query_attr_names( const char *query, vector<string> &names )
+{
+	const char *p = query;
+	while( *p ) {
+		if( isspace( (unsigned char)*p ) || strchr( "()&|", *p ) ) {
+			p++;
+		} else if( *p == '"' || *p == '\'' ) {
+			// quoted values aren't names; skip to the closing quote
+			char quote = *p++;
+			while( *p && *p != quote ) {
+				if( *p == '\\' && p[1] ) p++;
+				p++;
+			}
+			if( *p ) p++;
+		} else if( strchr( "=!<>", *p ) ) {
+			p++;
+		} else {
+			const char *start = p;
+			while( *p && !isspace( (unsigned char)*p ) && !strchr( "()&|=!<>\"'", *p ) ) {
+				p++;
+			}
+			string word( start, p - start );
+
+			const char *next = p;
+			while( isspace( (unsigned char)*next ) ) next++;
+			if( strncmp( next, "==", 2 ) == 0 || strncmp( next, "!=", 2 ) == 0 ||
+				*next == '<' || *next == '>' ) {
+				size_t i;
+				for( i = 0; i < names.size() && names[i] != word; i++ );
+				if( i == names.size() ) names.push_back( word );
+			}
+		}
+	}
+}
+
+// ----------------------------------------------------------------------
+// Create an index
+//
+// args:
+// 	name
+// 	index_type (as a string or integer)
+// 	volume = /boot (optional)
+
+static PyObject *bfs_create_index( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *name;
+	PyObject *type_obj;
+	dev_t vol_dev;
+	PyObject *volume = Py_None;
+
+	if( !PyArg_ParseTuple( args, "sO|O", &name, &type_obj, &volume ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify an index name and type" );
+		return NULL;
+	}
+
+	uint32 type_code;
+	if( !parse_type_code( type_obj, type_code ) ) return NULL;
+	if( !volume_converter( volume, &vol_dev ) ) return NULL;
+
+	int retval;
+	int error;
+
+	Py_BEGIN_ALLOW_THREADS
+	retval = fs_create_index( vol_dev, name, type_code, 0 );
+	error = errno;
+	Py_END_ALLOW_THREADS
+
+	if( retval < 0 ) {
+		raise_index_error( "create", name, error );
+		return NULL;
+	}
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+// ----------------------------------------------------------------------
+// Remove an index
+//
+// args:
+// 	name
+// 	volume = /boot (optional)
+
+static PyObject *bfs_remove_index( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *name;
+	PyObject *volume = Py_None;
+	dev_t vol_dev;
+
+	if( !PyArg_ParseTuple( args, "s|O", &name, &volume ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify an index name" );
+		return NULL;
+	}
+	if( !volume_converter( volume, &vol_dev ) ) return NULL;
+
+	int retval;
+	int error;
+
+	Py_BEGIN_ALLOW_THREADS
+	retval = fs_remove_index( vol_dev, name );
+	error = errno;
+	Py_END_ALLOW_THREADS
+
+	if( retval < 0 ) {
+		raise_index_error( "remove", name, error );
+		return NULL;
+	}
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+// ----------------------------------------------------------------------
+// List the indexes of a volume
+//
+// args:
+// 	volume = /boot (optional)
+
+static PyObject *bfs_list_indexes( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	PyObject *volume = Py_None;
+	dev_t vol_dev;
+
+	if( !PyArg_ParseTuple( args, "|O", &volume ) ) {
+		PyErr_SetString( PyExc_TypeError, "volume must be a path or a Volume" );
+		return NULL;
+	}
+	if( !volume_converter( volume, &vol_dev ) ) return NULL;
+
+	vector<string> names;
+	bool opened;
+	int error;
+
+	Py_BEGIN_ALLOW_THREADS
+	DIR *index_dir = fs_open_index_dir( vol_dev );
+	error = errno;
+	opened = ( NULL != index_dir );
+	if( opened ) {
+		struct dirent *ent;
+		while( NULL != ( ent = fs_read_index_dir( index_dir ) ) ) {
+			names.push_back( ent->d_name );
+		}
+		(void)fs_close_index_dir( index_dir );
+	}
+	Py_END_ALLOW_THREADS
+
+	if( !opened ) {
+		try {
+			strstream s;
+			s << "can't read the indexes of device " << vol_dev << ": "
+			  << strerror( error ) << ends;
+			PyErr_SetString( PyExc_RuntimeError, s.str() );
+		} catch ( ... ) {
+			PyErr_SetString( PyExc_RuntimeError, strerror( error ) );
+		}
+		return NULL;
+	}
+
+	PyObject *index_list = PyList_New( names.size() );
+	if( NULL == index_list ) return PyErr_NoMemory();
+
+	for( size_t i = 0; i < names.size(); i++ ) {
+		PyObject *name = PyString_FromString( names[i].c_str() );
+		if( NULL == name ) {
+			Py_DECREF( index_list );
+			return NULL;
+		}
+		PyList_SET_ITEM( index_list, i, name );
+	}
+
+	return index_list;
+}
+
+// ----------------------------------------------------------------------
+// Get information about an index
+//
+// args:
+// 	name
+// 	volume = /boot (optional)
+
+static PyObject *bfs_stat_index( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *name;
+	PyObject *volume = Py_None;
+	dev_t vol_dev;
+
+	if( !PyArg_ParseTuple( args, "s|O", &name, &volume ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify an index name" );
+		return NULL;
+	}
+	if( !volume_converter( volume, &vol_dev ) ) return NULL;
+
+	index_info info;
+	int retval;
+	int error;
+
+	Py_BEGIN_ALLOW_THREADS
+	retval = fs_stat_index( vol_dev, name, &info );
+	error = errno;
+	Py_END_ALLOW_THREADS
+
+	if( retval < 0 ) {
+		raise_index_error( "stat", name, error );
+		return NULL;
+	}
+
+	return Py_BuildValue( "{s:k,s:L,s:l,s:l,s:i,s:i}", 
+						  "type", (unsigned long)info.type, 
+						  "size", (PY_LONG_LONG)info.size,
+						  "modification_time", (long)info.modification_time,
+						  "creation_time", (long)info.creation_time,
+						  "uid", (int)info.uid, "gid", (int)info.gid );
+}
+
+// ----------------------------------------------------------------------
+// Tell which attributes of a query have an index on the volume
+//
+// args:
+// 	query
+// 	volume = /boot (optional)
+
+static PyObject *bfs_explain( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *query;
+	PyObject *volume = Py_None;
+	dev_t vol_dev;
+
+	if( !PyArg_ParseTuple( args, "s|O", &query, &volume ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a query string" );
+		return NULL;
+	}
+	if( !volume_converter( volume, &vol_dev ) ) return NULL;
+
+	vector<string> names;
+	vector<bool> indexed;
+
+	Py_BEGIN_ALLOW_THREADS
+	query_attr_names( query, names );
+	for( size_t i = 0; i < names.size(); i++ ) {
+		index_info info;
+		indexed.push_back( fs_stat_index( vol_dev, names[i].c_str(), &info ) == 0 );
+	}
+	Py_END_ALLOW_THREADS
+
+	PyObject *indexed_list = PyList_New( 0 );
+	PyObject *unindexed_list = PyList_New( 0 );
+	PyObject *result = NULL;
+
+	if( NULL != indexed_list && NULL != unindexed_list ) {
+		size_t i;
+		for( i = 0; i < names.size(); i++ ) {
+			PyObject *name = PyString_FromString( names[i].c_str() );
+			if( NULL == name ) break;
+
+			int failed = PyList_Append( indexed[i] ? indexed_list : unindexed_list, name );
+			Py_DECREF( name );
+			if( failed ) break;
+		}
+
+		if( i == names.size() ) {
+			result = Py_BuildValue( "{s:O,s:O}", "indexed", indexed_list,
+									"unindexed", unindexed_list );
+		}
+	}
+
+	Py_XDECREF( indexed_list );
+	Py_XDECREF( unindexed_list );
+	return result;
+}
+
+// ----------------------------------------------------------------------
+// List the mounted volumes
+
+static PyObject *bfs_volumes( PyObject *self, PyObject *args )
+{
+	// self and args aren't used
+	self = self;
+	args = args;
+
+	vector<VolumeInfo> volumes;
+
+	Py_BEGIN_ALLOW_THREADS
+	volumes = volume_list();
+	Py_END_ALLOW_THREADS
+
+	PyObject *volume_list_obj = PyList_New( volumes.size() );
+	if( NULL == volume_list_obj ) return PyErr_NoMemory();
+
+	for( size_t i = 0; i < volumes.size(); i++ ) {
+		PyObject *volume = volume_new( volumes[i] );
+		if( NULL == volume ) {
+			Py_DECREF( volume_list_obj );
+			return NULL;
+		}
+		PyList_SET_ITEM( volume_list_obj, i, volume );
+	}
+
+	return volume_list_obj;
+}
+
+// ----------------------------------------------------------------------
+// Find the volume a path is on
+//
+// args:
+// 	path
+
+static PyObject *bfs_volume_for_path( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *path;
+
+	if( !PyArg_ParseTuple( args, "s", &path ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a path" );
+		return NULL;
+	}
+
+	dev_t device;
+	vector<VolumeInfo> volumes;
+
+	Py_BEGIN_ALLOW_THREADS
+	device = volume_dev_for_path( path );
+	volumes = volume_list();
+	Py_END_ALLOW_THREADS
+
+	for( size_t i = 0; i < volumes.size(); i++ ) {
+		if( volumes[i].device == device ) return volume_new( volumes[i] );
+	}
+
+	try {
+		strstream s;
+		s << "can't find the volume of \"" << path << "\"" << ends;
+		PyErr_SetString( PyExc_IOError, s.str() );
+	} catch ( ... ) {
+		PyErr_SetString( PyExc_IOError, "can't find the volume" );
+	}
+
+	return NULL;
+}
+
+// ----------------------------------------------------------------------
+// Path cache controls
+//
+// args:
+// 	entries
+
+static PyObject *bfs_set_path_cache_size( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	int entries;
+
+	if( !PyArg_ParseTuple( args, "i", &entries ) || entries < 0 ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a number of entries" );
+		return NULL;
+	}
+
+	pthread_mutex_lock( &path_cache_lock );
+	path_cache_size = entries;
+	path_cache_trim();
+	pthread_mutex_unlock( &path_cache_lock );
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+static PyObject *bfs_clear_path_cache( PyObject *self, PyObject *args )
+{
+	// self and args aren't used
+	self = self;
+	args = args;
+
+	pthread_mutex_lock( &path_cache_lock );
+	path_cache_lru.clear();
+	path_cache_index.clear();
+	pthread_mutex_unlock( &path_cache_lock );
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+static PyObject *bfs_path_cache_stats( PyObject *self, PyObject *args )
+{
+	// self and args aren't used
+	self = self;
+	args = args;
+
+	pthread_mutex_lock( &path_cache_lock );
+	unsigned long hits = path_cache_hits;
+	unsigned long misses = path_cache_misses;
+	unsigned long entries = path_cache_lru.size();
+	unsigned long size = path_cache_size;
+	pthread_mutex_unlock( &path_cache_lock );
+
+	return Py_BuildValue( "{s:k,s:k,s:k,s:k}", "hits", hits, "misses", misses,
+						  "entries", entries, "size", size );
+}
+
+// ----------------------------------------------------------------------
+// Query cache controls
+//
+// args:
+// 	entries
+// 	bytes = 4MB (optional)
+
+static PyObject *bfs_set_query_cache_limits( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	int entries;
+	int bytes = QUERY_CACHE_DEFAULT_BYTES;
+	int port_capacity = QUERY_CACHE_DEFAULT_PORT_CAPACITY;
+
+	if( !PyArg_ParseTuple( args, "i|ii", &entries, &bytes, &port_capacity ) || 
+		entries < 0 || bytes < 0 ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a number of entries" );
+		return NULL;
+	}
+	if( port_capacity < 1 ) {
+		PyErr_SetString( PyExc_ValueError, "port_capacity must be at least 1" );
+		return NULL;
+	}
+
+	vector<CachedQuery *> evicted;
+
+	pthread_mutex_lock( &query_cache_lock );
+	query_cache_max_entries = entries;
+	query_cache_max_bytes = bytes;
+	query_cache_port_capacity = port_capacity;
+	query_cache_trim( evicted );
+	pthread_mutex_unlock( &query_cache_lock );
+
+	Py_BEGIN_ALLOW_THREADS
+	for( size_t i = 0; i < evicted.size(); i++ ) query_cache_free( evicted[i] );
+	Py_END_ALLOW_THREADS
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+static PyObject *bfs_clear_query_cache( PyObject *self, PyObject *args )
+{
+	// self and args aren't used
+	self = self;
+	args = args;
+
+	vector<CachedQuery *> evicted;
+
+	pthread_mutex_lock( &query_cache_lock );
+	evicted.assign( query_cache_lru.begin(), query_cache_lru.end() );
+	query_cache_lru.clear();
+	query_cache_index.clear();
+	query_cache_bytes = 0;
+	pthread_mutex_unlock( &query_cache_lock );
+
+	Py_BEGIN_ALLOW_THREADS
+	for( size_t i = 0; i < evicted.size(); i++ ) query_cache_free( evicted[i] );
+	Py_END_ALLOW_THREADS
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+static PyObject *bfs_query_cache_stats( PyObject *self, PyObject *args )
+{
+	// self and args aren't used
+	self = self;
+	args = args;
+
+	pthread_mutex_lock( &query_cache_lock );
+	unsigned long hits = query_cache_hits;
+	unsigned long misses = query_cache_misses;
+	unsigned long updates = query_cache_updates;
+	unsigned long overflows = query_cache_overflows;
+	unsigned long entries = query_cache_lru.size();
+	unsigned long bytes = query_cache_bytes;
+	unsigned long max_entries = query_cache_max_entries;
+	unsigned long max_bytes = query_cache_max_bytes;
+	unsigned long port_capacity = query_cache_port_capacity;
+	pthread_mutex_unlock( &query_cache_lock );
+
+	return Py_BuildValue( "{s:k,s:k,s:k,s:k,s:k,s:k,s:k,s:k,s:k}", 
+						  "hits", hits, "misses", misses, 
+						  "updates", updates, "overflows", overflows,
+						  "entries", entries, "bytes", bytes,
+						  "max_entries", max_entries, "max_bytes", max_bytes,
+						  "port_capacity", port_capacity );
+}
+
+#endif // !__linux__
+
+#ifdef __linux__
+// ----------------------------------------------------------------------
+// Queries on Linux.  There's no BFS, so they run on the indexes in
+// fsindex.h: a volume is a directory tree with an index directory at the
+// top, made by the first create_index(), and a path anywhere in it names
+// the volume.  The attribute writes keep the indexes up to date, and
+// rescan_indexes() fills them from what's already on disk.
+
+// The real path of a volume's directory; sets a RuntimeError if it
+// doesn't exist.
+static bool volume_dir( const char *volume, string &dir )
+{
+	char resolved[PATH_MAX];
+	struct stat st;
+	if( NULL == realpath( volume, resolved ) || stat( resolved, &st ) != 0 ) {
+		try {
+			strstream s;
+			s << "can't find volume \"" << volume << "\": "
+			  << strerror( errno ) << ends;
+			PyErr_SetString( PyExc_RuntimeError, s.str() );
+		} catch ( ... ) {
+			PyErr_SetString( PyExc_RuntimeError, strerror( errno ) );
+		}
+		return false;
+	}
+
+	dir = resolved;
+	if( !S_ISDIR( st.st_mode ) ) dir = index_parent( dir );
+	return true;
+}
+
+// The top of the indexed tree holding volume; sets a RuntimeError if
+// there isn't one.
+static bool volume_root( const char *volume, string &root )
+{
+	string dir;
+	if( !volume_dir( volume, dir ) ) return false;
+	if( index_find_root( dir, root ) ) return true;
+
+	try {
+		strstream s;
+		s << "no indexes on the volume holding \"" << volume << "\"" << ends;
+		PyErr_SetString( PyExc_RuntimeError, s.str() );
+	} catch ( ... ) {
+		PyErr_SetString( PyExc_RuntimeError, "no indexes on the volume" );
+	}
+	return false;
+}
+
+// Parse a query, setting a ValueError if it isn't one.
+static bool parse_query( const char *query, QueryExpr &expr )
+{
+	if( query_parse( query, expr ) ) return true;
+
+	try {
+		strstream s;
+		s << "bad query \"" << query << "\": " << expr.error << ends;
+		PyErr_SetString( PyExc_ValueError, s.str() );
+	} catch ( ... ) {
+		PyErr_SetString( PyExc_ValueError, "bad query" );
+	}
+	return false;
+}
+
+// Prefetch a query's hits through the descriptor index_query() checked
+// them with; files whose attributes can't be read are turned down.  Runs
+// without the GIL.
+class IndexPrefetch : public IndexHitCheck {
+public:
+	IndexPrefetch( const vector<string> *wanted, vector<RawAttrs *> &attrs )
+		: wanted( wanted ), attrs( attrs ) {}
+
+	bool hit( const string &, int fd ) {
+		RawAttrs *raw = new (nothrow) RawAttrs;
+		if( NULL == raw ) return false;
+
+		fsattr_api->read_raw_attrs_fd( fd, 0, wanted, NULL, *raw );
+		if( raw->status != RawAttrs::OK ) {
+			delete raw;
+			return false;
+		}
+		try {
+			attrs.push_back( raw );
+		} catch ( ... ) {
+			delete raw;
+			return false;
+		}
+		return true;
+	}
+
+private:
+	const vector<string> *wanted;
+	vector<RawAttrs *> &attrs;
+};
+
+// ----------------------------------------------------------------------
+// Perform a query
+//
+// args:
+// 	query
+//  volume = /boot (optional)
+//  flags = 0 (optional)
+//  refs = False (optional; not on Linux)
+//  attrs = None (optional)
+//  cached = False (optional; ignored on Linux)
+//  limit = -1 (optional)
+//  offset = 0 (optional)
+
+static PyObject *bfs_query( PyObject *self, PyObject *args, PyObject *kwds )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	static char *kwlist[] = { (char *)"query_string", (char *)"device", 
+							  (char *)"flags", (char *)"refs", 
+							  (char *)"attrs", (char *)"cached", 
+							  (char *)"limit", (char *)"offset", NULL };
+	char *query;
+	char *volume = (char *)"/boot";
+	uint32 flags = 0;
+	int refs = 0;
+	PyObject *attrs_obj = Py_None;
+	int cached = 0;
+	int limit = -1;
+	int offset = 0;
+
+	if( PyArg_ParseTupleAndKeywords( args, kwds, "s|sIiOiii", kwlist, &query, 
+									 &volume, &flags, &refs, &attrs_obj,
+									 &cached, &limit, &offset ) ) {
+		// eight arguments, seven are optional
+		if( 0 != flags ) {
+			PyErr_SetString( PyExc_ValueError, "don't use flags" );
+			return NULL;
+		}
+		if( offset < 0 ) {
+			PyErr_SetString( PyExc_ValueError, "offset can't be negative" );
+			return NULL;
+		}
+		if( refs ) {
+			PyErr_SetString( PyExc_ValueError, "there are no EntryRefs on Linux" );
+			return NULL;
+		}
+	} else {
+		PyErr_SetString( PyExc_TypeError, "you must specify a query string" );
+		return NULL;
+	}
+
+	vector<string> attr_names;
+	const vector<string> *wanted = NULL;
+	if( Py_None != attrs_obj ) {
+		if( NULL == get_fsattr_api() ) return NULL;
+		if( !fsattr_api->parse_attr_names( attrs_obj, attr_names ) ) return NULL;
+		wanted = &attr_names;
+	}
+
+	QueryExpr expr;
+	string root;
+	if( !parse_query( query, expr ) || !volume_root( volume, root ) ) return NULL;
+
+	vector<string> paths;
+	vector<RawAttrs *> attrs;
+	bool ok;
+	int error;
+
+	// Candidates past the page aren't checked at all.  Files whose
+	// attributes can't be prefetched are skipped like on Haiku, before
+	// they count towards offset or limit.
+	size_t max_hits = (size_t)-1;
+	if( limit >= 0 ) max_hits = (size_t)offset + limit;
+	IndexPrefetch prefetch( wanted, attrs );
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = index_query( root, expr, paths, max_hits, NULL != wanted ? &prefetch : NULL );
+	error = errno;
+	if( ok ) {
+		size_t first = min( (size_t)offset, paths.size() );
+		vector<string> page;
+		for( size_t i = first; i < paths.size(); i++ ) {
+			page.push_back( index_join( root, paths[i] ) );
+		}
+		paths.swap( page );
+
+		if( NULL != wanted ) {
+			for( size_t i = 0; i < first; i++ ) delete attrs[i];
+			attrs.erase( attrs.begin(), attrs.begin() + first );
+		}
+	}
+	Py_END_ALLOW_THREADS
+
+	if( !ok ) {
+		try {
+			strstream s;
+			s << "error with query \"" << query << "\": "
+			  << ( EINVAL == error ? "none of its attributes is indexed" : strerror( error ) )
+			  << ends;
+			PyErr_SetString( PyExc_RuntimeError, s.str() );
+		} catch ( ... ) {
+			PyErr_SetString( PyExc_RuntimeError, strerror( error ) );
+		}
+		return NULL;
+	}
+
+	PyObject *query_list = PyList_New( paths.size() );
+	for( size_t i = 0; NULL != query_list && i < paths.size(); i++ ) {
+		PyObject *entry = PyString_FromString( paths[i].c_str() );
+		if( NULL != entry && NULL != wanted ) {
+			PyObject *attributes = fsattr_api->raw_attrs_to_dict( *attrs[i] );
+			PyObject *pair = NULL;
+			if( NULL != attributes ) pair = PyTuple_Pack( 2, entry, attributes );
+			Py_XDECREF( attributes );
+			Py_DECREF( entry );
+			entry = pair;
+		}
+
+		if( NULL == entry ) {
+			Py_CLEAR( query_list );
+			break;
+		}
+		PyList_SET_ITEM( query_list, i, entry );
+	}
+
+	for( size_t i = 0; i < attrs.size(); i++ ) delete attrs[i];
+	return query_list;
+}
+
+// ----------------------------------------------------------------------
+// Create an index
+//
+// args:
+// 	name
+// 	index_type (as a string or integer)
+// 	volume = /boot (optional; the top of the tree, if it has no indexes yet)
+
+static PyObject *bfs_create_index( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *name;
+	PyObject *type_obj;
+	char *volume = (char *)"/boot";
+
+	if( !PyArg_ParseTuple( args, "sO|s", &name, &type_obj, &volume ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify an index name and type" );
+		return NULL;
+	}
+
+	uint32 type_code;
+	string dir, root;
+	if( !parse_type_code( type_obj, type_code ) ) return NULL;
+	if( !volume_dir( volume, dir ) ) return NULL;
+	if( !index_find_root( dir, root ) ) root = dir;
+
+	bool ok;
+	int error;
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = index_create( root, name, type_code );
+	error = errno;
+	Py_END_ALLOW_THREADS
+
+	if( !ok ) {
+		raise_index_error( "create", name, error );
+		return NULL;
+	}
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+// ----------------------------------------------------------------------
+// Remove an index
+//
+// args:
+// 	name
+// 	volume = /boot (optional)
+
+static PyObject *bfs_remove_index( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *name;
+	char *volume = (char *)"/boot";
+	string root;
+
+	if( !PyArg_ParseTuple( args, "s|s", &name, &volume ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify an index name" );
+		return NULL;
+	}
+	if( !volume_root( volume, root ) ) return NULL;
+
+	bool ok;
+	int error;
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = index_remove( root, name );
+	error = errno;
+	Py_END_ALLOW_THREADS
+
+	if( !ok ) {
+		raise_index_error( "remove", name, error );
+		return NULL;
+	}
+
+	Py_INCREF( Py_None );
+	return Py_None;
+}
+
+// ----------------------------------------------------------------------
+// List the indexes of a volume
+//
+// args:
+// 	volume = /boot (optional)
+
+static PyObject *bfs_list_indexes( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *volume = (char *)"/boot";
+	string root;
+
+	if( !PyArg_ParseTuple( args, "|s", &volume ) ) {
+		PyErr_SetString( PyExc_TypeError, "volume must be a path" );
+		return NULL;
+	}
+	if( !volume_root( volume, root ) ) return NULL;
+
+	map<string, uint32> types;
+	bool ok;
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = index_types( root, types );
+	Py_END_ALLOW_THREADS
+
+	if( !ok ) return PyErr_SetFromErrno( PyExc_RuntimeError );
+
+	PyObject *index_list = PyList_New( 0 );
+	if( NULL == index_list ) return PyErr_NoMemory();
+
+	for( map<string, uint32>::iterator i = types.begin(); i != types.end(); ++i ) {
+		PyObject *name = PyString_FromString( i->first.c_str() );
+		if( NULL == name || PyList_Append( index_list, name ) != 0 ) {
+			Py_XDECREF( name );
+			Py_DECREF( index_list );
+			return NULL;
+		}
+		Py_DECREF( name );
+	}
+
+	return index_list;
+}
+
+// ----------------------------------------------------------------------
+// Get information about an index
+//
+// args:
+// 	name
+// 	volume = /boot (optional)
+
+static PyObject *bfs_stat_index( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *name;
+	char *volume = (char *)"/boot";
+	string root;
+
+	if( !PyArg_ParseTuple( args, "s|s", &name, &volume ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify an index name" );
+		return NULL;
+	}
+	if( !volume_root( volume, root ) ) return NULL;
+
+	string base = index_base( root, name );
+	struct stat run_st, log_st;
+	IndexHeader header;
+	int retval = -1;
+	int error;
+
+	// The size and times cover the log too.
+	Py_BEGIN_ALLOW_THREADS
+	int fd = open( ( base + ".idx" ).c_str(), O_RDONLY );
+	error = errno;
+	if( fd >= 0 ) {
+		if( fstat( fd, &run_st ) == 0 &&
+			read( fd, &header, sizeof( header ) ) == (ssize_t)sizeof( header ) ) {
+			retval = 0;
+		} else {
+			error = EINVAL;
+		}
+		close( fd );
+	}
+	if( 0 == retval && stat( ( base + ".log" ).c_str(), &log_st ) == 0 ) {
+		run_st.st_size += log_st.st_size;
+		run_st.st_mtime = max( run_st.st_mtime, log_st.st_mtime );
+	}
+	Py_END_ALLOW_THREADS
+
+	if( retval < 0 ) {
+		raise_index_error( "stat", name, error );
+		return NULL;
+	}
+
+	return Py_BuildValue( "{s:k,s:L,s:l,s:l,s:i,s:i}", 
+						  "type", (unsigned long)header.type, 
+						  "size", (PY_LONG_LONG)run_st.st_size,
+						  "modification_time", (long)run_st.st_mtime,
+						  "creation_time", (long)run_st.st_ctime,
+						  "uid", (int)run_st.st_uid, "gid", (int)run_st.st_gid );
+}
+
+// ----------------------------------------------------------------------
+// Tell which attributes of a query have an index on the volume
+//
+// args:
+// 	query
+// 	volume = /boot (optional)
+
+static PyObject *bfs_explain( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *query;
+	char *volume = (char *)"/boot";
+	QueryExpr expr;
+	string root;
+
+	if( !PyArg_ParseTuple( args, "s|s", &query, &volume ) ) {
+		PyErr_SetString( PyExc_TypeError, "you must specify a query string" );
+		return NULL;
+	}
+	if( !parse_query( query, expr ) || !volume_root( volume, root ) ) return NULL;
+
+	vector<string> names;
+	map<string, uint32> types;
+	query_expr_attrs( expr, names );
+
+	Py_BEGIN_ALLOW_THREADS
+	(void)index_types( root, types );
+	Py_END_ALLOW_THREADS
+
+	PyObject *indexed_list = PyList_New( 0 );
+	PyObject *unindexed_list = PyList_New( 0 );
+	PyObject *result = NULL;
+
+	if( NULL != indexed_list && NULL != unindexed_list ) {
+		size_t i;
+		for( i = 0; i < names.size(); i++ ) {
+			PyObject *name = PyString_FromString( names[i].c_str() );
+			if( NULL == name ) break;
+
+			bool indexed = ( types.find( names[i] ) != types.end() );
+			int failed = PyList_Append( indexed ? indexed_list : unindexed_list, name );
+			Py_DECREF( name );
+			if( failed ) break;
+		}
+
+		if( i == names.size() ) {
+			result = Py_BuildValue( "{s:O,s:O}", "indexed", indexed_list,
+									"unindexed", unindexed_list );
+		}
+	}
+
+	Py_XDECREF( indexed_list );
+	Py_XDECREF( unindexed_list );
+	return result;
+}
+
+// ----------------------------------------------------------------------
+// Rebuild a volume's indexes from the files on it
+//
+// args:
+// 	volume = /boot (optional)
+// 	names = None (optional; only these indexes)
+
+static PyObject *bfs_rescan_indexes( PyObject *self, PyObject *args )
+{
+	// self isn't used for normal functions
+	self = self;
+
+	char *volume = (char *)"/boot";
+	PyObject *names_obj = Py_None;
+	string root;
+
+	if( !PyArg_ParseTuple( args, "|sO", &volume, &names_obj ) ) {
+		PyErr_SetString( PyExc_TypeError, "volume must be a path" );
+		return NULL;
+	}
+
+	vector<string> names;
+	if( Py_None != names_obj ) {
+		if( NULL == get_fsattr_api() ) return NULL;
+		if( !fsattr_api->parse_attr_names( names_obj, names ) ) return NULL;
+	}
+	if( !volume_root( volume, root ) ) return NULL;
+
+	bool ok;
+	int error;
+	uint64 files = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = index_rescan( root, Py_None == names_obj ? NULL : &names, files );
+	error = errno;
+	Py_END_ALLOW_THREADS
+
+	if( !ok ) {
+		raise_index_error( "rescan", root.c_str(), error );
+		return NULL;
+	}
+
+	return PyLong_FromUnsignedLongLong( files );
+}
+#endif // __linux__
 
 // ----------------------------------------------------------------------
-// Perform a query
+// Live queries.  After the initial results a live query keeps reporting
+// entries that start or stop matching.  A thread collects those events
+// into a queue and pokes a pipe, so the pipe can go into select() or an
+// asyncio loop; read_events() then empties the queue.
+//
+// On Haiku the events come from the query's notification port.  On Linux
+// a stand-in watches a directory tree with inotify; it only understands
+// name == "pattern" queries, which is enough for testing.
+
+#ifdef __linux__
+#define LIVE_ENTRY_CREATED	1	// same values as B_ENTRY_CREATED and
+#define LIVE_ENTRY_REMOVED	2	// B_ENTRY_REMOVED from NodeMonitor.h
+#else
+#define LIVE_ENTRY_CREATED	B_ENTRY_CREATED
+#define LIVE_ENTRY_REMOVED	B_ENTRY_REMOVED
+#define LIVE_QUERY_PORT_CAPACITY	256
+#endif
+
+struct LiveEvent {
+	int opcode;
+	dev_t device;
+	ino_t directory;
+	ino_t node;
+	string name;
+	string path;		// empty if it couldn't be found
+};
+
+#ifdef __linux__
+struct InotifyDir {
+	string path;
+	ino_t inode;
+	map<string, ino_t> children;	// so removals can report the node
+};
+#endif
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *results;			// paths matching when the query started
+	int event_pipe[2];			// read end is handed out by fileno()
+	pthread_mutex_t lock;		// protects events
+	deque<LiveEvent> *events;
+	bool thread_started;
+	pthread_t thread;
+#ifdef __linux__
+	dev_t device;
+	int inotify_fd;
+	int stop_pipe[2];			// wakes the thread up for close()
+	map<int, InotifyDir> *dirs;	// keyed by watch descriptor
+	string *pattern;
+#else
+	DIR *qdir;
+	port_id port;
+#endif
+} LiveQueryObject;
+
+static void live_query_push( LiveQueryObject *self, const LiveEvent &event )
+{
+	pthread_mutex_lock( &self->lock );
+	bool was_empty = self->events->empty();
+	self->events->push_back( event );
+	pthread_mutex_unlock( &self->lock );
+
+	// One byte per batch is enough to wake up select(); read_events()
+	// empties the pipe when it empties the queue.
+	if( was_empty ) {
+		char poke = 0;
+		(void)write( self->event_pipe[1], &poke, 1 );
+	}
+}
+
+#ifdef __linux__
+// Turn the paths into a Python list.
+static PyObject *path_list( const vector<string> &paths )
+{
+	PyObject *query_list = PyList_New( paths.size() );
+	if( NULL == query_list ) return PyErr_NoMemory();
+
+	for( size_t i = 0; i < paths.size(); i++ ) {
+		PyObject *entry = PyString_FromString( paths[i].c_str() );
+		if( NULL == entry ) {
+			Py_DECREF( query_list );
+			return NULL;
+		}
+		PyList_SET_ITEM( query_list, i, entry );
+	}
+
+	return query_list;
+}
+
+// Only name == "pattern" queries (optionally in parentheses) work here.
+static bool live_query_parse_pattern( const char *query, string &pattern )
+{
+	string q( query );
+	string::size_type start = q.find_first_not_of( " \t(" );
+	string::size_type end = q.find_last_not_of( " \t)" );
+	if( start == string::npos || end == string::npos ) return false;
+	q = q.substr( start, end - start + 1 );
+
+	if( q.compare( 0, 4, "name" ) != 0 ) return false;
+	string::size_type pos = q.find_first_not_of( " \t", 4 );
+	if( pos == string::npos || q.compare( pos, 2, "==" ) != 0 ) return false;
+	pos = q.find_first_not_of( " \t", pos + 2 );
+	if( pos == string::npos ) return false;
+
+	pattern = q.substr( pos );
+	if( pattern.size() >= 2 && pattern[0] == '"' && 
+		pattern[pattern.size() - 1] == '"' ) {
+		pattern = pattern.substr( 1, pattern.size() - 2 );
+	}
+
+	return !pattern.empty();
+}
+
+// Watch a directory and everything under it.  Matching entries go into
+// initial if it's given, otherwise they're reported as created (for
+// directories that showed up after the query started).
+static void live_query_watch_tree( LiveQueryObject *self, const string &path,
+								   ino_t inode, vector<string> *initial )
+{
+	int wd = inotify_add_watch( self->inotify_fd, path.c_str(),
+								IN_CREATE | IN_DELETE | IN_MOVED_FROM | 
+								IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW );
+	if( wd < 0 ) return;
+
+	InotifyDir &dir = ( *self->dirs )[wd];
+	dir.path = path;
+	dir.inode = inode;
+
+	DIR *d = opendir( path.c_str() );
+	if( NULL == d ) return;
+
+	struct dirent *ent;
+	vector<pair<string, ino_t> > subdirs;
+	while( NULL != ( ent = readdir( d ) ) ) {
+		if( strcmp( ent->d_name, "." ) == 0 || strcmp( ent->d_name, ".." ) == 0 ) continue;
+
+		string child = path + "/" + ent->d_name;
+		struct stat st;
+		if( lstat( child.c_str(), &st ) != 0 ) continue;
+
+		( *self->dirs )[wd].children[ent->d_name] = st.st_ino;
+		if( fnmatch( self->pattern->c_str(), ent->d_name, 0 ) == 0 ) {
+			if( initial ) {
+				initial->push_back( child );
+			} else {
+				LiveEvent event;
+				event.opcode = LIVE_ENTRY_CREATED;
+				event.device = st.st_dev;
+				event.directory = inode;
+				event.node = st.st_ino;
+				event.name = ent->d_name;
+				event.path = child;
+				live_query_push( self, event );
+			}
+		}
+		if( S_ISDIR( st.st_mode ) ) subdirs.push_back( make_pair( child, st.st_ino ) );
+	}
+	closedir( d );
+
+	for( size_t i = 0; i < subdirs.size(); i++ ) {
+		live_query_watch_tree( self, subdirs[i].first, subdirs[i].second, initial );
+	}
+}
+
+static void *live_query_thread( void *data )
+{
+	LiveQueryObject *self = static_cast<LiveQueryObject *>( data );
+	char buffer[4096] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+
+	for( ;; ) {
+		struct pollfd fds[2];
+		fds[0].fd = self->inotify_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = self->stop_pipe[0];
+		fds[1].events = POLLIN;
+		if( poll( fds, 2, -1 ) < 0 ) {
+			if( errno == EINTR ) continue;
+			break;
+		}
+		if( fds[1].revents ) break;	// close() wants us gone
+
+		ssize_t len = read( self->inotify_fd, buffer, sizeof( buffer ) );
+		if( len <= 0 ) {
+			if( len < 0 && ( errno == EINTR || errno == EAGAIN ) ) continue;
+			break;
+		}
+
+		for( char *ptr = buffer; ptr < buffer + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)ptr;
+			ptr += sizeof( struct inotify_event ) + ev->len;
+
+			if( ev->mask & IN_IGNORED ) {
+				self->dirs->erase( ev->wd );
+				continue;
+			}
+
+			map<int, InotifyDir>::iterator dir = self->dirs->find( ev->wd );
+			if( dir == self->dirs->end() || 0 == ev->len ) continue;
+
+			LiveEvent event;
+			event.device = self->device;
+			event.directory = dir->second.inode;
+			event.name = ev->name;
+			event.path = dir->second.path + "/" + ev->name;
+			bool matches = ( fnmatch( self->pattern->c_str(), ev->name, 0 ) == 0 );
+
+			if( ev->mask & ( IN_CREATE | IN_MOVED_TO ) ) {
+				struct stat st;
+				if( lstat( event.path.c_str(), &st ) != 0 ) continue;
+				dir->second.children[event.name] = st.st_ino;
+
+				if( matches ) {
+					event.opcode = LIVE_ENTRY_CREATED;
+					event.node = st.st_ino;
+					live_query_push( self, event );
+				}
+				if( S_ISDIR( st.st_mode ) ) {
+					live_query_watch_tree( self, event.path, st.st_ino, NULL );
+				}
+			} else if( ev->mask & ( IN_DELETE | IN_MOVED_FROM ) ) {
+				map<string, ino_t>::iterator child = dir->second.children.find( event.name );
+				event.node = 0;
+				if( child != dir->second.children.end() ) {
+					event.node = child->second;
+					dir->second.children.erase( child );
+				}
+
+				if( matches ) {
+					event.opcode = LIVE_ENTRY_REMOVED;
+					live_query_push( self, event );
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+#else
+static void *live_query_thread( void *data )
+{
+	LiveQueryObject *self = static_cast<LiveQueryObject *>( data );
+
+	for( ;; ) {
+		// Fails with B_BAD_PORT_ID once close() deletes the port.
+		ssize_t size = port_buffer_size( self->port );
+		if( size < 0 ) break;
+
+		char *buffer = (char *)malloc( size > 0 ? size : 1 );
+		if( NULL == buffer ) break;
+
+		int32 code;
+		ssize_t got = read_port( self->port, &code, buffer, size );
+		if( got < 0 ) {
+			free( buffer );
+			break;
+		}
+
+		BMessage message;
+		int32 opcode;
+		int32 device;
+		int64 directory;
+		int64 node;
+		const char *name = NULL;
+
+		if( message.Unflatten( buffer ) == B_OK && 
+			message.what == B_QUERY_UPDATE &&
+			message.FindInt32( "opcode", &opcode ) == B_OK &&
+			( opcode == B_ENTRY_CREATED || opcode == B_ENTRY_REMOVED ) &&
+			message.FindInt32( "device", &device ) == B_OK &&
+			message.FindInt64( "directory", &directory ) == B_OK &&
+			message.FindInt64( "node", &node ) == B_OK ) {
+			LiveEvent event;
+			event.opcode = opcode;
+			event.device = device;
+			event.directory = directory;
+			event.node = node;
+			if( message.FindString( "name", &name ) == B_OK ) {
+				event.name = name;
+
+				// The directory is still there for removed entries, so
+				// this works for both kinds of event.
+				entry_ref ref( device, directory, name );
+				BPath path( &ref );
+				if( path.InitCheck() == B_OK ) event.path = path.Path();
+			}
+
+			live_query_push( self, event );
+		}
+
+		free( buffer );
+	}
+
+	return NULL;
+}
+#endif
+
+// Stop the event thread and let go of the query; events already in the
+// queue can still be read.
+static void live_query_close( LiveQueryObject *self )
+{
+#ifdef __linux__
+	if( self->thread_started ) {
+		char poke = 0;
+		(void)write( self->stop_pipe[1], &poke, 1 );
+	}
+#else
+	// Closing the query stops the notifications, deleting the port wakes
+	// up the thread.
+	if( NULL != self->qdir ) {
+		(void)fs_close_query( self->qdir );
+		self->qdir = NULL;
+	}
+	if( self->port >= 0 ) {
+		(void)delete_port( self->port );
+		self->port = -1;
+	}
+#endif
+
+	if( self->thread_started ) {
+		Py_BEGIN_ALLOW_THREADS
+		pthread_join( self->thread, NULL );
+		Py_END_ALLOW_THREADS
+		self->thread_started = false;
+	}
+
+#ifdef __linux__
+	if( self->inotify_fd >= 0 ) {
+		close( self->inotify_fd );
+		self->inotify_fd = -1;
+	}
+	for( int i = 0; i < 2; i++ ) {
+		if( self->stop_pipe[i] >= 0 ) {
+			close( self->stop_pipe[i] );
+			self->stop_pipe[i] = -1;
+		}
+	}
+#endif
+	for( int i = 0; i < 2; i++ ) {
+		if( self->event_pipe[i] >= 0 ) {
+			close( self->event_pipe[i] );
+			self->event_pipe[i] = -1;
+		}
+	}
+}
+
+static void live_query_dealloc( LiveQueryObject *self )
+{
+	live_query_close( self );
+	Py_XDECREF( self->results );
+	delete self->events;
+#ifdef __linux__
+	delete self->dirs;
+	delete self->pattern;
+#endif
+	pthread_mutex_destroy( &self->lock );
+	self->ob_type->tp_free( (PyObject *)self );
+}
+
+// ----------------------------------------------------------------------
+// Start a live query
 //
 // args:
 // 	query
-//  volume = /boot (optional)
-//  flags = 0 (optional)
+//  volume = /boot (optional; on Linux, the root of the tree to watch)
 
-static PyObject *bfs_query( PyObject *self, PyObject *args )
+static PyObject *live_query_new( PyTypeObject *type, PyObject *args, PyObject *kwds )
 {
-	// self isn't used for normal functions
-	self = self;
+	// kwds isn't used, we only take positional arguments
+	kwds = kwds;
 
 	char *query;
 	char *volume = NULL;
-	uint32 flags = 0;
-	dev_t vol_dev = dev_for_path( "/boot" );
 
-	if( PyArg_ParseTuple( args, "s|si", &query, &volume, &flags ) ) {
-		// three arguments, two are optional
-		if( NULL != volume ) vol_dev = dev_for_path( volume );
-		if( 0 != flags ) {
-			PyErr_SetString( PyExc_ValueError, "don't use flags" );
-			return NULL;
-		}
-	} else {
+	if( !PyArg_ParseTuple( args, "s|s", &query, &volume ) ) {
 		PyErr_SetString( PyExc_TypeError, "you must specify a query string" );
 		return NULL;
 	}
 
-	DIR *qdir = fs_open_query( vol_dev, query, flags );
-	if( NULL == qdir ) {
+	LiveQueryObject *self = (LiveQueryObject *)type->tp_alloc( type, 0 );
+	if( NULL == self ) return NULL;
+
+	// Everything dealloc looks at has to be sane before the first return.
+	self->results = NULL;
+	self->event_pipe[0] = self->event_pipe[1] = -1;
+	pthread_mutex_init( &self->lock, NULL );
+	self->events = new deque<LiveEvent>;
+	self->thread_started = false;
+#ifdef __linux__
+	self->inotify_fd = -1;
+	self->stop_pipe[0] = self->stop_pipe[1] = -1;
+	self->dirs = new map<int, InotifyDir>;
+	self->pattern = new string;
+#else
+	self->qdir = NULL;
+	self->port = -1;
+#endif
+
+	if( pipe( self->event_pipe ) != 0 ) {
+		PyErr_SetFromErrno( PyExc_IOError );
+		Py_DECREF( self );
+		return NULL;
+	}
+	for( int i = 0; i < 2; i++ ) {
+		fcntl( self->event_pipe[i], F_SETFL, O_NONBLOCK );
+		fcntl( self->event_pipe[i], F_SETFD, FD_CLOEXEC );
+	}
+
+#ifdef __linux__
+	if( NULL == volume ) volume = (char *)"/boot";
+	if( !live_query_parse_pattern( query, *self->pattern ) ) {
+		PyErr_SetString( PyExc_ValueError, 
+						 "the Linux stand-in only handles name == \"pattern\" queries" );
+		Py_DECREF( self );
+		return NULL;
+	}
+
+	struct stat st;
+	self->inotify_fd = inotify_init();
+	if( self->inotify_fd < 0 || pipe( self->stop_pipe ) != 0 || 
+		stat( volume, &st ) != 0 ) {
 		try {
 			strstream s;
-			s << "error with query \"" << query << "\": "
+			s << "can't watch \"" << volume << "\": "
 			  << strerror( errno ) << ends;
 			PyErr_SetString( PyExc_RuntimeError, s.str() );
 		} catch ( ... ) {
 			PyErr_SetString( PyExc_RuntimeError, strerror( errno ) );
 		}
 
+		Py_DECREF( self );
 		return NULL;
 	}
+	self->device = st.st_dev;
 
-	PyObject *query_list = PyList_New( 0 );
-	if( NULL == query_list ) {
-		(void)fs_close_query( qdir );
-		return PyErr_NoMemory();
+	vector<string> initial;
+	string root( volume );
+	while( root.size() > 1 && root[root.size() - 1] == '/' ) root.erase( root.size() - 1 );
+
+	Py_BEGIN_ALLOW_THREADS
+	live_query_watch_tree( self, root, st.st_ino, &initial );
+	Py_END_ALLOW_THREADS
+
+	self->results = path_list( initial );
+	if( NULL == self->results ) {
+		Py_DECREF( self );
+		return NULL;
 	}
+#else
+	dev_t vol_dev = volume_dev_for_path( NULL == volume ? "/boot" : volume );
 
-	struct dirent *qent;
-	while( NULL != ( qent = fs_read_query( qdir ) ) ) {
-		char buff[B_PATH_NAME_LENGTH];
-		status_t retval = get_path_for_dirent( qent, buff, B_PATH_NAME_LENGTH );
-		if( retval != B_OK ) continue;	// throw an exception instead?
+	self->port = create_port( LIVE_QUERY_PORT_CAPACITY, "haikuglue live query" );
+	if( self->port < 0 ) {
+		PyErr_SetString( PyExc_RuntimeError, strerror( self->port ) );
+		Py_DECREF( self );
+		return NULL;
+	}
 
-		PyObject *entry = PyString_FromString( buff );
-		if( NULL == entry ) {
-			(void)fs_close_query( qdir );
-			return PyErr_NoMemory();
+	int error;
+	Py_BEGIN_ALLOW_THREADS
+	self->qdir = fs_open_live_query( vol_dev, query, B_LIVE_QUERY, self->port, 0 );
+	error = errno;
+	Py_END_ALLOW_THREADS
+
+	if( NULL == self->qdir ) {
+		try {
+			strstream s;
+			s << "error with query \"" << query << "\": "
+			  << strerror( error ) << ends;
+			PyErr_SetString( PyExc_RuntimeError, s.str() );
+		} catch ( ... ) {
+			PyErr_SetString( PyExc_RuntimeError, strerror( error ) );
 		}
 
-		if( PyList_Append( query_list, entry ) ) continue;	// throw an exception instead/
+		Py_DECREF( self );
+		return NULL;
 	}
 
-	(void)fs_close_query( qdir );
-	
-	Py_INCREF( query_list );
-	return query_list;
+	self->results = read_query_paths( self->qdir );
+	if( NULL == self->results ) {
+		Py_DECREF( self );
+		return NULL;
+	}
+#endif
+
+	if( pthread_create( &self->thread, NULL, live_query_thread, self ) != 0 ) {
+		PyErr_SetString( PyExc_RuntimeError, "can't start the live query thread" );
+		Py_DECREF( self );
+		return NULL;
+	}
+	self->thread_started = true;
+
+	return (PyObject *)self;
+}
+
+static PyObject *live_query_fileno( LiveQueryObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	if( self->event_pipe[0] < 0 ) {
+		PyErr_SetString( PyExc_ValueError, "live query is closed" );
+		return NULL;
+	}
+
+	return PyInt_FromLong( self->event_pipe[0] );
+}
+
+static PyObject *live_query_read_events( LiveQueryObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	deque<LiveEvent> events;
+
+	pthread_mutex_lock( &self->lock );
+	events.swap( *self->events );
+	if( self->event_pipe[0] >= 0 ) {
+		char junk[64];
+		while( read( self->event_pipe[0], junk, sizeof( junk ) ) > 0 ) ;
+	}
+	pthread_mutex_unlock( &self->lock );
+
+	PyObject *event_list = PyList_New( events.size() );
+	if( NULL == event_list ) return NULL;
+
+	for( size_t i = 0; i < events.size(); i++ ) {
+		const LiveEvent &event = events[i];
+		PyObject *the_event;
+		if( event.path.empty() ) {
+			the_event = Py_BuildValue( "(iLLLsO)", event.opcode,
+									   (PY_LONG_LONG)event.device,
+									   (PY_LONG_LONG)event.directory,
+									   (PY_LONG_LONG)event.node,
+									   event.name.c_str(), Py_None );
+		} else {
+			the_event = Py_BuildValue( "(iLLLss)", event.opcode,
+									   (PY_LONG_LONG)event.device,
+									   (PY_LONG_LONG)event.directory,
+									   (PY_LONG_LONG)event.node,
+									   event.name.c_str(), event.path.c_str() );
+		}
+
+		if( NULL == the_event ) {
+			Py_DECREF( event_list );
+			return NULL;
+		}
+		PyList_SET_ITEM( event_list, i, the_event );
+	}
+
+	return event_list;
+}
+
+static PyObject *live_query_close_method( LiveQueryObject *self, PyObject *args )
+{
+	// args isn't used, METH_NOARGS
+	args = args;
+
+	live_query_close( self );
+
+	Py_INCREF( Py_None );
+	return Py_None;
 }
 
+static PyMethodDef live_query_methods[] = {
+	{
+		"fileno",
+		(PyCFunction)live_query_fileno,
+		METH_NOARGS,
+		"fileno()\n" \
+		"\n" \
+		"Returns a file descriptor that becomes readable when events are\n" \
+		"waiting, for use with select(), poll() or an asyncio loop.  Don't\n" \
+		"read it yourself, read_events() does that."
+	},
+	{
+		"read_events",
+		(PyCFunction)live_query_read_events,
+		METH_NOARGS,
+		"read_events()\n" \
+		"\n" \
+		"Returns the events that arrived since the last call, without\n" \
+		"waiting; the list is empty if there aren't any.  Each event is a\n" \
+		"tuple ( opcode, device, directory, node, name, path ) where opcode\n" \
+		"is ENTRY_CREATED or ENTRY_REMOVED and path is None if it couldn't\n" \
+		"be found."
+	},
+	{
+		"close",
+		(PyCFunction)live_query_close_method,
+		METH_NOARGS,
+		"close()\n" \
+		"\n" \
+		"Stop the live query.  Events that already arrived can still be\n" \
+		"read with read_events()."
+	},
+	{ // sentinel
+		NULL,	// name
+		NULL,	// function
+		0,		// flags
+		""		// docstring
+	}
+};
+
+static PyMemberDef live_query_members[] = {
+	{
+		(char *)"results",
+		T_OBJECT,
+		offsetof( LiveQueryObject, results ),
+		READONLY,
+		(char *)"List of the paths that matched when the query started."
+	},
+	{ NULL, 0, 0, 0, NULL }	// sentinel
+};
+
+static PyTypeObject LiveQueryType = {
+	PyObject_HEAD_INIT( NULL )
+	0,									// ob_size
+	"_fsquery.LiveQuery",				// tp_name
+	sizeof( LiveQueryObject ),			// tp_basicsize
+	0,									// tp_itemsize
+	(destructor)live_query_dealloc,		// tp_dealloc
+	0,									// tp_print
+	0,									// tp_getattr
+	0,									// tp_setattr
+	0,									// tp_compare
+	0,									// tp_repr
+	0,									// tp_as_number
+	0,									// tp_as_sequence
+	0,									// tp_as_mapping
+	0,									// tp_hash
+	0,									// tp_call
+	0,									// tp_str
+	0,									// tp_getattro
+	0,									// tp_setattro
+	0,									// tp_as_buffer
+	Py_TPFLAGS_DEFAULT,					// tp_flags
+	"LiveQuery( query_string, device = \"/boot\" )\n" \
+	"\n" \
+	"Start a live query.  The paths matching right away are in the results\n" \
+	"attribute; after that, entries that start or stop matching are\n" \
+	"reported as events, see fileno() and read_events().\n" \
+	"\n" \
+	"On Linux this is a stand-in for testing: device is the root of a\n" \
+	"directory tree watched with inotify, and only name == \"pattern\"\n" \
+	"queries are understood.",			// tp_doc
+	0,									// tp_traverse
+	0,									// tp_clear
+	0,									// tp_richcompare
+	0,									// tp_weaklistoffset
+	0,									// tp_iter
+	0,									// tp_iternext
+	live_query_methods,					// tp_methods
+	live_query_members,					// tp_members
+	0,									// tp_getset
+	0,									// tp_base
+	0,									// tp_dict
+	0,									// tp_descr_get
+	0,									// tp_descr_set
+	0,									// tp_dictoffset
+	0,									// tp_init
+	0,									// tp_alloc
+	live_query_new,						// tp_new
+};
+
 // ----------------------------------------------------------------------
 // List of functions defined in the module
 static PyMethodDef fsquery_methods[] = {
 	{
 		"query",
-		bfs_query,
-		METH_VARARGS,
-		"query( query_string, device = \"/boot\", flags = 0 )\n" \
+		(PyCFunction)bfs_query,
+		METH_VARARGS | METH_KEYWORDS,
+		"query( query_string, device = \"/boot\", flags = 0, refs = False,\n" \
+		"       attrs = None, cached = False, limit = -1, offset = 0 )\n" \
 		"\n" \
 		"Perform a one-shot query.  The query_string must be a standard BeOS\n" \
-		"query, specified as a string.  Device can be any path, and defaults\n" \
-		"to your boot volume; it specifies the volume that will be queried.\n" \
+		"query, specified as a string.  Device can be any path or a Volume,\n" \
+		"and defaults to your boot volume; it specifies the volume that will\n" \
+		"be queried.\n" \
 		"flags must currently be 0, so don't bother specifying it.\n" \
 		"\n" \
-		"Returns a list of paths."
+		"Returns a list of paths.  If refs is true, it returns a list of\n" \
+		"EntryRef objects instead; they only find their path if you ask\n" \
+		"for it, which saves time if you just want to count the hits.\n" \
+		"\n" \
+		"If attrs is a list of attribute names, those attributes are read\n" \
+		"for each hit as the query goes, and each item of the list is a\n" \
+		"( path or EntryRef, attributes ) tuple where attributes is a\n" \
+		"dictionary like read_attrs() returns.  Missing attributes are left\n" \
+		"out, symlinks aren't traversed, and files that vanish before their\n" \
+		"attributes can be read are skipped.\n" \
+		"\n" \
+		"If cached is true, the hits are kept in the query cache and the\n" \
+		"next cached query for the same volume and query string is\n" \
+		"answered from there; a live query keeps the cached hits up to date.\n" \
+		"See set_query_cache_limits().\n" \
+		"\n" \
+		"offset skips that many hits and limit, unless it's negative, stops\n" \
+		"after that many, both counting only hits that would be returned;\n" \
+		"the query is closed as soon as it has enough, so the first page of\n" \
+		"a big query is cheap.  To page through a query\n" \
+		"without running it again, use iquery() and its fetch() method.\n" \
+		"\n" \
+		"On Linux the query runs on the indexes kept by create_index() and\n" \
+		"rescan_indexes(); device is any path in the indexed tree, refs\n" \
+		"isn't available and cached is ignored.  The indexes go by path, so\n" \
+		"a file that's renamed or moved drops out of the hits until\n" \
+		"rescan_indexes() is run."
+	},
+#ifndef __linux__
+	{
+		"iquery",
+		(PyCFunction)bfs_iquery,
+		METH_VARARGS | METH_KEYWORDS,
+		"iquery( query_string, device = \"/boot\", flags = 0, chunk_size = 64,\n" \
+		"        refs = False, attrs = None, offset = 0 )\n" \
+		"\n" \
+		"Like query(), but returns an iterator over the paths instead of a\n" \
+		"list.  The query is read chunk_size entries at a time as you iterate,\n" \
+		"so the first paths show up before the whole volume has been scanned\n" \
+		"and only one chunk of paths is in memory at once.  The query is\n" \
+		"closed when the iterator is used up, hits an error, is closed with\n" \
+		"its close() method or is garbage collected.  With refs true, it\n" \
+		"hands out EntryRef objects instead of paths, and attrs prefetches\n" \
+		"attributes, like query().  offset skips that many hits first.\n" \
+		"\n" \
+		"The iterator's fetch( count ) method returns the next count results\n" \
+		"as a list, so pages of results can be read off the same open query."
+	},
+	{
+		"query_all",
+		bfs_query_all,
+		METH_VARARGS,
+		"query_all( query_string )\n" \
+		"\n" \
+		"Perform a one-shot query on every mounted volume that supports\n" \
+		"queries.  The volumes are queried in parallel, one thread each,\n" \
+		"so it takes about as long as the slowest volume.\n" \
+		"\n" \
+		"Returns an iterator over the paths from all the volumes, in the\n" \
+		"order they are found.  Volumes where the query can't be run are\n" \
+		"skipped; RuntimeError is raised only if it fails on all of them."
+	},
+	{
+		"volumes",
+		bfs_volumes,
+		METH_NOARGS,
+		"volumes()\n" \
+		"\n" \
+		"Returns a list of Volume objects for the mounted volumes.  The list\n" \
+		"of volumes is read once and kept up to date as volumes are mounted\n" \
+		"and unmounted."
+	},
+	{
+		"volume_for_path",
+		bfs_volume_for_path,
+		METH_VARARGS,
+		"volume_for_path( path )\n" \
+		"\n" \
+		"Returns the Volume the path is on."
+	},
+#endif
+	{
+		"create_index",
+		bfs_create_index,
+		METH_VARARGS,
+		"create_index( name, index_type, volume = \"/boot\" )\n" \
+		"\n" \
+		"Create an index for the named attribute on the volume holding the\n" \
+		"given path.  index_type can be a four-character string or a number,\n" \
+		"like write_attr() takes; BFS indexes strings, integers, floats and\n" \
+		"doubles.  Files written before the index was made aren't in it."
+	},
+	{
+		"remove_index",
+		bfs_remove_index,
+		METH_VARARGS,
+		"remove_index( name, volume = \"/boot\" )\n" \
+		"\n" \
+		"Remove the named attribute's index from the volume."
+	},
+	{
+		"list_indexes",
+		bfs_list_indexes,
+		METH_VARARGS,
+		"list_indexes( volume = \"/boot\" )\n" \
+		"\n" \
+		"Returns a list of the names of the volume's indexes."
+	},
+	{
+		"stat_index",
+		bfs_stat_index,
+		METH_VARARGS,
+		"stat_index( name, volume = \"/boot\" )\n" \
+		"\n" \
+		"Returns a dictionary with the named index's type, size,\n" \
+		"modification_time, creation_time, uid and gid."
+	},
+	{
+		"explain",
+		bfs_explain,
+		METH_VARARGS,
+		"explain( query_string, volume = \"/boot\" )\n" \
+		"\n" \
+		"Look up the attributes a query compares in the volume's indexes.\n" \
+		"Returns a dictionary with an \"indexed\" and an \"unindexed\" list\n" \
+		"of attribute names.  A query needs at least one indexed attribute\n" \
+		"to run at all, and every unindexed one has to be checked file by\n" \
+		"file against what the indexed ones turn up."
+	},
+#ifdef __linux__
+	{
+		"rescan_indexes",
+		bfs_rescan_indexes,
+		METH_VARARGS,
+		"rescan_indexes( volume = \"/boot\", names = None )\n" \
+		"\n" \
+		"Rebuild the indexes of the volume (the indexed tree holding the\n" \
+		"given path) from the files on it, or only the named indexes, and\n" \
+		"return how many files were looked at.  Attribute writes keep the\n" \
+		"indexes up to date; this picks up files written before an index\n" \
+		"was created, renamed or deleted files, and the built-in name, size\n" \
+		"and last_modified indexes, which only change here."
+	},
+#else
+	{
+		"set_path_cache_size",
+		bfs_set_path_cache_size,
+		METH_VARARGS,
+		"set_path_cache_size( entries )\n" \
+		"\n" \
+		"Set how many directory paths EntryRef.path remembers; 0 turns the\n" \
+		"cache off.  The default is 1024."
+	},
+	{
+		"clear_path_cache",
+		bfs_clear_path_cache,
+		METH_NOARGS,
+		"clear_path_cache()\n" \
+		"\n" \
+		"Forget the remembered directory paths, for instance after renaming\n" \
+		"directories."
+	},
+	{
+		"path_cache_stats",
+		bfs_path_cache_stats,
+		METH_NOARGS,
+		"path_cache_stats()\n" \
+		"\n" \
+		"Returns a dictionary with the path cache's hits, misses, entries\n" \
+		"and size."
+	},
+	{
+		"set_query_cache_limits",
+		bfs_set_query_cache_limits,
+		METH_VARARGS,
+		"set_query_cache_limits( entries, bytes = 4194304, port_capacity = 256 )\n" \
+		"\n" \
+		"Set how many queries the query cache keeps, and roughly how much\n" \
+		"memory their hits may take; the least recently used queries go\n" \
+		"first.  0 entries turns the cache off.  The default is 32 queries\n" \
+		"in 4MB.  port_capacity is how many live query notifications a\n" \
+		"query can collect between two looks before it has to be run from\n" \
+		"scratch; raise it for busy volumes.  It applies to queries cached\n" \
+		"from then on."
+	},
+	{
+		"clear_query_cache",
+		bfs_clear_query_cache,
+		METH_NOARGS,
+		"clear_query_cache()\n" \
+		"\n" \
+		"Forget all the cached queries and close their live queries."
 	},
+	{
+		"query_cache_stats",
+		bfs_query_cache_stats,
+		METH_NOARGS,
+		"query_cache_stats()\n" \
+		"\n" \
+		"Returns a dictionary with the query cache's hits, misses, updates\n" \
+		"(live query notifications applied), overflows (queries thrown out\n" \
+		"because notifications may have been lost), entries, bytes,\n" \
+		"max_entries, max_bytes and port_capacity."
+	},
+#endif
 	{ // sentinel
 		NULL,	// name
 		NULL,	// function
@@ -121,10 +3708,29 @@ extern "C" DL_EXPORT(PyObject *) init_fsquery( void )
 	PyObject *mod = Py_InitModule4( "_fsquery", fsquery_methods, 
 									"Filesystem queries:\n" \
 									"\n" \
-									"query() - perform a query\n",
+									"query() - perform a query\n" \
+									"iquery() - perform a query, iterating over the results\n" \
+									"query_all() - perform a query on all volumes at once\n" \
+									"LiveQuery - a query that keeps reporting changes\n",
 									static_cast<PyObject *>( NULL ),
 									PYTHON_API_VERSION );
 
+#ifndef __linux__
+	if( PyType_Ready( &QueryIterType ) < 0 ) return mod;
+	if( PyType_Ready( &QueryAllIterType ) < 0 ) return mod;
+	if( PyType_Ready( &EntryRefType ) < 0 ) return mod;
+	Py_INCREF( &EntryRefType );
+	PyModule_AddObject( mod, "EntryRef", (PyObject *)&EntryRefType );
+	if( PyType_Ready( &VolumeType ) < 0 ) return mod;
+	Py_INCREF( &VolumeType );
+	PyModule_AddObject( mod, "Volume", (PyObject *)&VolumeType );
+#endif
+	if( PyType_Ready( &LiveQueryType ) < 0 ) return mod;
+	Py_INCREF( &LiveQueryType );
+	PyModule_AddObject( mod, "LiveQuery", (PyObject *)&LiveQueryType );
+	PyModule_AddIntConstant( mod, "ENTRY_CREATED", LIVE_ENTRY_CREATED );
+	PyModule_AddIntConstant( mod, "ENTRY_REMOVED", LIVE_ENTRY_REMOVED );
+
 	// Add some symbolic constants to the module
 	PyObject *dict = PyModule_GetDict( mod );
 	PyDict_SetItemString( dict, "__rcs_id__", 
@@ -0,0 +1,171 @@
+// haikuglue.storage._fsattr C interface
+//
+// The _fsattr module exports the raw attribute reading and conversion
+// behind read_attrs() through a capsule, so the other
+// extension modules (query prefetch, for one) read and convert attributes
+// exactly the same way without going back through Python.
+//
+
+#ifndef FSATTR_API_H
+#define FSATTR_API_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#define FSATTR_API_CAPSULE	"haikuglue.storage._fsattr._C_API"
+#define FSATTR_API_VERSION	6
+
+// Memory for the names and data of one file's attributes.  Small pieces
+// are packed into blocks that double in size up to RAW_ARENA_MAX_BLOCK,
+// so reading a file full of little attributes costs a malloc() or two
+// instead of one per attribute; big attributes get a block of their own.
+// It can start out in a buffer of the caller's (on its stack), which has
+// to outlive it.  Everything is freed with the arena.
+//
+// Building with RAW_ARENA_MALLOC_EACH defined (CFLAGS=-DRAW_ARENA_MALLOC_EACH)
+// gives every piece its own malloc() instead, which is what reading cost
+// before the arena; it's there for bench/dense_attrs.py to compare against.
+#define RAW_ARENA_FIRST_BLOCK	512
+#define RAW_ARENA_MAX_BLOCK		16384
+#define RAW_ARENA_STACK			1024	// suggested size for use()
+
+struct RawArena {
+	char *block;			// block being filled
+	size_t used;
+	size_t avail;
+	size_t next_size;		// size of the next block
+	vector<char *> chunks;	// malloc()ed blocks, to free
+
+	RawArena() : block( NULL ), used( 0 ), avail( 0 ), 
+				 next_size( RAW_ARENA_FIRST_BLOCK ) {}
+	// Copies start out empty; only empty RawAttrs get copied, by
+	// vector<RawAttrs>( n ).
+	RawArena( const RawArena & ) : block( NULL ), used( 0 ), avail( 0 ), 
+								   next_size( RAW_ARENA_FIRST_BLOCK ) {}
+	~RawArena() {
+		for( size_t i = 0; i < chunks.size(); i++ ) free( chunks[i] );
+	}
+
+	void use( char *buffer, size_t size ) {
+		block = buffer;
+		used = 0;
+		avail = size;
+	}
+
+	// Eight-byte aligned; NULL if there's no memory.
+	char *alloc( size_t size ) {
+		if( 0 == size ) size = 1;
+#ifdef RAW_ARENA_MALLOC_EACH
+		return own_block( size );
+#endif
+		size = ( size + 7 ) & ~(size_t)7;
+
+		if( size > avail - used ) {
+			if( size > RAW_ARENA_MAX_BLOCK / 2 ) return own_block( size );
+
+			while( next_size < size ) next_size *= 2;
+			char *fresh = own_block( next_size );
+			if( NULL == fresh ) return NULL;
+			block = fresh;
+			used = 0;
+			avail = next_size;
+			if( next_size < RAW_ARENA_MAX_BLOCK ) next_size *= 2;
+		}
+
+		char *ptr = block + used;
+		used += size;
+		return ptr;
+	}
+
+	char *copy_string( const char *str ) {
+		size_t size = strlen( str ) + 1;
+		char *ptr = alloc( size );
+		if( NULL != ptr ) memcpy( ptr, str, size );
+		return ptr;
+	}
+
+	// Called without the GIL, so running out of memory for chunks can't
+	// throw out of here.
+	char *own_block( size_t size ) {
+		char *ptr = (char *)malloc( size );
+		if( NULL == ptr ) return NULL;
+		try {
+			chunks.push_back( ptr );
+		} catch ( ... ) {
+			free( ptr );
+			return NULL;
+		}
+		return ptr;
+	}
+
+private:
+	// Never assigned; a copy of the pointers would be freed twice.
+	RawArena &operator=( const RawArena & );
+};
+
+// One attribute's raw data, read with the GIL released; the name and data
+// live in the RawAttrs' arena.
+struct RawAttr {
+	const char *name;
+	uint32 type;
+	char *data;			// NULL if only stat()ed
+	ssize_t size;
+
+	// B_REF_TYPE on Haiku: the path the entry_ref leads to, looked up while
+	// reading since that goes to the disk too.  If it couldn't be found,
+	// ref_path is NULL, ref_error says why and ref_no_entry whether it was
+	// the entry or its path that failed.
+	const char *ref_path;
+	int ref_error;
+	bool ref_no_entry;
+
+	RawAttr() : ref_path( NULL ), ref_error( 0 ), ref_no_entry( false ) {}
+};
+
+// Attributes bigger than this aren't read whole unless the caller asks
+// for more; the size comes from the file system, and a damaged or hostile
+// one shouldn't get to pick how much we malloc().
+#define RAW_ATTR_MAX_SIZE	( 64 * 1024 * 1024 )
+
+// All the attributes read from one file, or why that didn't work.
+struct RawAttrs {
+	enum { OK, OPEN_FAILED, ATTR_DIR_FAILED, NO_MEMORY, SHORT_READ, TOO_BIG };
+
+	vector<RawAttr> attrs;
+	RawArena arena;			// attrs' names and data
+	bool stat_only;			// set beforehand to skip reading the data
+	off_t max_size;			// biggest attribute to read, < 0 for any size
+	int status;				// one of the above
+	int error;				// errno when it went wrong
+	string failed_name;		// attribute that couldn't be read
+	ssize_t read_bytes;		// what we got for it...
+	off_t expected;			// ...and what we wanted (or its size, if TOO_BIG)
+
+	RawAttrs() : stat_only( false ), max_size( RAW_ATTR_MAX_SIZE ), status( OK ), 
+				 error( 0 ), read_bytes( 0 ), expected( 0 ) {}
+};
+
+struct FsAttrAPI {
+	int version;
+
+	// Read the attributes of an open file; names limits it to those
+	// attributes (missing ones are skipped), otherwise prefix limits it to
+	// the ones whose names start with it, and if both are NULL it's all of
+	// them.  Doesn't touch Python, so call it without the GIL.
+	void (*read_raw_attrs_fd)( int fd, int flags, const vector<string> *names,
+							   const char *prefix, RawAttrs &raw );
+
+	// Turn raw attributes into a read_attrs() style dictionary; needs the
+	// GIL, and returns NULL with an exception set if it fails.
+	PyObject *(*raw_attrs_to_dict)( const RawAttrs &raw );
+
+	// Get attribute names out of a Python sequence of strings; returns
+	// false with an exception set if it isn't one.
+	bool (*parse_attr_names)( PyObject *seq, vector<string> &names );
+};
+
+#endif // FSATTR_API_H
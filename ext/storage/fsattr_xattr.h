@@ -0,0 +1,434 @@
+// haikuglue.storage._fsattr on Linux
+//
+// The parts of the Haiku API that _fsattr uses, on top of Linux extended
+// attributes, so the same module (and the same Python code) runs on plain
+// Linux file servers.  Attributes are stored the way Haiku's own attribute
+// emulation stores them: a "user.haiku." xattr per attribute, holding the
+// type code (four bytes, host order) followed by the data.  Linux doesn't
+// allow user xattrs on symlinks, so ATTR_SYMLINK opens fail there.
+//
+
+#ifndef FSATTR_XATTR_H
+#define FSATTR_XATTR_H
+
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <time.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+typedef int8_t int8;
+typedef uint8_t uint8;
+typedef int16_t int16;
+typedef uint16_t uint16;
+typedef int32_t int32;
+typedef uint32_t uint32;
+typedef int64_t int64;
+typedef uint64_t uint64;
+typedef int32 status_t;
+
+#define B_OK		0
+#define B_ERROR		(-1)
+#define B_BAD_VALUE	EINVAL
+
+#define B_ATTR_NAME_LENGTH	256
+
+// Nothing to traverse on purpose; xattr calls don't care how the file was
+// opened, and directories can't be opened for writing.
+#define O_NOTRAVERSE	O_NOFOLLOW
+#define B_WRITE_ONLY	O_RDONLY
+
+// support/TypeConstants.h and storage/Mime.h
+enum {
+	B_AFFINE_TRANSFORM_TYPE			= 'AMTX',
+	B_ALIGNMENT_TYPE				= 'ALGN',
+	B_ANY_TYPE						= 'ANYT',
+	B_ATOM_TYPE						= 'ATOM',
+	B_ATOMREF_TYPE					= 'ATMR',
+	B_BOOL_TYPE						= 'BOOL',
+	B_CHAR_TYPE						= 'CHAR',
+	B_COLOR_8_BIT_TYPE				= 'CLRB',
+	B_DOUBLE_TYPE					= 'DBLE',
+	B_FLOAT_TYPE					= 'FLOT',
+	B_GRAYSCALE_8_BIT_TYPE			= 'GRYB',
+	B_INT16_TYPE					= 'SHRT',
+	B_INT32_TYPE					= 'LONG',
+	B_INT64_TYPE					= 'LLNG',
+	B_INT8_TYPE						= 'BYTE',
+	B_LARGE_ICON_TYPE				= 'ICON',
+	B_MEDIA_PARAMETER_GROUP_TYPE	= 'BMCG',
+	B_MEDIA_PARAMETER_TYPE			= 'BMCT',
+	B_MEDIA_PARAMETER_WEB_TYPE		= 'BMCW',
+	B_MESSAGE_TYPE					= 'MSGG',
+	B_MESSENGER_TYPE				= 'MSNG',
+	B_MIME_TYPE						= 'MIME',
+	B_MINI_ICON_TYPE				= 'MICN',
+	B_MONOCHROME_1_BIT_TYPE			= 'MNOB',
+	B_OBJECT_TYPE					= 'OPTR',
+	B_OFF_T_TYPE					= 'OFFT',
+	B_PATTERN_TYPE					= 'PATN',
+	B_POINTER_TYPE					= 'PNTR',
+	B_POINT_TYPE					= 'BPNT',
+	B_PROPERTY_INFO_TYPE			= 'SCTD',
+	B_RAW_TYPE						= 'RAWT',
+	B_RECT_TYPE						= 'RECT',
+	B_REF_TYPE						= 'RREF',
+	B_RGB_32_BIT_TYPE				= 'RGBB',
+	B_RGB_COLOR_TYPE				= 'RGBC',
+	B_SIZE_TYPE						= 'SIZE',
+	B_SIZE_T_TYPE					= 'SIZT',
+	B_SSIZE_T_TYPE					= 'SSZT',
+	B_STRING_TYPE					= 'CSTR',
+	B_STRING_LIST_TYPE				= 'STRL',
+	B_TIME_TYPE						= 'TIME',
+	B_UINT16_TYPE					= 'USHT',
+	B_UINT32_TYPE					= 'ULNG',
+	B_UINT64_TYPE					= 'ULLG',
+	B_UINT8_TYPE					= 'UBYT',
+	B_VECTOR_ICON_TYPE				= 'VICN',
+	B_XATTR_TYPE					= 'XATR',
+	B_NETWORK_ADDRESS_TYPE			= 'NWAD',
+	B_MIME_STRING_TYPE				= 'MIMS',
+	B_ASCII_TYPE					= 'TEXT'
+};
+
+// interface/Point.h, interface/Rect.h, interface/GraphicsDefs.h; just the
+// data, which is all an attribute has.
+struct BPoint {
+	float x;
+	float y;
+
+	BPoint() : x( 0 ), y( 0 ) {}
+	BPoint( float px, float py ) : x( px ), y( py ) {}
+};
+
+struct BRect {
+	float left;
+	float top;
+	float right;
+	float bottom;
+
+	BRect() : left( 0 ), top( 0 ), right( -1 ), bottom( -1 ) {}
+	BRect( float l, float t, float r, float b )
+		: left( l ), top( t ), right( r ), bottom( b ) {}
+};
+
+struct rgb_color {
+	uint8 red;
+	uint8 green;
+	uint8 blue;
+	uint8 alpha;
+};
+
+// support/ByteOrder.h
+typedef enum {
+	B_SWAP_HOST_TO_LENDIAN,
+	B_SWAP_HOST_TO_BENDIAN,
+	B_SWAP_LENDIAN_TO_HOST,
+	B_SWAP_BENDIAN_TO_HOST,
+	B_SWAP_ALWAYS
+} swap_action;
+
+static inline status_t swap_data( uint32 type, void *data, size_t size,
+								  swap_action action )
+{
+	size_t unit;
+	switch( type ) {
+	case B_INT16_TYPE:
+	case B_UINT16_TYPE:
+		unit = 2;
+		break;
+
+	case B_INT32_TYPE:
+	case B_UINT32_TYPE:
+	case B_FLOAT_TYPE:
+	case B_POINT_TYPE:
+	case B_RECT_TYPE:
+		unit = 4;
+		break;
+
+	case B_INT64_TYPE:
+	case B_UINT64_TYPE:
+	case B_DOUBLE_TYPE:
+		unit = 8;
+		break;
+
+	case B_SIZE_T_TYPE:
+	case B_SSIZE_T_TYPE:
+		unit = sizeof( size_t );
+		break;
+
+	case B_OFF_T_TYPE:
+		unit = sizeof( off_t );
+		break;
+
+	case B_TIME_TYPE:
+		unit = sizeof( time_t );
+		break;
+
+	default:
+		return B_BAD_VALUE;
+	}
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	bool swap = ( B_SWAP_ALWAYS == action || B_SWAP_HOST_TO_BENDIAN == action ||
+				  B_SWAP_BENDIAN_TO_HOST == action );
+#else
+	bool swap = ( B_SWAP_ALWAYS == action || B_SWAP_HOST_TO_LENDIAN == action ||
+				  B_SWAP_LENDIAN_TO_HOST == action );
+#endif
+	if( !swap ) return B_OK;
+
+	char *bytes = (char *)data;
+	for( size_t pos = 0; pos + unit <= size; pos += unit ) {
+		for( size_t i = 0; i < unit / 2; i++ ) {
+			char tmp = bytes[pos + i];
+			bytes[pos + i] = bytes[pos + unit - 1 - i];
+			bytes[pos + unit - 1 - i] = tmp;
+		}
+	}
+
+	return B_OK;
+}
+
+// ----------------------------------------------------------------------
+// kernel/fs_attr.h on xattrs.
+
+#define XATTR_HAIKU_PREFIX		"user.haiku."
+#define XATTR_HAIKU_PREFIX_LEN	( sizeof( XATTR_HAIKU_PREFIX ) - 1 )
+#define XATTR_TYPE_SIZE			sizeof( uint32 )
+#ifndef XATTR_NAME_MAX
+#define XATTR_NAME_MAX			255
+#endif
+
+// Index upkeep for writes and removals, in fsindex.h.  An IndexTarget is
+// the index lookup for one open file, for writing several attributes.
+struct IndexTarget {
+	bool indexed;		// false if no index can care about the file
+	string root;		// its volume
+	string rel;			// its path there
+	map<string, uint32> types;	// the volume's indexes
+};
+
+static inline void index_target( int fd, IndexTarget &target );
+static inline void index_note_target( const IndexTarget &target, const char *attribute,
+									  uint32 type, const char *data, size_t size );
+static inline void index_note_attr( int fd, const char *attribute, uint32 type,
+									const char *data, size_t size );
+
+struct attr_info {
+	uint32 type;
+	off_t size;
+};
+
+// The xattr name for an attribute; false (ENAMETOOLONG) if it won't fit.
+static inline bool xattr_name( const char *attribute, char *xname )
+{
+	size_t len = strlen( attribute );
+	if( XATTR_HAIKU_PREFIX_LEN + len > XATTR_NAME_MAX ) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+
+	memcpy( xname, XATTR_HAIKU_PREFIX, XATTR_HAIKU_PREFIX_LEN );
+	memcpy( xname + XATTR_HAIKU_PREFIX_LEN, attribute, len + 1 );
+	return true;
+}
+
+// The whole value, type and all; missing attributes are ENOENT, like on
+// Haiku, and values too short to have a type are skipped as not ours.
+static inline bool xattr_get( int fd, const char *attribute, vector<char> &value )
+{
+	char xname[XATTR_NAME_MAX + 1];
+	if( !xattr_name( attribute, xname ) ) return false;
+
+	for( ;; ) {
+		ssize_t size = fgetxattr( fd, xname, NULL, 0 );
+		if( size >= 0 ) {
+			value.resize( size );
+			size = fgetxattr( fd, xname, size > 0 ? &value[0] : NULL, size );
+		}
+		if( size < 0 ) {
+			if( ERANGE == errno ) continue;		// it grew in between
+			if( ENODATA == errno ) errno = ENOENT;
+			return false;
+		}
+
+		value.resize( size );
+		if( (size_t)size < XATTR_TYPE_SIZE ) {
+			errno = ENOENT;
+			return false;
+		}
+		return true;
+	}
+}
+
+static inline status_t fs_stat_attr( int fd, const char *attribute,
+									 struct attr_info *info )
+{
+	vector<char> value;
+	if( !xattr_get( fd, attribute, value ) ) return B_ERROR;
+
+	memcpy( &info->type, &value[0], XATTR_TYPE_SIZE );
+	info->size = value.size() - XATTR_TYPE_SIZE;
+	return B_OK;
+}
+
+static inline ssize_t fs_read_attr( int fd, const char *attribute, uint32 type,
+									off_t pos, void *buffer, size_t read_bytes )
+{
+	// type isn't checked, it isn't on Haiku either
+	type = type;
+
+	vector<char> value;
+	if( !xattr_get( fd, attribute, value ) ) return -1;
+
+	size_t size = value.size() - XATTR_TYPE_SIZE;
+	if( pos < 0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+	if( (size_t)pos >= size ) return 0;
+	if( read_bytes > size - pos ) read_bytes = size - pos;
+
+	memcpy( buffer, &value[XATTR_TYPE_SIZE + pos], read_bytes );
+	return read_bytes;
+}
+
+// Write into an attribute at pos, creating it with type if it isn't there;
+// replace throws away what was there first (type and all), otherwise the
+// data goes into what's there and the type is kept.  target is the file's
+// index lookup, if the caller has one.
+static inline ssize_t xattr_write_at( int fd, const char *attribute, uint32 type,
+									  off_t pos, const void *buffer, size_t write_bytes,
+									  bool replace, const IndexTarget *target = NULL )
+{
+	char xname[XATTR_NAME_MAX + 1];
+	if( !xattr_name( attribute, xname ) ) return -1;
+	if( pos < 0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	vector<char> value;
+	if( !replace && !xattr_get( fd, attribute, value ) ) {
+		if( ENOENT != errno ) return -1;
+		value.clear();
+	}
+	if( value.empty() ) {
+		value.resize( XATTR_TYPE_SIZE );
+		memcpy( &value[0], &type, XATTR_TYPE_SIZE );
+	}
+	if( value.size() < XATTR_TYPE_SIZE + pos + write_bytes ) {
+		value.resize( XATTR_TYPE_SIZE + pos + write_bytes );
+	}
+	if( write_bytes > 0 ) memcpy( &value[XATTR_TYPE_SIZE + pos], buffer, write_bytes );
+
+	if( fsetxattr( fd, xname, &value[0], value.size(), 0 ) != 0 ) return -1;
+
+	uint32 stored_type;
+	memcpy( &stored_type, &value[0], XATTR_TYPE_SIZE );
+	if( NULL != target ) {
+		index_note_target( *target, attribute, stored_type, &value[XATTR_TYPE_SIZE],
+						   value.size() - XATTR_TYPE_SIZE );
+	} else {
+		index_note_attr( fd, attribute, stored_type, &value[XATTR_TYPE_SIZE],
+						 value.size() - XATTR_TYPE_SIZE );
+	}
+	return write_bytes;
+}
+
+// Like Haiku, writing at 0 replaces the attribute.
+static inline ssize_t fs_write_attr( int fd, const char *attribute, uint32 type,
+									 off_t pos, const void *buffer, size_t write_bytes )
+{
+	return xattr_write_at( fd, attribute, type, pos, buffer, write_bytes, 0 == pos );
+}
+
+static inline status_t fs_remove_attr( int fd, const char *attribute )
+{
+	char xname[XATTR_NAME_MAX + 1];
+	if( !xattr_name( attribute, xname ) ) return B_ERROR;
+
+	if( fremovexattr( fd, xname ) != 0 ) {
+		if( ENODATA == errno ) errno = ENOENT;
+		return B_ERROR;
+	}
+
+	index_note_attr( fd, attribute, 0, NULL, 0 );
+	return B_OK;
+}
+
+// The attribute "directory" is the one flistxattr() list, filtered down
+// to ours.  DIR is opaque, so it's this behind the pointer.
+struct XattrDir {
+	vector<string> names;
+	size_t next;
+	struct dirent ent;
+};
+
+static inline DIR *fs_fopen_attr_dir( int fd )
+{
+	vector<char> list;
+	for( ;; ) {
+		ssize_t size = flistxattr( fd, NULL, 0 );
+		if( size >= 0 ) {
+			list.resize( size );
+			size = flistxattr( fd, size > 0 ? &list[0] : NULL, size );
+		}
+		if( size >= 0 ) {
+			list.resize( size );
+			break;
+		}
+		if( ERANGE != errno ) return NULL;
+	}
+
+	XattrDir *dir = new XattrDir;
+	dir->next = 0;
+	for( size_t pos = 0; pos < list.size(); ) {
+		const char *xname = &list[pos];
+		size_t len = strlen( xname );
+		if( strncmp( xname, XATTR_HAIKU_PREFIX, XATTR_HAIKU_PREFIX_LEN ) == 0 ) {
+			dir->names.push_back( xname + XATTR_HAIKU_PREFIX_LEN );
+		}
+		pos += len + 1;
+	}
+
+	return (DIR *)dir;
+}
+
+static inline struct dirent *fs_read_attr_dir( DIR *dir_handle )
+{
+	XattrDir *dir = (XattrDir *)dir_handle;
+	if( dir->next >= dir->names.size() ) return NULL;
+
+	const string &name = dir->names[dir->next++];
+	size_t len = name.size();
+	if( len >= sizeof( dir->ent.d_name ) ) len = sizeof( dir->ent.d_name ) - 1;
+	memcpy( dir->ent.d_name, name.c_str(), len );
+	dir->ent.d_name[len] = '\0';
+	return &dir->ent;
+}
+
+static inline int fs_close_attr_dir( DIR *dir_handle )
+{
+	delete (XattrDir *)dir_handle;
+	return 0;
+}
+
+#include "fsindex.h"
+
+#endif // FSATTR_XATTR_H
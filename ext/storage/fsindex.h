@@ -0,0 +1,1079 @@
+// haikuglue.storage attribute indexes on Linux
+//
+// BFS keeps an index for each indexed attribute inside the filesystem.  On
+// Linux the same thing lives in a ".haiku-index" directory at the top of a
+// tree, which plays the volume: the attribute writes in fsattr_xattr.h keep
+// it up to date, and rescan rebuilds it from the files.
+//
+// Each index is a run, <name>.idx, of entries sorted by value and then by
+// path (relative to the volume), searched in place through mmap(), plus a
+// log, <name>.log, of the changes since: the latest value of a path, or
+// that it's gone.  Once the log is INDEX_LOG_LIMIT bytes the next change
+// merges it into a fresh run.  Writers append under a shared flock() on
+// the log, and merging takes it exclusively, so readers (which also take
+// it shared) always see a run and a log that go together; rescanning
+// holds it shared while it reads the files, which puts merging off.
+//
+// Included at the end of fsattr_xattr.h.
+//
+
+#ifndef FSINDEX_H
+#define FSINDEX_H
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include "fsquery_expr.h"
+
+#define INDEX_DIR_NAME				".haiku-index"
+#define INDEX_MAGIC					0x48474958	// "HGIX"
+#define INDEX_VERSION				1
+#define INDEX_LOG_LIMIT				( 256 * 1024 )
+#define INDEX_ROOT_CACHE_SIZE		256
+#define INDEX_ROOT_CACHE_SECONDS	5
+
+enum {
+	INDEX_LOG_SET = 1,
+	INDEX_LOG_REMOVE = 2
+};
+
+// A run is the header, count uint64 offsets of the entries from the start
+// of the file, and the entries: an IndexEntryHeader, the key, the path.
+struct IndexHeader {
+	uint32 magic;
+	uint32 version;
+	uint32 type;
+	uint32 reserved;
+	uint64 count;
+};
+
+struct IndexEntryHeader {
+	uint32 key_size;
+	uint32 path_size;
+};
+
+// A log record is this, the key (nothing for INDEX_LOG_REMOVE), the path.
+struct IndexLogHeader {
+	uint32 size;		// all of it, header included
+	uint32 op;
+	uint32 key_size;
+	uint32 path_size;
+};
+
+struct IndexEntry {
+	string key;
+	string path;
+};
+
+// Where each path stands since the run: its new key, or removed.
+typedef map<string, pair<bool, string> > IndexChanges;
+
+// ----------------------------------------------------------------------
+// Names and keys
+
+static inline string index_dir( const string &root )
+{
+	return ( root == "/" ? string() : root ) + "/" INDEX_DIR_NAME;
+}
+
+static inline string index_join( const string &root, const string &rel )
+{
+	return ( root == "/" ? string() : root ) + "/" + rel;
+}
+
+// The index's files, without the .idx or .log; attribute names can have
+// anything but a null in them, so slashes (and leading dots) are escaped.
+static inline string index_base( const string &root, const string &name )
+{
+	string base = index_dir( root ) + "/";
+	for( size_t i = 0; i < name.size(); i++ ) {
+		char c = name[i];
+		if( c == '/' || c == '%' || ( 0 == i && c == '.' ) ) {
+			char escaped[4];
+			sprintf( escaped, "%%%02X", (unsigned char)c );
+			base += escaped;
+		} else {
+			base += c;
+		}
+	}
+
+	return base;
+}
+
+static inline string index_unescape( const string &file )
+{
+	string name;
+	for( size_t i = 0; i < file.size(); i++ ) {
+		if( file[i] == '%' && i + 2 < file.size() ) {
+			name += (char)strtol( file.substr( i + 1, 2 ).c_str(), NULL, 16 );
+			i += 2;
+		} else {
+			name += file[i];
+		}
+	}
+
+	return name;
+}
+
+// Make a value the kind an index holds; only the built-in attributes
+// (see query_stat_value()) ever need it.
+static inline void index_convert( QueryValue &value, int kind )
+{
+	if( value.kind == kind ) return;
+
+	if( QUERY_STRING == kind ) {
+		char buffer[32];
+		if( QUERY_INT == value.kind ) sprintf( buffer, "%lld", (long long)value.i );
+		else if( QUERY_UINT == value.kind ) sprintf( buffer, "%llu", (unsigned long long)value.u );
+		else sprintf( buffer, "%g", value.f );
+		value.str = buffer;
+	} else if( QUERY_STRING == value.kind ) {
+		value.i = strtoll( value.str.c_str(), NULL, 0 );
+		value.u = strtoull( value.str.c_str(), NULL, 0 );
+		value.f = strtod( value.str.c_str(), NULL );
+	} else if( QUERY_INT == value.kind ) {
+		value.u = (uint64)value.i;
+		value.f = (double)value.i;
+	} else if( QUERY_UINT == value.kind ) {
+		value.i = (int64)value.u;
+		value.f = (double)value.u;
+	} else {
+		value.i = (int64)value.f;
+		value.u = (uint64)value.f;
+	}
+	value.kind = kind;
+}
+
+// A key is the string, or the number in host byte order.
+static inline void index_key( const QueryValue &value, string &key )
+{
+	switch( value.kind ) {
+	case QUERY_INT:
+		key.assign( (const char *)&value.i, sizeof( value.i ) );
+		break;
+	case QUERY_UINT:
+		key.assign( (const char *)&value.u, sizeof( value.u ) );
+		break;
+	case QUERY_FLOAT:
+		key.assign( (const char *)&value.f, sizeof( value.f ) );
+		break;
+	default:
+		key = value.str;
+	}
+}
+
+static inline void index_key_value( int kind, const char *key, size_t size, QueryValue &value )
+{
+	value.kind = kind;
+	if( QUERY_STRING == kind ) {
+		value.str.assign( key, size );
+	} else if( size == 8 ) {
+		if( QUERY_INT == kind ) memcpy( &value.i, key, 8 );
+		else if( QUERY_UINT == kind ) memcpy( &value.u, key, 8 );
+		else memcpy( &value.f, key, 8 );
+	}
+}
+
+static inline int index_key_compare( int kind, const char *a, size_t a_size,
+									 const char *b, size_t b_size )
+{
+	if( QUERY_STRING == kind ) {
+		int c = memcmp( a, b, min( a_size, b_size ) );
+		if( c != 0 ) return c;
+		return ( a_size < b_size ) ? -1 : ( a_size > b_size ) ? 1 : 0;
+	}
+
+	QueryValue x, y;
+	index_key_value( kind, a, a_size, x );
+	index_key_value( kind, b, b_size, y );
+	if( QUERY_INT == kind ) return ( x.i < y.i ) ? -1 : ( y.i < x.i ) ? 1 : 0;
+	if( QUERY_UINT == kind ) return ( x.u < y.u ) ? -1 : ( y.u < x.u ) ? 1 : 0;
+	return ( x.f < y.f ) ? -1 : ( y.f < x.f ) ? 1 : 0;
+}
+
+struct IndexEntryLess {
+	int kind;
+
+	IndexEntryLess( int k ) : kind( k ) {}
+	bool operator()( const IndexEntry &a, const IndexEntry &b ) const {
+		int c = index_key_compare( kind, a.key.data(), a.key.size(),
+								   b.key.data(), b.key.size() );
+		return ( c != 0 ) ? c < 0 : a.path < b.path;
+	}
+};
+
+// A file's attributes for matching a query program against, built-in
+// ones first.
+class IndexFileSlots : public QuerySlots {
+public:
+	IndexFileSlots( const QueryProgram &program, int fd, const char *name,
+					const struct stat &st )
+		: QuerySlots( program ), fd( fd ), name( name ), st( st ) {}
+
+protected:
+	bool lookup( int slot, QueryValue &value ) {
+		const string &attr = program.slots[slot];
+		if( query_stat_value( attr, name, st, value ) ) return true;
+
+		vector<char> raw;
+		if( !xattr_get( fd, attr.c_str(), raw ) ) return false;
+
+		uint32 type;
+		memcpy( &type, &raw[0], XATTR_TYPE_SIZE );
+		return query_value_from_attr( type, &raw[XATTR_TYPE_SIZE],
+									  raw.size() - XATTR_TYPE_SIZE, value );
+	}
+
+private:
+	int fd;
+	const char *name;
+	const struct stat &st;
+};
+
+// ----------------------------------------------------------------------
+// Runs and logs
+
+struct IndexRun {
+	char *map;
+	size_t map_size;
+	uint32 type;
+	uint64 count;
+
+	IndexRun() : map( NULL ), map_size( 0 ), type( 0 ), count( 0 ) {}
+	~IndexRun() {
+		if( NULL != map ) munmap( map, map_size );
+	}
+
+	// false, with errno set, if it isn't there or isn't a run
+	bool open( const string &file ) {
+		int fd = ::open( file.c_str(), O_RDONLY );
+		if( fd < 0 ) return false;
+
+		struct stat st;
+		bool ok = ( fstat( fd, &st ) == 0 );
+		if( ok && (size_t)st.st_size >= sizeof( IndexHeader ) ) {
+			map_size = st.st_size;
+			map = (char *)mmap( NULL, map_size, PROT_READ, MAP_SHARED, fd, 0 );
+			if( MAP_FAILED == map ) {
+				map = NULL;
+				ok = false;
+			}
+		} else if( ok ) {
+			errno = EINVAL;
+			ok = false;
+		}
+		close( fd );
+		if( !ok ) return false;
+
+		IndexHeader header;
+		memcpy( &header, map, sizeof( header ) );
+		if( header.magic != INDEX_MAGIC || header.version != INDEX_VERSION ||
+			header.count > ( map_size - sizeof( header ) ) / sizeof( uint64 ) ) {
+			errno = EINVAL;
+			return false;
+		}
+		type = header.type;
+		count = header.count;
+		return true;
+	}
+
+	// false if the entry runs off the end (a damaged run)
+	bool entry( uint64 i, const char *&key, size_t &key_size,
+				const char *&path, size_t &path_size ) const {
+		uint64 offset;
+		memcpy( &offset, map + sizeof( IndexHeader ) + i * sizeof( uint64 ), sizeof( offset ) );
+
+		IndexEntryHeader header;
+		if( offset > map_size || map_size - offset < sizeof( header ) ) return false;
+		memcpy( &header, map + offset, sizeof( header ) );
+		offset += sizeof( header );
+		if( (uint64)header.key_size + header.path_size > map_size - offset ) return false;
+
+		key = map + offset;
+		key_size = header.key_size;
+		path = key + key_size;
+		path_size = header.path_size;
+		return true;
+	}
+};
+
+// Read a log from offset from on, latest change per path winning; a
+// record cut short by a crash ends it.
+static inline void index_read_log( int fd, off_t from, IndexChanges &changes )
+{
+	struct stat st;
+	if( fstat( fd, &st ) != 0 || st.st_size <= from ) return;
+
+	vector<char> log( st.st_size - from );
+	size_t got = 0;
+	while( got < log.size() ) {
+		ssize_t n = pread( fd, &log[got], log.size() - got, from + got );
+		if( n <= 0 ) break;
+		got += n;
+	}
+
+	IndexLogHeader header;
+	for( size_t pos = 0; pos + sizeof( header ) <= got; pos += header.size ) {
+		memcpy( &header, &log[pos], sizeof( header ) );
+		if( header.size < sizeof( header ) || header.size > got - pos ||
+			sizeof( header ) + (uint64)header.key_size + header.path_size > header.size ) break;
+
+		const char *key = &log[pos + sizeof( header )];
+		string path( key + header.key_size, header.path_size );
+		if( INDEX_LOG_SET == header.op ) {
+			changes[path] = make_pair( true, string( key, header.key_size ) );
+		} else {
+			changes[path] = make_pair( false, string() );
+		}
+	}
+}
+
+// Write a sorted run next to file and rename it into place.
+static inline bool index_write_run( const string &file, uint32 type,
+									const vector<IndexEntry> &entries )
+{
+	char suffix[32];
+	sprintf( suffix, ".%d.tmp", (int)getpid() );
+	string tmp = file + suffix;
+
+	FILE *out = fopen( tmp.c_str(), "wb" );
+	if( NULL == out ) return false;
+
+	IndexHeader header;
+	header.magic = INDEX_MAGIC;
+	header.version = INDEX_VERSION;
+	header.type = type;
+	header.reserved = 0;
+	header.count = entries.size();
+	bool ok = ( fwrite( &header, sizeof( header ), 1, out ) == 1 );
+
+	uint64 offset = sizeof( header ) + entries.size() * sizeof( uint64 );
+	for( size_t i = 0; ok && i < entries.size(); i++ ) {
+		ok = ( fwrite( &offset, sizeof( offset ), 1, out ) == 1 );
+		offset += sizeof( IndexEntryHeader ) + entries[i].key.size() + entries[i].path.size();
+	}
+	for( size_t i = 0; ok && i < entries.size(); i++ ) {
+		IndexEntryHeader entry;
+		entry.key_size = entries[i].key.size();
+		entry.path_size = entries[i].path.size();
+		ok = ( fwrite( &entry, sizeof( entry ), 1, out ) == 1 &&
+			   fwrite( entries[i].key.data(), 1, entry.key_size, out ) == entry.key_size &&
+			   fwrite( entries[i].path.data(), 1, entry.path_size, out ) == entry.path_size );
+	}
+
+	if( fclose( out ) != 0 ) ok = false;
+	if( ok && rename( tmp.c_str(), file.c_str() ) != 0 ) ok = false;
+	if( !ok ) unlink( tmp.c_str() );
+	return ok;
+}
+
+// The run with the changes applied, sorted.
+static inline void index_merge( const IndexRun &run, const IndexChanges &changes,
+								vector<IndexEntry> &entries )
+{
+	for( uint64 i = 0; i < run.count; i++ ) {
+		const char *key, *path;
+		size_t key_size, path_size;
+		if( !run.entry( i, key, key_size, path, path_size ) ) continue;
+
+		IndexEntry entry;
+		entry.path.assign( path, path_size );
+		if( changes.find( entry.path ) != changes.end() ) continue;
+		entry.key.assign( key, key_size );
+		entries.push_back( entry );
+	}
+
+	for( IndexChanges::const_iterator i = changes.begin(); i != changes.end(); ++i ) {
+		if( !i->second.first ) continue;
+
+		IndexEntry entry;
+		entry.path = i->first;
+		entry.key = i->second.second;
+		entries.push_back( entry );
+	}
+
+	sort( entries.begin(), entries.end(), IndexEntryLess( query_type_kind( run.type ) ) );
+}
+
+// Fold the log into the run; the caller holds the log exclusively.
+static inline void index_compact( const string &base, int log_fd )
+{
+	IndexRun run;
+	if( !run.open( base + ".idx" ) ) return;
+
+	IndexChanges changes;
+	index_read_log( log_fd, 0, changes );
+
+	vector<IndexEntry> entries;
+	index_merge( run, changes, entries );
+	if( index_write_run( base + ".idx", run.type, entries ) ) {
+		(void)ftruncate( log_fd, 0 );
+	}
+}
+
+// Log a change to one path's entry, merging the log if it's grown big.
+static inline void index_append( const string &base, int op, const string &key,
+								 const string &path )
+{
+	int fd = open( ( base + ".log" ).c_str(), O_RDWR | O_APPEND | O_CREAT, 0644 );
+	if( fd < 0 ) return;
+
+	IndexLogHeader header;
+	header.op = op;
+	header.key_size = key.size();
+	header.path_size = path.size();
+	header.size = sizeof( header ) + header.key_size + header.path_size;
+
+	// One write(), so records from different writers don't interleave.
+	string record( (const char *)&header, sizeof( header ) );
+	record += key;
+	record += path;
+
+	(void)flock( fd, LOCK_SH );
+	bool ok = ( write( fd, record.data(), record.size() ) == (ssize_t)record.size() );
+
+	// Merging waits for nobody; if someone else has the log (a rescan
+	// holds it throughout), the next change over the limit tries again.
+	struct stat st;
+	if( ok && fstat( fd, &st ) == 0 && st.st_size > INDEX_LOG_LIMIT &&
+		flock( fd, LOCK_EX | LOCK_NB ) == 0 ) {
+		// somebody else may have beaten us to it
+		if( fstat( fd, &st ) == 0 && st.st_size > INDEX_LOG_LIMIT ) index_compact( base, fd );
+	}
+
+	(void)flock( fd, LOCK_UN );
+	close( fd );
+}
+
+// ----------------------------------------------------------------------
+// Finding a file's volume and its indexes.  Both are remembered, the
+// volume (or that there's none) for INDEX_ROOT_CACHE_SECONDS, and the
+// indexes until the index directory changes.  A volume made in this
+// process is seen right away; one made by another process within
+// INDEX_ROOT_CACHE_SECONDS.
+
+struct IndexRootCacheEntry {
+	string root;		// empty if there's no volume
+	time_t when;
+};
+
+struct IndexTypesCacheEntry {
+	time_t mtime;
+	long mtime_nsec;
+	map<string, uint32> types;
+};
+
+static pthread_mutex_t index_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static map<string, IndexRootCacheEntry> index_root_cache;
+static map<string, IndexTypesCacheEntry> index_types_cache;
+
+static inline string index_parent( const string &path )
+{
+	string::size_type slash = path.find_last_of( '/' );
+	if( slash == string::npos ) return string();
+	return ( 0 == slash ) ? string( "/" ) : path.substr( 0, slash );
+}
+
+// The volume a directory is in: the nearest directory up from it with an
+// index directory.  false if there isn't one; that's remembered too, so
+// trees without indexes don't pay for the walk up on every write.
+static inline bool index_find_root( const string &dir, string &root )
+{
+	time_t now = time( NULL );
+
+	pthread_mutex_lock( &index_cache_lock );
+	map<string, IndexRootCacheEntry>::iterator cached = index_root_cache.find( dir );
+	bool hit = ( cached != index_root_cache.end() &&
+				 now - cached->second.when < INDEX_ROOT_CACHE_SECONDS );
+	if( hit ) root = cached->second.root;	// empty if there's none
+	pthread_mutex_unlock( &index_cache_lock );
+	if( hit ) return !root.empty();
+
+	root.erase();
+	for( string d = dir; !d.empty(); d = index_parent( d ) ) {
+		struct stat st;
+		if( stat( index_dir( d ).c_str(), &st ) == 0 && S_ISDIR( st.st_mode ) ) {
+			root = d;
+			break;
+		}
+		if( d == "/" ) break;
+	}
+
+	pthread_mutex_lock( &index_cache_lock );
+	if( index_root_cache.size() >= INDEX_ROOT_CACHE_SIZE ) index_root_cache.clear();
+	IndexRootCacheEntry entry;
+	entry.root = root;
+	entry.when = now;
+	index_root_cache[dir] = entry;
+	pthread_mutex_unlock( &index_cache_lock );
+
+	return !root.empty();
+}
+
+static inline void index_forget_roots( void )
+{
+	pthread_mutex_lock( &index_cache_lock );
+	index_root_cache.clear();
+	pthread_mutex_unlock( &index_cache_lock );
+}
+
+// The volume's indexes and their types; false, with errno set, if it has
+// no index directory.
+static inline bool index_types( const string &root, map<string, uint32> &types )
+{
+	struct stat st;
+	string dir = index_dir( root );
+	if( stat( dir.c_str(), &st ) != 0 ) return false;
+
+	pthread_mutex_lock( &index_cache_lock );
+	map<string, IndexTypesCacheEntry>::iterator cached = index_types_cache.find( root );
+	bool hit = ( cached != index_types_cache.end() &&
+				 cached->second.mtime == st.st_mtim.tv_sec &&
+				 cached->second.mtime_nsec == st.st_mtim.tv_nsec );
+	if( hit ) types = cached->second.types;
+	pthread_mutex_unlock( &index_cache_lock );
+	if( hit ) return true;
+
+	DIR *d = opendir( dir.c_str() );
+	if( NULL == d ) return false;
+
+	types.clear();
+	struct dirent *ent;
+	while( NULL != ( ent = readdir( d ) ) ) {
+		size_t len = strlen( ent->d_name );
+		if( len <= 4 || strcmp( ent->d_name + len - 4, ".idx" ) != 0 ) continue;
+
+		IndexHeader header;
+		int fd = open( ( dir + "/" + ent->d_name ).c_str(), O_RDONLY );
+		if( fd < 0 ) continue;
+		if( read( fd, &header, sizeof( header ) ) == (ssize_t)sizeof( header ) &&
+			header.magic == INDEX_MAGIC && header.version == INDEX_VERSION ) {
+			types[index_unescape( string( ent->d_name, len - 4 ) )] = header.type;
+		}
+		close( fd );
+	}
+	closedir( d );
+
+	pthread_mutex_lock( &index_cache_lock );
+	if( index_types_cache.size() >= INDEX_ROOT_CACHE_SIZE ) index_types_cache.clear();
+	IndexTypesCacheEntry entry;
+	entry.mtime = st.st_mtim.tv_sec;
+	entry.mtime_nsec = st.st_mtim.tv_nsec;
+	entry.types = types;
+	index_types_cache[root] = entry;
+	pthread_mutex_unlock( &index_cache_lock );
+
+	return true;
+}
+
+// ----------------------------------------------------------------------
+// Keeping the indexes up to date as attributes change
+
+// The path an open file was opened with; false if it's gone.
+static inline bool index_fd_path( int fd, string &path )
+{
+	char link[64];
+	char buffer[PATH_MAX];
+	sprintf( link, "/proc/self/fd/%d", fd );
+
+	ssize_t len = readlink( link, buffer, sizeof( buffer ) - 1 );
+	if( len <= 0 || buffer[0] != '/' ) return false;
+	buffer[len] = '\0';
+
+	path = buffer;
+	static const char deleted[] = " (deleted)";
+	return !( path.size() > sizeof( deleted ) - 1 &&
+			  path.compare( path.size() - ( sizeof( deleted ) - 1 ),
+			  				string::npos, deleted ) == 0 );
+}
+
+// Find out where an open file's attribute changes go: its volume, its
+// path there and the volume's indexes.  Done once per file, so writing
+// several attributes through one descriptor looks it up once.
+static inline void index_target( int fd, IndexTarget &target )
+{
+	target.indexed = false;
+
+	string path;
+	if( !index_fd_path( fd, path ) || path == "/" ) return;
+	if( !index_find_root( index_parent( path ), target.root ) ) return;
+	if( !index_types( target.root, target.types ) || target.types.empty() ) return;
+
+	target.rel = path.substr( target.root == "/" ? 1 : target.root.size() + 1 );
+	if( target.rel == INDEX_DIR_NAME || 
+		target.rel.compare( 0, sizeof( INDEX_DIR_NAME "/" ) - 1, 
+							INDEX_DIR_NAME "/" ) == 0 ) return;
+
+	target.indexed = true;
+}
+
+// An attribute of the target was written (data is the whole new value) or
+// removed (data is NULL); if it's indexed, log the change.  Index trouble
+// doesn't fail the write.
+static inline void index_note_target( const IndexTarget &target, const char *attribute, 
+									  uint32 type, const char *data, size_t size )
+{
+	if( !target.indexed ) return;
+	map<string, uint32>::const_iterator index = target.types.find( attribute );
+	if( index == target.types.end() ) return;
+
+	// Like BFS, only values of the index's type go in.
+	QueryValue value;
+	string key;
+	if( NULL != data && type == index->second &&
+		query_value_from_attr( type, data, size, value ) ) {
+		index_key( value, key );
+		index_append( index_base( target.root, attribute ), INDEX_LOG_SET, key, target.rel );
+	} else {
+		index_append( index_base( target.root, attribute ), INDEX_LOG_REMOVE, key, target.rel );
+	}
+}
+
+static inline void index_note_attr( int fd, const char *attribute, uint32 type,
+									const char *data, size_t size )
+{
+	IndexTarget target;
+	index_target( fd, target );
+	index_note_target( target, attribute, type, data, size );
+}
+
+// ----------------------------------------------------------------------
+// Managing indexes
+
+static inline bool index_create( const string &root, const string &name, uint32 type )
+{
+	if( mkdir( index_dir( root ).c_str(), 0755 ) != 0 && EEXIST != errno ) return false;
+	index_forget_roots();
+
+	string base = index_base( root, name );
+	struct stat st;
+	if( stat( ( base + ".idx" ).c_str(), &st ) == 0 ) {
+		errno = EEXIST;
+		return false;
+	}
+
+	vector<IndexEntry> none;
+	(void)unlink( ( base + ".log" ).c_str() );
+	return index_write_run( base + ".idx", type, none );
+}
+
+static inline bool index_remove( const string &root, const string &name )
+{
+	string base = index_base( root, name );
+	if( unlink( ( base + ".idx" ).c_str() ) != 0 ) return false;
+	(void)unlink( ( base + ".log" ).c_str() );
+	return true;
+}
+
+// ----------------------------------------------------------------------
+// Rebuilding indexes from the files
+
+struct IndexRescan {
+	string root;
+	vector<string> names;
+	vector<uint32> types;
+	vector< vector<IndexEntry> > entries;
+	uint64 files;
+};
+
+static inline void index_rescan_dir( IndexRescan &scan, const string &rel )
+{
+	string dir = rel.empty() ? scan.root : index_join( scan.root, rel );
+	DIR *d = opendir( dir.c_str() );
+	if( NULL == d ) return;
+
+	vector<string> subdirs;
+	struct dirent *ent;
+	while( NULL != ( ent = readdir( d ) ) ) {
+		if( strcmp( ent->d_name, "." ) == 0 || strcmp( ent->d_name, ".." ) == 0 ) continue;
+		if( rel.empty() && strcmp( ent->d_name, INDEX_DIR_NAME ) == 0 ) continue;
+
+		string child_rel = rel.empty() ? string( ent->d_name ) : rel + "/" + ent->d_name;
+		string child = index_join( scan.root, child_rel );
+		struct stat st;
+		if( lstat( child.c_str(), &st ) != 0 ) continue;
+		if( !S_ISREG( st.st_mode ) && !S_ISDIR( st.st_mode ) ) continue;
+
+		int fd = open( child.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK );
+		if( fd < 0 ) continue;
+
+		scan.files++;
+		for( size_t i = 0; i < scan.names.size(); i++ ) {
+			QueryValue value;
+			int kind = query_type_kind( scan.types[i] );
+			if( query_stat_value( scan.names[i], ent->d_name, st, value ) ) {
+				index_convert( value, kind );
+			} else {
+				vector<char> raw;
+				uint32 type;
+				if( !xattr_get( fd, scan.names[i].c_str(), raw ) ) continue;
+				memcpy( &type, &raw[0], XATTR_TYPE_SIZE );
+				if( type != scan.types[i] ||
+					!query_value_from_attr( type, &raw[XATTR_TYPE_SIZE],
+											raw.size() - XATTR_TYPE_SIZE, value ) ) continue;
+			}
+
+			IndexEntry entry;
+			index_key( value, entry.key );
+			entry.path = child_rel;
+			scan.entries[i].push_back( entry );
+		}
+		close( fd );
+
+		if( S_ISDIR( st.st_mode ) ) subdirs.push_back( child_rel );
+	}
+	closedir( d );
+
+	for( size_t i = 0; i < subdirs.size(); i++ ) index_rescan_dir( scan, subdirs[i] );
+}
+
+// Add what's in a log from offset from on to tail.
+static inline void index_read_tail( int fd, off_t from, vector<char> &tail )
+{
+	struct stat st;
+	if( fstat( fd, &st ) != 0 || st.st_size <= from ) return;
+
+	size_t start = tail.size();
+	tail.resize( start + ( st.st_size - from ) );
+	size_t got = 0;
+	while( start + got < tail.size() ) {
+		ssize_t n = pread( fd, &tail[start + got], tail.size() - start - got, from + got );
+		if( n <= 0 ) break;
+		got += n;
+	}
+	tail.resize( start + got );
+}
+
+// Rebuild the volume's indexes, or just the named ones.  Changes logged
+// while the files were being read are kept on top of the new runs, so
+// writers don't have to stop.  false, with errno set, if there's no such
+// index; files is how many files were looked at.
+static inline bool index_rescan( const string &root, const vector<string> *names,
+								 uint64 &files )
+{
+	map<string, uint32> types;
+	if( !index_types( root, types ) ) return false;
+
+	IndexRescan scan;
+	scan.root = root;
+	scan.files = 0;
+	for( map<string, uint32>::iterator i = types.begin(); i != types.end(); ++i ) {
+		if( NULL != names && find( names->begin(), names->end(), i->first ) == names->end() ) continue;
+		scan.names.push_back( i->first );
+		scan.types.push_back( i->second );
+	}
+	if( NULL != names && scan.names.size() != names->size() ) {
+		errno = ENOENT;
+		return false;
+	}
+	scan.entries.resize( scan.names.size() );
+
+	// Each log is held shared from when its length is noted until its new
+	// run goes in, so nothing merges it in between while writers carry
+	// on logging.  The run's inode tells whether a merge got in while the
+	// shared lock was traded for the exclusive one at the end.
+	vector<int> log_fds;
+	vector<off_t> log_start;
+	vector<ino_t> run_node;
+	for( size_t i = 0; i < scan.names.size(); i++ ) {
+		string base = index_base( root, scan.names[i] );
+		int fd = open( ( base + ".log" ).c_str(), O_RDWR | O_APPEND | O_CREAT, 0644 );
+		if( fd < 0 ) {
+			int error = errno;
+			for( size_t j = 0; j < log_fds.size(); j++ ) close( log_fds[j] );
+			errno = error;
+			return false;
+		}
+		(void)flock( fd, LOCK_SH );
+
+		struct stat st;
+		log_fds.push_back( fd );
+		log_start.push_back( fstat( fd, &st ) == 0 ? st.st_size : 0 );
+		run_node.push_back( stat( ( base + ".idx" ).c_str(), &st ) == 0 ? st.st_ino : 0 );
+	}
+
+	index_rescan_dir( scan, string() );
+
+	bool ok = true;
+	int error = 0;
+	for( size_t i = 0; i < scan.names.size(); i++ ) {
+		int fd = log_fds[i];
+		if( ok ) {
+			string base = index_base( root, scan.names[i] );
+			sort( scan.entries[i].begin(), scan.entries[i].end(),
+				  IndexEntryLess( query_type_kind( scan.types[i] ) ) );
+
+			// What was logged since we started goes back on top.  A merge
+			// while we were trading locks put what we'd read so far into
+			// the run and left a log of what came after, all of it new.
+			vector<char> tail;
+			index_read_tail( fd, log_start[i], tail );
+			off_t from = log_start[i] + tail.size();
+			(void)flock( fd, LOCK_EX );
+
+			struct stat st;
+			if( stat( ( base + ".idx" ).c_str(), &st ) != 0 || st.st_ino != run_node[i] ) from = 0;
+			index_read_tail( fd, from, tail );
+
+			ok = index_write_run( base + ".idx", scan.types[i], scan.entries[i] );
+			error = errno;
+			if( ok && ftruncate( fd, 0 ) == 0 && !tail.empty() ) {
+				(void)write( fd, &tail[0], tail.size() );
+			}
+		}
+
+		(void)flock( fd, LOCK_UN );
+		close( fd );
+	}
+	if( !ok ) {
+		errno = error;
+		return false;
+	}
+
+	files = scan.files;
+	return true;
+}
+
+// ----------------------------------------------------------------------
+// Running queries
+
+// One index, as of now.
+struct IndexView {
+	int kind;
+	IndexRun run;
+	IndexChanges changes;
+};
+
+static inline bool index_load( const string &root, const string &name, IndexView &view )
+{
+	string base = index_base( root, name );
+	int log_fd = open( ( base + ".log" ).c_str(), O_RDONLY );
+	if( log_fd >= 0 ) (void)flock( log_fd, LOCK_SH );
+
+	bool ok = view.run.open( base + ".idx" );
+	if( ok && log_fd >= 0 ) index_read_log( log_fd, 0, view.changes );
+	view.kind = query_type_kind( view.run.type );
+
+	if( log_fd >= 0 ) {
+		(void)flock( log_fd, LOCK_UN );
+		close( log_fd );
+	}
+	return ok;
+}
+
+// The key a comparison's literal makes for an index, if it makes one.
+static inline bool index_literal_key( const QueryNode &term, int kind, string &key )
+{
+	QueryValue value;
+	value.kind = kind;
+	if( QUERY_INT == kind ) {
+		if( !term.has_int ) return false;
+		value.i = term.int_value;
+	} else if( QUERY_UINT == kind ) {
+		if( !term.has_uint ) return false;
+		value.u = term.uint_value;
+	} else if( QUERY_FLOAT == kind ) {
+		if( !term.has_float ) return false;
+		value.f = term.float_value;
+	} else {
+		value.str = term.value;
+	}
+
+	index_key( value, key );
+	return true;
+}
+
+// First entry of the run whose key isn't below key.
+static inline uint64 index_lower_bound( const IndexView &view, const string &key )
+{
+	uint64 lo = 0, hi = view.run.count;
+	while( lo < hi ) {
+		uint64 mid = lo + ( hi - lo ) / 2;
+		const char *k, *path;
+		size_t k_size, path_size;
+		if( view.run.entry( mid, k, k_size, path, path_size ) &&
+			index_key_compare( view.kind, k, k_size, key.data(), key.size() ) < 0 ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+// Add the paths of the index entries matching a comparison.  Only the
+// stretch of the run the comparison allows is looked at: an equal range,
+// everything above or below a value, or the entries starting with a
+// wildcard pattern's fixed prefix; != and patterns starting with a
+// wildcard read it all.
+static inline void index_scan( const IndexView &view, const QueryNode &term, set<string> &paths )
+{
+	string lo, hi, prefix;
+	bool has_lo = false, has_hi = false, hi_inclusive = false, has_prefix = false;
+
+	if( QUERY_STRING == view.kind && term.wildcard &&
+		( QUERY_EQ == term.op || QUERY_NE == term.op ) ) {
+		if( QUERY_EQ == term.op ) {
+			prefix = term.pattern.substr( 0, term.pattern.find_first_of( "*?[\\" ) );
+			has_prefix = has_lo = !prefix.empty();
+			lo = prefix;
+		}
+	} else {
+		string key;
+		if( index_literal_key( term, view.kind, key ) ) {
+			if( QUERY_EQ == term.op || QUERY_GE == term.op || QUERY_GT == term.op ) {
+				lo = key;
+				has_lo = true;
+			}
+			if( QUERY_EQ == term.op || QUERY_LE == term.op || QUERY_LT == term.op ) {
+				hi = key;
+				has_hi = true;
+				hi_inclusive = ( QUERY_LT != term.op );
+			}
+		}
+	}
+
+	QueryValue value;
+	for( uint64 i = has_lo ? index_lower_bound( view, lo ) : 0; i < view.run.count; i++ ) {
+		const char *key, *path;
+		size_t key_size, path_size;
+		if( !view.run.entry( i, key, key_size, path, path_size ) ) continue;
+
+		if( has_prefix && ( key_size < prefix.size() ||
+							memcmp( key, prefix.data(), prefix.size() ) != 0 ) ) break;
+		if( has_hi ) {
+			int c = index_key_compare( view.kind, key, key_size, hi.data(), hi.size() );
+			if( c > 0 || ( c == 0 && !hi_inclusive ) ) break;
+		}
+
+		string p( path, path_size );
+		if( view.changes.find( p ) != view.changes.end() ) continue;
+
+		index_key_value( view.kind, key, key_size, value );
+		if( query_match_term( term, value ) ) paths.insert( p );
+	}
+
+	for( IndexChanges::const_iterator i = view.changes.begin(); i != view.changes.end(); ++i ) {
+		if( !i->second.first ) continue;
+
+		const string &key = i->second.second;
+		index_key_value( view.kind, key.data(), key.size(), value );
+		if( query_match_term( term, value ) ) paths.insert( i->first );
+	}
+}
+
+// The paths the indexes say might match the part of the query at node;
+// false if the indexes can't answer it.  An and needs one side indexed
+// (both narrow it down further), an or needs both, and a not can't be
+// answered from an index at all, just as on BFS.
+static inline bool index_candidates( const string &root, const map<string, uint32> &types,
+									 const QueryExpr &expr, int node, set<string> &paths )
+{
+	const QueryNode &n = expr.nodes[node];
+	switch( n.kind ) {
+	case QUERY_TERM:
+		{
+			if( types.find( n.attr ) == types.end() ) return false;
+
+			IndexView view;
+			if( !index_load( root, n.attr, view ) ) return false;
+			index_scan( view, n, paths );
+		}
+		return true;
+
+	case QUERY_AND:
+		{
+			set<string> left, right;
+			bool has_left = index_candidates( root, types, expr, n.left, left );
+			bool has_right = index_candidates( root, types, expr, n.right, right );
+			if( has_left && has_right ) {
+				set_intersection( left.begin(), left.end(), right.begin(), right.end(),
+								  inserter( paths, paths.end() ) );
+			} else if( has_left ) {
+				paths.swap( left );
+			} else if( has_right ) {
+				paths.swap( right );
+			} else {
+				return false;
+			}
+		}
+		return true;
+
+	case QUERY_OR:
+		{
+			set<string> right;
+			if( !index_candidates( root, types, expr, n.left, paths ) ||
+				!index_candidates( root, types, expr, n.right, right ) ) return false;
+			paths.insert( right.begin(), right.end() );
+		}
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+// Gets each of index_query()'s hits while the file is still open, and can
+// turn it down (because its attributes couldn't be read, say); hits that
+// are turned down don't count towards max_hits.
+class IndexHitCheck {
+public:
+	virtual ~IndexHitCheck() {}
+	virtual bool hit( const string &path, int fd ) = 0;
+};
+
+// Run a query on a volume: the indexes pick the candidates, and each one is
+// checked against the whole query as it is on disk now, so entries left
+// behind by renamed or deleted files never show up.  Fills in the paths
+// (relative to the volume) in order, stopping once there are max_hits of
+// them; false, with errno set, if the volume has no indexes or none the
+// query can use (EINVAL).
+static inline bool index_query( const string &root, const QueryExpr &expr,
+								vector<string> &paths, 
+								size_t max_hits = (size_t)-1,
+								IndexHitCheck *check = NULL )
+{
+	map<string, uint32> types;
+	if( !index_types( root, types ) ) return false;
+
+	set<string> candidates;
+	if( !index_candidates( root, types, expr, expr.root, candidates ) ) {
+		errno = EINVAL;
+		return false;
+	}
+
+	QueryProgram program;
+	query_compile( expr, program );
+
+	for( set<string>::iterator i = candidates.begin(); 
+		 i != candidates.end() && paths.size() < max_hits; ++i ) {
+		string path = index_join( root, *i );
+		struct stat st;
+		if( lstat( path.c_str(), &st ) != 0 ) continue;
+
+		int fd = open( path.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK );
+		if( fd < 0 ) continue;
+
+		string::size_type slash = i->find_last_of( '/' );
+		const char *name = i->c_str() + ( slash == string::npos ? 0 : slash + 1 );
+		IndexFileSlots record( program, fd, name, st );
+		if( query_run( program, record ) && ( NULL == check || check->hit( *i, fd ) ) ) {
+			paths.push_back( *i );
+		}
+		close( fd );
+	}
+
+	return true;
+}
+
+#endif // FSINDEX_H
@@ -0,0 +1,633 @@
+// haikuglue.storage node monitoring
+//
+// A NodeMonitor watches nodes the way watch_node() does and keeps their
+// events in a queue, with repeats folded together: until the queue is
+// read, a burst of writes to one attribute (or of entries showing up in
+// one directory) is a single event.  A pipe is readable while the queue
+// isn't empty, so it can go into select() or an event loop.  Nothing in
+// here touches Python.
+//
+// On Haiku the events come from watch_node() through a looper.  On Linux
+// a stand-in built on inotify reports the same events: inotify says that
+// something about a node changed, and the stand-in compares the node's
+// attributes with what they were to find out which ones (or that it was
+// its stat data).  It keeps the path it was given for each node, so a
+// node that's been renamed gets its attribute changes reported without a
+// name.
+//
+// Events are about the watched node: its attributes and stat data, or,
+// for a directory, entries being created, removed or moved in it.
+//
+// On Linux, include fsattr_xattr.h first.
+//
+
+#ifndef FSMONITOR_H
+#define FSMONITOR_H
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/xattr.h>
+#include <poll.h>
+#else
+#include <app/Looper.h>
+#include <app/Message.h>
+#include <app/Messenger.h>
+#include <storage/Entry.h>
+#include <storage/NodeMonitor.h>
+#endif
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+// storage/NodeMonitor.h
+#define B_STOP_WATCHING		0x0000
+#define B_WATCH_NAME		0x0001
+#define B_WATCH_STAT		0x0002
+#define B_WATCH_ATTR		0x0004
+#define B_WATCH_DIRECTORY	0x0008
+
+#define B_ENTRY_CREATED		1
+#define B_ENTRY_REMOVED		2
+#define B_ENTRY_MOVED		3
+#define B_STAT_CHANGED		4
+#define B_ATTR_CHANGED		5
+#endif
+
+// Not one of Haiku's opcodes: events were lost, so anything being watched
+// may have changed.  Its device and node are 0.  The inotify stand-in sends
+// it when the kernel's queue overflows.
+#define MONITOR_EVENTS_LOST	(-1)
+
+struct MonitorEvent {
+	dev_t device;		// the watched node
+	ino_t node;
+	int opcode;
+	bool has_attr;		// B_ATTR_CHANGED, if it's known which attribute
+	string attr;
+
+	bool operator<( const MonitorEvent &other ) const {
+		if( device != other.device ) return device < other.device;
+		if( node != other.node ) return node < other.node;
+		if( opcode != other.opcode ) return opcode < other.opcode;
+		if( has_attr != other.has_attr ) return has_attr < other.has_attr;
+		return attr < other.attr;
+	}
+};
+
+#ifdef __linux__
+// A watched node; attrs has a hash of each of its Haiku attributes, for
+// working out which ones an IN_ATTRIB was about.
+struct MonitorWatch {
+	dev_t device;
+	ino_t node;
+	uint32 flags;
+	string path;
+	map<string, uint64> attrs;
+};
+#else
+class NodeMonitor;
+
+class MonitorLooper : public BLooper {
+public:
+	MonitorLooper( NodeMonitor *monitor )
+		: BLooper( "haikuglue node monitor", B_LOW_PRIORITY ), monitor( monitor ) {}
+
+	virtual void MessageReceived( BMessage *message );
+
+private:
+	NodeMonitor *monitor;
+};
+#endif
+
+class NodeMonitor {
+public:
+	NodeMonitor();
+	~NodeMonitor() { close(); pthread_mutex_destroy( &lock ); }
+
+	// Both return 0, or an error code for strerror(); watch() returns
+	// EINVAL for flags it can't watch.
+	int open( void );
+	int watch( const char *path, uint32 flags, dev_t &device, ino_t &node );
+	int unwatch( dev_t device, ino_t node );
+
+	// Stop watching everything; events already queued can still be taken.
+	void close( void );
+
+	// Readable while there are events; -1 before open() and after close().
+	int fileno( void ) const { return event_pipe[0]; }
+
+	// Hand over the events queued so far, oldest first.
+	void take( vector<MonitorEvent> &events );
+
+#ifdef __linux__
+	void run( void );
+#else
+	void received( BMessage *message );
+#endif
+
+private:
+	void push( const MonitorEvent &event );	// with lock held
+	void close_event_pipe( void );
+
+	pthread_mutex_t lock;
+	vector<MonitorEvent> queue;
+	set<MonitorEvent> queued;
+	int event_pipe[2];
+#ifdef __linux__
+	void attrib( int wd );	// with lock held; lets go of it for a while
+
+	int inotify_fd;
+	int stop_pipe[2];				// wakes the thread up for close()
+	bool thread_started;
+	pthread_t thread;
+	map<int, MonitorWatch> watches;	// by watch descriptor
+	map<pair<dev_t, ino_t>, int> descriptors;
+#else
+	MonitorLooper *looper;
+#endif
+
+	// Not copyable.
+	NodeMonitor( const NodeMonitor & );
+	NodeMonitor &operator=( const NodeMonitor & );
+};
+
+inline NodeMonitor::NodeMonitor()
+{
+	pthread_mutex_init( &lock, NULL );
+	event_pipe[0] = event_pipe[1] = -1;
+#ifdef __linux__
+	inotify_fd = -1;
+	stop_pipe[0] = stop_pipe[1] = -1;
+	thread_started = false;
+#else
+	looper = NULL;
+#endif
+}
+
+inline void NodeMonitor::push( const MonitorEvent &event )
+{
+	if( !queued.insert( event ).second ) return;
+
+	// One byte is enough to wake up select(); take() empties the pipe
+	// when it empties the queue.
+	queue.push_back( event );
+	if( 1 == queue.size() && event_pipe[1] >= 0 ) {
+		char poke = 0;
+		(void)write( event_pipe[1], &poke, 1 );
+	}
+}
+
+inline void NodeMonitor::close_event_pipe( void )
+{
+	pthread_mutex_lock( &lock );
+	for( int i = 0; i < 2; i++ ) {
+		if( event_pipe[i] >= 0 ) {
+			::close( event_pipe[i] );
+			event_pipe[i] = -1;
+		}
+	}
+	pthread_mutex_unlock( &lock );
+}
+
+inline void NodeMonitor::take( vector<MonitorEvent> &events )
+{
+	pthread_mutex_lock( &lock );
+	events.swap( queue );
+	queue.clear();
+	queued.clear();
+	if( event_pipe[0] >= 0 ) {
+		char junk[64];
+		while( read( event_pipe[0], junk, sizeof( junk ) ) > 0 ) ;
+	}
+	pthread_mutex_unlock( &lock );
+}
+
+#ifdef __linux__
+// ----------------------------------------------------------------------
+// The inotify stand-in
+
+#define MONITOR_HASH_BASIS	0xcbf29ce484222325ULL	// FNV-1a
+#define MONITOR_HASH_PRIME	0x100000001b3ULL
+
+// Hash each of the Haiku attributes at path; false if they can't be read.
+static inline bool monitor_attr_hashes( const string &path, map<string, uint64> &attrs )
+{
+	vector<char> names;
+	ssize_t size = listxattr( path.c_str(), NULL, 0 );
+	while( size > 0 ) {
+		names.resize( size );
+		size = listxattr( path.c_str(), &names[0], names.size() );
+		if( size >= 0 || ERANGE != errno ) break;
+		size = listxattr( path.c_str(), NULL, 0 );
+	}
+	if( size < 0 ) return false;
+
+	size_t prefix_len = strlen( XATTR_HAIKU_PREFIX );
+	vector<char> value;
+	for( ssize_t pos = 0; pos < size; pos += strlen( &names[pos] ) + 1 ) {
+		const char *name = &names[pos];
+		if( strncmp( name, XATTR_HAIKU_PREFIX, prefix_len ) != 0 ) continue;
+
+		ssize_t value_size = getxattr( path.c_str(), name, NULL, 0 );
+		if( value_size < 0 ) continue;
+		value.resize( value_size + 1 );
+		value_size = getxattr( path.c_str(), name, &value[0], value_size );
+		if( value_size < 0 ) continue;
+
+		uint64 hash = MONITOR_HASH_BASIS;
+		for( ssize_t i = 0; i < value_size; i++ ) {
+			hash = ( hash ^ (unsigned char)value[i] ) * MONITOR_HASH_PRIME;
+		}
+		attrs[name + prefix_len] = hash;
+	}
+
+	return true;
+}
+
+static void *monitor_thread( void *data )
+{
+	static_cast<NodeMonitor *>( data )->run();
+	return NULL;
+}
+
+inline int NodeMonitor::open( void )
+{
+	if( pipe( event_pipe ) != 0 ) return errno;
+	if( pipe( stop_pipe ) != 0 ) return errno;
+	for( int i = 0; i < 2; i++ ) {
+		fcntl( event_pipe[i], F_SETFL, O_NONBLOCK );
+		fcntl( event_pipe[i], F_SETFD, FD_CLOEXEC );
+		fcntl( stop_pipe[i], F_SETFD, FD_CLOEXEC );
+	}
+
+	inotify_fd = inotify_init();
+	if( inotify_fd < 0 ) return errno;
+	fcntl( inotify_fd, F_SETFD, FD_CLOEXEC );
+
+	int error = pthread_create( &thread, NULL, monitor_thread, this );
+	if( error != 0 ) return error;
+	thread_started = true;
+
+	return 0;
+}
+
+inline int NodeMonitor::watch( const char *path, uint32 flags,
+									  dev_t &device, ino_t &node )
+{
+	struct stat st;
+	if( stat( path, &st ) != 0 ) return errno;
+	device = st.st_dev;
+	node = st.st_ino;
+
+	if( B_STOP_WATCHING == flags ) {
+		int error = unwatch( device, node );
+		return ( ENOENT == error ) ? 0 : error;
+	}
+	// B_WATCH_NAME would need the node's new name, which inotify doesn't
+	// give.
+	if( flags & ~( B_WATCH_STAT | B_WATCH_ATTR | B_WATCH_DIRECTORY ) ) return EINVAL;
+
+	uint32_t mask = 0;
+	if( flags & ( B_WATCH_ATTR | B_WATCH_STAT ) ) mask |= IN_ATTRIB;
+	if( flags & B_WATCH_STAT ) mask |= IN_MODIFY;
+	if( ( flags & B_WATCH_DIRECTORY ) && S_ISDIR( st.st_mode ) ) {
+		mask |= IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+	}
+	// Only B_WATCH_DIRECTORY, on a file: watched, but nothing to report,
+	// as on Haiku.  run() ignores IN_DELETE_SELF.
+	if( 0 == mask ) mask = IN_DELETE_SELF;
+
+	// Before the watch, so changes made in between are reported rather
+	// than folded into the starting point.
+	map<string, uint64> attrs;
+	if( mask & IN_ATTRIB ) (void)monitor_attr_hashes( path, attrs );
+
+	pthread_mutex_lock( &lock );
+	int wd = inotify_add_watch( inotify_fd, path, mask );
+	int error = errno;
+	if( wd >= 0 ) {
+		MonitorWatch &watch = watches[wd];
+		watch.device = device;
+		watch.node = node;
+		watch.flags = flags;
+		watch.path = path;
+		watch.attrs.swap( attrs );
+		descriptors[make_pair( device, node )] = wd;
+	}
+	pthread_mutex_unlock( &lock );
+
+	return ( wd < 0 ) ? error : 0;
+}
+
+inline int NodeMonitor::unwatch( dev_t device, ino_t node )
+{
+	pthread_mutex_lock( &lock );
+	map<pair<dev_t, ino_t>, int>::iterator wd = descriptors.find( make_pair( device, node ) );
+	if( wd == descriptors.end() ) {
+		pthread_mutex_unlock( &lock );
+		return ENOENT;
+	}
+	(void)inotify_rm_watch( inotify_fd, wd->second );
+	watches.erase( wd->second );
+	descriptors.erase( wd );
+	pthread_mutex_unlock( &lock );
+
+	return 0;
+}
+
+// Something about the node watched by wd changed; find out what.  Reading
+// its attributes can take a while, so that happens without the lock, and
+// take() and watch() don't wait on the disk.
+inline void NodeMonitor::attrib( int wd )
+{
+	map<int, MonitorWatch>::iterator watch = watches.find( wd );
+	string path = watch->second.path;
+	dev_t device = watch->second.device;
+	ino_t node = watch->second.node;
+
+	pthread_mutex_unlock( &lock );
+	map<string, uint64> attrs;
+	bool readable = monitor_attr_hashes( path, attrs );
+	pthread_mutex_lock( &lock );
+
+	// It may have been unwatched meanwhile, and the descriptor handed to
+	// another node.
+	watch = watches.find( wd );
+	if( watch == watches.end() || watch->second.device != device ||
+		watch->second.node != node ) {
+		return;
+	}
+	uint32 flags = watch->second.flags;
+
+	MonitorEvent event;
+	event.device = device;
+	event.node = node;
+	event.opcode = B_ATTR_CHANGED;
+	event.has_attr = true;
+
+	if( !readable ) {
+		// Renamed or gone; an attribute may have changed, or not.
+		if( flags & B_WATCH_ATTR ) {
+			event.has_attr = false;
+			push( event );
+		}
+		if( flags & B_WATCH_STAT ) {
+			event.opcode = B_STAT_CHANGED;
+			event.has_attr = false;
+			push( event );
+		}
+		return;
+	}
+
+	bool changed = false;
+	map<string, uint64>::iterator now = attrs.begin();
+	map<string, uint64>::iterator then = watch->second.attrs.begin();
+	while( now != attrs.end() || then != watch->second.attrs.end() ) {
+		if( then == watch->second.attrs.end() ||
+			( now != attrs.end() && now->first < then->first ) ) {
+			event.attr = now->first;	// new
+			++now;
+		} else if( now == attrs.end() || then->first < now->first ) {
+			event.attr = then->first;	// removed
+			++then;
+		} else {
+			bool same = ( now->second == then->second );
+			event.attr = now->first;
+			++now;
+			++then;
+			if( same ) continue;
+		}
+
+		changed = true;
+		if( flags & B_WATCH_ATTR ) push( event );
+	}
+	watch->second.attrs.swap( attrs );
+
+	// Not the attributes, so it's something stat() shows.
+	if( !changed && ( flags & B_WATCH_STAT ) ) {
+		event.opcode = B_STAT_CHANGED;
+		event.has_attr = false;
+		event.attr.erase();
+		push( event );
+	}
+}
+
+inline void NodeMonitor::run( void )
+{
+	char buffer[4096] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+
+	for( ;; ) {
+		struct pollfd fds[2];
+		fds[0].fd = inotify_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = stop_pipe[0];
+		fds[1].events = POLLIN;
+		if( poll( fds, 2, -1 ) < 0 ) {
+			if( errno == EINTR ) continue;
+			break;
+		}
+		if( fds[1].revents ) break;	// close() wants us gone
+
+		ssize_t len = read( inotify_fd, buffer, sizeof( buffer ) );
+		if( len <= 0 ) {
+			if( len < 0 && ( errno == EINTR || errno == EAGAIN ) ) continue;
+			break;
+		}
+
+		pthread_mutex_lock( &lock );
+		for( char *ptr = buffer; ptr < buffer + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)ptr;
+			ptr += sizeof( struct inotify_event ) + ev->len;
+
+			if( ev->mask & IN_Q_OVERFLOW ) {
+				MonitorEvent event;
+				event.device = 0;
+				event.node = 0;
+				event.opcode = MONITOR_EVENTS_LOST;
+				event.has_attr = false;
+				push( event );
+				continue;
+			}
+
+			map<int, MonitorWatch>::iterator watch = watches.find( ev->wd );
+			if( watch == watches.end() ) continue;
+			if( ev->mask & IN_IGNORED ) {
+				descriptors.erase( make_pair( watch->second.device, watch->second.node ) );
+				watches.erase( watch );
+				continue;
+			}
+
+			MonitorEvent event;
+			event.device = watch->second.device;
+			event.node = watch->second.node;
+			event.has_attr = false;
+
+			if( ev->mask & IN_CREATE ) {
+				event.opcode = B_ENTRY_CREATED;
+				push( event );
+			} else if( ev->mask & IN_DELETE ) {
+				event.opcode = B_ENTRY_REMOVED;
+				push( event );
+			} else if( ev->mask & ( IN_MOVED_FROM | IN_MOVED_TO ) ) {
+				event.opcode = B_ENTRY_MOVED;
+				push( event );
+			} else if( ev->len > 0 ) {
+				// A directory hears about its entries' changes too; those
+				// are theirs to report.
+				continue;
+			} else if( ev->mask & IN_MODIFY ) {
+				event.opcode = B_STAT_CHANGED;
+				push( event );
+			} else if( ev->mask & IN_ATTRIB ) {
+				attrib( ev->wd );
+			}
+		}
+		pthread_mutex_unlock( &lock );
+	}
+}
+
+inline void NodeMonitor::close( void )
+{
+	if( thread_started ) {
+		char poke = 0;
+		(void)write( stop_pipe[1], &poke, 1 );
+		pthread_join( thread, NULL );
+		thread_started = false;
+	}
+
+	if( inotify_fd >= 0 ) {
+		::close( inotify_fd );
+		inotify_fd = -1;
+	}
+	for( int i = 0; i < 2; i++ ) {
+		if( stop_pipe[i] >= 0 ) {
+			::close( stop_pipe[i] );
+			stop_pipe[i] = -1;
+		}
+	}
+	watches.clear();
+	descriptors.clear();
+	close_event_pipe();
+}
+#else
+// ----------------------------------------------------------------------
+// watch_node()
+
+inline void MonitorLooper::MessageReceived( BMessage *message )
+{
+	if( message->what == B_NODE_MONITOR ) {
+		monitor->received( message );
+	} else {
+		BLooper::MessageReceived( message );
+	}
+}
+
+inline int NodeMonitor::open( void )
+{
+	if( pipe( event_pipe ) != 0 ) return errno;
+	for( int i = 0; i < 2; i++ ) {
+		fcntl( event_pipe[i], F_SETFL, O_NONBLOCK );
+		fcntl( event_pipe[i], F_SETFD, FD_CLOEXEC );
+	}
+
+	looper = new MonitorLooper( this );
+	looper->Run();
+	return 0;
+}
+
+inline int NodeMonitor::watch( const char *path, uint32 flags,
+									  dev_t &device, ino_t &node )
+{
+	struct stat st;
+	if( stat( path, &st ) != 0 ) return errno;
+	device = st.st_dev;
+	node = st.st_ino;
+
+	node_ref nref( device, node );
+	status_t status = watch_node( &nref, flags, BMessenger( looper ) );
+	return ( status == B_OK ) ? 0 : status;
+}
+
+inline int NodeMonitor::unwatch( dev_t device, ino_t node )
+{
+	node_ref nref( device, node );
+	status_t status = watch_node( &nref, B_STOP_WATCHING, BMessenger( looper ) );
+	return ( status == B_OK ) ? 0 : status;
+}
+
+inline void NodeMonitor::received( BMessage *message )
+{
+	int32 opcode;
+	int32 device;
+	if( message->FindInt32( "opcode", &opcode ) != B_OK ||
+		message->FindInt32( "device", &device ) != B_OK ) return;
+
+	MonitorEvent event;
+	event.device = device;
+	event.opcode = opcode;
+	event.has_attr = false;
+
+	// Directory events go to the directory, the rest to the node.
+	int64 node;
+	int64 to_node = 0;
+	const char *attr;
+	bool moved_between = false;
+	switch( opcode ) {
+	case B_ENTRY_CREATED:
+	case B_ENTRY_REMOVED:
+		if( message->FindInt64( "directory", &node ) != B_OK ) return;
+		break;
+
+	case B_ENTRY_MOVED:
+		if( message->FindInt64( "from directory", &node ) != B_OK ||
+			message->FindInt64( "to directory", &to_node ) != B_OK ) return;
+		moved_between = ( node != to_node );
+		break;
+
+	case B_STAT_CHANGED:
+		if( message->FindInt64( "node", &node ) != B_OK ) return;
+		break;
+
+	case B_ATTR_CHANGED:
+		if( message->FindInt64( "node", &node ) != B_OK ) return;
+		if( message->FindString( "attr", &attr ) == B_OK ) {
+			event.has_attr = true;
+			event.attr = attr;
+		}
+		break;
+
+	default:
+		return;
+	}
+	event.node = node;
+
+	pthread_mutex_lock( &lock );
+	push( event );
+	if( moved_between ) {
+		event.node = to_node;
+		push( event );
+	}
+	pthread_mutex_unlock( &lock );
+}
+
+inline void NodeMonitor::close( void )
+{
+	if( NULL != looper ) {
+		(void)stop_watching( BMessenger( looper ) );
+		if( looper->Lock() ) looper->Quit();
+		looper = NULL;
+	}
+	close_event_pipe();
+}
+#endif
+
+#endif
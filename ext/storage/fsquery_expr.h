@@ -0,0 +1,629 @@
+// haikuglue.storage query expressions
+//
+// A parser and evaluator for BFS query strings, like
+//
+//	(MAIL:status=="New")&&(MAIL:priority>2)||name=="*.[jJ][pP][gG]"
+//
+// The string is parsed once into a QueryExpr, a tree of and/or/not nodes
+// over attribute comparisons, and compiled into a QueryProgram, which is
+// matched against attribute records without parsing anything or looking
+// up attribute names again.  Comparisons follow BFS: strings
+// compare bytewise (== and != take shell wildcards), numbers compare as
+// numbers of the attribute's type, and a missing attribute matches no
+// comparison at all.  Needs the Haiku types (or fsattr_xattr.h) first.
+//
+
+#ifndef FSQUERY_EXPR_H
+#define FSQUERY_EXPR_H
+
+#include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+// Parsing and compiling recurse (compiling once per comparison in a run
+// of && or ||), so a query can't nest parentheses and nots deeper than
+// this or have more comparisons, or a long enough string would run the
+// stack out.
+#define QUERY_MAX_DEPTH		64
+#define QUERY_MAX_TERMS		256
+
+// What an attribute's value is compared as.
+enum {
+	QUERY_STRING,
+	QUERY_INT,
+	QUERY_UINT,
+	QUERY_FLOAT
+};
+
+// Node kinds; and/or have two children, not has one.
+enum {
+	QUERY_AND,
+	QUERY_OR,
+	QUERY_NOT,
+	QUERY_TERM
+};
+
+// Comparisons.
+enum {
+	QUERY_EQ,
+	QUERY_NE,
+	QUERY_LT,
+	QUERY_GT,
+	QUERY_LE,
+	QUERY_GE
+};
+
+// One attribute value, decoded for comparing.
+struct QueryValue {
+	int kind;
+	string str;
+	int64 i;
+	uint64 u;
+	double f;
+
+	QueryValue() : kind( QUERY_STRING ), i( 0 ), u( 0 ), f( 0 ) {}
+};
+
+struct QueryNode {
+	int kind;
+	int left;			// children (indexes into QueryExpr::nodes)
+	int right;
+
+	// QUERY_TERM only
+	string attr;
+	int op;
+	string value;		// the literal, with the escapes taken out
+	string pattern;		// the literal for fnmatch(), escapes left in
+	bool wildcard;		// pattern has *, ? or [ in it
+	bool has_int;		// the literal as each kind of number, if it is one
+	bool has_uint;
+	bool has_float;
+	int64 int_value;
+	uint64 uint_value;
+	double float_value;
+
+	QueryNode() : kind( QUERY_TERM ), left( -1 ), right( -1 ), op( QUERY_EQ ),
+				  wildcard( false ), has_int( false ), has_uint( false ),
+				  has_float( false ), int_value( 0 ), uint_value( 0 ),
+				  float_value( 0 ) {}
+};
+
+struct QueryExpr {
+	vector<QueryNode> nodes;
+	int root;
+	string error;		// why parsing failed
+
+	QueryExpr() : root( -1 ) {}
+};
+
+// ----------------------------------------------------------------------
+// Values
+
+static inline int query_type_kind( uint32 type )
+{
+	switch( type ) {
+	case B_INT8_TYPE:
+	case B_INT16_TYPE:
+	case B_INT32_TYPE:
+	case B_INT64_TYPE:
+	case B_SSIZE_T_TYPE:
+	case B_OFF_T_TYPE:
+	case B_TIME_TYPE:
+	case B_BOOL_TYPE:
+		return QUERY_INT;
+
+	case B_UINT8_TYPE:
+	case B_UINT16_TYPE:
+	case B_UINT32_TYPE:
+	case B_UINT64_TYPE:
+	case B_SIZE_T_TYPE:
+		return QUERY_UINT;
+
+	case B_FLOAT_TYPE:
+	case B_DOUBLE_TYPE:
+		return QUERY_FLOAT;
+
+	default:
+		return QUERY_STRING;
+	}
+}
+
+// Decode raw attribute data; false if it's the wrong size for its type,
+// which counts as missing.  Strings stop at their terminating null.
+static inline bool query_value_from_attr( uint32 type, const char *data, size_t size,
+										  QueryValue &value )
+{
+	value.kind = query_type_kind( type );
+	switch( value.kind ) {
+	case QUERY_INT:
+		if( 1 == size ) {
+			int8 x;
+			memcpy( &x, data, 1 );
+			value.i = x;
+		} else if( 2 == size ) {
+			int16 x;
+			memcpy( &x, data, 2 );
+			value.i = x;
+		} else if( 4 == size ) {
+			int32 x;
+			memcpy( &x, data, 4 );
+			value.i = x;
+		} else if( 8 == size ) {
+			memcpy( &value.i, data, 8 );
+		} else {
+			return false;
+		}
+		return true;
+
+	case QUERY_UINT:
+		if( 1 == size ) {
+			uint8 x;
+			memcpy( &x, data, 1 );
+			value.u = x;
+		} else if( 2 == size ) {
+			uint16 x;
+			memcpy( &x, data, 2 );
+			value.u = x;
+		} else if( 4 == size ) {
+			uint32 x;
+			memcpy( &x, data, 4 );
+			value.u = x;
+		} else if( 8 == size ) {
+			memcpy( &value.u, data, 8 );
+		} else {
+			return false;
+		}
+		return true;
+
+	case QUERY_FLOAT:
+		if( sizeof( float ) == size ) {
+			float x;
+			memcpy( &x, data, sizeof( float ) );
+			value.f = x;
+		} else if( sizeof( double ) == size ) {
+			memcpy( &value.f, data, sizeof( double ) );
+		} else {
+			return false;
+		}
+		return true;
+
+	default:
+		{
+			const char *end = (const char *)memchr( data, '\0', size );
+			value.str.assign( data, NULL == end ? size : end - data );
+		}
+		return true;
+	}
+}
+
+// ----------------------------------------------------------------------
+// Matching
+
+template<class T>
+static inline bool query_compare( int op, const T &a, const T &b )
+{
+	switch( op ) {
+	case QUERY_EQ:	return a == b;
+	case QUERY_NE:	return !( a == b );
+	case QUERY_LT:	return a < b;
+	case QUERY_GT:	return b < a;
+	case QUERY_LE:	return !( b < a );
+	case QUERY_GE:	return !( a < b );
+	}
+
+	return false;
+}
+
+static inline bool query_match_term( const QueryNode &term, const QueryValue &value )
+{
+	switch( value.kind ) {
+	case QUERY_INT:
+		if( term.has_int ) return query_compare( term.op, value.i, term.int_value );
+		if( term.has_float ) return query_compare( term.op, (double)value.i, term.float_value );
+		return false;
+
+	case QUERY_UINT:
+		if( term.has_uint ) return query_compare( term.op, value.u, term.uint_value );
+		if( term.has_float ) return query_compare( term.op, (double)value.u, term.float_value );
+		return false;
+
+	case QUERY_FLOAT:
+		if( term.has_float ) return query_compare( term.op, value.f, term.float_value );
+		return false;
+
+	default:
+		if( term.wildcard && ( QUERY_EQ == term.op || QUERY_NE == term.op ) ) {
+			bool matches = ( fnmatch( term.pattern.c_str(), value.str.c_str(), 0 ) == 0 );
+			return ( QUERY_EQ == term.op ) ? matches : !matches;
+		}
+		return query_compare( term.op, value.str, term.value );
+	}
+}
+
+// The attribute names a query looks at, each once, in the order they first
+// show up.
+static inline void query_expr_attrs( const QueryExpr &expr, vector<string> &names )
+{
+	for( size_t i = 0; i < expr.nodes.size(); i++ ) {
+		if( expr.nodes[i].kind != QUERY_TERM ) continue;
+
+		size_t j;
+		for( j = 0; j < names.size() && names[j] != expr.nodes[i].attr; j++ );
+		if( j == names.size() ) names.push_back( expr.nodes[i].attr );
+	}
+}
+
+// The attributes BFS keeps for every entry come from stat(); false for
+// any other name.
+static inline bool query_is_stat_attr( const string &attr )
+{
+	return attr == "name" || attr == "size" || attr == "last_modified";
+}
+
+static inline bool query_stat_value( const string &attr, const char *name,
+									 const struct stat &st, QueryValue &value )
+{
+	if( attr == "name" ) {
+		value.kind = QUERY_STRING;
+		value.str = name;
+	} else if( attr == "size" ) {
+		value.kind = QUERY_INT;
+		value.i = st.st_size;
+	} else if( attr == "last_modified" ) {
+		value.kind = QUERY_INT;
+		value.i = st.st_mtime;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+// ----------------------------------------------------------------------
+// Programs.  The tree is flattened into code for a machine with one
+// boolean register: TERM sets it from a comparison, NOT flips it, and the
+// jumps skip the other side of an and/or once the answer is known.  Each
+// attribute name gets a slot, so a record is asked for slot numbers
+// instead of names.
+
+enum {
+	QUERY_OP_TERM,			// arg is the term
+	QUERY_OP_NOT,
+	QUERY_OP_JUMP_FALSE,	// arg is where to
+	QUERY_OP_JUMP_TRUE
+};
+
+struct QueryInsn {
+	int op;
+	int arg;
+};
+
+struct QueryProgram {
+	vector<QueryInsn> code;
+	vector<QueryNode> terms;
+	vector<int> term_slots;		// the slot each term compares
+	vector<string> slots;		// attribute names, each once
+	map<string, int> slot_of;
+};
+
+// What a program is matched against: attribute values by slot.  Each
+// slot is looked up once per record, however many terms compare it;
+// lookup() returns false if the attribute isn't there.
+class QuerySlots {
+public:
+	QuerySlots( const QueryProgram &program )
+		: program( program ), state( program.slots.size(), 0 ),
+		  values( program.slots.size() ) {}
+	virtual ~QuerySlots() {}
+
+	// The value in slot, or NULL if the record doesn't have it.
+	const QueryValue *get( int slot ) {
+		if( 0 == state[slot] ) state[slot] = lookup( slot, values[slot] ) ? 1 : -1;
+		return ( state[slot] > 0 ) ? &values[slot] : NULL;
+	}
+
+	// Forget the values, for reusing the object on the next record.
+	void reset( void ) {
+		fill( state.begin(), state.end(), 0 );
+	}
+
+protected:
+	virtual bool lookup( int slot, QueryValue &value ) = 0;
+
+	const QueryProgram &program;
+
+private:
+	vector<signed char> state;	// 0 not looked up yet, 1 there, -1 missing
+	vector<QueryValue> values;
+};
+
+static inline void query_compile_node( const QueryExpr &expr, int node, QueryProgram &program )
+{
+	const QueryNode &n = expr.nodes[node];
+	QueryInsn insn;
+	switch( n.kind ) {
+	case QUERY_AND:
+	case QUERY_OR:
+		{
+			query_compile_node( expr, n.left, program );
+			size_t jump = program.code.size();
+			insn.op = ( QUERY_AND == n.kind ) ? QUERY_OP_JUMP_FALSE : QUERY_OP_JUMP_TRUE;
+			insn.arg = 0;
+			program.code.push_back( insn );
+			query_compile_node( expr, n.right, program );
+			program.code[jump].arg = program.code.size();
+		}
+		break;
+
+	case QUERY_NOT:
+		query_compile_node( expr, n.left, program );
+		insn.op = QUERY_OP_NOT;
+		insn.arg = 0;
+		program.code.push_back( insn );
+		break;
+
+	default:
+		{
+			map<string, int>::iterator slot = program.slot_of.find( n.attr );
+			if( slot == program.slot_of.end() ) {
+				slot = program.slot_of.insert( make_pair( n.attr, (int)program.slots.size() ) ).first;
+				program.slots.push_back( n.attr );
+			}
+			insn.op = QUERY_OP_TERM;
+			insn.arg = program.terms.size();
+			program.terms.push_back( n );
+			program.term_slots.push_back( slot->second );
+			program.code.push_back( insn );
+		}
+	}
+}
+
+static inline void query_compile( const QueryExpr &expr, QueryProgram &program )
+{
+	program = QueryProgram();
+	query_compile_node( expr, expr.root, program );
+}
+
+static inline bool query_run( const QueryProgram &program, QuerySlots &record )
+{
+	bool result = false;
+	size_t pc = 0;
+	while( pc < program.code.size() ) {
+		const QueryInsn &insn = program.code[pc++];
+		switch( insn.op ) {
+		case QUERY_OP_TERM:
+			{
+				const QueryValue *value = record.get( program.term_slots[insn.arg] );
+				result = NULL != value && query_match_term( program.terms[insn.arg], *value );
+			}
+			break;
+
+		case QUERY_OP_NOT:
+			result = !result;
+			break;
+
+		case QUERY_OP_JUMP_FALSE:
+			if( !result ) pc = insn.arg;
+			break;
+
+		default:
+			if( result ) pc = insn.arg;
+		}
+	}
+
+	return result;
+}
+
+// ----------------------------------------------------------------------
+// Parsing; the grammar is
+//
+//	or    := and ( "||" and )*
+//	and   := unary ( "&&" unary )*
+//	unary := "!" unary | "(" or ")" | term
+//	term  := word op ( quoted | word )
+//	op    := "==" | "!=" | "<" | ">" | "<=" | ">="
+//
+// with \ escaping the next character in quoted strings.
+
+struct QueryParser {
+	const char *start;
+	const char *p;
+	QueryExpr &expr;
+	int depth;			// parentheses and nots we're inside
+	int terms;
+
+	QueryParser( const char *query, QueryExpr &e ) 
+		: start( query ), p( query ), expr( e ), depth( 0 ), terms( 0 ) {}
+
+	void skip_space() {
+		while( isspace( (unsigned char)*p ) ) p++;
+	}
+
+	int fail( const char *what ) {
+		if( expr.error.empty() ) {
+			char where[32];
+			sprintf( where, " at offset %d", (int)( p - start ) );
+			expr.error = string( what ) + where;
+		}
+		return -1;
+	}
+
+	int add( int kind, int left, int right ) {
+		QueryNode node;
+		node.kind = kind;
+		node.left = left;
+		node.right = right;
+		expr.nodes.push_back( node );
+		return expr.nodes.size() - 1;
+	}
+
+	// A quoted string or a bare word; returns false if there's neither.
+	bool literal( string &value, string &pattern, bool &wildcard, bool &quoted ) {
+		value.erase();
+		pattern.erase();
+		wildcard = false;
+		quoted = ( *p == '"' || *p == '\'' );
+		if( quoted ) {
+			char quote = *p++;
+			while( *p && *p != quote ) {
+				if( *p == '\\' && p[1] ) {
+					// the escape stays in for fnmatch(), unless it's
+					// only there for the quote
+					if( p[1] != quote ) pattern += *p;
+					p++;
+				} else if( strchr( "*?[", *p ) ) {
+					wildcard = true;
+				}
+				value += *p;
+				pattern += *p;
+				p++;
+			}
+			if( *p != quote ) return false;
+			p++;
+			return true;
+		}
+
+		while( *p && !isspace( (unsigned char)*p ) && !strchr( "()&|=!<>\"'", *p ) ) {
+			if( strchr( "*?[", *p ) ) wildcard = true;
+			value += *p;
+			pattern += *p;
+			p++;
+		}
+		return !value.empty();
+	}
+
+	int term() {
+		if( ++terms > QUERY_MAX_TERMS ) return fail( "too many comparisons" );
+
+		string attr, pattern;
+		bool wildcard, quoted;
+		if( !literal( attr, pattern, wildcard, quoted ) ) {
+			return fail( "expected an attribute name" );
+		}
+
+		skip_space();
+		int op;
+		if( strncmp( p, "==", 2 ) == 0 ) {
+			op = QUERY_EQ;
+			p += 2;
+		} else if( strncmp( p, "!=", 2 ) == 0 ) {
+			op = QUERY_NE;
+			p += 2;
+		} else if( strncmp( p, "<=", 2 ) == 0 ) {
+			op = QUERY_LE;
+			p += 2;
+		} else if( strncmp( p, ">=", 2 ) == 0 ) {
+			op = QUERY_GE;
+			p += 2;
+		} else if( *p == '<' ) {
+			op = QUERY_LT;
+			p++;
+		} else if( *p == '>' ) {
+			op = QUERY_GT;
+			p++;
+		} else {
+			return fail( "expected a comparison" );
+		}
+
+		skip_space();
+		QueryNode node;
+		node.kind = QUERY_TERM;
+		node.attr = attr;
+		node.op = op;
+		if( !literal( node.value, node.pattern, node.wildcard, quoted ) ) {
+			return fail( "expected a value" );
+		}
+
+		// Numbers are worked out now so matching doesn't parse anything.
+		const char *str = node.value.c_str();
+		char *end;
+		if( *str ) {
+			errno = 0;
+			node.int_value = strtoll( str, &end, 0 );
+			node.has_int = ( 0 == *end && 0 == errno );
+			errno = 0;
+			node.uint_value = strtoull( str, &end, 0 );
+			node.has_uint = ( 0 == *end && 0 == errno && NULL == strchr( str, '-' ) );
+			errno = 0;
+			node.float_value = strtod( str, &end );
+			node.has_float = ( 0 == *end && 0 == errno );
+		}
+
+		expr.nodes.push_back( node );
+		return expr.nodes.size() - 1;
+	}
+
+	int unary() {
+		skip_space();
+		bool negate = ( *p == '!' && p[1] != '=' );
+		if( !negate && *p != '(' ) return term();
+		if( depth >= QUERY_MAX_DEPTH ) return fail( "nested too deeply" );
+
+		p++;
+		depth++;
+		int child = negate ? unary() : any();
+		depth--;
+		if( child < 0 ) return -1;
+		if( negate ) return add( QUERY_NOT, child, -1 );
+
+		skip_space();
+		if( *p != ')' ) return fail( "expected )" );
+		p++;
+		return child;
+	}
+
+	int all() {
+		int left = unary();
+		for( ;; ) {
+			if( left < 0 ) return -1;
+			skip_space();
+			if( strncmp( p, "&&", 2 ) != 0 ) return left;
+			p += 2;
+
+			int right = unary();
+			if( right < 0 ) return -1;
+			left = add( QUERY_AND, left, right );
+		}
+	}
+
+	int any() {
+		int left = all();
+		for( ;; ) {
+			if( left < 0 ) return -1;
+			skip_space();
+			if( strncmp( p, "||", 2 ) != 0 ) return left;
+			p += 2;
+
+			int right = all();
+			if( right < 0 ) return -1;
+			left = add( QUERY_OR, left, right );
+		}
+	}
+};
+
+// Parse a query string; false, with expr.error saying why, if it isn't one.
+static inline bool query_parse( const char *query, QueryExpr &expr )
+{
+	expr.nodes.clear();
+	expr.error.erase();
+
+	QueryParser parser( query, expr );
+	expr.root = parser.any();
+	if( expr.root >= 0 ) {
+		parser.skip_space();
+		if( *parser.p ) expr.root = parser.fail( "unexpected text" );
+	}
+
+	return expr.root >= 0;
+}
+
+#endif // FSQUERY_EXPR_H
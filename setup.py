@@ -7,21 +7,34 @@ if sys.platform == "zeta":
 
 from distutils.core import setup, Extension
 
-modules_list = [
-	Extension('haikuglue.storage._find_directory',
-		['ext/storage/_find_directory.cpp'],
-		extra_compile_args=['-Wno-multichar'],
-		extra_link_args=['-nostart', '-Wl,-soname=_find_directory.so'],
-		libraries=libs),
-	Extension('haikuglue.storage._fsquery',
-		['ext/storage/_fsquery.cpp'],
-		extra_link_args=['-nostart', '-Wl,-soname=_fsquery.so'],
-		libraries=libs),
-	Extension('haikuglue.storage._fsattr',
-		['ext/storage/_fsattr.cpp'],
-		extra_compile_args=['-Wno-multichar'],
-		extra_link_args=['-nostart', '-Wl,-soname=_fsattr.so'],
-		libraries=libs)]
+if sys.platform.startswith("linux"):
+	# No Haiku API here; attributes live in xattrs, and _fsquery is the
+	# stand-in used for testing.
+	modules_list = [
+		Extension('haikuglue.storage._fsquery',
+			['ext/storage/_fsquery.cpp'],
+			extra_compile_args=['-Wno-multichar'],
+			libraries=["pthread"]),
+		Extension('haikuglue.storage._fsattr',
+			['ext/storage/_fsattr.cpp'],
+			extra_compile_args=['-Wno-multichar'],
+			libraries=["pthread"])]
+else:
+	modules_list = [
+		Extension('haikuglue.storage._find_directory',
+			['ext/storage/_find_directory.cpp'],
+			extra_compile_args=['-Wno-multichar'],
+			extra_link_args=['-nostart', '-Wl,-soname=_find_directory.so'],
+			libraries=libs),
+		Extension('haikuglue.storage._fsquery',
+			['ext/storage/_fsquery.cpp'],
+			extra_link_args=['-nostart', '-Wl,-soname=_fsquery.so'],
+			libraries=libs),
+		Extension('haikuglue.storage._fsattr',
+			['ext/storage/_fsattr.cpp'],
+			extra_compile_args=['-Wno-multichar'],
+			extra_link_args=['-nostart', '-Wl,-soname=_fsattr.so'],
+			libraries=libs)]
 
 
 setup(name='HaikuGlue',
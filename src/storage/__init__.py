@@ -4,20 +4,74 @@ Just a few basic BeOS/Haiku API calls for setting attributes on
 files and doing queries.  Various related type constants are also
 exported."""
 
+import sys
+
 from haikuglue import Enum
 
-import _find_directory
-import _fsattr
 import _fsquery
+import _fsattr
 
 # constants
-directory_which = Enum(_find_directory.directory_which)
 types = Enum(_fsattr.types)
 attr = Enum(_fsattr.attr)
+monitor = Enum(_fsattr.monitor)
 
-# functions
-find_directory = _find_directory.find_directory
-query = _fsquery.query
+# classes
+LiveQuery = _fsquery.LiveQuery
+ENTRY_CREATED = _fsquery.ENTRY_CREATED
+ENTRY_REMOVED = _fsquery.ENTRY_REMOVED
+AttrFile = _fsattr.AttrFile
+Query = _fsattr.Query
+Watcher = _fsattr.Watcher
+
+# functions; on Linux the attributes are xattrs (see fsattr_xattr.h)
 read_attrs = _fsattr.read_attrs
+read_attr = _fsattr.read_attr
+read_attr_buffer = _fsattr.read_attr_buffer
+read_attrs_many = _fsattr.read_attrs_many
+set_attr_cache_limit = _fsattr.set_attr_cache_limit
+clear_attr_cache = _fsattr.clear_attr_cache
+attr_cache_stats = _fsattr.attr_cache_stats
+list_attrs = _fsattr.list_attrs
+list_attrs_many = _fsattr.list_attrs_many
+crawl = _fsattr.crawl
 write_attr = _fsattr.write_attr
+write_attrs = _fsattr.write_attrs
+write_attr_at = _fsattr.write_attr_at
 remove_attr = _fsattr.remove_attr
+register_codec = _fsattr.register_codec
+compile_query = _fsattr.compile_query
+query = _fsquery.query
+create_index = _fsquery.create_index
+remove_index = _fsquery.remove_index
+list_indexes = _fsquery.list_indexes
+stat_index = _fsquery.stat_index
+explain = _fsquery.explain
+
+if sys.platform.startswith("linux"):
+	# the indexes are ours there, see fsindex.h
+	rescan_indexes = _fsquery.rescan_indexes
+else:
+	import _find_directory
+
+	# constants
+	directory_which = Enum(_find_directory.directory_which)
+
+	# classes
+	EntryRef = _fsquery.EntryRef
+	Volume = _fsquery.Volume
+	AttrStream = _fsattr.AttrStream
+
+	# functions
+	find_directory = _find_directory.find_directory
+	iquery = _fsquery.iquery
+	query_all = _fsquery.query_all
+	volumes = _fsquery.volumes
+	volume_for_path = _fsquery.volume_for_path
+	set_path_cache_size = _fsquery.set_path_cache_size
+	clear_path_cache = _fsquery.clear_path_cache
+	path_cache_stats = _fsquery.path_cache_stats
+	set_query_cache_limits = _fsquery.set_query_cache_limits
+	clear_query_cache = _fsquery.clear_query_cache
+	query_cache_stats = _fsquery.query_cache_stats
+	open_attr = _fsattr.open_attr
@@ -0,0 +1,30 @@
+"""What the Linux tests have in common: a temporary directory for each test,
+and waiting on the node monitor's thread without guessing at sleeps."""
+
+import shutil
+import sys
+import tempfile
+import time
+import unittest
+
+# How long something that should happen right away gets before the test
+# fails; only a very slow machine comes near it.
+DEADLINE = 5.0
+
+@unittest.skipUnless(sys.platform.startswith("linux"), "Linux stand-ins")
+class TempDirTestCase(unittest.TestCase):
+	"""Runs each test with self.dir, an empty directory removed afterwards."""
+
+	def setUp(self):
+		self.dir = tempfile.mkdtemp()
+
+	def tearDown(self):
+		shutil.rmtree(self.dir)
+
+	def wait_for(self, done, what="it"):
+		"""Call done() until it's true, failing the test after DEADLINE."""
+		deadline = time.time() + DEADLINE
+		while not done():
+			if time.time() > deadline:
+				self.fail("gave up waiting for %s" % what)
+			time.sleep(0.005)
@@ -0,0 +1,191 @@
+"""The attribute cache: hits, invalidation by writes here and elsewhere,
+and eviction.
+
+Needs inotify and a file system with user xattrs in the temporary
+directory; run with the built package on the path, see the README."""
+
+from __future__ import with_statement
+
+import ctypes
+import os
+import struct
+import unittest
+
+from haikuglue import storage
+from linux_case import TempDirTestCase
+
+def type_code(code):
+	return struct.unpack(">I", code)[0]
+
+class CacheTestCase(TempDirTestCase):
+	def setUp(self):
+		TempDirTestCase.setUp(self)
+		self.path = os.path.join(self.dir, "file")
+		open(self.path, "w").close()
+		storage.write_attrs(self.path, {"Test:n": ("LONG", 1), "Test:s": ("CSTR", "one"),
+										"Other:n": ("LONG", 2)})
+		storage.set_attr_cache_limit(1024 * 1024)
+		self.start = storage.attr_cache_stats()
+
+	def tearDown(self):
+		storage.set_attr_cache_limit(0)
+		TempDirTestCase.tearDown(self)
+
+	def counted(self, name):
+		return storage.attr_cache_stats()[name] - self.start[name]
+
+	def elsewhere(self, change):
+		"""Make a change behind the module's back, and wait for the cache's
+		node monitor to throw out what it had."""
+		before = storage.attr_cache_stats()["invalidations"]
+		change()
+		self.wait_for(lambda: storage.attr_cache_stats()["invalidations"] > before,
+					  "the cache to hear about it")
+
+	def set_elsewhere(self, name, value):
+		"""Change a LONG attribute behind the module's back."""
+		libc = ctypes.CDLL(None, use_errno=True)
+		xattr = "user.haiku." + name
+		raw = ctypes.create_string_buffer(64)
+		size = libc.getxattr(self.path, xattr, raw, len(raw))
+		self.assertTrue(size > 4)
+		data = raw.raw[:size - 4] + struct.pack("=i", value)
+		self.elsewhere(lambda: self.assertEqual(
+			libc.setxattr(self.path, xattr, data, len(data), 0), 0))
+
+class HitTest(CacheTestCase):
+	def test_hit(self):
+		first = storage.read_attrs(self.path)
+		second = storage.read_attrs(self.path)
+		self.assertEqual(first, second)
+		self.assertEqual(self.counted("misses"), 1)
+		self.assertEqual(self.counted("hits"), 1)
+		self.assertEqual(storage.attr_cache_stats()["entries"], 1)
+
+	def test_copies(self):
+		storage.read_attrs(self.path)["Test:n"] = None
+		self.assertEqual(storage.read_attrs(self.path)["Test:n"], (type_code("LONG"), 1))
+
+	def test_names_and_prefix(self):
+		storage.read_attrs(self.path)
+		self.assertEqual(storage.read_attrs(self.path, names=["Test:s", "missing"]),
+						 {"Test:s": (type_code("CSTR"), "one")})
+		self.assertEqual(storage.read_attrs(self.path, prefix="Other:"),
+						 {"Other:n": (type_code("LONG"), 2)})
+		self.assertEqual(self.counted("hits"), 2)
+
+	def test_missing_file(self):
+		self.assertRaises(IOError, storage.read_attrs, os.path.join(self.dir, "missing"))
+		self.assertEqual(storage.attr_cache_stats()["entries"], 0)
+
+	def test_off(self):
+		storage.set_attr_cache_limit(0)
+		storage.read_attrs(self.path)
+		storage.read_attrs(self.path)
+		self.assertEqual(storage.attr_cache_stats()["entries"], 0)
+		self.assertEqual(self.counted("hits"), 0)
+
+class InvalidationTest(CacheTestCase):
+	def test_write_attr(self):
+		storage.read_attrs(self.path)
+		storage.write_attr(self.path, "Test:n", "LONG", 5)
+		self.assertEqual(storage.read_attrs(self.path)["Test:n"], (type_code("LONG"), 5))
+
+	def test_write_attrs(self):
+		storage.read_attrs(self.path)
+		storage.write_attrs(self.path, {"Test:n": ("LONG", 6), "Test:x": ("LONG", 7)})
+		attrs = storage.read_attrs(self.path)
+		self.assertEqual(attrs["Test:n"], (type_code("LONG"), 6))
+		self.assertEqual(attrs["Test:x"], (type_code("LONG"), 7))
+
+	def test_remove_attr(self):
+		storage.read_attrs(self.path)
+		storage.remove_attr(self.path, "Test:s")
+		self.assertFalse("Test:s" in storage.read_attrs(self.path))
+
+	def test_attr_file(self):
+		storage.read_attrs(self.path)
+		with storage.AttrFile(self.path) as f:
+			f.set("Test:n", "LONG", 8)
+		self.assertEqual(storage.read_attrs(self.path)["Test:n"], (type_code("LONG"), 8))
+
+	def test_elsewhere(self):
+		storage.read_attrs(self.path)
+		self.set_elsewhere("Test:n", 9)
+		self.assertEqual(storage.read_attrs(self.path)["Test:n"], (type_code("LONG"), 9))
+		self.assertEqual(self.counted("invalidations"), 1)
+
+	def test_stat_change(self):
+		storage.read_attrs(self.path)
+		self.elsewhere(lambda: os.chmod(self.path, 0600))
+		storage.read_attrs(self.path)
+		self.assertEqual(self.counted("hits"), 0)
+
+	def test_clear(self):
+		storage.read_attrs(self.path)
+		storage.clear_attr_cache()
+		self.assertEqual(storage.attr_cache_stats()["entries"], 0)
+		storage.read_attrs(self.path)
+		self.assertEqual(storage.attr_cache_stats()["entries"], 1)
+
+	def test_register_codec(self):
+		storage.read_attrs(self.path)
+		storage.register_codec("LONG", decode=lambda data: "decoded")
+		try:
+			self.assertEqual(storage.attr_cache_stats()["entries"], 0)
+			self.assertEqual(storage.read_attrs(self.path)["Test:n"], (type_code("LONG"), "decoded"))
+		finally:
+			storage.register_codec("LONG")
+		self.assertEqual(storage.read_attrs(self.path)["Test:n"], (type_code("LONG"), 1))
+
+	def test_python_decoded(self):
+		# what a Python codec returns may be mutable, so it's never shared
+		storage.register_codec("LONG", decode=lambda data: [data])
+		try:
+			storage.read_attrs(self.path)["Test:n"][1].append("changed")
+			self.assertEqual(len(storage.read_attrs(self.path)["Test:n"][1]), 1)
+			self.assertEqual(storage.attr_cache_stats()["entries"], 0)
+			self.assertEqual(self.counted("hits"), 0)
+		finally:
+			storage.register_codec("LONG")
+		storage.read_attrs(self.path)
+		self.assertEqual(storage.attr_cache_stats()["entries"], 1)
+
+class LimitTest(CacheTestCase):
+	def test_eviction(self):
+		paths = []
+		for i in range(20):
+			path = os.path.join(self.dir, "file%d" % i)
+			open(path, "w").close()
+			storage.write_attr(path, "Test:s", "CSTR", "x" * 100)
+			paths.append(path)
+		storage.set_attr_cache_limit(2000)
+		for path in paths:
+			storage.read_attrs(path)
+		stats = storage.attr_cache_stats()
+		self.assertTrue(stats["bytes"] <= 2000)
+		self.assertTrue(0 < stats["entries"] < 20)
+		self.assertEqual(self.counted("evictions"), 20 - stats["entries"])
+
+		# the most recently read are the ones kept
+		storage.read_attrs(paths[-1])
+		self.assertEqual(self.counted("hits"), 1)
+
+	def test_shrink(self):
+		storage.read_attrs(self.path)
+		storage.set_attr_cache_limit(1)
+		self.assertEqual(storage.attr_cache_stats()["entries"], 0)
+		self.assertEqual(storage.attr_cache_stats()["limit"], 1)
+
+	def test_bad_limits(self):
+		self.assertRaises(ValueError, storage.set_attr_cache_limit, -1)
+		self.assertRaises(TypeError, storage.set_attr_cache_limit, "lots")
+		self.assertEqual(storage.attr_cache_stats()["limit"], 1024 * 1024)
+
+	def test_stats(self):
+		self.assertEqual(sorted(storage.attr_cache_stats()),
+						 ["bytes", "entries", "evictions", "hits", "invalidations",
+						  "limit", "misses", "overflows"])
+
+if __name__ == "__main__":
+	unittest.main()
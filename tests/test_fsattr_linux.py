@@ -0,0 +1,241 @@
+"""Attribute round trips on the Linux xattr backend.
+
+Needs a file system with user xattrs (tmpfs, ext4, xfs, btrfs...); run
+with the built package on the path, see the README."""
+
+import ctypes
+import os
+import struct
+import sys
+import threading
+import unittest
+
+from haikuglue import storage
+from linux_case import TempDirTestCase
+
+# ( type code, value ) for every type the module converts, plus one it
+# doesn't know, which comes back as raw bytes.
+ROUND_TRIPS = [
+	("TEXT", "plain text"),
+	("CHAR", "x"),
+	("MIME", "text/plain"),
+	("MIMS", "application/x-vnd.Be-doc"),
+	("CSTR", "hello"),
+	("RAWT", "\x00\x01\xfe\xff"),
+	("BOOL", True),
+	("BYTE", -5),
+	("UBYT", 250),
+	("SHRT", -300),
+	("USHT", 60000),
+	("LONG", -70000),
+	("ULNG", 4000000000),
+	("LLNG", -2 ** 40),
+	("ULLG", 2 ** 63),
+	("SIZT", 12345),
+	("SSZT", -12345),
+	("OFFT", 2 ** 40),
+	("TIME", 1700000000),
+	("FLOT", 1.5),
+	("DBLE", 3.25),
+	("BPNT", (1.0, 2.0)),
+	("RECT", (1.0, 2.0, 3.0, 4.0)),
+	("RGBC", (1, 2, 3, 4)),
+	("ABCD", "opaque bytes"),
+]
+
+def type_code(code):
+	return struct.unpack(">I", code)[0]
+
+class AttrTestCase(TempDirTestCase):
+	def setUp(self):
+		TempDirTestCase.setUp(self)
+		self.path = os.path.join(self.dir, "file")
+		open(self.path, "w").close()
+
+class RoundTripTest(AttrTestCase):
+	def test_each_type(self):
+		for code, value in ROUND_TRIPS:
+			storage.write_attr(self.path, "attr:" + code, code, value)
+		attrs = storage.read_attrs(self.path)
+		for code, value in ROUND_TRIPS:
+			self.assertEqual(attrs["attr:" + code], (type_code(code), value), code)
+
+	def test_type_as_number(self):
+		storage.write_attr(self.path, "n", type_code("LONG"), 7)
+		self.assertEqual(storage.read_attrs(self.path)["n"], (type_code("LONG"), 7))
+
+	def test_stored_as_haiku_xattr(self):
+		storage.write_attr(self.path, "META:x", "LONG", 1)
+		self.assertEqual(storage.read_attr(self.path, "META:x"), struct.pack("=i", 1))
+
+	def test_overwrite(self):
+		storage.write_attr(self.path, "a", "CSTR", "a much longer first value")
+		storage.write_attr(self.path, "a", "LONG", 3)
+		self.assertEqual(storage.read_attrs(self.path), {"a": (type_code("LONG"), 3)})
+
+	def test_bad_data(self):
+		self.assertRaises(TypeError, storage.write_attr, self.path, "a", "LONG", (1, 2))
+		self.assertEqual(storage.read_attrs(self.path), {})
+
+	def test_missing_file(self):
+		missing = os.path.join(self.dir, "missing")
+		self.assertRaises(IOError, storage.read_attrs, missing)
+		self.assertRaises(IOError, storage.write_attr, missing, "a", "LONG", 1)
+
+class SelectTest(AttrTestCase):
+	def setUp(self):
+		AttrTestCase.setUp(self)
+		storage.write_attrs(self.path, {
+			"META:title": ("CSTR", "Title"),
+			"META:year": ("LONG", 1999),
+			"BEOS:TYPE": ("MIMS", "text/plain"),
+		})
+
+	def test_names(self):
+		attrs = storage.read_attrs(self.path, names=["META:year", "BEOS:TYPE", "nope"])
+		self.assertEqual(sorted(attrs), ["BEOS:TYPE", "META:year"])
+
+	def test_prefix(self):
+		attrs = storage.read_attrs(self.path, prefix="META:")
+		self.assertEqual(sorted(attrs), ["META:title", "META:year"])
+		self.assertEqual(storage.read_attrs(self.path, prefix="none:"), {})
+
+	def test_names_and_prefix(self):
+		self.assertRaises(ValueError, storage.read_attrs, self.path,
+						  names=["META:year"], prefix="META:")
+
+	def test_list_attrs(self):
+		listed = sorted(storage.list_attrs(self.path))
+		self.assertEqual(listed, [("BEOS:TYPE", type_code("MIMS"), len("text/plain")),
+								  ("META:title", type_code("CSTR"), len("Title")),
+								  ("META:year", type_code("LONG"), 4)])
+
+	def test_foreign_xattrs_left_out(self):
+		libc = ctypes.CDLL(None, use_errno=True)
+		self.assertEqual(libc.setxattr(self.path, "user.other", "x", 1, 0), 0)
+		self.assertEqual(len(storage.read_attrs(self.path)), 3)
+
+class EndianTest(AttrTestCase):
+	def test_big_endian(self):
+		storage.write_attr(self.path, "be", "LONG", 1, storage.attr.BIG_ENDIAN)
+		self.assertEqual(storage.read_attr(self.path, "be"), "\x00\x00\x00\x01")
+		attrs = storage.read_attrs(self.path, storage.attr.BIG_ENDIAN)
+		self.assertEqual(attrs["be"][1], 1)
+
+	def test_little_endian(self):
+		storage.write_attr(self.path, "le", "SHRT", 2, storage.attr.LITTLE_ENDIAN)
+		self.assertEqual(storage.read_attr(self.path, "le"), "\x02\x00")
+		attrs = storage.read_attrs(self.path, storage.attr.LITTLE_ENDIAN)
+		self.assertEqual(attrs["le"][1], 2)
+
+	def test_swapped_read(self):
+		storage.write_attr(self.path, "be", "LONG", 1, storage.attr.BIG_ENDIAN)
+		native = storage.read_attrs(self.path)["be"][1]
+		if sys.byteorder == "little":
+			self.assertEqual(native, 1 << 24)
+		else:
+			self.assertEqual(native, 1)
+
+	def test_strings_not_swapped(self):
+		storage.write_attr(self.path, "s", "CSTR", "abcd", storage.attr.BIG_ENDIAN)
+		self.assertEqual(storage.read_attrs(self.path)["s"][1], "abcd")
+
+	def test_both(self):
+		both = storage.attr.BIG_ENDIAN | storage.attr.LITTLE_ENDIAN
+		self.assertRaises(ValueError, storage.read_attrs, self.path, both)
+		self.assertRaises(ValueError, storage.write_attr, self.path, "a", "LONG", 1, both)
+
+class RemoveTest(AttrTestCase):
+	def test_remove(self):
+		storage.write_attr(self.path, "a", "LONG", 1)
+		storage.write_attr(self.path, "b", "LONG", 2)
+		storage.remove_attr(self.path, "a")
+		self.assertEqual(sorted(storage.read_attrs(self.path)), ["b"])
+
+	def test_remove_missing(self):
+		self.assertRaises(IOError, storage.remove_attr, self.path, "nope")
+
+class CodecTest(AttrTestCase):
+	def tearDown(self):
+		storage.register_codec("ABCD")
+		TempDirTestCase.tearDown(self)
+
+	def test_codecs(self):
+		storage.register_codec("ABCD", decode=lambda data: data[::-1],
+							   encode=lambda value: value[::-1])
+		storage.write_attr(self.path, "a", "ABCD", "abc")
+		self.assertEqual(storage.read_attr(self.path, "a"), "cba")
+		self.assertEqual(storage.read_attrs(self.path)["a"], (type_code("ABCD"), "abc"))
+
+	def test_reregister_while_decoding(self):
+		# the codec being run loses its last reference halfway through
+		def decode(data):
+			storage.register_codec("ABCD", decode=lambda data: "second")
+			return "first:" + data
+		storage.register_codec("ABCD", decode=decode)
+		del decode
+		storage.write_attr(self.path, "a", "ABCD", "x")
+		self.assertEqual(storage.read_attrs(self.path)["a"], (type_code("ABCD"), "first:x"))
+		self.assertEqual(storage.read_attrs(self.path)["a"], (type_code("ABCD"), "second"))
+
+	def test_reregister_while_encoding(self):
+		def encode(value):
+			storage.register_codec("ABCD")
+			return "encoded"
+		storage.register_codec("ABCD", encode=encode)
+		del encode
+		storage.write_attr(self.path, "a", "ABCD", "x")
+		self.assertEqual(storage.read_attr(self.path, "a"), "encoded")
+
+class MaxSizeTest(AttrTestCase):
+	def setUp(self):
+		AttrTestCase.setUp(self)
+		storage.write_attr(self.path, "big", "RAWT", "x" * 100)
+		storage.write_attr(self.path, "small", "RAWT", "x" * 10)
+
+	def test_read_attrs(self):
+		self.assertRaises(IOError, storage.read_attrs, self.path, max_size=50)
+		self.assertEqual(storage.read_attrs(self.path, names=["small"], max_size=50),
+						 {"small": (type_code("RAWT"), "x" * 10)})
+		self.assertEqual(len(storage.read_attrs(self.path, max_size=-1)), 2)
+
+	def test_read_attr(self):
+		self.assertRaises(IOError, storage.read_attr, self.path, "big", max_size=50)
+		self.assertEqual(storage.read_attr(self.path, "big", 0, 50, max_size=50), "x" * 50)
+
+	def test_read_attr_buffer(self):
+		self.assertRaises(IOError, storage.read_attr_buffer, self.path, "big", max_size=50)
+		self.assertEqual(storage.read_attr_buffer(self.path, "big", max_size=100)[1],
+						 bytearray("x" * 100))
+
+	def test_default(self):
+		self.assertEqual(storage.attr.MAX_SIZE, 64 * 1024 * 1024)
+
+class AttrFileTest(AttrTestCase):
+	def test_close_under_readers(self):
+		storage.write_attr(self.path, "a", "CSTR", "x" * 1000)
+		attr_file = storage.AttrFile(self.path)
+		seen = []
+
+		def read():
+			try:
+				while True:
+					seen.append(attr_file.get("a")[1])
+			except ValueError:
+				pass
+
+		readers = [threading.Thread(target=read) for i in range(4)]
+		for reader in readers:
+			reader.start()
+		while len(seen) < 100:
+			pass
+		attr_file.close()
+		for reader in readers:
+			reader.join()
+
+		# whatever the readers got was this file's attribute
+		self.assertEqual(set(seen), set(["x" * 1000]))
+		self.assertTrue(attr_file.closed)
+
+if __name__ == "__main__":
+	unittest.main()
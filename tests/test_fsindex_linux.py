@@ -0,0 +1,197 @@
+"""The Linux attribute indexes behind query(): parsing, the change log,
+merging it into the index, and rescanning.  See fsindex.h."""
+
+import os
+import shutil
+import threading
+import unittest
+
+from haikuglue import storage
+from linux_case import TempDirTestCase
+
+class IndexTestCase(TempDirTestCase):
+	def make(self, name, **attrs):
+		path = os.path.join(self.dir, name)
+		if not os.path.isdir(os.path.dirname(path)):
+			os.makedirs(os.path.dirname(path))
+		open(path, "w").close()
+		for attr_name, value in attrs.items():
+			storage.write_attr(path, attr_name.replace("_", ":"), *value)
+		return path
+
+	def query(self, query_string, **kwds):
+		return sorted(os.path.basename(path) for path in
+					  storage.query(query_string, self.dir, **kwds))
+
+	def index_file(self, name, ext):
+		return os.path.join(self.dir, ".haiku-index", name + ext)
+
+class ParserTest(IndexTestCase):
+	def setUp(self):
+		IndexTestCase.setUp(self)
+		storage.create_index("Audio:Track", "LONG", self.dir)
+		storage.create_index("Audio:Title", "CSTR", self.dir)
+		for i in range(1, 6):
+			self.make("t%d" % i, Audio_Track=("LONG", i),
+					  Audio_Title=("CSTR", "Song %d" % i))
+
+	def test_comparisons(self):
+		self.assertEqual(self.query("Audio:Track==3"), ["t3"])
+		self.assertEqual(self.query("Audio:Track!=3"), ["t1", "t2", "t4", "t5"])
+		self.assertEqual(self.query("Audio:Track<2"), ["t1"])
+		self.assertEqual(self.query("Audio:Track<=2"), ["t1", "t2"])
+		self.assertEqual(self.query("Audio:Track>4"), ["t5"])
+		self.assertEqual(self.query("Audio:Track>=4"), ["t4", "t5"])
+
+	def test_strings_and_wildcards(self):
+		self.assertEqual(self.query('Audio:Title=="Song 2"'), ["t2"])
+		self.assertEqual(self.query('Audio:Title=="Song [45]"'), ["t4", "t5"])
+		self.assertEqual(self.query('Audio:Title=="*3"'), ["t3"])
+
+	def test_logic(self):
+		self.assertEqual(self.query("(Audio:Track<2)||(Audio:Track>4)"), ["t1", "t5"])
+		self.assertEqual(self.query('(Audio:Track>1)&&(Audio:Title=="*4")'), ["t4"])
+		self.assertEqual(self.query("(Audio:Track>1)&&!(Audio:Track==3)"),
+						 ["t2", "t4", "t5"])
+
+	def test_bad_queries(self):
+		for bad in ["Audio:Track==", "(Audio:Track==1", "Audio:Track 1", "&&"]:
+			self.assertRaises(ValueError, storage.query, bad, self.dir)
+
+	def test_unindexed(self):
+		self.assertRaises(RuntimeError, storage.query, "Other:Thing==1", self.dir)
+		explained = storage.explain("(Audio:Track==1)&&(Other:Thing==1)", self.dir)
+		self.assertEqual(explained["indexed"], ["Audio:Track"])
+		self.assertEqual(explained["unindexed"], ["Other:Thing"])
+
+	def test_paging(self):
+		self.assertEqual(self.query("Audio:Track>0", limit=2), ["t1", "t2"])
+		self.assertEqual(self.query("Audio:Track>0", limit=2, offset=4), ["t5"])
+		self.assertEqual(self.query("Audio:Track>0", limit=0), [])
+
+	def test_paging_with_attrs(self):
+		hits = storage.query("Audio:Track>0", self.dir, attrs=["Audio:Title"],
+							 limit=2, offset=1)
+		self.assertEqual([os.path.basename(path) for path, attrs in hits], ["t2", "t3"])
+		self.assertEqual([attrs["Audio:Title"][1] for path, attrs in hits],
+						 ["Song 2", "Song 3"])
+
+class LogTest(IndexTestCase):
+	def setUp(self):
+		IndexTestCase.setUp(self)
+		storage.create_index("Audio:Track", "LONG", self.dir)
+
+	def test_changes_replayed(self):
+		path = self.make("a", Audio_Track=("LONG", 1))
+		self.make("b", Audio_Track=("LONG", 2))
+		self.assertTrue(os.path.getsize(self.index_file("Audio:Track", ".log")) > 0)
+		self.assertEqual(self.query("Audio:Track==1"), ["a"])
+
+		storage.write_attr(path, "Audio:Track", "LONG", 7)
+		self.assertEqual(self.query("Audio:Track==1"), [])
+		self.assertEqual(self.query("Audio:Track>5"), ["a"])
+
+		storage.remove_attr(path, "Audio:Track")
+		self.assertEqual(self.query("Audio:Track>0"), ["b"])
+
+	def test_other_types_stay_out(self):
+		self.make("a", Audio_Track=("CSTR", "1"))
+		self.assertEqual(self.query("Audio:Track==1"), [])
+
+	def test_write_attrs(self):
+		path = self.make("a")
+		storage.write_attrs(path, {"Audio:Track": ("LONG", 3), "Other": ("LONG", 1)})
+		self.assertEqual(self.query("Audio:Track==3"), ["a"])
+
+	def test_deleted_files_checked(self):
+		path = self.make("a", Audio_Track=("LONG", 1))
+		os.unlink(path)
+		self.assertEqual(self.query("Audio:Track==1"), [])
+
+	def test_new_volume_seen(self):
+		other = os.path.join(self.dir, "sub", "vol")
+		path = self.make("sub/vol/f", Audio_Genre=("CSTR", "Jazz"))
+		storage.create_index("Audio:Genre", "CSTR", other)
+		storage.write_attr(path, "Audio:Genre", "CSTR", "Blues")
+		self.assertEqual(storage.query('Audio:Genre=="Blues"', other), [path])
+
+	def test_compaction(self):
+		paths = [self.make("f%02d" % i) for i in range(50)]
+		log = self.index_file("Audio:Track", ".log")
+		run = self.index_file("Audio:Track", ".idx")
+		run_size = os.path.getsize(run)
+
+		# Enough changes to push the log over its limit a few times.
+		for value in range(400):
+			for path in paths:
+				storage.write_attr(path, "Audio:Track", "LONG", value)
+
+		self.assertTrue(os.path.getsize(run) > run_size)
+		self.assertTrue(os.path.getsize(log) < 256 * 1024)
+		self.assertEqual(len(self.query("Audio:Track==399")), 50)
+		self.assertEqual(self.query("Audio:Track<399"), [])
+
+class RescanTest(IndexTestCase):
+	def test_files_from_before(self):
+		self.make("a", Audio_Track=("LONG", 1))
+		self.make("sub/b", Audio_Track=("LONG", 2))
+		storage.create_index("Audio:Track", "LONG", self.dir)
+		self.assertEqual(self.query("Audio:Track>0"), [])
+
+		self.assertEqual(storage.rescan_indexes(self.dir), 3)
+		self.assertEqual(self.query("Audio:Track>0"), ["a", "b"])
+
+	def test_renames(self):
+		storage.create_index("Audio:Track", "LONG", self.dir)
+		path = self.make("f3", Audio_Track=("LONG", 3))
+		os.rename(path, os.path.join(self.dir, "g3"))
+
+		# Gone by the old path, and not there by the new one until a rescan.
+		self.assertEqual(self.query("Audio:Track==3"), [])
+		storage.rescan_indexes(self.dir)
+		self.assertEqual(self.query("Audio:Track==3"), ["g3"])
+
+	def test_built_in_indexes(self):
+		storage.create_index("name", "CSTR", self.dir)
+		storage.create_index("size", "LLNG", self.dir)
+		self.make("small")
+		with open(os.path.join(self.dir, "big"), "w") as f:
+			f.write("x" * 1000)
+		storage.rescan_indexes(self.dir)
+		self.assertEqual(self.query('name=="sm*"'), ["small"])
+		self.assertEqual(self.query("size>100"), ["big"])
+
+	def test_writes_during_rescan(self):
+		# what's logged while the files are read ends up on top of the new run
+		storage.create_index("Audio:Track", "LONG", self.dir)
+		paths = [self.make("f%03d" % i, Audio_Track=("LONG", 0)) for i in range(200)]
+
+		done = []
+		def write():
+			for value in range(1, 30):
+				for path in paths[:20]:
+					storage.write_attr(path, "Audio:Track", "LONG", value)
+			done.append(True)
+		writer = threading.Thread(target=write)
+		writer.start()
+		while not done:
+			storage.rescan_indexes(self.dir)
+		writer.join()
+
+		self.assertEqual(len(self.query("Audio:Track==29")), 20)
+		self.assertEqual(len(self.query("Audio:Track==0")), 180)
+		self.assertEqual(self.query("(Audio:Track>0)&&(Audio:Track<29)"), [])
+
+	def test_only_named(self):
+		storage.create_index("Audio:Track", "LONG", self.dir)
+		storage.create_index("Audio:Title", "CSTR", self.dir)
+		self.make("a", Audio_Track=("LONG", 1), Audio_Title=("CSTR", "x"))
+		shutil.rmtree(os.path.join(self.dir, ".haiku-index"))
+		storage.create_index("Audio:Track", "LONG", self.dir)
+		storage.create_index("Audio:Title", "CSTR", self.dir)
+		storage.rescan_indexes(self.dir, ["Audio:Track"])
+		self.assertEqual(self.query("Audio:Track==1"), ["a"])
+		self.assertEqual(self.query('Audio:Title=="x"'), [])
+
+if __name__ == "__main__":
+	unittest.main()
@@ -0,0 +1,173 @@
+"""The Watcher's inotify stand-in: which events come out, and folding.
+
+Needs inotify and a file system with user xattrs in the temporary
+directory; run with the built package on the path, see the README."""
+
+import os
+import select
+import tempfile
+import unittest
+
+from haikuglue import storage
+from haikuglue.storage import monitor
+from linux_case import TempDirTestCase
+
+class WatcherTestCase(TempDirTestCase):
+	def setUp(self):
+		TempDirTestCase.setUp(self)
+		self.path = os.path.join(self.dir, "file")
+		open(self.path, "w").close()
+		storage.write_attr(self.path, "Test:a", "LONG", 1)
+		self.watcher = storage.Watcher()
+
+		# Changed at the end of events(), outside self.dir so directory
+		# watches don't hear about it.
+		fd, self.marker = tempfile.mkstemp()
+		os.close(fd)
+		self.marker_ref = None
+		self.marks = 0
+
+	def tearDown(self):
+		self.watcher.close()
+		os.unlink(self.marker)
+		TempDirTestCase.tearDown(self)
+
+	def events(self):
+		"""The events so far, without node_refs, as one read_events() at the
+		end would have them.  Events come out in order, so once a change
+		made now to the marker file shows up, everything before it has too;
+		what came out in between is folded like the watcher folds what
+		hasn't been read yet."""
+		if self.marker_ref is None:
+			self.marker_ref = self.watcher.watch(self.marker, monitor.WATCH_ATTR)
+		self.marks += 1
+		storage.write_attr(self.marker, "Test:mark", "LONG", self.marks)
+
+		got = []
+		def marked():
+			got.extend(self.watcher.read_events())
+			return any(node_ref == self.marker_ref for node_ref, attr_name, opcode in got)
+		self.wait_for(marked, "the marker's event")
+
+		folded = []
+		for event in got:
+			if event[0] != self.marker_ref and event not in folded:
+				folded.append(event)
+		return [(attr_name, opcode) for node_ref, attr_name, opcode in folded]
+
+class EventTest(WatcherTestCase):
+	def test_attr_changed(self):
+		node_ref = self.watcher.watch(self.path)
+		self.assertEqual(node_ref, (os.stat(self.path).st_dev, os.stat(self.path).st_ino))
+		storage.write_attr(self.path, "Test:a", "LONG", 2)
+		self.assertEqual(self.events(), [("Test:a", monitor.ATTR_CHANGED)])
+
+	def test_new_and_removed(self):
+		self.watcher.watch(self.path, monitor.WATCH_ATTR)
+		storage.write_attr(self.path, "Test:b", "LONG", 1)
+		storage.remove_attr(self.path, "Test:a")
+		self.assertEqual(sorted(self.events()),
+						 [("Test:a", monitor.ATTR_CHANGED), ("Test:b", monitor.ATTR_CHANGED)])
+
+	def test_stat_changed(self):
+		self.watcher.watch(self.path)
+		open(self.path, "w").write("data")
+		self.assertEqual(self.events(), [(None, monitor.STAT_CHANGED)])
+
+	def test_attr_only(self):
+		self.watcher.watch(self.path, monitor.WATCH_ATTR)
+		open(self.path, "w").write("data")
+		os.chmod(self.path, 0600)
+		self.assertEqual(self.events(), [])
+
+	def test_folding(self):
+		self.watcher.watch(self.path)
+		for i in range(20):
+			storage.write_attr(self.path, "Test:a", "LONG", i + 10)
+		self.assertEqual(self.events(), [("Test:a", monitor.ATTR_CHANGED)])
+		storage.write_attr(self.path, "Test:a", "LONG", 100)
+		self.assertEqual(self.events(), [("Test:a", monitor.ATTR_CHANGED)])
+
+	def test_directory(self):
+		self.watcher.watch(self.dir, monitor.WATCH_DIRECTORY)
+		open(os.path.join(self.dir, "one"), "w").close()
+		open(os.path.join(self.dir, "two"), "w").close()
+		os.rename(os.path.join(self.dir, "one"), os.path.join(self.dir, "three"))
+		os.unlink(os.path.join(self.dir, "two"))
+		self.assertEqual(self.events(), [(None, monitor.ENTRY_CREATED),
+										 (None, monitor.ENTRY_MOVED),
+										 (None, monitor.ENTRY_REMOVED)])
+
+	def test_directory_entries_changing(self):
+		# those are the entries' events, not the directory's
+		self.watcher.watch(self.dir, monitor.WATCH_DIRECTORY)
+		storage.write_attr(self.path, "Test:a", "LONG", 2)
+		open(self.path, "w").write("data")
+		self.assertEqual(self.events(), [])
+
+	def test_renamed(self):
+		self.watcher.watch(self.path, monitor.WATCH_ATTR)
+		os.rename(self.path, self.path + ".moved")
+		storage.write_attr(self.path + ".moved", "Test:a", "LONG", 2)
+		self.assertEqual(self.events(), [(None, monitor.ATTR_CHANGED)])
+
+	def test_fileno(self):
+		self.watcher.watch(self.path)
+		self.assertEqual(select.select([self.watcher], [], [], 0)[0], [])
+		storage.write_attr(self.path, "Test:a", "LONG", 2)
+		self.assertEqual(select.select([self.watcher], [], [], 2)[0], [self.watcher])
+		self.events()
+		self.assertEqual(select.select([self.watcher], [], [], 0)[0], [])
+
+class WatchTest(WatcherTestCase):
+	def test_unwatch(self):
+		node_ref = self.watcher.watch(self.path)
+		self.watcher.unwatch(node_ref)
+		storage.write_attr(self.path, "Test:a", "LONG", 2)
+		self.assertEqual(self.events(), [])
+		self.assertRaises(KeyError, self.watcher.unwatch, self.path)
+
+	def test_unwatch_with_zero(self):
+		self.watcher.watch(self.path)
+		self.watcher.watch(self.path, 0)
+		self.watcher.watch(self.path, 0)
+		storage.write_attr(self.path, "Test:a", "LONG", 2)
+		self.assertEqual(self.events(), [])
+
+	def test_change_flags(self):
+		self.watcher.watch(self.path)
+		self.watcher.watch(self.path, monitor.WATCH_STAT)
+		storage.write_attr(self.path, "Test:a", "LONG", 2)
+		self.assertEqual(self.events(), [])
+
+	def test_watch_name(self):
+		try:
+			self.watcher.watch(self.path, 1)	# B_WATCH_NAME
+		except ValueError, e:
+			self.assertTrue("WATCH_NAME" in str(e))
+		else:
+			self.fail("WATCH_NAME was accepted")
+		self.assertRaises(ValueError, self.watcher.watch, self.path, 0x100)
+
+	def test_directory_flag_on_a_file(self):
+		self.watcher.watch(self.path, monitor.WATCH_DIRECTORY)
+		storage.write_attr(self.path, "Test:a", "LONG", 2)
+		self.assertEqual(self.events(), [])
+		self.watcher.unwatch(self.path)
+
+	def test_missing(self):
+		self.assertRaises(IOError, self.watcher.watch, os.path.join(self.dir, "missing"))
+
+	def test_events_lost_opcode(self):
+		# can't be made to happen here without lowering the kernel's limit
+		opcodes = [monitor.ATTR_CHANGED, monitor.STAT_CHANGED, monitor.ENTRY_CREATED,
+				   monitor.ENTRY_REMOVED, monitor.ENTRY_MOVED]
+		self.assertFalse(monitor.EVENTS_LOST in opcodes)
+
+	def test_closed(self):
+		self.watcher.close()
+		self.assertTrue(self.watcher.closed)
+		self.assertRaises(ValueError, self.watcher.watch, self.path)
+
+if __name__ == "__main__":
+	unittest.main()
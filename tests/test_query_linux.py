@@ -0,0 +1,140 @@
+"""Compiled queries: Query.match() and filter(), and the where argument of
+read_attrs_many() and crawl().
+
+The matching itself doesn't touch the disk, but where does; run with the
+built package on the path, see the README."""
+
+import os
+import struct
+import unittest
+
+from haikuglue import storage
+from linux_case import TempDirTestCase
+
+def type_code(code):
+	return struct.unpack(">I", code)[0]
+
+class MatchTest(unittest.TestCase):
+	def test_plain_values(self):
+		query = storage.compile_query("size>10&&name==\"*.txt\"")
+		self.assertTrue(query.match({"size": 20, "name": "a.txt"}))
+		self.assertFalse(query.match({"size": 5, "name": "a.txt"}))
+		self.assertFalse(query.match({"size": 20, "name": "a.jpg"}))
+
+	def test_read_attrs_values(self):
+		query = storage.compile_query("Media:Rating>=8")
+		self.assertTrue(query.match({"Media:Rating": (type_code("LONG"), 9)}))
+		self.assertFalse(query.match({"Media:Rating": (type_code("LONG"), 7)}))
+
+	def test_missing_attribute(self):
+		self.assertFalse(storage.compile_query("size>10").match({}))
+		self.assertFalse(storage.compile_query("size!=10").match({}))
+
+	def test_strings(self):
+		self.assertTrue(storage.compile_query("A:x==\"ab*\"").match({"A:x": "abc"}))
+		self.assertFalse(storage.compile_query("A:x==\"ab\"").match({"A:x": "abc"}))
+		self.assertTrue(storage.compile_query("A:x<\"b\"").match({"A:x": "abc"}))
+
+	def test_logic(self):
+		query = storage.compile_query("A:x==1||(A:y==2&&A:z==3)")
+		self.assertTrue(query.match({"A:x": 1}))
+		self.assertTrue(query.match({"A:y": 2, "A:z": 3}))
+		self.assertFalse(query.match({"A:y": 2}))
+
+	def test_needs_a_dict(self):
+		self.assertRaises(TypeError, storage.compile_query("size>10").match, [])
+
+class FilterTest(unittest.TestCase):
+	def test_dicts_and_tuples(self):
+		query = storage.compile_query("size>10")
+		items = [{"size": 20}, ("a", {"size": 5}), ("b", {"size": 30}), {}]
+		self.assertEqual(query.filter(items), [{"size": 20}, ("b", {"size": 30})])
+
+	def test_iterator(self):
+		query = storage.compile_query("size>10")
+		self.assertEqual(query.filter(iter([{"size": 11}, {"size": 9}])), [{"size": 11}])
+
+	def test_bad_items(self):
+		query = storage.compile_query("size>10")
+		self.assertRaises(TypeError, query.filter, [{"size": 20}, "not a dict"])
+		self.assertRaises(TypeError, query.filter, [("a", "not a dict")])
+
+class QueryTest(unittest.TestCase):
+	def test_attributes(self):
+		query = storage.Query("size>10&&name==\"*.txt\"&&size<100")
+		self.assertEqual(query.query_string, "size>10&&name==\"*.txt\"&&size<100")
+		self.assertEqual(sorted(query.attrs), ["name", "size"])
+
+	def test_bad_queries(self):
+		for bad in ("size>", "size>10&&", "(size>10", "==3"):
+			self.assertRaises(ValueError, storage.compile_query, bad)
+			self.assertRaises(ValueError, storage.Query, bad)
+
+	def test_limits(self):
+		for bad in ("(" * 100000 + "size>1" + ")" * 100000, "!" * 100000 + "size>1",
+					"&&".join(["size>%d" % i for i in range(100000)])):
+			self.assertRaises(ValueError, storage.compile_query, bad)
+		self.assertTrue(storage.compile_query("(" * 64 + "size>1" + ")" * 64).match({"size": 2}))
+		self.assertTrue(storage.compile_query("||".join(["size==%d" % i for i in range(256)]))
+						.match({"size": 255}))
+
+	def test_cache(self):
+		self.assertTrue(storage.compile_query("size>10") is storage.compile_query("size>10"))
+		self.assertFalse(storage.Query("size>10") is storage.compile_query("size>10"))
+
+class WhereTest(TempDirTestCase):
+	def setUp(self):
+		TempDirTestCase.setUp(self)
+		self.paths = []
+		for i in range(6):
+			path = os.path.join(self.dir, "file%d.txt" % i)
+			open(path, "w").write("x" * i * 10)
+			storage.write_attrs(path, {"Test:n": ("LONG", i), "Test:s": ("CSTR", "s%d" % i),
+									   "Other:n": ("LONG", i)})
+			self.paths.append(path)
+
+	def test_read_attrs_many(self):
+		results = storage.read_attrs_many(self.paths, where="Test:n>=3")
+		self.assertEqual([r is None for r in results], [True] * 3 + [False] * 3)
+		self.assertEqual(results[4]["Test:s"], (type_code("CSTR"), "s4"))
+
+	def test_read_attrs_many_query(self):
+		query = storage.compile_query("Test:s==\"s1\"||Test:s==\"s5\"")
+		results = storage.read_attrs_many(self.paths, where=query)
+		self.assertEqual([i for i, r in enumerate(results) if r is not None], [1, 5])
+
+	def test_read_attrs_many_names(self):
+		# the query's attributes are read for matching but not returned
+		results = storage.read_attrs_many(self.paths, names=["Test:s"], where="Test:n==2")
+		self.assertEqual(results[2], {"Test:s": (type_code("CSTR"), "s2")})
+		results = storage.read_attrs_many(self.paths, prefix="Other:", where="Test:n==2")
+		self.assertEqual(results[2], {"Other:n": (type_code("LONG"), 2)})
+
+	def test_read_attrs_many_errors(self):
+		missing = os.path.join(self.dir, "missing")
+		results = storage.read_attrs_many([missing, self.paths[0]], where="Test:n==0")
+		self.assertTrue(isinstance(results[0], IOError))
+		self.assertTrue(results[1] is not None)
+
+	def test_read_attrs_many_bad_query(self):
+		self.assertRaises(ValueError, storage.read_attrs_many, self.paths, where="Test:n>")
+
+	def test_crawl(self):
+		found = sorted(path for path, attrs in storage.crawl(self.dir, where="Test:n<2"))
+		self.assertEqual(found, self.paths[:2])
+
+	def test_crawl_file_attributes(self):
+		found = dict(storage.crawl(self.dir, names=["Test:n"],
+								   where="size>=30&&name==\"file?.txt\""))
+		self.assertEqual(sorted(found), self.paths[3:])
+		self.assertEqual(found[self.paths[3]], {"Test:n": (type_code("LONG"), 3)})
+
+	def test_crawl_prefix(self):
+		found = dict(storage.crawl(self.dir, prefix="Other:", where="Test:s==\"s0\""))
+		self.assertEqual(found, {self.paths[0]: {"Other:n": (type_code("LONG"), 0)}})
+
+	def test_crawl_nothing(self):
+		self.assertEqual(list(storage.crawl(self.dir, where="Test:n>100")), [])
+
+if __name__ == "__main__":
+	unittest.main()